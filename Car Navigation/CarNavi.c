@@ -5,16 +5,53 @@
 #include <stdio.h>
 #include <math.h>
 #include <unistd.h>
+#define GL_GLEXT_PROTOTYPES  /* FBO(GL_EXT_framebuffer_object)の関数を使う */
 #include <GL/glfw.h>
 #include <FTGL/ftgl.h>
 #include <string.h>
 #include <time.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <float.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(CARNAVI_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define MaxCross 100        /* 最大交差点数=100 */
 #define MaxName  50         /* 最大文字数50文字(半角) */
+#define NamePoolBlock (1 << 20) /* 交差点名を格納する領域の1ブロックの大きさ */
 
-#define PATH_SIZE     100   /* 経路上の最大の交差点数 */
+#define MaxStops      50    /* 巡回する経由地の最大数(現在地を含む) */
+#define MaxFacility   16    /* 近い順に探す施設の最大数 */
+#define MaxThreads    64    /* 並列計算に使う最大スレッド数 */
+#define MaxFleet      100000 /* シミュレーションする最大の車両数 */
+#define MaxRoadShape  256   /* 1本の道路の最大形状点数 */
+#define SHAPE_UNIT    0.001 /* 形状点の座標の単位[km] */
+#define TURN_COST_LEFT  0.1 /* 左折のコスト[分] */
+#define TURN_COST_RIGHT 0.5 /* 右折のコスト[分] */
+#define TURN_COST_UTURN 1.0 /* Uターンのコスト[分] */
+#define MaxBatch      256   /* 経路探索サーバでまとめて処理する最大の要求数 */
+#define ServerBufSize 65536 /* 経路探索サーバの接続ごとの受信バッファ */
+#define SERVER_PORT   8080  /* 経路探索サーバの待ち受けポート */
 #define MARKER_RADIUS 0.1   /* マーカーの半径 */
+#define DELTA_SCALE   3.0   /* Δステッピング法のΔ(道路の評価値の平均の何倍か) */
 
 /* 座標変換マクロの定義 */
 double ORIGIN_X;
@@ -29,6 +66,243 @@ int window_speed = 100;
 #endif
 static FTGLfont *font; /* 読み込んだフォントを差すポインタ */
 
+//計測(-DCARNAVI_PROFILE を付けてコンパイルしたときだけ有効、付けなければ何も残らない)
+//スレッドごとのカウンタと区間タイマで、経路探索1回ごとと描画1フレームごとの内訳を取る
+//記録した区間はChromeのトレース形式(chrome://tracing で開ける)で書き出せる
+#ifdef CARNAVI_PROFILE
+#define MaxProfEvent 65536  /* スレッドごとに記録する区間の数(超えたら古いものから上書き) */
+
+//経路探索のカウンタ
+typedef struct {
+    long settled;           /* 確定した交差点(状態)の数 */
+    long relaxed;           /* 評価値を更新した道路の数 */
+    long heap_ops;          /* ヒープへの追加と取り出しの回数 */
+} ProfCounter;
+
+//記録した区間
+typedef struct {
+    char const *name;
+    uint64_t begin, end;    /* 開始と終了の時刻(ティック) */
+    ProfCounter delta;      /* 区間内でのカウンタの増分 */
+} ProfEvent;
+
+//スレッドごとの記録
+typedef struct ProfThread {
+    int tid;
+    long event_number;      /* これまでに記録した区間の数 */
+    ProfEvent event[MaxProfEvent];
+    struct ProfThread *next;
+} ProfThread;
+
+//区間の開始時の状態
+typedef struct {
+    uint64_t begin;
+    ProfCounter counter;
+} ProfScope;
+
+//1フレームの内訳
+enum { PROF_MAP, PROF_LABEL, PROF_SWAP, PROF_PARTS };
+static char const *prof_part_name[PROF_PARTS] = {"map_show", "labels", "glfwSwapBuffers"};
+
+static __thread ProfCounter prof_counter;
+static __thread ProfThread *prof_thread = NULL;
+static __thread ProfEvent prof_last_query;          /* このスレッドの最後の経路探索 */
+static ProfEvent prof_shown_query;                  /* 画面に表示する経路探索(経路探索スレッドが置く) */
+static ProfThread *prof_threads = NULL;
+static int prof_thread_number = 0;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static double prof_tick_us = 1e-3;                  /* 1ティックあたりのマイクロ秒 */
+static uint64_t prof_origin;
+static double prof_frame_us[PROF_PARTS];            /* 描画中のフレームの内訳 */
+static double prof_last_frame_us[PROF_PARTS + 1];   /* 直前のフレームの内訳と合計 */
+static int prof_overlay = 1;                        /* 1なら画面に計測値を重ねて表示する */
+
+//現在の時刻(x86ではrdtsc、それ以外はナノ秒)
+static inline uint64_t prof_now(void){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+//ティックとマイクロ秒の比を求める関数(clock_gettimeと比べる)
+static void prof_init(void){
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec begin, end;
+    uint64_t t0;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    t0 = prof_now();
+    usleep(20000);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    prof_tick_us = ((end.tv_sec - begin.tv_sec) * 1e6 + (end.tv_nsec - begin.tv_nsec) / 1e3)
+                   / (double)(prof_now() - t0);
+#endif
+    prof_origin = prof_now();
+}
+
+static void prof_begin(ProfScope *s){
+    s->counter = prof_counter;
+    s->begin = prof_now();
+}
+
+//区間を閉じて記録し、その長さ[us]を返す関数
+static double prof_end(ProfScope const *s, char const *name){
+    ProfEvent *e;
+    uint64_t end = prof_now();
+
+    if(prof_thread == NULL){
+        prof_thread = malloc(sizeof(ProfThread));
+        if(prof_thread == NULL){
+            return (end - s->begin) * prof_tick_us;
+        }
+        prof_thread->event_number = 0;
+        pthread_mutex_lock(&prof_lock);
+        prof_thread->tid = prof_thread_number++;
+        prof_thread->next = prof_threads;
+        prof_threads = prof_thread;
+        pthread_mutex_unlock(&prof_lock);
+    }
+    e = &prof_thread->event[prof_thread->event_number++ % MaxProfEvent];
+    e->name = name;
+    e->begin = s->begin;
+    e->end = end;
+    e->delta.settled = prof_counter.settled - s->counter.settled;
+    e->delta.relaxed = prof_counter.relaxed - s->counter.relaxed;
+    e->delta.heap_ops = prof_counter.heap_ops - s->counter.heap_ops;
+    if(e->delta.settled > 0){
+        prof_last_query = *e;
+    }
+    return (end - s->begin) * prof_tick_us;
+}
+
+//フレームを閉じて、内訳を表示用に移す関数
+static void prof_frame_end(ProfScope const *s){
+    int k;
+    prof_last_frame_us[PROF_PARTS] = prof_end(s, "frame");
+    for(k = 0; k < PROF_PARTS; ++k){
+        prof_last_frame_us[k] = prof_frame_us[k];
+        prof_frame_us[k] = 0.0;
+    }
+}
+
+//直前の経路探索の統計を表示する関数
+static void prof_print_query(void){
+    if(prof_last_query.name == NULL){
+        return;
+    }
+    printf("[計測] %s: 確定 %ld  更新 %ld  ヒープ操作 %ld  %.1lfus\n", prof_last_query.name,
+           prof_last_query.delta.settled, prof_last_query.delta.relaxed, prof_last_query.delta.heap_ops,
+           (prof_last_query.end - prof_last_query.begin) * prof_tick_us);
+}
+
+//このスレッドの最後の経路探索を画面に表示するものとして置く関数
+static void prof_publish_query(void){
+    pthread_mutex_lock(&prof_lock);
+    prof_shown_query = prof_last_query;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+//計測値を画面の左上に重ねて描く関数
+static void prof_draw_overlay(int width, int height){
+    char line[4][128];
+    int k;
+    ProfEvent query;
+
+    if(!prof_overlay || font == NULL){
+        return;
+    }
+    pthread_mutex_lock(&prof_lock);
+    query = prof_shown_query;
+    pthread_mutex_unlock(&prof_lock);
+    snprintf(line[0], sizeof(line[0]), "frame %.0fus  map %.0fus  labels %.0fus  swap %.0fus",
+             prof_last_frame_us[PROF_PARTS], prof_last_frame_us[PROF_MAP],
+             prof_last_frame_us[PROF_LABEL], prof_last_frame_us[PROF_SWAP]);
+    snprintf(line[1], sizeof(line[1]), "%s %.0fus",
+             query.name ? query.name : "-", (query.end - query.begin) * prof_tick_us);
+    snprintf(line[2], sizeof(line[2]), "settled %ld  relaxed %ld  heap %ld",
+             query.delta.settled, query.delta.relaxed, query.delta.heap_ops);
+    line[3][0] = '\0';
+
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, width, 0, height, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glColor3d(0.3, 1.0, 0.3);
+    for(k = 0; line[k][0] != '\0'; ++k){
+        glLoadIdentity();
+        glTranslated(10, height - 30 * (k + 1), 0);
+        ftglRenderFont(font, line[k], FTGL_RENDER_ALL);
+    }
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
+//記録した区間をChromeのトレース形式で書き出す関数(他のスレッドが止まってから呼ぶ)
+static void prof_write_trace(char const *filename){
+    FILE *fp = fopen(filename, "w");
+    ProfThread *t;
+    ProfEvent const *e;
+    long k, first;
+    int comma = 0;
+
+    if(fp == NULL){
+        perror(filename);
+        return;
+    }
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for(t = prof_threads; t != NULL; t = t->next){
+        first = (t->event_number > MaxProfEvent) ? t->event_number - MaxProfEvent : 0;
+        for(k = first; k < t->event_number; ++k){
+            e = &t->event[k % MaxProfEvent];
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    comma ? ",\n" : "", e->name, t->tid,
+                    (double)(e->begin - prof_origin) * prof_tick_us, (double)(e->end - e->begin) * prof_tick_us);
+            if(e->delta.settled > 0 || e->delta.heap_ops > 0){
+                fprintf(fp, ",\"args\":{\"settled\":%ld,\"relaxed\":%ld,\"heap_ops\":%ld}",
+                        e->delta.settled, e->delta.relaxed, e->delta.heap_ops);
+            }
+            fprintf(fp, "}");
+            comma = 1;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    printf("[計測] %sに書き出しました\n", filename);
+}
+
+#define PROF_INIT()             prof_init()
+#define PROF_COUNT(field, n)    (prof_counter.field += (n))
+#define PROF_BEGIN(s)           ProfScope s; prof_begin(&s)
+#define PROF_END(s, name)       prof_end(&s, name)
+#define PROF_PART(s, part)      (prof_frame_us[part] += prof_end(&s, prof_part_name[part]))
+#define PROF_FRAME_END(s)       prof_frame_end(&s)
+#define PROF_PRINT_QUERY()      prof_print_query()
+#define PROF_PUBLISH_QUERY()    prof_publish_query()
+#define PROF_OVERLAY(w, h)      prof_draw_overlay(w, h)
+#define PROF_TOGGLE_OVERLAY()   (prof_overlay = !prof_overlay)
+#define PROF_WRITE_TRACE(file)  prof_write_trace(file)
+#else
+#define PROF_INIT()             ((void)0)
+#define PROF_COUNT(field, n)    ((void)0)
+#define PROF_BEGIN(s)           ((void)0)
+#define PROF_END(s, name)       ((void)0)
+#define PROF_PART(s, part)      ((void)0)
+#define PROF_FRAME_END(s)       ((void)0)
+#define PROF_PRINT_QUERY()      ((void)0)
+#define PROF_PUBLISH_QUERY()    ((void)0)
+#define PROF_OVERLAY(w, h)      ((void)0)
+#define PROF_TOGGLE_OVERLAY()   ((void)0)
+#define PROF_WRITE_TRACE(file)  ((void)0)
+#endif
+#define PROF_TRACE_FILE "carnavi_trace.json"
+
 //交差点の構造体(位置)
 typedef struct {
     double x, y;            /* 位置 x, y */
@@ -38,575 +312,10430 @@ typedef struct {
     int id;                 /* 交差点番号 */
     Position pos;           /* 位置を表す構造体 */
     double wait;            /* 平均待ち時間 */
-    char jname[MaxName];    /* 交差点名(日本語) */
-    char ename[MaxName];    /* 交差点名(ローマ字) */
+    char *jname;            /* 交差点名(日本語、name_poolの中を指す) */
+    char *ename;            /* 交差点名(ローマ字、name_poolの中を指す) */
     int points;             /* 交差道路数 */
     int next[5];            /* 隣接する交差点番号 */
-    double distance;        /* 基準交差点からのトータル距離：追加 */
-    double time;            /* 基準交差点からのトータル時間 */
-    int previous_distance;           /* 基準交差点からの経路（直前の交差点番号）：追加 */
-    int previous_time;
+    double length[5];       /* 隣接する交差点までの道路の長さ */
+    int shape[5];           /* 道路の形状点の先頭(shape_delta内の位置) */
+    int shape_points[5];    /* 道路の形状点数(0なら直線) */
+    int turn_table;         /* 右左折禁止の表の番号(-1なら禁止なし) */
+    unsigned char facility; /* 施設の種類(1 << facility_kindの添字 の和) */
 } Crossing;
 
-//交差点情報の配列と経路の配列の定義
-static Crossing cross[MaxCross];
+//地図の版
+//差分を当てるたびに交差点の配列を写した新しい版を作り、公開した版の道路と名前は書き換えない
+//交差点の数と並びは版が変わっても同じなので、交差点の添字と経路はどの版でもそのまま使える
+typedef struct MapSnapshot {
+    unsigned version;              /* 版の番号(読み込んだ地図が1) */
+    int crossing_number;
+    Crossing *cross;
+    unsigned cost_version;         /* 道路の長さか待ち時間が最後に変わった版 */
+    unsigned lower_version;        /* 道路の長さか待ち時間が最後に短くなった(道路が増えた)版 */
+    struct MapChange const *roads; /* 道路が変わった範囲の履歴(新しい順) */
+    uint64_t retired;              /* 置き換えられたときのエポック */
+    struct MapSnapshot *next;      /* 回収を待つ版の列 */
+} MapSnapshot;
 
-//ファイルを読み込む関数
-static int map_read(char *filename) {
-    FILE *fp;
-    int i, j;
-    int crossing_number;          /* 交差点数 */
+//交差点情報の配列(交差点数に合わせて確保する)
+//スレッドごとの変数で、そのスレッドが見ている版の配列を指す(地図を公開したらmap_enterで今の版に移る)
+static __thread Crossing *cross = NULL;
+static __thread MapSnapshot *map_view = NULL;  /* このスレッドが見ている版(公開していなければNULL) */
+//交差点番号(ID)からcross[]の添字を引く表(並べ替えていなければ添字とIDは同じ、全ての版で共有する)
+static int *cross_index = NULL;
 
-    fp = fopen(filename, "r");
-    if (fp == NULL) {
-        perror(filename);
-        return -1;
-    }
+//交差点名を格納する領域
+//ブロック単位で確保して再配置しないので、交差点が名前を直接指せる
+typedef struct NameBlock {
+    struct NameBlock *next;
+    size_t used;
+    char text[NamePoolBlock];
+} NameBlock;
+static NameBlock *name_pool = NULL;
 
-    /* はじめに交差点数を読み込む */
-    fscanf(fp, "%d", &crossing_number);
+//交差点名を格納して、その場所を返す関数
+static char *name_store(char const *name){
+    size_t len = strlen(name) + 1;
+    NameBlock *b;
+    char *p;
 
-    for (i = 0; i < crossing_number; i++) {
+    if(name_pool == NULL || name_pool->used + len > NamePoolBlock){
+        b = malloc(sizeof(NameBlock));
+        if(b == NULL){
+            return NULL;
+        }
+        b->next = name_pool;
+        b->used = 0;
+        name_pool = b;
+    }
+    p = &name_pool->text[name_pool->used];
+    memcpy(p, name, len);
+    name_pool->used += len;
+    return p;
+}
 
-        fscanf(fp, "%d,%lf,%lf,%lf,%[^,],%[^,],%d",
-                     &(cross[i].id), &(cross[i].pos.x), &(cross[i].pos.y),
-                     &(cross[i].wait), cross[i].jname,
-                     cross[i].ename, &(cross[i].points));
+//施設の種類
+//地図の拡張行 facility,交差点番号,種類 で付けるほか、交差点名(日本語)に含まれる語からも決める
+#define FacilityKinds 5
+static struct {
+    char const *name;              /* 拡張行と経路探索サーバで使う名前 */
+    char const *jname;             /* 表示する名前 */
+    char const *words[10];         /* 交差点名にこの語を含めばこの種類とする */
+} const facility_kind[FacilityKinds] = {
+    {"hospital", "病院",     {"病院"}},
+    {"station",  "駅",       {"駅"}},
+    {"park",     "公園",     {"公園"}},
+    {"public",   "公共施設", {"市民センター", "免許センター", "図書館", "博物館", "裁判所", "郵便局",
+                              "市民会館", "天文台", "資料館"}},
+    {"ic",       "インターチェンジ", {"IC"}},
+};
 
-         for(j=0; j < 5; ++j){
-        cross[i].next[j] = -1; 
+//交差点名から決まる施設の種類
+static unsigned facility_from_name(char const *jname){
+    unsigned kinds = 0;
+    int k, w;
+    for(k = 0; k < FacilityKinds; ++k){
+        for(w = 0; w < 10 && facility_kind[k].words[w] != NULL; ++w){
+            if(strstr(jname, facility_kind[k].words[w]) != NULL){
+                kinds |= 1u << k;
+            }
+        }
     }
+    return kinds;
+}
 
-        for (j = 0; j < cross[i].points; j++) {
-            fscanf(fp, ",%d", &(cross[i].next[j]));
+//種類の名前(英語・日本語)から添字を引く関数(なければ-1)
+static int facility_find(char const *name){
+    int k;
+    for(k = 0; k < FacilityKinds; ++k){
+        if(strcmp(name, facility_kind[k].name) == 0 || strcmp(name, facility_kind[k].jname) == 0){
+            return k;
         }
-
     }
-    fclose(fp);
-
-    return crossing_number;
+    return -1;
 }
 
-//円を描く関数
-static void draw_circle(double x, double y, double r) {
-    int const N = 24;             /* 円周を 24分割して線分で描画することにする */
-    int i;
-
-    glBegin(GL_LINE_LOOP);
-    for (i = 0; i < N; i++)
-        glVertex2d(x + cos(2 * M_PI * i / N) * r,
-                   y + sin(2 * M_PI * i / N) * r);
-    glEnd();
-}
+//道路の形状点
+//形状点は1つ前の点(最初は出発側の交差点)からの差分を SHAPE_UNIT 単位の整数で持つ
+//表示を間引くための重要度(Douglas-Peucker法で消える許容誤差)も合わせて持つ
+//地図を読み込むときに必要なだけ伸ばし、版を作っても書き換えないので全部の版で共有する
+static short (*shape_delta)[2] = NULL;  /* 差分 dx, dy */
+static float *shape_rank = NULL;        /* 重要度[km] */
+static int shape_number = 0;            /* 使用中の形状点数 */
+static int shape_capacity = 0;          /* 確保済みの形状点数 */
 
-//球を描く関数
-static void draw_ball(double x, double y, double r){
-    int const N = 6;
-    int i ;
-    for(i = 0; i < N; ++i){
-        glPushMatrix();
+//形状点の領域をあと1点分確保する関数
+static int shape_reserve(void){
+    short (*delta)[2];
+    float *rank;
+    int capacity;
 
-        glTranslated(x, y, 0);
-        glRotatef(90, 1.0, 0, 0);
-        glRotatef(360 * i / N, 0, 1.0, 0);
-        glTranslated(-x, -y, 0);
-        draw_circle(x, y, r);
+    if(shape_number < shape_capacity){
+        return 0;
+    }
+    capacity = (shape_capacity == 0) ? 1024 : shape_capacity * 2;
+    delta = realloc(shape_delta, sizeof(shape_delta[0]) * capacity);
+    if(delta == NULL){
+        return -1;
+    }
+    shape_delta = delta;
+    rank = realloc(shape_rank, sizeof(shape_rank[0]) * capacity);
+    if(rank == NULL){
+        return -1;
+    }
+    shape_rank = rank;
+    shape_capacity = capacity;
+    return 0;
+}
 
-        glTranslated(x, y, 0);
-        glRotatef(90, 0, 0, 0);
-        glRotatef(360 * i / N, 1.0, 0, 0);
-        glTranslated(-x, -y, 0);
-        draw_circle(x, y, r);
 
-        glTranslated(x, y, 0);
-        glRotatef(90, 0, 0, 0);
-        glRotatef(360 * i / N, 0, 1.0, 0);
-        glTranslated(-x, -y, 0);
-        draw_circle(x, y, r);
+//交差点aから伸びるj番目の道路の形状点を取り出す関数
+//両端の交差点を含めて、重要度がtolerance以上の点だけをxs, ysに入れて個数を返す
+static int road_shape(int a, int j, double tolerance, double xs[], double ys[]){
+    int k, n = 0;
+    int offset = cross[a].shape[j];
+    long cx = 0, cy = 0;
 
-        glPopMatrix();
+    xs[n] = cross[a].pos.x;
+    ys[n] = cross[a].pos.y;
+    n++;
+    for(k = 0; k < cross[a].shape_points[j]; ++k){
+        cx += shape_delta[offset + k][0];
+        cy += shape_delta[offset + k][1];
+        if(shape_rank[offset + k] >= tolerance){
+            xs[n] = cross[a].pos.x + cx * SHAPE_UNIT;
+            ys[n] = cross[a].pos.y + cy * SHAPE_UNIT;
+            n++;
+        }
     }
+    xs[n] = cross[ cross[a].next[j] ].pos.x;
+    ys[n] = cross[ cross[a].next[j] ].pos.y;
+    return n + 1;
 }
 
-//円錐を描く関数
-static void draw_corn(double x, double y, double z, double r){
-    int const N = 12;
-    int i;
-    //底面
-    glNormal3d(0.0,-1.0,0.0);
-    glBegin(GL_TRIANGLE_FAN);
-    for (i = 0; i < N; i++){
-        glVertex3d(x + cos(2 * M_PI * i / N) * r, y + sin(2 * M_PI * i / N) * r,0);
-    }
-    glEnd();
-    //側面
-    for (i = 0; i < N ; i++){
-        glBegin(GL_TRIANGLES);
-        glVertex3d(x,y,z);
-        glVertex3d(x + cos(2 * M_PI * i / N) * r, y + sin(2 * M_PI * i / N) * r,0);
-        glVertex3d(x + cos(2 * M_PI * (i+1) / N) * r, y + sin(2 * M_PI * (i+1) / N) * r,0);
-        glEnd();
+//交差点aから交差点bへの道路が何番目かを求める関数(つながっていなければ-1)
+static int road_slot(int a, int b){
+    int j;
+    for(j = 0; j < cross[a].points; ++j){
+        if(cross[a].next[j] == b){
+            return j;
+        }
     }
+    return -1;
 }
 
-//文字列を描く関数
-static void draw_outtextxy(double x, double y, char const *text, double rotation, double rotation_z) {
-    double const scale = 0.01;
-    glPushMatrix();
-    glTranslated(x, y, 0.0);
-    glRotatef(rotation,0,0,1.0);
-    glRotatef(rotation_z,1.0,0,0);
-    glScaled(scale, scale, scale);
-    ftglRenderFont(font, text, FTGL_RENDER_ALL);
-    glPopMatrix();
+//交差点aから交差点bへの道路の長さ(つながっていなければINFINITY)
+static double road_length(int a, int b){
+    int j = road_slot(a, b);
+    return (j == -1) ? INFINITY : cross[a].length[j];
 }
 
-//道路網を描く関数
-static void map_show(int crossing_number) {
-    int i, j;
-    double x0, y0, x1, y1, x2, y2;
-
-    for (i = 0; i < crossing_number; i++) {     /* 交差点毎のループ */
-        x0 = cross[i].pos.x;
-        y0 = cross[i].pos.y;
-
-        /* 交差点を表す円を描く */
-        glColor3d(1.0, 0.5, 0.5);
-        draw_corn(x0,y0,0.3,0.05);
+//右左折の禁止表
+//禁止のある交差点だけが表を持つ(Crossing.turn_tableが表の番号)
+//turn_ban[表][入ってくる道路] は、その道路から進めない道路のビットを立てたもの
+//形状点と同じく地図を読み込むときに伸ばし、全部の版で共有する
+static unsigned char (*turn_ban)[5] = NULL;
+static int turn_table_number = 0;
+static int turn_table_capacity = 0;
+static int turn_mode = 1;              /* 1なら右左折のコストと禁止を考慮する */
 
+//禁止のない表を1つ足して、その番号を返す関数(確保できなければ-1)
+static int turn_table_add(void){
+    unsigned char (*table)[5];
+    int capacity;
 
-        /* 交差点から伸びる道路を描く */
-        glColor3d(1.0, 1.0, 1.0);
-        for (j = 0; j < cross[i].points; j++) {
-            x1 = cross[ cross[i].next[j] ].pos.x;
-            y1 = cross[ cross[i].next[j] ].pos.y;
-            x2 = (x0 + x1)/2;
-            y2 = (y0 + y1)/2; //中間点の設定
+    if(turn_table_number >= turn_table_capacity){
+        capacity = (turn_table_capacity == 0) ? 256 : turn_table_capacity * 2;
+        table = realloc(turn_ban, sizeof(turn_ban[0]) * capacity);
+        if(table == NULL){
+            return -1;
+        }
+        turn_ban = table;
+        turn_table_capacity = capacity;
+    }
+    memset(turn_ban[turn_table_number], 0, sizeof(turn_ban[0]));
+    return turn_table_number++;
+}
 
-            glBegin(GL_LINES);
-            glColor3d(1,0,0);
-            glVertex2d(x0, y0);
-            glColor3d(1,1,1);
-            glVertex2d(x2, y2);
-            glEnd();
+//交差点の配列と交差点名、形状点、右左折の禁止表を捨てて、crossing_number個の交差点を確保する関数
+static int cross_alloc(int crossing_number){
+    NameBlock *b;
+    while(name_pool != NULL){
+        b = name_pool;
+        name_pool = b->next;
+        free(b);
+    }
+    free(shape_delta);
+    free(shape_rank);
+    shape_delta = NULL;
+    shape_rank = NULL;
+    shape_number = shape_capacity = 0;
+    free(turn_ban);
+    turn_ban = NULL;
+    turn_table_number = turn_table_capacity = 0;
+    free(cross);
+    free(cross_index);
+    cross = calloc(crossing_number, sizeof(Crossing));
+    cross_index = malloc(sizeof(int) * crossing_number);
+    return (cross == NULL || cross_index == NULL) ? -1 : 0;
+}
 
-            glBegin(GL_LINES);
-            glColor3d(1,1,1);
-            glVertex2d(x2,y2);
-            glColor3d(1,0,0);
-            glVertex2d(x1,y1);
-            glEnd();
 
-        }
+//交差点aから伸びるj番目の道路で、交差点aの次の点を求める関数(道路の向きを求めるのに使う)
+static void road_first_point(int a, int j, double *x, double *y){
+    int offset = cross[a].shape[j];
+    if(cross[a].shape_points[j] > 0){
+        *x = cross[a].pos.x + shape_delta[offset][0] * SHAPE_UNIT;
+        *y = cross[a].pos.y + shape_delta[offset][1] * SHAPE_UNIT;
+    }
+    else{
+        *x = cross[ cross[a].next[j] ].pos.x;
+        *y = cross[ cross[a].next[j] ].pos.y;
     }
 }
 
-//経路の始点と終点の交差点名を表示する関数
-static void draw_intersection_name(int vehicle_pathIterator, int path[], double rotation, double rotation_z){
-    double x0, y0, x1, y1;
-    x0 = cross[path[vehicle_pathIterator + 0]].pos.x;
-    y0 = cross[path[vehicle_pathIterator + 0]].pos.y;
-    x1 = cross[path[vehicle_pathIterator + 1]].pos.x;
-    y1 = cross[path[vehicle_pathIterator + 1]].pos.y;
-    glColor3d(1.0,1.0,0.0);
-    draw_outtextxy(x0, y0, cross[path[vehicle_pathIterator + 0]].jname, rotation, rotation_z);
-    if(path[vehicle_pathIterator + 1] != -1){
-        draw_outtextxy(x1, y1, cross[path[vehicle_pathIterator + 1]].jname, rotation, rotation_z);
-    } 
+//交差点aから伸びるj番目の道路で、先の交差点の手前の点を求める関数(入ってくる向きを求めるのに使う)
+static void road_last_point(int a, int j, double *x, double *y){
+    int offset = cross[a].shape[j];
+    long cx = 0, cy = 0;
+    int k;
+
+    for(k = 0; k < cross[a].shape_points[j]; ++k){
+        cx += shape_delta[offset + k][0];
+        cy += shape_delta[offset + k][1];
+    }
+    *x = cross[a].pos.x + cx * SHAPE_UNIT;
+    *y = cross[a].pos.y + cy * SHAPE_UNIT;
 }
-//経路上の交差点名をすべて表示する関数
-static void draw_intersection_pathname(int path[], double rotation, double rotation_z){
-    int i = 0;
-    double x0,y0;
-    while(1){
-        if(path[i] == -1){
-            break;
-        }
-        x0 = cross[path[i]].pos.x;
-        y0 = cross[path[i]].pos.y;
 
-        /* 交差点の名前を描く */
-        glColor3d(1.0, 1.0, 0.0);
-        draw_outtextxy(x0, y0, cross[path[i]].jname, rotation, rotation_z);
+//前の点(x0,y0)から今の交差点(x1,y1)を通って次の点(x2,y2)へ進むときに曲がる角度[度]
+//直進が0、Uターンが180で、時計回り(右折)なら負、反時計回り(左折)なら正
+static double turn_angle(double x0, double y0, double x1, double y1, double x2, double y2){
+    double dot_product = (x1 - x0)*(x1 - x2) + (y1 - y0)*(y1 - y2); //内積の計算
+    double cross_product = (x0 - x1)*(y2 - y1) - (y0 - y1)*(x2 - x1); //外積のZ軸計算
+    double norm = hypot(x1 - x0,y1 - y0) * hypot(x1 - x2,y1 - y2);
+    double c, deg;
 
-        i++;
+    if(norm <= 0.0){
+        return 0.0;
     }
+    c = dot_product / norm;
+    if(c > 1.0){
+        c = 1.0;
+    }
+    if(c < -1.0){
+        c = -1.0;
+    }
+    deg = 180 - acos(c) * 180 / M_PI;
+    return (cross_product >= 0.0) ? -deg : deg;
 }
-//交差点名をすべて表示する関数
-static void draw_intersection_allname(int crossing_number, double rotation, double rotation_z){
-    int i;
-    double x0,y0;
-    for(i = 0; i < crossing_number; ++i){
-        x0 = cross[i].pos.x;
-        y0 = cross[i].pos.y;
 
-        /* 交差点の名前を描く */
-        glColor3d(1.0, 1.0, 0.0);
-        draw_outtextxy(x0, y0, cross[i].jname, rotation, rotation_z);
+//曲がる角度deg[度]のコスト[分]
+static double turn_cost_angle(double deg){
+    if(fabs(deg) > 150){
+        return TURN_COST_UTURN;
     }
+    if(fabs(deg) < 30){
+        return 0.0;             /* 直進 */
+    }
+    //左側通行なので、対向車線を横切る右折の方が時間がかかる
+    return (deg < 0) ? TURN_COST_RIGHT : TURN_COST_LEFT;
 }
 
-//メイン経路を表示
-static void draw_main_path(int path[],int choice_mode){
-    int i =0;
-    double x0, x1, y0, y1;
-    while(1){
-        if(path[i+1] == -1){
-            break;
-        }
-        x0 = cross[ path[i] ].pos.x;
-        y0 = cross[ path[i] ].pos.y;
-        x1 = cross[ path[i+1] ].pos.x;
-        y1 = cross[ path[i+1] ].pos.y;
-        glLineWidth(6.0);
-        glBegin(GL_LINES);
-        if(choice_mode == 0){
-            glColor3d(0,0,1);
-        }
-        else if(choice_mode == 1){
-            glColor3d(0.6,1.0,0.2);
-        }
-        
-        glVertex2d(x0,y0);
-        glVertex2d(x1,y1);
-        glEnd();
-        glLineWidth(1.0);
-        i++;
+//交差点viaにin番目の道路から入ってout番目の道路へ出るときのコスト[分]
+//禁止されていれば負の値を返す
+static double turn_cost(int via, int in, int out){
+    double x0, y0, x2, y2, deg;
+
+    if(turn_mode == 0){
+        return 0.0;
     }
-}
-//サブ経路を表示
-static void draw_sub_path(int path[],int choice_mode){
-    int i =0;
-    double x0, x1, y0, y1;
-    while(1){
-        if(path[i+1] == -1){
-            break;
-        }
-        x0 = cross[ path[i] ].pos.x;
-        y0 = cross[ path[i] ].pos.y;
-        x1 = cross[ path[i+1] ].pos.x;
-        y1 = cross[ path[i+1] ].pos.y;
-        glLineWidth(1.5);
-        glBegin(GL_LINES);
-        if(choice_mode == 1){
-            glColor3d(0,0,1);
-        }
-        else if(choice_mode == 0){
-            glColor3d(0.6,1.0,0.2);
-        }
-        
-        glVertex2d(x0,y0);
-        glVertex2d(x1,y1);
-        glEnd();
-        glLineWidth(1.0);
-        i++;
+    if(cross[via].turn_table >= 0 && (turn_ban[cross[via].turn_table][in] >> out) & 1){
+        return -1.0;
     }
+    if(in == out){
+        return TURN_COST_UTURN;
+    }
+    road_first_point(via, in, &x0, &y0);
+    road_first_point(via, out, &x2, &y2);
+    deg = turn_angle(x0, y0, cross[via].pos.x, cross[via].pos.y, x2, y2);
+    return turn_cost_angle(deg);
 }
 
-//交差点間の距離を計算
-double distance(int a, int b){
-  return hypot(cross[a].pos.x-cross[b].pos.x,
-	       cross[a].pos.y-cross[b].pos.y);
+//交差点uのj番目の道路から、その先の交差点のout番目の道路へ出るときのコスト[分](禁止なら負)
+//一方通行で逆向きの道路がなければ、入ってくる向きは道路の最後の形状点から求める
+//(禁止は入ってくる道路の逆向きの番号で表に書くので、両向きの道路にしか付かない)
+static double turn_cost_edge(int u, int j, int out){
+    int via = cross[u].next[j], in = road_slot(via, u);
+    double x0, y0, x2, y2;
+
+    if(in != -1 || turn_mode == 0){
+        return turn_cost(via, in, out);
+    }
+    road_last_point(u, j, &x0, &y0);
+    road_first_point(via, out, &x2, &y2);
+    return turn_cost_angle(turn_angle(x0, y0, cross[via].pos.x, cross[via].pos.y, x2, y2));
 }
 
-//ダイクストラ法(距離)による目的地からの最短距離算出
-void dijkstra_distance(int crossing_number,int target){
-  int i,j,n;
-  double min_distance;
-  double d;
-  int min_cross = 0;
-  int done[MaxCross];     /* 確定済み:1 未確定:0 を入れるフラグ */
-
-  for(i=0;i<crossing_number;i++)/* 初期化 */
-    {
-      cross[i].distance=1e100;  /* 初期値は有り得ないくらい大きな値 */
-      cross[i].previous_distance=-1;     /* 最短経路情報を初期化 */
-      done[i]=0;                /* 全交差点未確定 */
-    }
-
-  /* ただし、基準の交差点は 0 */
-  cross[target].distance=0;
-  
-  for(i=0;i<crossing_number;i++) /* c_number回やれば終わるはず */
-    {
-      /* 最も距離数値の小さな未確定交差点を選定 */
-      min_distance=1e100;
-      for(j=0;j<crossing_number;j++)
-	{  /* _未確定？_    ______暫定最短より近い？_______ */
-	  if((done[j]==0)&&(cross[j].distance < min_distance))
-	    {
-	      min_distance=cross[j].distance;
-	      min_cross=j;
-	    }
-	}
-      /* 交差点 min_cross は 確定できる */
-      done[min_cross]=1;  /* 確定 */
-      /* 確定交差点周りで距離の計算 */
-      for(j=0;j<cross[min_cross].points;j++)
-	{
-	  n=cross[min_cross].next[j];    /* 長ったらしいので置き換え(だけ) */
-	  /* 評価指標 */
-	  d=distance(min_cross,n)+cross[min_cross].distance;
-	  /* 現在の暫定値と比較して、短いなら更新 */
-	  if(cross[n].distance > d){
-	    cross[n].distance = d;
-	    cross[n].previous_distance = min_cross;
-	  }
-	}
+//交差点fromからviaを通ってtoへ進むときのコスト[分]
+//右左折が禁止されているか道路がなければINFINITY(経路の合計に足すと、走れない経路として分かる)
+static double turn_cost_path(int from, int via, int to){
+    int j = road_slot(from, via), out = road_slot(via, to);
+    double turn;
+    if(j == -1 || out == -1){
+        return INFINITY;
     }
+    turn = turn_cost_edge(from, j, out);
+    return (turn < 0) ? INFINITY : turn;
 }
 
-//ダイクストラ法(時間)による目的地への最短時間導出
-void dijkstra_time(int crossing_number, int target, double speed){
-    int i,j,n;
-    double min_time;
-    double t;
-    int min_cross = 0;
-    int done[MaxCross];  //確定済み1　未確定0を入れるフラグ
+//交差点aから交差点bへの道路上で、長さの割合tの位置を求める関数
+static void road_point(int a, int b, double t, double *x, double *y){
+    double xs[MaxRoadShape + 2], ys[MaxRoadShape + 2];
+    int j = road_slot(a, b);
+    int k, n;
+    double rest, d;
 
-    for(i=0;i<crossing_number;i++){     /* 初期化 */
-      cross[i].time=1e100;  /* 初期値は有り得ないくらい大きな値 */
-      cross[i].previous_time=-1;     /* 最短経路情報を初期化 */
-      done[i]=0;                /* 全交差点未確定 */
+    if(j == -1){        /* つながっていなければ直線で求める */
+        *x = cross[a].pos.x + (cross[b].pos.x - cross[a].pos.x) * t;
+        *y = cross[a].pos.y + (cross[b].pos.y - cross[a].pos.y) * t;
+        return;
     }
+    n = road_shape(a, j, 0.0, xs, ys);
+    rest = cross[a].length[j] * t;
 
-    //ただし基準の交差点は0
-    cross[target].time = 0;
-    
-    for(i = 0; i < crossing_number; ++i){   //c_number回で終わるはず
-        //最も時間数値の未確認交差点を選定
-        min_time = 1e100;
-        for(j = 0; j < crossing_number; ++j){
-            if((done[j] == 0) && (cross[j].time < min_time)){
-                min_time = cross[j].time;
-                min_cross = j;
-            }
-        }
-        //交差点min_crossは確定できる
-        done[min_cross] = 1;
-        //確定交差点周りで距離の計算
-        for(j = 0; j < cross[min_cross].points; ++j){
-            n = cross[min_cross].next[j];
-            //評価指標(隣接交差点の待ち時間　+　交差点に行くまでの時間)
-            t = cross[n].wait + (distance(min_cross,n)/(speed/60)) + cross[min_cross].time;
-            //現在の暫定値と比較して、短いなら更新
-            if(cross[n].time > t){
-                cross[n].time = t;
-                cross[n].previous_time = min_cross;
+    for(k = 0; k + 1 < n; ++k){
+        d = hypot(xs[k + 1] - xs[k], ys[k + 1] - ys[k]);
+        if(rest <= d || k + 2 == n){
+            d = (d > 0) ? rest / d : 0.0;
+            if(d > 1.0){
+                d = 1.0;
             }
+            *x = xs[k] + (xs[k + 1] - xs[k]) * d;
+            *y = ys[k] + (ys[k + 1] - ys[k]) * d;
+            return;
         }
+        rest -= d;
     }
+    *x = xs[n - 1];
+    *y = ys[n - 1];
 }
 
-//最短経路計算
-int pickup_path_distance(int crossing_number,int start,int goal,int path[],int maxpath){
-  int c=start;         /* 現在いる交差点 */
-  int i;
+//交差点aから交差点bへの道路を、長さの割合ratioまで線分(GL_LINES)の頂点として出す関数
+static void road_vertices(int a, int b, double ratio, double tolerance){
+    double xs[MaxRoadShape + 2], ys[MaxRoadShape + 2];
+    int j = road_slot(a, b);
+    int k, n;
+    double rest, d;
 
-  path[0]=start;
-  i=1;
-  c=start;             /* 現在値を start に設定 */
-  while(c!=goal)
-    {
-      c=cross[c].previous_distance;
-      path[i]=c;
-      i++;
+    if(j == -1){        /* つながっていなければ描かない */
+        return;
     }
-  return 0;
-}
-//最短時間計算
-int pickup_path_time(int crossing_number,int start,int goal,int path[],int maxpath){
-  int c=start;         /* 現在いる交差点 */
-  int i;
+    n = road_shape(a, j, tolerance, xs, ys);
+    rest = cross[a].length[j] * ratio;
 
-  path[0]=start;
-  i=1;
-  c=start;             /* 現在値を start に設定 */
-  while(c!=goal)
-    {
-      c=cross[c].previous_time;
-      path[i]=c;
-      i++;
+    for(k = 0; k + 1 < n && rest > 0; ++k){
+        d = hypot(xs[k + 1] - xs[k], ys[k + 1] - ys[k]);
+        glVertex2d(xs[k], ys[k]);
+        if(rest < d){
+            glVertex2d(xs[k] + (xs[k + 1] - xs[k]) * rest / d, ys[k] + (ys[k + 1] - ys[k]) * rest / d);
+            return;
+        }
+        glVertex2d(xs[k + 1], ys[k + 1]);
+        rest -= d;
     }
-  return 0;
 }
 
-//合計距離計算
-double calculate_distance(int path[]){
-    int i = 0;
-    double all_distance = 0.0;
-    while(1){
-        if(path[i+1] == -1){
-            break;
-        }
-        all_distance = all_distance + distance(path[i],path[i+1]);
+//Douglas-Peucker法で形状点の重要度を求める関数
+//区間lo～hiで線分から最も離れた点の距離を重要度とし、親の重要度を超えないようにする
+static void shape_simplify(double const xs[], double const ys[], int lo, int hi, double cap, float rank[]){
+    int k, far = -1;
+    double d, len, best = -1.0;
+
+    if(hi - lo < 2){
+        return;
+    }
+    len = hypot(xs[hi] - xs[lo], ys[hi] - ys[lo]);
+    for(k = lo + 1; k < hi; ++k){
+        if(len > 0){
+            d = fabs((xs[hi] - xs[lo]) * (ys[lo] - ys[k]) - (xs[lo] - xs[k]) * (ys[hi] - ys[lo])) / len;
+        }
+        else{
+            d = hypot(xs[k] - xs[lo], ys[k] - ys[lo]);
+        }
+        if(d > best){
+            best = d;
+            far = k;
+        }
+    }
+    if(best > cap){
+        best = cap;
+    }
+    rank[far - 1] = best;   /* rank[]は両端の交差点を含まない */
+    shape_simplify(xs, ys, lo, far, best, rank);
+    shape_simplify(xs, ys, far, hi, best, rank);
+}
+
+//交差点aのj番目の道路に形状点(両端を含まない)を登録して長さを求める関数
+static int road_set_shape(int a, int j, double const px[], double const py[], int points){
+    double xs[MaxRoadShape + 2], ys[MaxRoadShape + 2];
+    long cx = 0, cy = 0, tx, ty, dx, dy;
+    int k, n = 0, start = shape_number;
+
+    //差分が short に収まらないときは途中に点を足して分割する
+    for(k = 0; k < points; ++k){
+        tx = lround((px[k] - cross[a].pos.x) / SHAPE_UNIT);
+        ty = lround((py[k] - cross[a].pos.y) / SHAPE_UNIT);
+        do{
+            dx = tx - cx;
+            dy = ty - cy;
+            if(dx > SHRT_MAX) dx = SHRT_MAX;
+            if(dx < -SHRT_MAX) dx = -SHRT_MAX;
+            if(dy > SHRT_MAX) dy = SHRT_MAX;
+            if(dy < -SHRT_MAX) dy = -SHRT_MAX;
+            if(n >= MaxRoadShape || shape_reserve() < 0){
+                return -1;
+            }
+            shape_delta[shape_number][0] = (short)dx;
+            shape_delta[shape_number][1] = (short)dy;
+            cx += dx;
+            cy += dy;
+            shape_number++;
+            n++;
+            xs[n] = cross[a].pos.x + cx * SHAPE_UNIT;
+            ys[n] = cross[a].pos.y + cy * SHAPE_UNIT;
+        }while(cx != tx || cy != ty);
+    }
+    xs[0] = cross[a].pos.x;
+    ys[0] = cross[a].pos.y;
+    xs[n + 1] = cross[ cross[a].next[j] ].pos.x;
+    ys[n + 1] = cross[ cross[a].next[j] ].pos.y;
+
+    cross[a].shape[j] = start;
+    cross[a].shape_points[j] = n;
+    cross[a].length[j] = 0.0;
+    for(k = 0; k <= n; ++k){
+        cross[a].length[j] += hypot(xs[k + 1] - xs[k], ys[k + 1] - ys[k]);
+    }
+    if(n > 0){
+        shape_simplify(xs, ys, 0, n + 1, 1e100, &shape_rank[start]);
+    }
+    return 0;
+}
+
+//ファイルを読み込む関数
+static int map_read(char *filename) {
+    FILE *fp;
+    int i, j, k;
+    int crossing_number;          /* 交差点数 */
+    int a, b, c, points;          /* 形状点を持つ道路の両端と形状点数 */
+    char keyword[16];             /* 拡張行の種類 */
+    char kind[16];                /* 施設の種類 */
+    char jname[MaxName], ename[MaxName];
+    static double px[MaxRoadShape], py[MaxRoadShape];
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+
+    /* はじめに交差点数を読み込む */
+    if (fscanf(fp, "%d", &crossing_number) != 1 || crossing_number <= 0
+        || cross_alloc(crossing_number) < 0) {
+        fprintf(stderr, "%s: invalid crossing number\n", filename);
+        fclose(fp);
+        return -1;
+    }
+
+    for (i = 0; i < crossing_number; i++) {
+
+        if (fscanf(fp, "%d,%lf,%lf,%lf,%49[^,],%49[^,],%d",
+                     &(cross[i].id), &(cross[i].pos.x), &(cross[i].pos.y),
+                     &(cross[i].wait), jname,
+                     ename, &(cross[i].points)) != 7
+            || cross[i].points < 0 || cross[i].points > 5) {
+            fprintf(stderr, "%s: invalid crossing %d\n", filename, i);
+            fclose(fp);
+            return -1;
+        }
+        cross[i].jname = name_store(jname);
+        cross[i].ename = name_store(ename);
+        cross[i].facility = facility_from_name(jname);
+
+         for(j=0; j < 5; ++j){
+        cross[i].next[j] = -1; 
+    }
+
+        for (j = 0; j < cross[i].points; j++) {
+            if (fscanf(fp, ",%d", &(cross[i].next[j])) != 1
+                || cross[i].next[j] < 0 || cross[i].next[j] >= crossing_number) {
+                fprintf(stderr, "%s: invalid crossing %d\n", filename, i);
+                fclose(fp);
+                return -1;
+            }
+        }
+
+    }
+
+    /* IDは0～交差点数-1を1回ずつ使う(道路は行の順番で指す) */
+    for (i = 0; i < crossing_number; i++) {
+        cross_index[i] = -1;
+    }
+    for (i = 0; i < crossing_number; i++) {
+        if (cross[i].id < 0 || cross[i].id >= crossing_number || cross_index[cross[i].id] != -1) {
+            fprintf(stderr, "%s: invalid crossing id %d\n", filename, cross[i].id);
+            fclose(fp);
+            return -1;
+        }
+        cross_index[cross[i].id] = i;
+    }
+
+    /* 道路の長さ(形状点がなければ交差点間の直線) */
+    shape_number = 0;
+    for (i = 0; i < crossing_number; i++) {
+        for (j = 0; j < cross[i].points; j++) {
+            cross[i].length[j] = hypot(cross[i].pos.x - cross[ cross[i].next[j] ].pos.x,
+                                       cross[i].pos.y - cross[ cross[i].next[j] ].pos.y);
+            cross[i].shape[j] = 0;
+            cross[i].shape_points[j] = 0;
+        }
+        cross[i].turn_table = -1;
+    }
+    turn_table_number = 0;
+
+    /* 拡張形式 : 交差点の後に道路の形状点と右左折禁止を読み込む(省略可)
+       shape,交差点番号,交差点番号,形状点数,x1,y1,x2,y2,...
+       noturn,来た交差点番号,曲がる交差点番号,行き先の交差点番号
+       facility,交差点番号,種類(hospital, station, park, public, ic) */
+    while (fscanf(fp, " %15[a-z]", keyword) == 1) {
+        if (strcmp(keyword, "facility") == 0) {
+            if (fscanf(fp, ",%d,%15[a-z]", &a, kind) != 2 || a < 0 || a >= crossing_number
+                || facility_find(kind) < 0) {
+                fprintf(stderr, "%s: invalid facility\n", filename);
+                fclose(fp);
+                return -1;
+            }
+            cross[a].facility |= 1u << facility_find(kind);
+            continue;
+        }
+        if (strcmp(keyword, "noturn") == 0) {
+            if (fscanf(fp, ",%d,%d,%d", &a, &b, &c) != 3
+                || a < 0 || a >= crossing_number || b < 0 || b >= crossing_number
+                || c < 0 || c >= crossing_number
+                || road_slot(b, a) == -1 || road_slot(b, c) == -1) {
+                fprintf(stderr, "%s: invalid noturn\n", filename);
+                fclose(fp);
+                return -1;
+            }
+            /* 禁止のある交差点にだけ表を割り当てる */
+            if (cross[b].turn_table == -1) {
+                cross[b].turn_table = turn_table_add();
+                if (cross[b].turn_table < 0) {
+                    fprintf(stderr, "%s: out of memory\n", filename);
+                    fclose(fp);
+                    return -1;
+                }
+            }
+            turn_ban[cross[b].turn_table][road_slot(b, a)] |= 1 << road_slot(b, c);
+            continue;
+        }
+        if (strcmp(keyword, "shape") != 0 || fscanf(fp, ",%d,%d,%d", &a, &b, &points) != 3) {
+            fprintf(stderr, "%s: unknown line '%s'\n", filename, keyword);
+            fclose(fp);
+            return -1;
+        }
+        if (a < 0 || a >= crossing_number || b < 0 || b >= crossing_number
+            || road_slot(a, b) == -1 || road_slot(b, a) == -1
+            || points < 0 || points > MaxRoadShape) {
+            fprintf(stderr, "%s: invalid shape %d-%d\n", filename, a, b);
+            fclose(fp);
+            return -1;
+        }
+        for (k = 0; k < points; k++) {
+            if (fscanf(fp, ",%lf,%lf", &px[k], &py[k]) != 2) {
+                fprintf(stderr, "%s: invalid shape %d-%d\n", filename, a, b);
+                fclose(fp);
+                return -1;
+            }
+        }
+        /* 逆向きの道路には逆順で登録する */
+        if (road_set_shape(a, road_slot(a, b), px, py, points) < 0) {
+            fprintf(stderr, "%s: too many shape points\n", filename);
+            fclose(fp);
+            return -1;
+        }
+        for (k = 0; k < points / 2; k++) {
+            double t;
+            t = px[k]; px[k] = px[points - 1 - k]; px[points - 1 - k] = t;
+            t = py[k]; py[k] = py[points - 1 - k]; py[points - 1 - k] = t;
+        }
+        if (road_set_shape(b, road_slot(b, a), px, py, points) < 0) {
+            fprintf(stderr, "%s: too many shape points\n", filename);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    return crossing_number;
+}
+
+//交差点の並べ替え
+//地図ファイルの交差点番号(ID)はそのままにして、cross[]の中の並びだけを変える
+//隣り合う交差点がメモリ上でも近くなるので、経路探索や描画でキャッシュに乗りやすくなる
+//画面や経路探索サーバでやりとりする番号はcross[].id、プログラムの中ではcross[]の添字を使う
+
+//交差点を幅優先の順に並べる(つながっていない部分は続けて並べる)
+//old_id[新しい添字] = 元の添字、new_id[元の添字] = 新しい添字
+static void cross_bfs_order(int crossing_number, int old_id[], int new_id[]){
+    int head = 0, tail = 0, root, v, j, n;
+
+    for(v = 0; v < crossing_number; ++v){
+        new_id[v] = -1;
+    }
+    for(root = 0; root < crossing_number; ++root){
+        if(new_id[root] != -1){
+            continue;
+        }
+        new_id[root] = tail;
+        old_id[tail++] = root;
+        while(head < tail){
+            v = old_id[head++];
+            for(j = 0; j < cross[v].points; ++j){
+                n = cross[v].next[j];
+                if(new_id[n] == -1){
+                    new_id[n] = tail;
+                    old_id[tail++] = n;
+                }
+            }
+        }
+    }
+}
+
+//ヒルベルト曲線上の位置(x, yは 0～(1<<16)-1)
+static uint64_t hilbert_key(uint32_t x, uint32_t y){
+    uint64_t d = 0;
+    uint32_t s, rx, ry, t;
+    for(s = 1u << 15; s > 0; s >>= 1){
+        rx = (x & s) > 0;
+        ry = (y & s) > 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        //象限に合わせて回転する
+        if(ry == 0){
+            if(rx == 1){
+                x = s - 1 - (x & (s - 1));
+                y = s - 1 - (y & (s - 1));
+            }
+            t = x;
+            x = y;
+            y = t;
+        }
+        x &= s - 1;
+        y &= s - 1;
+    }
+    return d;
+}
+
+typedef struct {
+    uint64_t key;
+    int id;
+} SortKey;
+
+static int compare_sort_key(void const *a, void const *b){
+    SortKey const *p = a, *q = b;
+    if(p->key != q->key){
+        return (p->key < q->key) ? -1 : 1;
+    }
+    return p->id - q->id;
+}
+
+//交差点を位置のヒルベルト曲線の順に並べる
+static int cross_hilbert_order(int crossing_number, int old_id[], int new_id[]){
+    SortKey *key = malloc(sizeof(SortKey) * crossing_number);
+    double x0 = 1e100, y0 = 1e100, x1 = -1e100, y1 = -1e100, scale;
+    int v;
+
+    if(key == NULL){
+        return -1;
+    }
+    for(v = 0; v < crossing_number; ++v){
+        x0 = fmin(x0, cross[v].pos.x);
+        y0 = fmin(y0, cross[v].pos.y);
+        x1 = fmax(x1, cross[v].pos.x);
+        y1 = fmax(y1, cross[v].pos.y);
+    }
+    scale = 65535.0 / fmax(fmax(x1 - x0, y1 - y0), 1e-9);
+    for(v = 0; v < crossing_number; ++v){
+        key[v].key = hilbert_key((uint32_t)((cross[v].pos.x - x0) * scale), (uint32_t)((cross[v].pos.y - y0) * scale));
+        key[v].id = v;
+    }
+    qsort(key, crossing_number, sizeof(SortKey), compare_sort_key);
+    for(v = 0; v < crossing_number; ++v){
+        old_id[v] = key[v].id;
+        new_id[key[v].id] = v;
+    }
+    free(key);
+    return 0;
+}
+
+//cross[]を並べ替える関数(method 0:ヒルベルト曲線 1:幅優先)
+//形状点と右左折禁止の表は道路の順番(スロット)で引くので、交差点と一緒に動かすだけでよい
+static int map_reorder(int crossing_number, int method){
+    int *old_id = malloc(sizeof(int) * crossing_number);
+    int *new_id = malloc(sizeof(int) * crossing_number);
+    Crossing *sorted = malloc(sizeof(Crossing) * crossing_number);
+    int v, j, result = -1;
+
+    if(old_id == NULL || new_id == NULL || sorted == NULL){
+        goto reorderend;
+    }
+    if(method == 0){
+        if(cross_hilbert_order(crossing_number, old_id, new_id) < 0){
+            goto reorderend;
+        }
+    }
+    else{
+        cross_bfs_order(crossing_number, old_id, new_id);
+    }
+    for(v = 0; v < crossing_number; ++v){
+        sorted[v] = cross[old_id[v]];
+        for(j = 0; j < sorted[v].points; ++j){
+            sorted[v].next[j] = new_id[sorted[v].next[j]];
+        }
+        cross_index[sorted[v].id] = v;
+    }
+    free(cross);
+    cross = sorted;
+    sorted = NULL;
+    result = 0;
+
+    reorderend:
+    free(old_id);
+    free(new_id);
+    free(sorted);
+    return result;
+}
+
+//地図をファイルに書き出す関数(読み込んだときと同じ形式、交差点はcross[]の並び順)
+static int map_write(char const *filename, int crossing_number){
+    static double xs[MaxRoadShape + 2], ys[MaxRoadShape + 2];
+    FILE *fp = fopen(filename, "w");
+    int i, j, k, n, out;
+
+    if(fp == NULL){
+        perror(filename);
+        return -1;
+    }
+    fprintf(fp, "%d\n", crossing_number);
+    for(i = 0; i < crossing_number; ++i){
+        fprintf(fp, "%d,%.6f,%.6f,%.6f,%s,%s,%d", cross[i].id, cross[i].pos.x, cross[i].pos.y, cross[i].wait,
+                cross[i].jname, cross[i].ename, cross[i].points);
+        for(j = 0; j < cross[i].points; ++j){
+            fprintf(fp, ",%d", cross[i].next[j]);
+        }
+        fprintf(fp, "\n");
+    }
+    //形状点は片方の向きだけ書く(読み込むときに逆向きにも登録される)
+    for(i = 0; i < crossing_number; ++i){
+        for(j = 0; j < cross[i].points; ++j){
+            if(cross[i].shape_points[j] == 0 || cross[i].next[j] < i){
+                continue;
+            }
+            n = road_shape(i, j, -1.0, xs, ys);
+            fprintf(fp, "shape,%d,%d,%d", i, cross[i].next[j], n - 2);
+            for(k = 1; k < n - 1; ++k){
+                fprintf(fp, ",%.3f,%.3f", xs[k], ys[k]);
+            }
+            fprintf(fp, "\n");
+        }
+    }
+    for(i = 0; i < crossing_number; ++i){
+        if(cross[i].turn_table < 0){
+            continue;
+        }
+        for(j = 0; j < cross[i].points; ++j){
+            for(out = 0; out < cross[i].points; ++out){
+                if((turn_ban[cross[i].turn_table][j] >> out) & 1){
+                    fprintf(fp, "noturn,%d,%d,%d\n", cross[i].next[j], i, cross[i].next[out]);
+                }
+            }
+        }
+    }
+    //施設は交差点名から決まらないものだけ書く
+    for(i = 0; i < crossing_number; ++i){
+        for(k = 0; k < FacilityKinds; ++k){
+            if(((cross[i].facility & ~facility_from_name(cross[i].jname)) >> k) & 1){
+                fprintf(fp, "facility,%d,%s\n", i, facility_kind[k].name);
+            }
+        }
+    }
+    if(fclose(fp) != 0){
+        perror(filename);
+        return -1;
+    }
+    return 0;
+}
+
+//経過時間(ミリ秒)を測る関数
+static double elapsed_ms(struct timespec const *begin){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) * 1e3 + (now.tv_nsec - begin->tv_nsec) / 1e6;
+}
+
+//-----------------------------地図の版の入れ替え------------------------------
+//経路探索サーバや画面を止めずに地図を変えるため、差分ファイルを当てた新しい版を作り、ポインタを付け替えて公開する
+//読む側(サーバのワーカー、経路探索スレッド、描画)は要求やフレームの間だけ版に留まり(map_enter～map_leave)、ロックは取らない
+//途中で公開された版には次に入ったときに移るので、処理中の探索やフレームは最後まで同じ版を見る
+//古い版は、それに留まっているスレッドがいなくなったことをエポックで確かめてから解放する
+//  読む側は、全体のエポックを自分の記録に写してから今の版を読む
+//  書く側は、版を付け替えてからエポックを進める。置き換えたときのエポック以下で留まっている読む側がいなければ、
+//  古い版を読んでいるスレッドはいない
+//右左折の禁止表、道路の形状点、交差点名の領域は差分で書き換えないので、全ての版で共有する
+#define MapMaxReaders    (MaxThreads + 16)  /* 版に留まるスレッドの最大数 */
+#define MapWatchInterval 200                /* 差分ファイルを調べる間隔[ms] */
+
+//道路が変わった範囲の履歴(新しい順、版の間で共有して解放しない)
+typedef struct MapChange {
+    unsigned version;              /* 道路を変えた版 */
+    double area[4];                /* 変えた範囲 x0, y0, x1, y1 */
+    struct MapChange const *next;  /* それより前の変更 */
+} MapChange;
+
+//読む側のスレッドごとの記録
+typedef struct {
+    uint64_t epoch;                /* 留まっている間は入ったときのエポック、外にいれば0(原子的に読み書きする) */
+    int used;                      /* スレッドが使っていれば1(原子的に読み書きする) */
+} MapReader;
+
+static struct {
+    MapSnapshot *current;          /* 今の版(原子的に読み書きする、公開していなければNULL) */
+    uint64_t epoch;                /* 全体のエポック(1から、原子的に読み書きする) */
+    MapReader reader[MapMaxReaders];
+    MapSnapshot *retired;          /* 置き換えられて回収を待つ版(lockで守る) */
+    int retired_number;
+    long freed;                    /* 解放した版の数 */
+    MapChange const *changes;      /* 道路が変わった範囲の履歴(lockで守る) */
+    pthread_mutex_t lock;          /* 書く側どうし(版の作成と公開、回収)の排他 */
+    //差分ファイルの監視
+    pthread_t watcher;
+    int watching, stop;
+    char const *diff;
+    struct timespec mtime;
+    off_t size;
+} map_rcu = {.epoch = 1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread MapReader *map_reader = NULL;  /* このスレッドの記録 */
+
+//このスレッドが見ている版の番号(地図を公開していなければ1)
+static unsigned map_version(void){
+    return (map_view != NULL) ? map_view->version : 1;
+}
+
+//見ている版の費用が版versionから変わっていないか(ハブラベルのように正確な費用を前計算したものを使えるか)
+static int map_costs_unchanged(unsigned version){
+    return map_view == NULL || map_view->cost_version <= version;
+}
+
+//見ている版の費用が版versionより小さくなっていないか(ランドマークのように費用の下界を前計算したものを使えるか)
+static int map_costs_not_lowered(unsigned version){
+    return map_view == NULL || map_view->lower_version <= version;
+}
+
+//今の版に入る関数(留まっている間は、その版の交差点をcrossで読める)
+//既に入っていれば今の版に移り直す。地図を公開していなければ何もせずNULLを返す
+static MapSnapshot *map_enter(void){
+    MapSnapshot *s;
+    int k;
+
+    if(__atomic_load_n(&map_rcu.current, __ATOMIC_ACQUIRE) == NULL){
+        return NULL;
+    }
+    //初めて入るスレッドは空いている記録を取る
+    for(k = 0; map_reader == NULL && k < MapMaxReaders; ++k){
+        if(__atomic_exchange_n(&map_rcu.reader[k].used, 1, __ATOMIC_ACQ_REL) == 0){
+            map_reader = &map_rcu.reader[k];
+        }
+    }
+    if(map_reader == NULL){
+        fprintf(stderr, "too many map readers\n");
+        abort();
+    }
+    __atomic_store_n(&map_reader->epoch, __atomic_load_n(&map_rcu.epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    s = __atomic_load_n(&map_rcu.current, __ATOMIC_SEQ_CST);
+    map_view = s;
+    cross = s->cross;
+    return s;
+}
+
+//版から出る関数(出た後は次にmap_enterするまでcrossを読まない)
+static void map_leave(void){
+    if(map_reader != NULL){
+        __atomic_store_n(&map_reader->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+//スレッドを終える前に記録を返す関数
+static void map_detach(void){
+    if(map_reader != NULL){
+        map_leave();
+        __atomic_store_n(&map_reader->used, 0, __ATOMIC_RELEASE);
+        map_reader = NULL;
+    }
+}
+
+//メニューの入力を読む関数(scanfと同じ)
+//入力を待つ間は版から出て古い版の解放を止めないようにし、読んだら今の版に入り直す
+static int menu_scanf(char const *format, ...){
+    va_list ap;
+    int entered = map_reader != NULL && __atomic_load_n(&map_reader->epoch, __ATOMIC_RELAXED) != 0;
+    int r;
+
+    if(entered){
+        map_leave();
+    }
+    va_start(ap, format);
+    r = vscanf(format, ap);
+    va_end(ap);
+    if(entered){
+        map_enter();
+    }
+    return r;
+}
+
+//回収を待つ版のうち、もう誰も留まっていないものを解放する関数(lockを取って呼ぶ)
+static void map_reclaim_locked(void){
+    uint64_t oldest = UINT64_MAX, e;
+    MapSnapshot **p, *s;
+    int k;
+
+    for(k = 0; k < MapMaxReaders; ++k){
+        e = __atomic_load_n(&map_rcu.reader[k].epoch, __ATOMIC_SEQ_CST);
+        if(e != 0 && e < oldest){
+            oldest = e;
+        }
+    }
+    for(p = &map_rcu.retired; (s = *p) != NULL; ){
+        if(s->retired < oldest){
+            *p = s->next;
+            free(s->cross);
+            free(s);
+            map_rcu.retired_number--;
+            map_rcu.freed++;
+        }
+        else{
+            p = &s->next;
+        }
+    }
+}
+
+static void map_reclaim(void){
+    pthread_mutex_lock(&map_rcu.lock);
+    map_reclaim_locked();
+    pthread_mutex_unlock(&map_rcu.lock);
+}
+
+//版sを今の版にする関数(lockを取って呼ぶ)
+static void map_publish_locked(MapSnapshot *s){
+    MapSnapshot *old = __atomic_exchange_n(&map_rcu.current, s, __ATOMIC_SEQ_CST);
+    if(old != NULL){
+        old->retired = __atomic_fetch_add(&map_rcu.epoch, 1, __ATOMIC_SEQ_CST);
+        old->next = map_rcu.retired;
+        map_rcu.retired = old;
+        map_rcu.retired_number++;
+    }
+    map_reclaim_locked();
+}
+
+//読み込んだ地図を版1として公開して、このスレッドはその版に入る関数
+//これより後は、cross[]の道路や名前を書き換えるのではなく差分を当てた版を作る(map_readも呼ばない)
+static int map_share(int crossing_number){
+    MapSnapshot *s = calloc(1, sizeof(MapSnapshot));
+    if(s == NULL){
+        return -1;
+    }
+    s->version = s->cost_version = s->lower_version = 1;
+    s->crossing_number = crossing_number;
+    s->cross = cross;
+    pthread_mutex_lock(&map_rcu.lock);
+    map_publish_locked(s);
+    pthread_mutex_unlock(&map_rcu.lock);
+    map_enter();
+    return 0;
+}
+
+//版sで交差点aからbへの道路が何番目か(つながっていなければ-1)
+static int map_slot(Crossing const *c, int a, int b){
+    int j;
+    for(j = 0; j < c[a].points; ++j){
+        if(c[a].next[j] == b){
+            return j;
+        }
+    }
+    return -1;
+}
+
+//差分を今の版に当てた新しい版を作って公開する関数
+//当てた行数を返す。誤りがあれば何も公開せずに-1を返す(同じ差分を2度当てても結果は変わらない)
+//交差点は番号(ID)で指す
+//  wait,交差点番号,待ち時間
+//  name,交差点番号,日本語名,ローマ字名
+//  road,交差点番号,交差点番号[,長さ]   (両向きの直線の道路を足す、既にあれば長さだけ変える。長さは直線距離以上)
+//  facility,交差点番号,種類
+static int map_patch(FILE *fp, char const *filename){
+    MapSnapshot *old, *s;
+    MapChange *change = NULL;
+    Crossing *c = NULL;
+    char keyword[16], kind[16], jname[MaxName], ename[MaxName];
+    int ends[2], a, b, j, k, n, lines = 0, changed = 0, lowered = 0;
+    double value;
+
+    pthread_mutex_lock(&map_rcu.lock);
+    old = map_rcu.current;
+    n = old->crossing_number;
+    s = calloc(1, sizeof(MapSnapshot));
+    c = malloc(sizeof(Crossing) * n);
+    change = malloc(sizeof(MapChange));
+    if(s == NULL || c == NULL || change == NULL){
+        fprintf(stderr, "%s: out of memory\n", filename);
+        goto patcherror;
+    }
+    memcpy(c, old->cross, sizeof(Crossing) * n);
+    change->area[0] = change->area[1] = 1e300;
+    change->area[2] = change->area[3] = -1e300;
+
+    while(fscanf(fp, " %15[a-z]", keyword) == 1){
+        if(strcmp(keyword, "wait") == 0){
+            if(fscanf(fp, ",%d,%lf", &a, &value) != 2 || a < 0 || a >= n || value < 0){
+                fprintf(stderr, "%s: invalid wait\n", filename);
+                goto patcherror;
+            }
+            a = cross_index[a];
+            changed |= value != c[a].wait;
+            lowered |= value < c[a].wait;
+            c[a].wait = value;
+        }
+        else if(strcmp(keyword, "name") == 0){
+            if(fscanf(fp, ",%d,%49[^,],%49[^,\r\n]", &a, jname, ename) != 3 || a < 0 || a >= n){
+                fprintf(stderr, "%s: invalid name\n", filename);
+                goto patcherror;
+            }
+            a = cross_index[a];
+            //交差点名から決まる施設は付け直す(前の版が読んでいる名前はそのまま残す)
+            c[a].facility = (c[a].facility & ~facility_from_name(c[a].jname)) | facility_from_name(jname);
+            c[a].jname = name_store(jname);
+            c[a].ename = name_store(ename);
+            if(c[a].jname == NULL || c[a].ename == NULL){
+                fprintf(stderr, "%s: out of memory\n", filename);
+                goto patcherror;
+            }
+        }
+        else if(strcmp(keyword, "road") == 0){
+            if(fscanf(fp, ",%d,%d", &a, &b) != 2 || a < 0 || a >= n || b < 0 || b >= n || a == b){
+                fprintf(stderr, "%s: invalid road\n", filename);
+                goto patcherror;
+            }
+            a = cross_index[a];
+            b = cross_index[b];
+            if(fscanf(fp, ",%lf", &value) != 1){
+                value = -1;     /* 長さを省けば直線の長さ */
+            }
+            else if(value < hypot(c[a].pos.x - c[b].pos.x, c[a].pos.y - c[b].pos.y)){
+                fprintf(stderr, "%s: road %d-%d shorter than straight line\n", filename, c[a].id, c[b].id);
+                goto patcherror;    /* 直線距離を経路探索の下界に使うので */
+            }
+            ends[0] = a;
+            ends[1] = b;
+            if(map_slot(c, a, b) == -1){
+                if(c[a].points >= 5 || c[b].points >= 5){
+                    fprintf(stderr, "%s: too many roads at %d-%d\n", filename, c[a].id, c[b].id);
+                    goto patcherror;
+                }
+                for(k = 0; k < 2; ++k){
+                    j = c[ends[k]].points++;
+                    c[ends[k]].next[j] = ends[1 - k];
+                    c[ends[k]].length[j] = hypot(c[a].pos.x - c[b].pos.x, c[a].pos.y - c[b].pos.y);
+                    c[ends[k]].shape[j] = 0;
+                    c[ends[k]].shape_points[j] = 0;
+                }
+                changed = lowered = 1;
+                change->area[0] = fmin(change->area[0], fmin(c[a].pos.x, c[b].pos.x));
+                change->area[1] = fmin(change->area[1], fmin(c[a].pos.y, c[b].pos.y));
+                change->area[2] = fmax(change->area[2], fmax(c[a].pos.x, c[b].pos.x));
+                change->area[3] = fmax(change->area[3], fmax(c[a].pos.y, c[b].pos.y));
+            }
+            if(value >= 0){
+                for(k = 0; k < 2; ++k){
+                    j = map_slot(c, ends[k], ends[1 - k]);
+                    changed |= value != c[ends[k]].length[j];
+                    lowered |= value < c[ends[k]].length[j];
+                    c[ends[k]].length[j] = value;
+                }
+            }
+        }
+        else if(strcmp(keyword, "facility") == 0){
+            if(fscanf(fp, ",%d,%15[a-z]", &a, kind) != 2 || a < 0 || a >= n || facility_find(kind) < 0){
+                fprintf(stderr, "%s: invalid facility\n", filename);
+                goto patcherror;
+            }
+            c[cross_index[a]].facility |= 1u << facility_find(kind);
+        }
+        else{
+            fprintf(stderr, "%s: unknown line '%s'\n", filename, keyword);
+            goto patcherror;
+        }
+        lines++;
+    }
+    if(!feof(fp)){
+        fprintf(stderr, "%s: invalid line\n", filename);
+        goto patcherror;
+    }
+    if(lines == 0){
+        goto patchempty;        /* 空の差分では版を作らない */
+    }
+
+    s->version = old->version + 1;
+    s->crossing_number = n;
+    s->cross = c;
+    s->cost_version = changed ? s->version : old->cost_version;
+    s->lower_version = lowered ? s->version : old->lower_version;
+    if(change->area[0] <= change->area[2]){
+        change->version = s->version;
+        change->next = map_rcu.changes;
+        map_rcu.changes = change;
+        change = NULL;
+    }
+    s->roads = map_rcu.changes;
+    map_publish_locked(s);
+    pthread_mutex_unlock(&map_rcu.lock);
+    free(change);
+    return lines;
+
+    patcherror:
+    lines = -1;
+    patchempty:
+    pthread_mutex_unlock(&map_rcu.lock);
+    free(s);
+    free(c);
+    free(change);
+    return lines;
+}
+
+//差分ファイルを監視するスレッド
+//ファイルが変わったら当てて新しい版を公開し、回収を待つ版があれば回収する
+static void *map_watch_main(void *arg){
+    struct stat st;
+    struct timespec begin;
+    FILE *fp;
+    int n;
+
+    while(!__atomic_load_n(&map_rcu.stop, __ATOMIC_ACQUIRE)){
+        if(stat(map_rcu.diff, &st) == 0
+           && (st.st_mtim.tv_sec != map_rcu.mtime.tv_sec || st.st_mtim.tv_nsec != map_rcu.mtime.tv_nsec
+               || st.st_size != map_rcu.size)){
+            map_rcu.mtime = st.st_mtim;
+            map_rcu.size = st.st_size;
+            fp = fopen(map_rcu.diff, "r");
+            if(fp != NULL){
+                clock_gettime(CLOCK_MONOTONIC, &begin);
+                n = map_patch(fp, map_rcu.diff);
+                fclose(fp);
+                if(n > 0){
+                    printf("%sを当てて地図を版%uにしました(%d行、%.1lfms)\n", map_rcu.diff,
+                           __atomic_load_n(&map_rcu.current, __ATOMIC_ACQUIRE)->version, n, elapsed_ms(&begin));
+                    fflush(stdout);
+                }
+            }
+        }
+        map_reclaim();
+        usleep(MapWatchInterval * 1000);
+    }
+    return NULL;
+}
+
+//差分ファイルの監視を始める関数(起動したときにファイルがあれば、まずそれを当てる)
+static int map_watch_start(char const *filename){
+    map_rcu.diff = filename;
+    map_rcu.stop = 0;
+    if(pthread_create(&map_rcu.watcher, NULL, map_watch_main, NULL) != 0){
+        return -1;
+    }
+    map_rcu.watching = 1;
+    return 0;
+}
+
+static void map_watch_stop(void){
+    if(map_rcu.watching){
+        __atomic_store_n(&map_rcu.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(map_rcu.watcher, NULL);
+        map_rcu.watching = 0;
+    }
+}
+
+//スレッドを作る関数
+//作られたスレッドは、作ったスレッドと同じ版を見る(作ったスレッドがjoinするまで版に留まっているとき)
+//長く動き続けるスレッドは、仕事ごとに自分でmap_enterする
+typedef struct {
+    void *(*main)(void *);
+    void *arg;
+    Crossing *cross;
+    MapSnapshot *view;
+} MapThread;
+
+static void *map_thread_main(void *arg){
+    MapThread t = *(MapThread *)arg;
+    free(arg);
+    cross = t.cross;
+    map_view = t.view;
+    return t.main(t.arg);
+}
+
+static int map_thread_create(pthread_t *thread, void *(*main)(void *), void *arg){
+    MapThread *t = malloc(sizeof(MapThread));
+    int result;
+
+    if(t == NULL){
+        return ENOMEM;
+    }
+    t->main = main;
+    t->arg = arg;
+    t->cross = cross;
+    t->view = map_view;
+    result = pthread_create(thread, NULL, map_thread_main, t);
+    if(result != 0){
+        free(t);
+    }
+    return result;
+}
+
+//threads個の仕事をスレッドで分担して、全て終わるまで待つ関数(仕事tの引数は args + t * size)
+//スレッドが作れなかった仕事は呼んだスレッドで順に行い、作れたスレッドだけをjoinする
+static void map_thread_run(int threads, void *(*main)(void *), void *args, size_t size){
+    pthread_t thread[MaxThreads];
+    char started[MaxThreads];
+    int t;
+
+    for(t = 0; t < threads; ++t){
+        started[t] = (map_thread_create(&thread[t], main, (char *)args + t * size) == 0);
+    }
+    for(t = 0; t < threads; ++t){
+        if(!started[t]){
+            main((char *)args + t * size);
+        }
+    }
+    for(t = 0; t < threads; ++t){
+        if(started[t]){
+            pthread_join(thread[t], NULL);
+        }
+    }
+}
+
+//円を描く関数
+static void draw_circle(double x, double y, double r) {
+    int const N = 24;             /* 円周を 24分割して線分で描画することにする */
+    int i;
+
+    glBegin(GL_LINE_LOOP);
+    for (i = 0; i < N; i++)
+        glVertex2d(x + cos(2 * M_PI * i / N) * r,
+                   y + sin(2 * M_PI * i / N) * r);
+    glEnd();
+}
+
+//球を描く関数
+static void draw_ball(double x, double y, double r){
+    int const N = 6;
+    int i ;
+    for(i = 0; i < N; ++i){
+        glPushMatrix();
+
+        glTranslated(x, y, 0);
+        glRotatef(90, 1.0, 0, 0);
+        glRotatef(360 * i / N, 0, 1.0, 0);
+        glTranslated(-x, -y, 0);
+        draw_circle(x, y, r);
+
+        glTranslated(x, y, 0);
+        glRotatef(90, 0, 0, 0);
+        glRotatef(360 * i / N, 1.0, 0, 0);
+        glTranslated(-x, -y, 0);
+        draw_circle(x, y, r);
+
+        glTranslated(x, y, 0);
+        glRotatef(90, 0, 0, 0);
+        glRotatef(360 * i / N, 0, 1.0, 0);
+        glTranslated(-x, -y, 0);
+        draw_circle(x, y, r);
+
+        glPopMatrix();
+    }
+}
+
+//円錐を描く関数
+static void draw_corn(double x, double y, double z, double r){
+    int const N = 12;
+    int i;
+    //底面
+    glNormal3d(0.0,-1.0,0.0);
+    glBegin(GL_TRIANGLE_FAN);
+    for (i = 0; i < N; i++){
+        glVertex3d(x + cos(2 * M_PI * i / N) * r, y + sin(2 * M_PI * i / N) * r,0);
+    }
+    glEnd();
+    //側面
+    for (i = 0; i < N ; i++){
+        glBegin(GL_TRIANGLES);
+        glVertex3d(x,y,z);
+        glVertex3d(x + cos(2 * M_PI * i / N) * r, y + sin(2 * M_PI * i / N) * r,0);
+        glVertex3d(x + cos(2 * M_PI * (i+1) / N) * r, y + sin(2 * M_PI * (i+1) / N) * r,0);
+        glEnd();
+    }
+}
+
+//文字列を描く関数
+static void draw_outtextxy(double x, double y, char const *text, double rotation, double rotation_z) {
+    double const scale = 0.01;
+    glPushMatrix();
+    glTranslated(x, y, 0.0);
+    glRotatef(rotation,0,0,1.0);
+    glRotatef(rotation_z,1.0,0,0);
+    glScaled(scale, scale, scale);
+    ftglRenderFont(font, text, FTGL_RENDER_ALL);
+    glPopMatrix();
+}
+
+//交差点を表す円錐を描く関数
+static void cross_show(int i) {
+    glColor3d(1.0, 0.5, 0.5);
+    draw_corn(cross[i].pos.x, cross[i].pos.y, 0.3, 0.05);
+}
+
+//交差点iから伸びるj本目の道路を描く関数(両端が赤く中間が白くなるように描く)
+static void road_show(int i, int j, double tolerance) {
+    int k, n;
+    double x0, y0, x1, y1, x2, y2;
+    double xs[MaxRoadShape + 2], ys[MaxRoadShape + 2];
+    double along, c;
+
+    x0 = cross[i].pos.x;
+    y0 = cross[i].pos.y;
+    if (cross[i].shape_points[j] > 0) {
+        /* 形状点を持つ道路は折れ線で描く */
+        n = road_shape(i, j, tolerance, xs, ys);
+        along = 0.0;
+        glBegin(GL_LINE_STRIP);
+        for (k = 0; k < n; k++) {
+            if (k > 0) {
+                along += hypot(xs[k] - xs[k - 1], ys[k] - ys[k - 1]);
+            }
+            c = 1.0 - fabs(2.0 * along / cross[i].length[j] - 1.0);
+            glColor3d(1, c, c);
+            glVertex2d(xs[k], ys[k]);
+        }
+        glEnd();
+        return;
+    }
+    x1 = cross[ cross[i].next[j] ].pos.x;
+    y1 = cross[ cross[i].next[j] ].pos.y;
+    x2 = (x0 + x1)/2;
+    y2 = (y0 + y1)/2; //中間点の設定
+
+    glBegin(GL_LINES);
+    glColor3d(1,0,0);
+    glVertex2d(x0, y0);
+    glColor3d(1,1,1);
+    glVertex2d(x2, y2);
+    glEnd();
+
+    glBegin(GL_LINES);
+    glColor3d(1,1,1);
+    glVertex2d(x2,y2);
+    glColor3d(1,0,0);
+    glVertex2d(x1,y1);
+    glEnd();
+}
+
+//道路網を描く関数
+//toleranceより重要度の低い形状点は間引いて描く(視点が遠いほど大きくする)
+static void map_show(int crossing_number, double tolerance) {
+    int i, j;
+
+    for (i = 0; i < crossing_number; i++) {     /* 交差点毎のループ */
+        /* 交差点を表す円を描く */
+        cross_show(i);
+
+        /* 交差点から伸びる道路を描く */
+        for (j = 0; j < cross[i].points; j++) {
+            road_show(i, j, tolerance);
+        }
+    }
+}
+
+//-----------------------道路網の画像(ラスタタイル)-----------------------
+//動かない道路網(道路と交差点)は，画面外のフレームバッファ(FBO)で区画ごとの画像に描いておき，
+//毎フレームはその画像を地面に貼ってから経路と移動体を重ねる(描画の手間が交差点の密度によらない)
+//  階層lの区画は一辺 RasterTileKm * 2^l [km]で，画面の1画素が画像の1画素に近くなる階層を使う
+//  画像はメモリに RasterCacheMax 枚まで持ち，あふれたら最後に使ったのが最も古いものから捨てる
+//  ディレクトリを指定すれば画像をファイルにも書き出し，次からはそれを読む
+//GLFW2ではOpenGLの文脈を他のスレッドと共有できないので，画像はメインスレッドで1フレームに RasterBudget 枚まで作る
+//まだ画像の無い区画は，その区画を通る道路だけをその場で描く
+//交差点名は視点の方を向けて描くので画像にはしない
+#define RasterTilePx   256     /* 画像の一辺[画素] */
+#define RasterTileKm   0.5     /* 最も細かい階層の区画の一辺[km] */
+#define RasterLevels   10      /* 階層の数 */
+#define RasterCacheMax 256     /* メモリに持つ画像の最大数(1枚256KB) */
+#define RasterBudget   4       /* 1フレームに作る画像の最大数 */
+#define RasterVisible  64      /* 1フレームに貼る区画の最大数(超えるなら粗い階層にする) */
+#define RasterMaxCells (1 << 22) /* 最も細かい区画の数の上限(超える地図では画像を使わない) */
+#define RASTER_MAGIC   0x54524e43  /* 画像ファイルの先頭の識別子 */
+
+//メモリに持っている画像
+typedef struct {
+    int level, x, y;           /* 階層と区画の位置 */
+    GLuint texture;
+    unsigned long used;        /* 最後に使ったフレーム */
+} RasterTile;
+
+static struct {
+    int indexed;               /* 索引を作ろうとした地図の交差点数 */
+    int crossing_number;       /* 索引を作った地図の交差点数(作れなければ0) */
+    double origin_x, origin_y; /* 最も細かい区画の左下 */
+    int cols, rows;
+    int *cell_offset;          /* 最も細かい区画ごとに，そこを通る道路の番号 cell_road[cell_offset[c]]～ */
+    int *cell_road;
+    int *cross_offset;         /* 同じく，そこに円錐がかかる交差点 cell_cross[cross_offset[c]]～ */
+    int *cell_cross;
+    int *edge_first;           /* 交差点iから出る道路の番号は edge_first[i]～edge_first[i+1]-1 */
+    int *edge_from;            /* 道路の番号から出発する交差点 */
+    unsigned *stamp;           /* 1つの区画で同じ道路を2度描かないためのしるし */
+    unsigned stamp_now;
+    int usable;                /* FBOが使えれば1(ウィンドウを開くたびに調べる) */
+    GLuint fbo;
+    RasterTile tile[RasterCacheMax];
+    int number;
+    unsigned long frame;
+    char const *dir;           /* 画像を書き出すディレクトリ(NULLならメモリだけ) */
+    long made, loaded, reused, fallback;
+} raster;
+
+//矩形がかかる最も細かい区画の範囲を求める関数(地図の外は端の区画に含める)
+static void raster_cells(double x0, double y0, double x1, double y1, int *cx0, int *cy0, int *cx1, int *cy1){
+    *cx0 = (int)floor((x0 - raster.origin_x) / RasterTileKm);
+    *cy0 = (int)floor((y0 - raster.origin_y) / RasterTileKm);
+    *cx1 = (int)floor((x1 - raster.origin_x) / RasterTileKm);
+    *cy1 = (int)floor((y1 - raster.origin_y) / RasterTileKm);
+    *cx0 = (*cx0 < 0) ? 0 : (*cx0 >= raster.cols) ? raster.cols - 1 : *cx0;
+    *cy0 = (*cy0 < 0) ? 0 : (*cy0 >= raster.rows) ? raster.rows - 1 : *cy0;
+    *cx1 = (*cx1 < 0) ? 0 : (*cx1 >= raster.cols) ? raster.cols - 1 : *cx1;
+    *cy1 = (*cy1 < 0) ? 0 : (*cy1 >= raster.rows) ? raster.rows - 1 : *cy1;
+}
+
+//道路網の索引を作る関数(道路と交差点を，通る最も細かい区画ごとに並べる)
+static int raster_index(int crossing_number){
+    int i, j, k, n, c, e, pass, edge_number = 0;
+    int cx0, cy0, cx1, cy1, x, y;
+    double min_x = 1e300, min_y = 1e300, max_x = -1e300, max_y = -1e300;
+    double bx0, by0, bx1, by1;
+    double xs[MaxRoadShape + 2], ys[MaxRoadShape + 2];
+
+    for(i = 0; i < crossing_number; ++i){
+        min_x = fmin(min_x, cross[i].pos.x);
+        min_y = fmin(min_y, cross[i].pos.y);
+        max_x = fmax(max_x, cross[i].pos.x);
+        max_y = fmax(max_y, cross[i].pos.y);
+        edge_number += cross[i].points;
+    }
+    raster.origin_x = floor((min_x - 0.1) / RasterTileKm) * RasterTileKm;
+    raster.origin_y = floor((min_y - 0.1) / RasterTileKm) * RasterTileKm;
+    raster.cols = (int)((max_x + 0.1 - raster.origin_x) / RasterTileKm) + 1;
+    raster.rows = (int)((max_y + 0.1 - raster.origin_y) / RasterTileKm) + 1;
+    if(crossing_number <= 0 || (double)raster.cols * raster.rows > RasterMaxCells){
+        return -1;
+    }
+    n = raster.cols * raster.rows;
+    raster.cell_offset = calloc(n + 1, sizeof(int));
+    raster.cross_offset = calloc(n + 1, sizeof(int));
+    raster.edge_first = malloc(sizeof(int) * (crossing_number + 1));
+    raster.edge_from = malloc(sizeof(int) * (edge_number + 1));
+    raster.stamp = calloc(edge_number + 1, sizeof(unsigned));
+    if(raster.cell_offset == NULL || raster.cross_offset == NULL || raster.edge_first == NULL
+       || raster.edge_from == NULL || raster.stamp == NULL){
+        return -1;
+    }
+    e = 0;
+    for(i = 0; i < crossing_number; ++i){
+        raster.edge_first[i] = e;
+        for(j = 0; j < cross[i].points; ++j){
+            raster.edge_from[e++] = i;
+        }
+    }
+    raster.edge_first[crossing_number] = e;
+
+    //1回目で区画ごとの数を数え，2回目で並べる(並べながら進めた始まりの位置は最後に1つずらして戻す)
+    for(pass = 0; pass < 2; ++pass){
+        if(pass == 1){
+            for(c = 0; c < n; ++c){
+                raster.cell_offset[c + 1] += raster.cell_offset[c];
+                raster.cross_offset[c + 1] += raster.cross_offset[c];
+            }
+            raster.cell_road = malloc(sizeof(int) * (raster.cell_offset[n] + 1));
+            raster.cell_cross = malloc(sizeof(int) * (raster.cross_offset[n] + 1));
+            if(raster.cell_road == NULL || raster.cell_cross == NULL){
+                return -1;
+            }
+        }
+        for(i = 0; i < crossing_number; ++i){
+            //円錐の底面がかかる区画
+            raster_cells(cross[i].pos.x - 0.05, cross[i].pos.y - 0.05, cross[i].pos.x + 0.05, cross[i].pos.y + 0.05,
+                         &cx0, &cy0, &cx1, &cy1);
+            for(y = cy0; y <= cy1; ++y){
+                for(x = cx0; x <= cx1; ++x){
+                    c = y * raster.cols + x;
+                    if(pass == 0){
+                        raster.cross_offset[c + 1]++;
+                    }
+                    else{
+                        raster.cell_cross[raster.cross_offset[c]++] = i;
+                    }
+                }
+            }
+            //道路の形状の外接矩形がかかる区画
+            for(j = 0; j < cross[i].points; ++j){
+                k = road_shape(i, j, 0.0, xs, ys);
+                bx0 = bx1 = xs[0];
+                by0 = by1 = ys[0];
+                while(--k > 0){
+                    bx0 = fmin(bx0, xs[k]); bx1 = fmax(bx1, xs[k]);
+                    by0 = fmin(by0, ys[k]); by1 = fmax(by1, ys[k]);
+                }
+                raster_cells(bx0, by0, bx1, by1, &cx0, &cy0, &cx1, &cy1);
+                for(y = cy0; y <= cy1; ++y){
+                    for(x = cx0; x <= cx1; ++x){
+                        c = y * raster.cols + x;
+                        if(pass == 0){
+                            raster.cell_offset[c + 1]++;
+                        }
+                        else{
+                            raster.cell_road[raster.cell_offset[c]++] = raster.edge_first[i] + j;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    memmove(raster.cell_offset + 1, raster.cell_offset, sizeof(int) * n);
+    memmove(raster.cross_offset + 1, raster.cross_offset, sizeof(int) * n);
+    raster.cell_offset[0] = raster.cross_offset[0] = 0;
+    raster.crossing_number = crossing_number;
+    return 0;
+}
+
+//区画(階層level，位置x,y)にかかる道路と交差点を描く関数
+static void raster_draw_area(int level, int x, int y, double tolerance){
+    int cx, cy, cx0, cy0, cx1, cy1, c, k, e, i;
+
+    cx0 = x << level;
+    cy0 = y << level;
+    cx1 = (cx0 + (1 << level) < raster.cols) ? cx0 + (1 << level) : raster.cols;
+    cy1 = (cy0 + (1 << level) < raster.rows) ? cy0 + (1 << level) : raster.rows;
+    if(++raster.stamp_now == 0){
+        memset(raster.stamp, 0, sizeof(unsigned) * (raster.edge_first[raster.crossing_number] + 1));
+        raster.stamp_now = 1;
+    }
+    for(cy = cy0; cy < cy1; ++cy){
+        for(cx = cx0; cx < cx1; ++cx){
+            c = cy * raster.cols + cx;
+            for(k = raster.cell_offset[c]; k < raster.cell_offset[c + 1]; ++k){
+                e = raster.cell_road[k];
+                if(raster.stamp[e] != raster.stamp_now){
+                    raster.stamp[e] = raster.stamp_now;
+                    i = raster.edge_from[e];
+                    road_show(i, e - raster.edge_first[i], tolerance);
+                }
+            }
+        }
+    }
+    //交差点は道路の上に描く(同じ交差点を2度描いても見た目は変わらない)
+    for(cy = cy0; cy < cy1; ++cy){
+        for(cx = cx0; cx < cx1; ++cx){
+            c = cy * raster.cols + cx;
+            for(k = raster.cross_offset[c]; k < raster.cross_offset[c + 1]; ++k){
+                cross_show(raster.cell_cross[k]);
+            }
+        }
+    }
+}
+
+//画像ファイルの名前
+static void raster_filename(char *filename, size_t size, int level, int x, int y){
+    snprintf(filename, size, "%s/raster_%d_%d_%d.bin", raster.dir, level, x, y);
+}
+
+//画像ファイルを読む関数(見つからないか地図が違えば-1を返す)
+static int raster_read(int level, int x, int y, unsigned char *pixel){
+    char filename[PATH_MAX + 64];
+    int header[5];
+    FILE *fp;
+    int ok;
+
+    raster_filename(filename, sizeof(filename), level, x, y);
+    fp = fopen(filename, "rb");
+    if(fp == NULL){
+        return -1;
+    }
+    ok = fread(header, sizeof(int), 5, fp) == 5 && header[0] == RASTER_MAGIC
+         && header[1] == raster.crossing_number && header[2] == level && header[3] == x && header[4] == y
+         && fread(pixel, 4, RasterTilePx * RasterTilePx, fp) == RasterTilePx * RasterTilePx;
+    fclose(fp);
+    return ok ? 0 : -1;
+}
+
+//画像ファイルを書き出す関数(書けなくても描画は続ける)
+static void raster_write(int level, int x, int y, unsigned char const *pixel){
+    char filename[PATH_MAX + 64];
+    int header[5] = {RASTER_MAGIC, raster.crossing_number, level, x, y};
+    FILE *fp;
+
+    raster_filename(filename, sizeof(filename), level, x, y);
+    fp = fopen(filename, "wb");
+    if(fp == NULL){
+        return;
+    }
+    fwrite(header, sizeof(int), 5, fp);
+    fwrite(pixel, 4, RasterTilePx * RasterTilePx, fp);
+    fclose(fp);
+}
+
+//区画の画像を作る関数(ファイルにあれば読み，なければFBOに描く)
+static GLuint raster_render(int level, int x, int y){
+    static unsigned char pixel[RasterTilePx * RasterTilePx * 4];
+    double size = RasterTileKm * (1 << level);
+    double x0 = raster.origin_x + x * size, y0 = raster.origin_y + y * size;
+    GLuint texture;
+    int cached = raster.dir != NULL && raster_read(level, x, y, pixel) == 0;
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, RasterTilePx, RasterTilePx, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                 cached ? pixel : NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    if(cached){
+        raster.loaded++;
+        return texture;
+    }
+
+    //区画をそのまま真上から画像に描く
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, raster.fbo);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, texture, 0);
+    glPushAttrib(GL_VIEWPORT_BIT | GL_COLOR_BUFFER_BIT | GL_CURRENT_BIT);
+    glViewport(0, 0, RasterTilePx, RasterTilePx);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(x0, x0 + size, y0, y0 + size, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    raster_draw_area(level, x, y, size / RasterTilePx);
+    if(raster.dir != NULL){
+        glReadPixels(0, 0, RasterTilePx, RasterTilePx, GL_RGBA, GL_UNSIGNED_BYTE, pixel);
+        raster_write(level, x, y, pixel);
+    }
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopAttrib();
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+    raster.made++;
+    return texture;
+}
+
+//区画の画像を探す関数(なければ，budgetが残っていれば作り，あふれたら最後に使ったのが最も古いものを捨てる)
+static RasterTile *raster_get(int level, int x, int y, int *budget){
+    int t, oldest = -1;
+    RasterTile *tile;
+
+    for(t = 0; t < raster.number; ++t){
+        tile = &raster.tile[t];
+        if(tile->level == level && tile->x == x && tile->y == y){
+            tile->used = raster.frame;
+            raster.reused++;
+            return tile;
+        }
+        if(oldest == -1 || tile->used < raster.tile[oldest].used){
+            oldest = t;
+        }
+    }
+    if(*budget <= 0){
+        return NULL;
+    }
+    if(raster.number < RasterCacheMax){
+        tile = &raster.tile[raster.number++];
+    }
+    else if(raster.tile[oldest].used != raster.frame){
+        tile = &raster.tile[oldest];
+        glDeleteTextures(1, &tile->texture);
+    }
+    else{
+        return NULL;    /* すべてこのフレームで使っている */
+    }
+    (*budget)--;
+    tile->level = level;
+    tile->x = x;
+    tile->y = y;
+    tile->used = raster.frame;
+    tile->texture = raster_render(level, x, y);
+    return tile;
+}
+
+//ウィンドウを開いたときに，FBOが使えるか調べて用意する関数
+static void raster_open(void){
+    char const *extensions = (char const *)glGetString(GL_EXTENSIONS);
+
+    raster.usable = extensions != NULL && strstr(extensions, "GL_EXT_framebuffer_object") != NULL;
+    raster.number = 0;
+    if(raster.usable){
+        glGenFramebuffersEXT(1, &raster.fbo);
+    }
+}
+
+//ウィンドウを閉じる前に，画像とFBOを捨てる関数(OpenGLの文脈と一緒に無くなるため)
+static void raster_close(void){
+    int t;
+    if(raster.usable){
+        for(t = 0; t < raster.number; ++t){
+            glDeleteTextures(1, &raster.tile[t].texture);
+        }
+        glDeleteFramebuffersEXT(1, &raster.fbo);
+    }
+    raster.number = 0;
+    raster.usable = 0;
+}
+
+//道路網の索引を捨てる関数
+static void raster_free(void){
+    free(raster.cell_offset);
+    free(raster.cell_road);
+    free(raster.cross_offset);
+    free(raster.cell_cross);
+    free(raster.edge_first);
+    free(raster.edge_from);
+    free(raster.stamp);
+    raster.cell_offset = raster.cell_road = raster.cross_offset = raster.cell_cross = NULL;
+    raster.edge_first = raster.edge_from = NULL;
+    raster.stamp = NULL;
+    raster.crossing_number = 0;
+    raster.indexed = 0;
+}
+
+//地図の版seenから版sまでに道路が変わった区画の画像を捨てる関数
+//交差点は動かないので区画の位置はそのままで，道路の番号が変わるので索引だけ作り直す
+//ファイルに書き出した画像も，変わった範囲にかかるものは消して次に作り直す
+static void raster_update(MapSnapshot const *s, unsigned seen){
+    MapChange const *c;
+    double area[4] = {1e300, 1e300, -1e300, -1e300}, size;
+    char filename[256];
+    int level, x, y, t;
+
+    for(c = s->roads; c != NULL && c->version > seen; c = c->next){
+        area[0] = fmin(area[0], c->area[0]);
+        area[1] = fmin(area[1], c->area[1]);
+        area[2] = fmax(area[2], c->area[2]);
+        area[3] = fmax(area[3], c->area[3]);
+    }
+    if(area[0] > area[2] || raster.crossing_number == 0){
+        return;
+    }
+    for(t = 0; t < raster.number; ){
+        size = RasterTileKm * (1 << raster.tile[t].level);
+        if(raster.origin_x + raster.tile[t].x * size <= area[2] && area[0] <= raster.origin_x + (raster.tile[t].x + 1) * size
+           && raster.origin_y + raster.tile[t].y * size <= area[3] && area[1] <= raster.origin_y + (raster.tile[t].y + 1) * size){
+            glDeleteTextures(1, &raster.tile[t].texture);
+            raster.tile[t] = raster.tile[--raster.number];
+        }
+        else{
+            t++;
+        }
+    }
+    for(level = 0; raster.dir != NULL && level < RasterLevels; ++level){
+        size = RasterTileKm * (1 << level);
+        for(y = (int)floor((area[1] - raster.origin_y) / size); y <= (int)floor((area[3] - raster.origin_y) / size); ++y){
+            for(x = (int)floor((area[0] - raster.origin_x) / size); x <= (int)floor((area[2] - raster.origin_x) / size); ++x){
+                raster_filename(filename, sizeof(filename), level, x, y);
+                unlink(filename);
+            }
+        }
+    }
+    raster_free();
+}
+
+//画面の点(正規化した座標sx,sy)から見た地面(z=0)の位置を求める関数
+//地面に届かない(地平線より上)ときは，描画する奥行きの限界(far)の位置を地面に落とす
+static void raster_ground(double const m[16], double const p[16], double sx, double sy, double far,
+                          double *gx, double *gy){
+    double ex, ey, ez, dx, dy, dz, vx = sx / p[0], vy = sy / p[5], vz = -1.0, t, len;
+
+    //視点の位置(モデルビュー行列の回転の転置を平行移動に掛ける)と，視線の向き
+    ex = -(m[0] * m[12] + m[1] * m[13] + m[2] * m[14]);
+    ey = -(m[4] * m[12] + m[5] * m[13] + m[6] * m[14]);
+    ez = -(m[8] * m[12] + m[9] * m[13] + m[10] * m[14]);
+    dx = m[0] * vx + m[1] * vy + m[2] * vz;
+    dy = m[4] * vx + m[5] * vy + m[6] * vz;
+    dz = m[8] * vx + m[9] * vy + m[10] * vz;
+    len = sqrt(dx * dx + dy * dy + dz * dz);
+    t = far / len;
+    if(dz < 0 && -ez / dz < t){
+        t = -ez / dz;
+    }
+    *gx = ex + dx * t;
+    *gy = ey + dy * t;
+}
+
+//道路網を描く関数(画像が使えれば区画の画像を地面に貼り，使えなければmap_showで描く)
+//投影と視点の行列を設定したあとで呼ぶ
+static void raster_show(int crossing_number, double tolerance, int width, int height){
+    double m[16], p[16], gx[5], gy[5], min_x, min_y, max_x, max_y, size, px;
+    int level, x, y, x0, y0, x1, y1, k, cols, rows, budget = RasterBudget;
+    int missing_number = 0;
+    int missing[RasterVisible][2];
+    RasterTile *tile;
+
+    if(raster.indexed != crossing_number){
+        raster_free();
+        if(raster_index(crossing_number) < 0){
+            raster_free();      /* 区画が多すぎる地図では画像を使わない */
+        }
+        raster.indexed = crossing_number;
+    }
+    if(!raster.usable || raster.crossing_number == 0){
+        map_show(crossing_number, tolerance);
+        return;
+    }
+    raster.frame++;
+
+    //画面の四隅と中心から見た地面の範囲
+    glGetDoublev(GL_MODELVIEW_MATRIX, m);
+    glGetDoublev(GL_PROJECTION_MATRIX, p);
+    raster_ground(m, p, -1, -1, 50.0, &gx[0], &gy[0]);
+    raster_ground(m, p,  1, -1, 50.0, &gx[1], &gy[1]);
+    raster_ground(m, p,  1,  1, 50.0, &gx[2], &gy[2]);
+    raster_ground(m, p, -1,  1, 50.0, &gx[3], &gy[3]);
+    raster_ground(m, p,  0,  0, 50.0, &gx[4], &gy[4]);
+    min_x = max_x = gx[0];
+    min_y = max_y = gy[0];
+    for(k = 1; k < 5; ++k){
+        min_x = fmin(min_x, gx[k]); max_x = fmax(max_x, gx[k]);
+        min_y = fmin(min_y, gy[k]); max_y = fmax(max_y, gy[k]);
+    }
+
+    //画面の1画素の大きさ(視点の真下)に画像の1画素が近くなる階層を選び，区画が多すぎれば粗くする
+    px = 2.0 * (-(m[8] * m[12] + m[9] * m[13] + m[10] * m[14])) / (p[0] * (width > 0 ? width : 1));
+    level = (int)floor(log2(fmax(px * RasterTilePx / RasterTileKm, 1.0)));
+    for(;; ++level){
+        if(level >= RasterLevels - 1){
+            level = RasterLevels - 1;
+        }
+        size = RasterTileKm * (1 << level);
+        cols = (raster.cols + (1 << level) - 1) >> level;
+        rows = (raster.rows + (1 << level) - 1) >> level;
+        x0 = (int)floor((min_x - raster.origin_x) / size);
+        y0 = (int)floor((min_y - raster.origin_y) / size);
+        x1 = (int)floor((max_x - raster.origin_x) / size);
+        y1 = (int)floor((max_y - raster.origin_y) / size);
+        x0 = (x0 < 0) ? 0 : x0;
+        y0 = (y0 < 0) ? 0 : y0;
+        x1 = (x1 >= cols) ? cols - 1 : x1;
+        y1 = (y1 >= rows) ? rows - 1 : y1;
+        if((x1 - x0 + 1) * (y1 - y0 + 1) <= RasterVisible || level == RasterLevels - 1){
+            break;
+        }
+    }
+
+    //画像のある区画を地面に貼る
+    glPushAttrib(GL_ENABLE_BIT | GL_TEXTURE_BIT | GL_CURRENT_BIT);
+    glEnable(GL_TEXTURE_2D);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    for(y = y0; y <= y1; ++y){
+        for(x = x0; x <= x1; ++x){
+            tile = raster_get(level, x, y, &budget);
+            if(tile == NULL){
+                if(missing_number < RasterVisible){
+                    missing[missing_number][0] = x;
+                    missing[missing_number][1] = y;
+                    missing_number++;
+                }
+                continue;
+            }
+            glBindTexture(GL_TEXTURE_2D, tile->texture);
+            glBegin(GL_QUADS);
+            glTexCoord2d(0, 0); glVertex2d(raster.origin_x + x * size, raster.origin_y + y * size);
+            glTexCoord2d(1, 0); glVertex2d(raster.origin_x + (x + 1) * size, raster.origin_y + y * size);
+            glTexCoord2d(1, 1); glVertex2d(raster.origin_x + (x + 1) * size, raster.origin_y + (y + 1) * size);
+            glTexCoord2d(0, 1); glVertex2d(raster.origin_x + x * size, raster.origin_y + (y + 1) * size);
+            glEnd();
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glPopAttrib();
+
+    //まだ画像の無い区画は道路をそのまま描く(貼った画像に消されないよう後で描く)
+    for(k = 0; k < missing_number; ++k){
+        raster_draw_area(level, missing[k][0], missing[k][1], tolerance);
+        raster.fallback++;
+    }
+}
+
+//経路の始点と終点の交差点名を表示する関数
+static void draw_intersection_name(int vehicle_pathIterator, int path[], double rotation, double rotation_z){
+    double x0, y0, x1, y1;
+    PROF_BEGIN(scope);
+    x0 = cross[path[vehicle_pathIterator + 0]].pos.x;
+    y0 = cross[path[vehicle_pathIterator + 0]].pos.y;
+    glColor3d(1.0,1.0,0.0);
+    draw_outtextxy(x0, y0, cross[path[vehicle_pathIterator + 0]].jname, rotation, rotation_z);
+    if(path[vehicle_pathIterator + 1] != -1){
+        x1 = cross[path[vehicle_pathIterator + 1]].pos.x;
+        y1 = cross[path[vehicle_pathIterator + 1]].pos.y;
+        draw_outtextxy(x1, y1, cross[path[vehicle_pathIterator + 1]].jname, rotation, rotation_z);
+    } 
+    PROF_PART(scope, PROF_LABEL);
+}
+//経路上の交差点名をすべて表示する関数
+static void draw_intersection_pathname(int path[], double rotation, double rotation_z){
+    int i = 0;
+    double x0,y0;
+    PROF_BEGIN(scope);
+    while(1){
+        if(path[i] == -1){
+            break;
+        }
+        x0 = cross[path[i]].pos.x;
+        y0 = cross[path[i]].pos.y;
+
+        /* 交差点の名前を描く */
+        glColor3d(1.0, 1.0, 0.0);
+        draw_outtextxy(x0, y0, cross[path[i]].jname, rotation, rotation_z);
+
         i++;
     }
-    return all_distance;
+    PROF_PART(scope, PROF_LABEL);
+}
+//交差点名をすべて表示する関数
+static void draw_intersection_allname(int crossing_number, double rotation, double rotation_z){
+    int i;
+    double x0,y0;
+    PROF_BEGIN(scope);
+    for(i = 0; i < crossing_number; ++i){
+        x0 = cross[i].pos.x;
+        y0 = cross[i].pos.y;
+
+        /* 交差点の名前を描く */
+        glColor3d(1.0, 1.0, 0.0);
+        draw_outtextxy(x0, y0, cross[i].jname, rotation, rotation_z);
+    }
+    PROF_PART(scope, PROF_LABEL);
+}
+
+//交差点間の距離を計算
+double distance(int a, int b){
+  return hypot(cross[a].pos.x-cross[b].pos.x,
+	       cross[a].pos.y-cross[b].pos.y);
+}
+
+//優先度付きキュー(二分ヒープ)の要素
+typedef struct {
+    double key;             /* 基準交差点からの評価値 */
+    int id;                 /* 交差点番号 */
+} HeapNode;
+
+//ヒープに要素を追加する関数
+static void heap_push(HeapNode heap[], int *size, double key, int id){
+    int i = (*size)++;
+    PROF_COUNT(heap_ops, 1);
+    while(i > 0 && heap[(i - 1) / 2].key > key){
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i].key = key;
+    heap[i].id = id;
+}
+
+//ヒープから最小の要素を取り出す関数
+static HeapNode heap_pop(HeapNode heap[], int *size){
+    HeapNode top = heap[0];
+    HeapNode last = heap[--(*size)];
+    int i = 0, c;
+    PROF_COUNT(heap_ops, 1);
+    while((c = 2 * i + 1) < *size){
+        if(c + 1 < *size && heap[c + 1].key < heap[c].key){
+            c++;
+        }
+        if(last.key <= heap[c].key){
+            break;
+        }
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = last;
+    return top;
+}
+
+//ヒープに要素を追加する関数(足りなければ広げる)
+static int heap_push_grow(HeapNode **heap, int *size, int *cap, double key, int id){
+    HeapNode *h;
+    if(*size >= *cap){
+        h = realloc(*heap, sizeof(HeapNode) * (*cap * 2 + 16));
+        if(h == NULL){
+            return -1;
+        }
+        *heap = h;
+        *cap = *cap * 2 + 16;
+    }
+    heap_push(*heap, size, key, id);
+    return 0;
+}
+
+//問い合わせや1フレームの間だけ使う一時領域(先頭から切り出すだけのアロケータ)
+//解放はarena_resetでまとめて O(1) で行う
+//入りきらなかった分だけ別に確保し、次のresetで必要だった大きさに作り直すので、同じ規模の処理が続けば確保は起きない
+typedef struct ArenaExtra {
+    struct ArenaExtra *next;
+    double data[];                 /* double の境界にそろえる */
+} ArenaExtra;
+
+typedef struct {
+    char *base;
+    size_t size, used;
+    size_t wanted;                 /* 前回のreset以降に必要だった合計 */
+    ArenaExtra *extra;             /* 入りきらなかった分 */
+} Arena;
+
+#define ARENA_ALIGN 16
+
+static void *arena_alloc(Arena *a, size_t bytes){
+    ArenaExtra *e;
+    bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    a->wanted += bytes;
+    if(a->used + bytes <= a->size){
+        a->used += bytes;
+        return a->base + a->used - bytes;
+    }
+    e = malloc(sizeof(ArenaExtra) + bytes);
+    if(e == NULL){
+        return NULL;
+    }
+    e->next = a->extra;
+    a->extra = e;
+    return e->data;
+}
+
+static void arena_reset(Arena *a){
+    ArenaExtra *e;
+    char *p;
+    if(a->extra != NULL){
+        while((e = a->extra) != NULL){
+            a->extra = e->next;
+            free(e);
+        }
+        p = realloc(a->base, a->wanted);
+        if(p != NULL){
+            a->base = p;
+            a->size = a->wanted;
+        }
+    }
+    a->used = 0;
+    a->wanted = 0;
+}
+
+static void arena_free(Arena *a){
+    arena_reset(a);
+    free(a->base);
+    memset(a, 0, sizeof(*a));
+}
+
+//経路探索の作業領域(スレッドごとに1つ持ち、問い合わせのたびに使い回す)
+//評価値は問い合わせごとの番号(epoch)の印で有効かどうかを見るので、全交差点の初期化はいらない
+typedef struct {
+    int states;                    /* 確保済みの状態数 */
+    unsigned epoch;
+    unsigned *stamp;               /* stamp[v] == epoch なら label[v]・previous[v] は今回の値 */
+    unsigned *mark;                /* mark[v] == epoch なら打ち切りを待つ交差点 */
+    double *label;
+    int *previous;
+    HeapNode *heap;
+    int heap_cap;
+    int settled;                   /* 直前の探索で確定した状態の数 */
+    Arena arena;                   /* 経路など、1回の問い合わせの間だけ使う領域 */
+} SearchContext;
+
+//探索を始める関数(状態数が前より多いときだけ確保し直す)
+//一時領域arenaは探索をまたいで使えるように、問い合わせの区切りで呼び出し側がarena_resetする
+static int search_begin(SearchContext *c, int states){
+    unsigned *stamp, *mark;
+    double *label;
+    int *previous;
+
+    if(states > c->states){
+        stamp = realloc(c->stamp, sizeof(unsigned) * states);
+        if(stamp != NULL){
+            c->stamp = stamp;
+        }
+        mark = realloc(c->mark, sizeof(unsigned) * states);
+        if(mark != NULL){
+            c->mark = mark;
+        }
+        label = realloc(c->label, sizeof(double) * states);
+        if(label != NULL){
+            c->label = label;
+        }
+        previous = realloc(c->previous, sizeof(int) * states);
+        if(previous != NULL){
+            c->previous = previous;
+        }
+        if(stamp == NULL || mark == NULL || label == NULL || previous == NULL){
+            return -1;
+        }
+        memset(c->stamp, 0, sizeof(unsigned) * states);
+        memset(c->mark, 0, sizeof(unsigned) * states);
+        c->states = states;
+        c->epoch = 0;
+    }
+    if(++c->epoch == 0){
+        memset(c->stamp, 0, sizeof(unsigned) * c->states);
+        memset(c->mark, 0, sizeof(unsigned) * c->states);
+        c->epoch = 1;
+    }
+    return 0;
+}
+
+static void search_free(SearchContext *c){
+    free(c->stamp);
+    free(c->mark);
+    free(c->label);
+    free(c->previous);
+    free(c->heap);
+    arena_free(&c->arena);
+    memset(c, 0, sizeof(*c));
+}
+
+//今回の問い合わせでの評価値(届いていなければ 1e100)と直前の状態(なければ -1)
+static inline double search_label(SearchContext const *c, int v){
+    return (c->stamp[v] == c->epoch) ? c->label[v] : 1e100;
+}
+
+static inline int search_previous(SearchContext const *c, int v){
+    return (c->stamp[v] == c->epoch) ? c->previous[v] : -1;
+}
+
+//評価値がよくなればヒープに入れて1を返す
+static inline int search_relax(SearchContext *c, int *heap_size, int v, double key, int from){
+    if(c->stamp[v] == c->epoch && c->label[v] <= key){
+        return 0;
+    }
+    c->stamp[v] = c->epoch;
+    c->label[v] = key;
+    c->previous[v] = from;
+    PROF_COUNT(relaxed, 1);
+    return heap_push_grow(&c->heap, heap_size, &c->heap_cap, key, v) == 0;
+}
+
+//-----------------------------評価値の方針------------------------------
+//最短距離と最短時間の探索と経路の合計は、評価値の決め方だけが違う同じ処理なので、
+//処理は1つのマクロに書き、評価値の方針ごとにROUTE_INSTANTIATEで別の関数として作る
+//方針NAMEは費用の式(ROUTE_ROAD_NAMEなど)のマクロで表し、評価値と直前の交差点は探索の作業領域(SearchContext)に書く
+//費用は式として関数の中に書き込まれるので、最適化しないで作っても実行時に方針をたどる呼び出しは起きない
+//トラックや有料道路を避けるような評価値は、方針のマクロを足してROUTE_INSTANTIATEすれば同じ処理で探索・合計できる
+//ただしこのマクロで作るのは右左折を考慮しない交差点ごとの探索だけで、右左折を考慮する探索(dijkstra_turn)・施設の検索・
+//ランドマーク・Δステッピング法・圧縮したグラフ・多階層の上位グラフ・区画に分けた地図の探索は、それぞれ別に書いた繰り返しのまま
+
+//下界は丸めの分だけ小さくして、実際の費用を超えないようにする
+#define RouteBoundSlack (1 - 1e-9)
+
+//距離  道路を通る評価値は長さ、待ち時間と右左折のコストはない(禁止された右左折はINFINITYとする)
+//(0.0を足しても値は変わらないので、時間と同じ式のまま結果はビット単位で前と一致する)
+#define ROUTE_ROAD_distance(from, to, length, speed) (length)
+#define ROUTE_WAIT_distance(v)  0.0
+#define ROUTE_TURN_distance(a, b, c) ((turn_cost_path(a, b, c) == INFINITY) ? INFINITY : 0.0)
+//道路は直線より短くならず、待ち時間は0以上なので、直線距離(を速さで割ったもの)は下界になる
+#define ROUTE_BOUND_distance(from, to, speed) (distance(from, to) * RouteBoundSlack)
+
+//時間  道路を通る時間に、交差点から出ていくときの待ち時間と右左折のコストを足す
+#define ROUTE_ROAD_time(from, to, length, speed) ((length) / ((speed) / 60))
+#define ROUTE_WAIT_time(v)  cross[v].wait
+#define ROUTE_TURN_time(a, b, c) turn_cost_path(a, b, c)
+#define ROUTE_BOUND_time(from, to, speed) (distance(from, to) / ((speed) / 60) * RouteBoundSlack)
+
+//経路を描く色(metric 0:距離 1:時間)
+static const double route_color[2][3] = {{0, 0, 1}, {0.6, 1.0, 0.2}};
+
+//dijkstra_distance(添字0)・dijkstra_time(添字1)の結果を入れる作業領域
+//cross[]と同じくスレッドごとに持つので、公開した地図の版には探索の値を書かない
+static __thread SearchContext route_context[2];
+
+//未確定の交差点の選び方
+enum {
+    RouteQueueScan,             /* 毎回全交差点を見て選ぶ O(n^2)、作業領域がいらない */
+    RouteQueueHeap              /* 二分ヒープで選ぶ O(m log n)、heap・heap_capを広げながら使う */
+};
+
+//route_edge_NAME(u, j, speed)
+//交差点uのj番目の道路を、隣の交差点からuへ通る評価値(目的地から逆に広げる探索で使う)
+//足し算の順序は交差点の待ち時間+道路を通る評価値とし、並列版や合計と結果をビット単位で一致させる
+#define ROUTE_EDGE(NAME) \
+static inline double route_edge_##NAME(int u, int j, double speed){ \
+    return ROUTE_WAIT_##NAME(cross[u].next[j]) + ROUTE_ROAD_##NAME(cross[u].next[j], u, cross[u].length[j], speed); \
+}
+
+//route_search_NAME_QUEUE(ctx, crossing_number, target, source, speed)
+//方針NAMEのダイクストラ法で、目的地targetからの評価値と直前の交差点を作業領域ctxに求める関数
+//(search_label・search_previousで読む。stampが今回の探索で届いた、markが確定した交差点の印)
+//未確定の交差点はQUEUE(RouteQueueScanかRouteQueueHeap)で選ぶ
+//source >= 0 なら出発地sourceが確定した時点で打ち切り、ヒープで選ぶときは下界を足したA*にする
+//(下界は出発地からの見積もりで、三角不等式から矛盾がないので、確定した交差点の評価値は最短のまま)
+//作業領域かヒープが確保できなければ-1を返す
+#define ROUTE_SEARCH(NAME, SUFFIX, QUEUE) \
+static int route_search_##NAME##_##SUFFIX(SearchContext *ctx, int crossing_number, int target, int source, \
+                                          double speed){ \
+    int i, j, n, u = 0, heap_size = 0; \
+    int astar = (source >= 0); \
+    double best, c; \
+    HeapNode top; \
+    unsigned epoch; \
+    PROF_BEGIN(scope); \
+ \
+    if(search_begin(ctx, crossing_number) < 0){ \
+        return -1; \
+    } \
+    epoch = ctx->epoch; \
+    /* 基準の交差点は 0 */ \
+    ctx->label[target] = 0; \
+    ctx->previous[target] = -1; \
+    ctx->stamp[target] = epoch; \
+    if(QUEUE == RouteQueueHeap \
+       && heap_push_grow(&ctx->heap, &heap_size, &ctx->heap_cap, \
+                         astar ? ROUTE_BOUND_##NAME(source, target, speed) : 0, target) < 0){ \
+        return -1; \
+    } \
+ \
+    for(i = 0; i < crossing_number; ++i){   /* crossing_number回やれば終わるはず */ \
+        if(QUEUE == RouteQueueScan){ \
+            /* 最も評価値の小さな未確定交差点を選定 */ \
+            best = 1e100; \
+            for(j = 0; j < crossing_number; ++j){ \
+                if(ctx->stamp[j] == epoch && ctx->mark[j] != epoch && ctx->label[j] < best){ \
+                    best = ctx->label[j]; \
+                    u = j; \
+                } \
+            } \
+            if(best >= 1e100){ \
+                break;          /* 残りは届かない交差点 */ \
+            } \
+        } \
+        else{ \
+            /* 確定済みの交差点の古い要素は読み飛ばす */ \
+            u = -1; \
+            while(heap_size > 0){ \
+                top = heap_pop(ctx->heap, &heap_size); \
+                if(ctx->mark[top.id] != epoch){ \
+                    u = top.id; \
+                    break; \
+                } \
+            } \
+            if(u < 0){ \
+                break; \
+            } \
+        } \
+        /* 交差点 u は確定できる */ \
+        ctx->mark[u] = epoch; \
+        PROF_COUNT(settled, 1); \
+        if(u == source){ \
+            break; \
+        } \
+        /* 確定交差点周りで評価値の計算 */ \
+        for(j = 0; j < cross[u].points; ++j){ \
+            n = cross[u].next[j]; \
+            c = route_edge_##NAME(u, j, speed) + ctx->label[u]; \
+            /* 初めて届いたか、現在の暫定値と比較して小さいなら更新 */ \
+            if(ctx->stamp[n] != epoch || ctx->label[n] > c){ \
+                ctx->label[n] = c; \
+                ctx->previous[n] = u; \
+                ctx->stamp[n] = epoch; \
+                PROF_COUNT(relaxed, 1); \
+                if(QUEUE == RouteQueueHeap \
+                   && heap_push_grow(&ctx->heap, &heap_size, &ctx->heap_cap, \
+                                     astar ? c + ROUTE_BOUND_##NAME(source, n, speed) : c, n) < 0){ \
+                    return -1; \
+                } \
+            } \
+        } \
+    } \
+    PROF_END(scope, "dijkstra_" #NAME); \
+    return 0; \
+}
+
+//交差点ごとの探索の結果から、出発地startから目的地goalまでの経路をpathに-1終端で入れる関数
+static int route_pickup(SearchContext const *ctx, int start, int goal, int path[], int maxpath){
+    int c = start;       /* 現在いる交差点 */
+    int i = 1;
+    PROF_BEGIN(scope);
+
+    path[0] = start;
+    while(c != goal && c >= 0 && i < maxpath - 1){  /* 届かないか入りきらなければ打ち切る */
+        c = (c < ctx->states) ? search_previous(ctx, c) : -1;
+        path[i] = c;
+        i++;
+    }
+    path[i] = -1;
+    PROF_END(scope, "pickup_path");
+    return (c == goal) ? 0 : -1;
+}
+
+//route_total_NAME(path, speed)
+//方針NAMEでの経路の合計の評価値(つながっていない交差点が並んでいるか、禁止された右左折があればINFINITY)
+#define ROUTE_TOTAL(NAME) \
+static double route_total_##NAME(int path[], double speed){ \
+    int i = 0; \
+    double all = 0.0, turn; \
+    while(path[i] != -1 && path[i+1] != -1){ \
+        all = all + ROUTE_WAIT_##NAME(path[i]); \
+        all = all + ROUTE_ROAD_##NAME(path[i], path[i+1], road_length(path[i], path[i+1]), speed); \
+        /* 交差点での右左折のコスト */ \
+        if(i > 0 && (turn = ROUTE_TURN_##NAME(path[i-1], path[i], path[i+1])) > 0){ \
+            all = all + turn; \
+        } \
+        i++; \
+    } \
+    /* 現在地の交差点の待ち時間は考慮しないものとする */ \
+    if(path[0] != -1){ \
+        all = all - ROUTE_WAIT_##NAME(path[0]); \
+    } \
+    return all; \
+}
+
+//方針NAMEの処理をすべて作る
+#define ROUTE_INSTANTIATE(NAME) \
+    ROUTE_EDGE(NAME) \
+    ROUTE_SEARCH(NAME, scan, RouteQueueScan) \
+    ROUTE_SEARCH(NAME, heap, RouteQueueHeap) \
+    ROUTE_TOTAL(NAME)
+
+ROUTE_INSTANTIATE(distance)
+ROUTE_INSTANTIATE(time)
+
+//経路を色color、太さwidthで表示
+static void draw_path(int path[], double const color[3], double width){
+    int i = 0;
+    glLineWidth(width);
+    glColor3d(color[0], color[1], color[2]);
+    glBegin(GL_LINES);
+    while(path[i] != -1 && path[i+1] != -1){
+        road_vertices(path[i], path[i+1], 1.0, 0.0);   //道路の形に沿って描く
+        i++;
+    }
+    glEnd();
+    glLineWidth(1.0);
+}
+
+//ダイクストラ法(距離)による目的地からの最短距離算出(作業領域が確保できなければ-1)
+int dijkstra_distance(int crossing_number,int target){
+    return route_search_distance_scan(&route_context[0], crossing_number, target, -1, 0);
+}
+
+//ダイクストラ法(時間)による目的地への最短時間導出
+int dijkstra_time(int crossing_number, int target, double speed){
+    return route_search_time_scan(&route_context[1], crossing_number, target, -1, speed);
+}
+
+//最短経路計算
+int pickup_path_distance(int start,int goal,int path[],int maxpath){
+    return route_pickup(&route_context[0], start, goal, path, maxpath);
+}
+//最短時間計算
+int pickup_path_time(int start,int goal,int path[],int maxpath){
+    return route_pickup(&route_context[1], start, goal, path, maxpath);
+}
+
+//合計距離計算
+double calculate_distance(int path[]){
+    return route_total_distance(path, 0);
+}
+//合計時間計算
+double calculate_time(int path[],double speed){
+    return route_total_time(path, speed);
+}
+//経路をリセットする関数
+int path_reset(int path[], int pathmax){
+    int i;
+    for(i = 0; i < pathmax; ++i){
+        path[i] = -1;
+    }
+    return 0;
+}
+
+//経路から交差点の座標を導く関数
+double id_to_posx(int path[], int id){
+    
+    return cross[ path[id] ].pos.x;
+}
+double id_to_posy(int path[], int id){
+    
+    return cross[ path[id] ].pos.y;
+}
+
+//走行中の経路
+//区間(交差点iからi+1)ごとの長さと所要時間、その累積を持つので、残りの距離と到着までの時間を毎フレーム O(1) で求められる
+//所要時間の数え方はcalculate_timeと同じ(出発した交差点の待ち時間と右左折のコストをその区間に含める)
+typedef struct {
+    int number;                    /* 経路上の交差点数 */
+    int cap;
+    double speed;
+    double *leg_length;            /* 区間の長さ[km] */
+    double *leg_fixed;             /* 区間の待ち時間と右左折のコスト[分](速度によらない) */
+    int *leg_steps;                /* 区間を何ステップで進むか(アニメーション用) */
+    double *sum_length;            /* sum_length[i] : 出発地から交差点iまでの距離 */
+    double *sum_time;              /* sum_time[i] : 出発地から交差点iまでの所要時間 */
+} Route;
+
+static void route_free(Route *r){
+    free(r->leg_length);
+    free(r->leg_fixed);
+    free(r->leg_steps);
+    free(r->sum_length);
+    free(r->sum_time);
+    memset(r, 0, sizeof(*r));
+}
+
+//速度が変わったときに、区間from以降の所要時間の累積だけを計算し直す関数
+static void route_set_speed(Route *r, double speed, int from){
+    int i;
+    r->speed = speed;
+    if(from < 0){
+        from = 0;
+    }
+    for(i = from; i + 1 < r->number; ++i){
+        r->sum_time[i + 1] = r->sum_time[i] + r->leg_fixed[i] + r->leg_length[i] / (speed / 60);
+    }
+}
+
+//-1終端の経路から区間の表を作る関数(足りなくなったときだけ確保し直す)
+static int route_set(Route *r, int const path[], double speed){
+    int i, n = 0, cap;
+    double turn;
+
+    while(path[n] != -1){
+        n++;
+    }
+    if(n > r->cap){
+        cap = (n > 2 * r->cap) ? n : 2 * r->cap;
+        route_free(r);
+        r->leg_length = malloc(sizeof(double) * cap);
+        r->leg_fixed = malloc(sizeof(double) * cap);
+        r->leg_steps = malloc(sizeof(int) * cap);
+        r->sum_length = malloc(sizeof(double) * cap);
+        r->sum_time = malloc(sizeof(double) * cap);
+        if(r->leg_length == NULL || r->leg_fixed == NULL || r->leg_steps == NULL
+           || r->sum_length == NULL || r->sum_time == NULL){
+            route_free(r);
+            return -1;
+        }
+        r->cap = cap;
+    }
+    r->number = n;
+    if(n == 0){
+        return 0;
+    }
+    r->sum_length[0] = 0.0;
+    r->sum_time[0] = 0.0;
+    for(i = 0; i + 1 < n; ++i){
+        r->leg_length[i] = road_length(path[i], path[i + 1]);
+        if(r->leg_length[i] == INFINITY){
+            r->number = 0;
+            return -1;      /* つながっていない交差点が並んでいる */
+        }
+        r->sum_length[i + 1] = r->sum_length[i] + r->leg_length[i];
+        //現在地の交差点の待ち時間は考慮しない
+        r->leg_fixed[i] = 0.0;
+        if(i > 0){
+            r->leg_fixed[i] = cross[path[i]].wait;
+            turn = turn_cost_path(path[i - 1], path[i], path[i + 1]);
+            if(turn == INFINITY){
+                r->number = 0;
+                return -1;  /* 禁止された右左折がある */
+            }
+            r->leg_fixed[i] += turn;
+        }
+        //長さによって進むステップ数を変える
+        r->leg_steps[i] = (r->leg_length[i] >= 0.05) ? (int)(r->leg_length[i] / 0.1) : (int)(r->leg_length[i] / 0.01);
+    }
+    r->leg_length[n - 1] = 0.0;
+    r->leg_fixed[n - 1] = 0.0;
+    r->leg_steps[n - 1] = 0;
+    route_set_speed(r, speed, 0);
+    return 0;
+}
+
+//区間itのstepステップ目にいるときの、目的地までの残りの距離[km]と所要時間[分]
+//区間の途中では、進んだ割合だけ区間の長さと走る時間を差し引く(待ちと右左折は区間の始めに済んだものとする)
+static void route_remaining(Route const *r, int it, int step, double *km, double *minutes){
+    double f;
+    if(r->number == 0 || it >= r->number - 1){
+        *km = 0.0;
+        *minutes = 0.0;
+        return;
+    }
+    f = (r->leg_steps[it] > 0) ? fmin((double)step / r->leg_steps[it], 1.0) : 1.0;
+    *km = r->sum_length[r->number - 1] - r->sum_length[it] - f * r->leg_length[it];
+    *minutes = r->sum_time[r->number - 1] - r->sum_time[it] - r->leg_fixed[it]
+               - f * r->leg_length[it] / (r->speed / 60);
+}
+
+//残りの距離と到着までの時間を画面の左下に重ねて描く関数
+static void draw_route_status(Route const *r, int it, int step, int width, int height){
+    char line[128];
+    double km, minutes;
+
+    if(font == NULL){
+        return;
+    }
+    route_remaining(r, it, step, &km, &minutes);
+    snprintf(line, sizeof(line), "残り %.2fkm  到着まで %.1f分  (%.0fkm/h)", km, minutes, r->speed);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, width, 0, height, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glTranslated(10, 20, 0);
+    glColor3d(1.0, 1.0, 0.6);
+    ftglRenderFont(font, line, FTGL_RENDER_ALL);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
+//ナビ画面の入力(毎フレームすべてのキーを調べる代わりに、GLFWのコールバックで受け取っておく)
+//コールバックはglfwPollEvents・glfwWaitEvents・glfwSwapBuffersの中でメインスレッドから呼ばれるので排他はいらない
+static struct {
+    char hit[GLFW_KEY_LAST + 1];      /* コールバックで押されたキー */
+    char pressed[GLFW_KEY_LAST + 1];  /* key_pollで取り出した、このフレームで押されたキー */
+    int dirty;                        /* 描き直しが必要なら1(キー入力・ウィンドウの大きさの変更・経路の入れ替え) */
+} navi_input;
+
+static void GLFWCALL navi_key_callback(int key, int action){
+    if(action == GLFW_PRESS && key >= 0 && key <= GLFW_KEY_LAST){
+        navi_input.hit[key] = 1;
+        navi_input.dirty = 1;
+    }
+}
+
+static void GLFWCALL navi_size_callback(int width, int height){
+    navi_input.dirty = 1;
+}
+
+static void GLFWCALL navi_refresh_callback(void){
+    navi_input.dirty = 1;
+}
+
+//届いているイベントを処理して、押されたキーを取り出す関数
+static void key_poll(void){
+    glfwPollEvents();
+    memcpy(navi_input.pressed, navi_input.hit, sizeof(navi_input.pressed));
+    memset(navi_input.hit, 0, sizeof(navi_input.hit));
+}
+
+//key_pollで取り出したキーが押されていたら1を返す関数
+static int key_pressed(int key){
+    return navi_input.pressed[key];
+}
+
+//ナビ画面のウィンドウを開き、入力のコールバックとフォントを用意する関数
+static void navi_window_open(void){
+    glfwInit();
+    glfwOpenWindow(1000, 800, 0, 0, 0, 0, 0, 0, GLFW_WINDOW);
+    memset(&navi_input, 0, sizeof(navi_input));
+    navi_input.dirty = 1;
+    glfwSetKeyCallback(navi_key_callback);
+    glfwSetWindowSizeCallback(navi_size_callback);
+    glfwSetWindowRefreshCallback(navi_refresh_callback);
+    glfwEnable(GLFW_KEY_REPEAT);   /* 押し続けたキーは繰り返し届く */
+
+    /* 文字列描画のためのフォントの読み込みと設定(ウィンドウを開いたときに1回だけ) */
+    font = ftglCreateExtrudeFont(FONT_FILENAME);
+    if (font == NULL) {
+        perror(FONT_FILENAME);
+        fprintf(stderr, "could not load font\n");
+        exit(1);
+    }
+    ftglSetFontFaceSize(font, 24, 24);
+    ftglSetFontDepth(font, 0.01);
+    ftglSetFontOutset(font, 0, 0.1);
+    ftglSetFontCharMap(font, ft_encoding_unicode);
+    raster_open();
+}
+
+//ナビ画面のウィンドウを閉じる関数
+static void navi_window_close(void){
+    raster_close();
+    if(font != NULL){
+        ftglDestroyFont(font);
+        font = NULL;
+    }
+    glfwTerminate();
+}
+
+//経路が届くまでの間、出発地を中心に地図だけを描く関数(ウィンドウを止めない)
+static void draw_waiting_frame(int crossing_number, int start, double range_z){
+    int width, height;
+
+    glfwGetWindowSize(&width, &height);
+    glViewport(0, 0, width, height);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(120.0, 1.0, 0, 50);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glTranslated(-cross[start].pos.x, -cross[start].pos.y, -range_z);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    raster_show(crossing_number, range_z * 0.005, width, height);
+    glColor3d(0.6, 1.0, 1.0);
+    draw_corn(cross[start].pos.x, cross[start].pos.y, 0.4, 0.05);
+    glfwSwapBuffers();
+}
+
+//交差点名で検索する関数(englishが1ならローマ字、0なら日本語)
+//完全一致があれば*exactにその番号を入れて0を返す
+//なければ*exactを-1にして、部分一致した交差点を最大outmax個output[]に入れてその数を返す
+static int search_cross_name(int num, char const *input, int english, int *exact, int output[], int outmax){
+    int i, n = 0;
+    char const *name;
+
+    *exact = -1;
+    //まず完全一致から探す
+    for(i = 0; i < num; ++i){
+        name = english ? cross[i].ename : cross[i].jname;
+        if(strcmp(name, input) == 0){
+            *exact = i;
+            return 0;
+        }
+    }
+    //次に部分一致を探す
+    for(i = 0; i < num && n < outmax; ++i){
+        name = english ? cross[i].ename : cross[i].jname;
+        if(strstr(name, input) != NULL){
+            output[n++] = i;
+        }
+    }
+    return n;
+}
+
+//交差点を検索する関数(日本語)
+int search_cross_ja(int num){
+    int i,k;
+    int f = -1;
+    char input[200];
+    int *output = malloc(sizeof(int) * (num + 1));
+    if(output == NULL){
+        fprintf(stderr, "search: out of memory\n");
+        return -1;      /* 見つからなかったときと同じくメニューに戻る */
+    }
+    printf("交差点名を入力してください(日本語)\n");
+    menu_scanf("%199s",input);
+    puts("");
+    //output[1]から候補を入れる(0番は選択なし)
+    output[0] = -1;
+    k = search_cross_name(num, input, 0, &f, &output[1], num);
+    if(f != -1 || k == 0){
+        goto searchend;
+    }
+    //部分一致の候補表示
+    printf("'%s'が含まれる交差点を表示します\n",input);
+    for(i = 1; i <= k; ++i){
+        printf("%d. %s\n",i,cross[output[i]].jname);
+    }
+    printf("交差点を選択してください(数字)\n");
+    printf("input>");
+    menu_scanf("%d",&i);
+    if (i >= 0 && i <= k){
+        f = output[i];
+    }
+    searchend:
+    free(output);
+    if(f == -1){
+        printf("交差点を見つけることができませんでした\n");
+    }
+    return f;
+}
+
+//交差点を検索する関数(英語)
+int search_cross_en(int num){
+    int i,k;
+    int f = -1;
+    char input[200];
+    int *output = malloc(sizeof(int) * (num + 1));
+    if(output == NULL){
+        fprintf(stderr, "search: out of memory\n");
+        return -1;      /* 見つからなかったときと同じくメニューに戻る */
+    }
+    printf("交差点名を入力してください(英語)\n");
+    menu_scanf("%199s",input);
+    puts("");
+    //output[1]から候補を入れる(0番は選択なし)
+    output[0] = -1;
+    k = search_cross_name(num, input, 1, &f, &output[1], num);
+    if(f != -1 || k == 0){
+        goto searchend;
+    }
+    //部分一致の候補表示
+    printf("'%s'が含まれる交差点を表示します\n",input);
+    for(i = 1; i <= k; ++i){
+        printf("%d. %s\n",i,cross[output[i]].ename);
+    }
+    printf("交差点を選択してください(数字)\n");
+    printf("input>");
+    menu_scanf("%d",&i);
+    if (i >= 0 && i <= k){
+        f = output[i];
+    }
+    searchend:
+    free(output);
+    if(f == -1){
+        printf("交差点を見つけることができませんでした\n");
+    }
+    return f;
+}
+
+//交差点を検索する関数(交差点ID)
+int search_cross_id(int num){
+    int input;
+    int f = -1;
+    printf("交差点名を入力してください(ID)\n");
+    printf("input>");
+    menu_scanf("%d",&input);
+    puts("");
+    if(0 <= input && input < num){
+        f = cross_index[input];
+    }
+    if(f == -1){
+        printf("交差点を見つけることができませんでした\n");
+    }
+    return f;
+}
+
+//利用するスレッド数を決める関数
+static int worker_count(int jobs){
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1){
+        n = 1;
+    }
+    if(n > MaxThreads){
+        n = MaxThreads;
+    }
+    if(n > jobs){
+        n = jobs;
+    }
+    return (int)n;
+}
+
+//ヒープを用いたダイクストラ法(時間)  stopsの交差点がすべて確定したら打ち切る
+//結果は作業領域ctxに入れる(search_label・search_previousで読む)ので、複数のスレッドから同時に呼べる
+static int dijkstra_time_heap(SearchContext *ctx, int crossing_number, int target, double speed,
+                              int const stops[], int stop_number){
+    int i, j, n;
+    double t;
+    int remain = 0;
+    int heap_size = 0;
+    HeapNode top;
+    PROF_BEGIN(scope);
+
+    if(search_begin(ctx, crossing_number) < 0){
+        return -1;
+    }
+    for(i = 0; i < stop_number; ++i){
+        if(ctx->mark[stops[i]] != ctx->epoch){
+            remain++;       /* 同じ交差点が二度指定されていても1つと数える */
+        }
+        ctx->mark[stops[i]] = ctx->epoch;
+    }
+
+    search_relax(ctx, &heap_size, target, 0, -1);
+    while(heap_size > 0 && remain > 0){
+        top = heap_pop(ctx->heap, &heap_size);
+        if(top.key > ctx->label[top.id]){
+            continue;       /* 古い要素は読み飛ばす */
+        }
+        PROF_COUNT(settled, 1);
+        if(ctx->mark[top.id] == ctx->epoch){
+            remain--;
+        }
+        for(j = 0; j < cross[top.id].points; ++j){
+            n = cross[top.id].next[j];
+            t = route_edge_time(top.id, j, speed) + top.key;
+            search_relax(ctx, &heap_size, n, t, top.id);
+        }
+    }
+    PROF_END(scope, "dijkstra_time_heap");
+    return 0;
+}
+
+//ランドマーク(ALT)の下界  前計算とファイルの読み書きは「ランドマーク(ALT)」の節にある
+//交差点vから目的地gへの費用は、ランドマークLからの・への費用と三角不等式から
+//  d(v,g) >= d(L,g) - d(L,v)    d(v,g) >= d(v,L) - d(g,L)
+//を満たすので、その最大を目的地へ向かう探索(A*)の下界に使う
+#define AltMax      32          /* ランドマークの最大数 */
+#define AltNone     FLT_MAX     /* たどり着けない費用 */
+
+static struct {
+    int crossing_number;
+    unsigned version;              /* 作ったときの地図の版 */
+    int number;                    /* ランドマークの数 */
+    double speed;                  /* 時間を求めた車の速度 */
+    int landmark[AltMax];
+    float *from[2];                /* [評価値]  from[m][v * number + k] : k番目のランドマークからvへの費用 */
+    float *to[2];                  /* [評価値]  to[m][v * number + k] : vからk番目のランドマークへの費用 */
+    float slack[2];                /* floatに丸めた誤差の分だけ下界から引く量 */
+} alt;
+
+//目的地ごとに前もって読んでおく下界の材料
+typedef struct {
+    int metric;                    /* ランドマークが使えなければ -1 */
+    float from[AltMax], to[AltMax];
+} AltGoal;
+
+//目的地goalへの下界の材料を用意する関数
+//時間の下界は作ったときの車の速度以下なら使える(遅い車ほど時間はかかり、待ち時間は変わらない)
+//地図の版が変わっても、道路が増えず費用が小さくなっていなければ下界のまま使える
+static void alt_goal(AltGoal *a, int crossing_number, int goal, int metric, double speed){
+    int k;
+
+    a->metric = -1;
+    if(alt.number == 0 || alt.crossing_number != crossing_number || (metric == 1 && speed > alt.speed)
+       || !map_costs_not_lowered(alt.version)){
+        return;
+    }
+    a->metric = metric;
+    for(k = 0; k < alt.number; ++k){
+        a->from[k] = alt.from[metric][(size_t)goal * alt.number + k];
+        a->to[k] = alt.to[metric][(size_t)goal * alt.number + k];
+    }
+}
+
+//交差点vから目的地への費用の下界(目的地へたどり着けないと分かれば無限大)
+//1つの交差点の費用はランドマークの数だけ続けて並んでいるので、続いたメモリを読むだけで求まる
+static inline double alt_bound(AltGoal const *a, int v){
+    float const *f = &alt.from[a->metric][(size_t)v * alt.number];
+    float const *t = &alt.to[a->metric][(size_t)v * alt.number];
+    double h = 0;
+    int k;
+
+    for(k = 0; k < alt.number; ++k){
+        h = fmax(h, fmax((double)a->from[k] - f[k], (double)t[k] - a->to[k]));
+    }
+    if(h >= AltNone / 2){
+        return INFINITY;    /* ランドマークから目的地へは行けるがvへは行けない、など */
+    }
+    return fmax(h - alt.slack[a->metric], 0);
+}
+
+//道路を状態とする探索の状態stateが表す交差点
+//状態 u * 6 + j は「交差点uのj番目の道路を通って、その先の交差点に入った」ことを表す(j == 5 は出発地uにいる)
+//通ってきた道路は出ていった交差点の側の番号で表すので、逆向きの道路がない一方通行の道路も通れる
+static inline int turn_state_crossing(int state){
+    return (state % 6 == 5) ? state / 6 : cross[state / 6].next[state % 6];
+}
+
+//道路を状態とする探索で、状態goal_stateから出発地へたどった経路を-1終端でpathに入れる関数
+static int turn_path(SearchContext const *ctx, int goal_state, int path[], int maxpath){
+    int n = 0, state;
+
+    for(state = goal_state; state != -1; state = ctx->previous[state]){
+        n++;
+    }
+    if(n >= maxpath){
+        return -1;
+    }
+    path[n] = -1;
+    for(state = goal_state; state != -1; state = ctx->previous[state]){
+        path[--n] = turn_state_crossing(state);
+    }
+    return 0;
+}
+
+//右左折のコストと禁止を考慮した経路探索(道路を状態とするダイクストラ法)
+//状態の表し方はturn_state_crossingを参照
+//状態の数は道路数程度なので、交差点ごとの探索と比べてもメモリは数倍で済む
+//ランドマークがあれば、評価値に目的地への下界を足したA*にする(ヒープと評価値の配列には下界を足した値が入る)
+//右左折のコストは0以上で、出発地以外では道路の長さに出ていく交差点の待ち時間を足すので、ランドマークの費用の向きと同じになる
+//下界はfloatの丸めの分を引いてあり実際の費用を超えないので、目的地を取り出した時点で最短になっている
+//metric 0:距離 1:時間、経路をpathに-1終端で入れて合計の評価値を返す(たどり着けなければ負)
+static double dijkstra_turn(SearchContext *ctx, int crossing_number, int start, int goal, int metric, double speed,
+                            int path[], int maxpath){
+    int heap_size = 0;
+    double cost = -1;
+    HeapNode top;
+    int j, u, v, s, n, goal_state = -1;
+    double c, g, h, turn;
+    AltGoal bound;
+    PROF_BEGIN(scope);
+
+    if(search_begin(ctx, crossing_number * 6) < 0){
+        return -1;
+    }
+    alt_goal(&bound, crossing_number, goal, metric, speed);
+    ctx->settled = 0;
+    search_relax(ctx, &heap_size, start * 6 + 5, 0, -1);    /* 出発地の下界は0とする */
+    while(heap_size > 0){
+        top = heap_pop(ctx->heap, &heap_size);
+        if(top.key > ctx->label[top.id]){
+            continue;
+        }
+        PROF_COUNT(settled, 1);
+        ctx->settled++;
+        u = top.id / 6;
+        s = top.id % 6;
+        v = turn_state_crossing(top.id);
+        if(v == goal){
+            goal_state = top.id;
+            break;
+        }
+        g = (bound.metric < 0 || s == 5) ? top.key : top.key - alt_bound(&bound, v);
+        for(j = 0; j < cross[v].points; ++j){
+            n = cross[v].next[j];
+            c = g + ((metric == 0) ? cross[v].length[j] : cross[v].length[j] / (speed / 60));
+            if(s != 5){
+                turn = turn_cost_edge(u, s, j);
+                if(turn < 0){
+                    continue;   /* 右左折禁止 */
+                }
+                if(metric == 1){
+                    c += cross[v].wait + turn;
+                }
+            }
+            if(bound.metric >= 0){
+                h = alt_bound(&bound, n);
+                if(h == INFINITY){
+                    continue;   /* ここからは目的地へ行けない */
+                }
+                c += h;
+            }
+            search_relax(ctx, &heap_size, v * 6 + j, c, top.id);
+        }
+    }
+    if(goal_state == -1 || turn_path(ctx, goal_state, path, maxpath) < 0){
+        goto turnend;
+    }
+    cost = ctx->label[goal_state];      /* 目的地の下界は0 */
+
+    turnend:
+    PROF_END(scope, "dijkstra_turn");
+    return cost;
+}
+
+//近い施設の探索の結果
+typedef struct {
+    int crossing;                  /* 施設の交差点 */
+    int state;                     /* 経路をたどる状態(turn_pathで出発地まで戻れる) */
+    double cost;                   /* 出発地からの評価値 */
+} FacilityHit;
+
+//出発地から評価値の小さい順にk個の施設(kindsのビットの種類)を求める関数
+//dijkstra_turnと同じ状態と評価値で出発地から広げ、施設の交差点をk個確定したら打ち切るので、
+//施設ごとに経路を求めるのと違って、手間は探した範囲に比例する(出発地の交差点自体は数えない)
+//結果はhitに近い順に入れて個数を返す(経路は次の探索までturn_pathで取り出せる)
+static int facility_nearest(SearchContext *ctx, int crossing_number, int start, unsigned kinds, int k,
+                            int metric, double speed, FacilityHit hit[]){
+    int heap_size = 0, found = 0;
+    HeapNode top;
+    int j, u, v, s;
+    double c, turn;
+    PROF_BEGIN(scope);
+
+    if(search_begin(ctx, crossing_number * 6) < 0){
+        return -1;
+    }
+    ctx->settled = 0;
+    search_relax(ctx, &heap_size, start * 6 + 5, 0, -1);
+    while(heap_size > 0 && found < k){
+        top = heap_pop(ctx->heap, &heap_size);
+        if(top.key > ctx->label[top.id]){
+            continue;
+        }
+        PROF_COUNT(settled, 1);
+        ctx->settled++;
+        u = top.id / 6;
+        s = top.id % 6;
+        v = turn_state_crossing(top.id);
+        //交差点に最初に入った状態が、その交差点への最短になる
+        if((cross[v].facility & kinds) != 0 && v != start && ctx->mark[v] != ctx->epoch){
+            ctx->mark[v] = ctx->epoch;
+            hit[found].crossing = v;
+            hit[found].state = top.id;
+            hit[found].cost = top.key;
+            found++;
+        }
+        for(j = 0; j < cross[v].points; ++j){
+            c = top.key + ((metric == 0) ? cross[v].length[j] : cross[v].length[j] / (speed / 60));
+            if(s != 5){
+                turn = turn_cost_edge(u, s, j);
+                if(turn < 0){
+                    continue;   /* 右左折禁止 */
+                }
+                if(metric == 1){
+                    c += cross[v].wait + turn;
+                }
+            }
+            search_relax(ctx, &heap_size, v * 6 + j, c, top.id);
+        }
+    }
+    PROF_END(scope, "facility_nearest");
+    return found;
+}
+
+//並列のΔステッピング法(目的地から全交差点への最短経路)
+//評価値をΔごとのバケツに分け、同じバケツの交差点はスレッドで分担して同時に緩和する
+//評価値は負でないdoubleのビット列をuint64_tとして比べる(ビット列の大小と値の大小が一致する)
+typedef struct {
+    int *item;
+    int size, cap;
+} IntList;
+
+static int int_list_push(IntList *l, int v){
+    int *p;
+    if(l->size == l->cap){
+        p = realloc(l->item, sizeof(int) * (l->cap ? l->cap * 2 : 256));
+        if(p == NULL){
+            return -1;
+        }
+        l->item = p;
+        l->cap = l->cap ? l->cap * 2 : 256;
+    }
+    l->item[l->size++] = v;
+    return 0;
+}
+
+typedef struct {
+    int crossing_number, metric, threads;
+    double speed, delta;
+    uint64_t *label;               /* 評価値(doubleのビット列) */
+    int *previous;
+    int *round_mark;               /* 今回の処理対象に入れた回 */
+    int *bucket_mark;              /* 確定した交差点として登録したバケツ */
+    IntList frontier;              /* 今回緩和する交差点 */
+    IntList settled;               /* 今のバケツで軽い道路を緩和した交差点 */
+    IntList out[MaxThreads];       /* スレッドごとの評価値が下がった交差点 */
+    double weight_sum[MaxThreads], weight_max[MaxThreads];
+    IntList *bucket;               /* 評価値 [bΔ, (b+1)Δ) の交差点(bucket_number個を使い回す) */
+    int bucket_number, current, round;
+    int target, heavy, finished, failed;
+    int go;                        /* スレッドを作り終えてthreadsとbarrierが決まった */
+    pthread_barrier_t barrier;
+    SearchContext *result;         /* 結果を入れる呼び出したスレッドの作業領域 */
+} DeltaStep;
+
+typedef struct {
+    DeltaStep *d;
+    int id;
+} DeltaWorker;
+
+static inline double delta_label(uint64_t const *label, int n){
+    uint64_t bits = __atomic_load_n(&label[n], __ATOMIC_RELAXED);
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+//評価値を原子的に小さくする(小さくできたら1を返す)
+static inline int delta_lower(uint64_t *label, int n, double value){
+    uint64_t bits, old = __atomic_load_n(&label[n], __ATOMIC_RELAXED);
+    memcpy(&bits, &value, sizeof(bits));
+    while(bits < old){
+        if(__atomic_compare_exchange_n(&label[n], &old, bits, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//道路の評価値(逐次版と同じroute_edge_*を使って、結果をビット単位で一致させる)
+static inline double delta_weight(DeltaStep const *d, int u, int j){
+    if(d->metric == 0){
+        return route_edge_distance(u, j, d->speed);
+    }
+    return route_edge_time(u, j, d->speed);
+}
+
+//スレッド0がバリアの間に次に緩和する交差点を決める
+static void delta_next(DeltaStep *d){
+    IntList *list, tmp;
+    int t, k, n, b, step;
+
+    if(d->heavy == 0){
+        for(k = 0; k < d->frontier.size; ++k){
+            n = d->frontier.item[k];
+            if(d->bucket_mark[n] != d->current){
+                d->bucket_mark[n] = d->current;
+                d->failed |= int_list_push(&d->settled, n);
+            }
+        }
+    }
+    d->frontier.size = 0;
+    d->round++;
+    //評価値が下がった交差点を、今のバケツなら次の処理対象に、そうでなければそのバケツに入れる
+    for(t = 0; t < d->threads; ++t){
+        for(k = 0; k < d->out[t].size; ++k){
+            n = d->out[t].item[k];
+            b = (int)(delta_label(d->label, n) / d->delta);
+            if(b == d->current && d->heavy == 0){
+                if(d->round_mark[n] != d->round){
+                    d->round_mark[n] = d->round;
+                    d->failed |= int_list_push(&d->frontier, n);
+                }
+            }
+            else{
+                d->failed |= int_list_push(&d->bucket[b % d->bucket_number], n);
+            }
+        }
+        d->out[t].size = 0;
+    }
+    if(d->failed){
+        d->finished = 1;
+        return;
+    }
+    if(d->frontier.size > 0){
+        d->heavy = 0;
+        return;
+    }
+    //今のバケツが空になったら、そこで確定した交差点から重い道路を一度だけ緩和する
+    if(d->heavy == 0 && d->settled.size > 0){
+        tmp = d->frontier;
+        d->frontier = d->settled;
+        d->settled = tmp;
+        d->heavy = 1;
+        return;
+    }
+    //次に空でないバケツ(評価値が下がって移った古い要素は読み飛ばす)
+    for(step = 1; step <= d->bucket_number; ++step){
+        b = d->current + step;
+        list = &d->bucket[b % d->bucket_number];
+        for(k = 0; k < list->size; ++k){
+            n = list->item[k];
+            if((int)(delta_label(d->label, n) / d->delta) == b && d->round_mark[n] != d->round){
+                d->round_mark[n] = d->round;
+                d->failed |= int_list_push(&d->frontier, n);
+            }
+        }
+        list->size = 0;
+        if(d->frontier.size > 0){
+            d->current = b;
+            d->heavy = 0;
+            return;
+        }
+    }
+    d->finished = 1;
+}
+
+//直前の交差点をuにするか(評価値の小さい方、同じなら番号の小さい方を選ぶ、逐次版で先に確定する方)
+static inline void delta_previous(DeltaStep *d, int n, int u, double lu){
+    int old = __atomic_load_n(&d->previous[n], __ATOMIC_RELAXED);
+    double lo;
+    while(old != u){
+        if(old >= 0){
+            lo = delta_label(d->label, old);
+            if(lo < lu || (lo == lu && old < u)){
+                return;
+            }
+        }
+        if(__atomic_compare_exchange_n(&d->previous[n], &old, u, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+            return;
+        }
+    }
+}
+
+static void *delta_worker(void *arg){
+    DeltaWorker *w = arg;
+    DeltaStep *d = w->d;
+    IntList *out = &d->out[w->id];
+    uint64_t infinity;
+    double lu, c, none = 1e100;
+    int i, j, n, u, t;
+
+    while(!__atomic_load_n(&d->go, __ATOMIC_ACQUIRE)){
+        sched_yield();
+    }
+    //初期化と、Δを決めるための道路の評価値の集計を分担する
+    memcpy(&infinity, &none, sizeof(infinity));
+    d->weight_sum[w->id] = 0.0;
+    d->weight_max[w->id] = 0.0;
+    for(u = w->id; u < d->crossing_number; u += d->threads){
+        d->label[u] = infinity;
+        d->previous[u] = -1;
+        d->round_mark[u] = -1;
+        d->bucket_mark[u] = -1;
+        for(j = 0; j < cross[u].points; ++j){
+            c = delta_weight(d, u, j);
+            d->weight_sum[w->id] += c;
+            if(c > d->weight_max[w->id]){
+                d->weight_max[w->id] = c;
+            }
+        }
+    }
+    pthread_barrier_wait(&d->barrier);
+    if(w->id == 0){
+        double sum = 0.0, max = 0.0;
+        long roads = 0;
+        for(u = 0; u < d->crossing_number; ++u){
+            roads += cross[u].points;
+        }
+        for(t = 0; t < d->threads; ++t){
+            sum += d->weight_sum[t];
+            if(d->weight_max[t] > max){
+                max = d->weight_max[t];
+            }
+        }
+        //Δは道路の評価値の平均の定数倍(軽い道路はバケツの中で繰り返し、重い道路は一度だけ緩和する)
+        d->delta = (roads > 0 && sum > 0) ? DELTA_SCALE * sum / roads : 1.0;
+        d->bucket_number = (int)(max / d->delta) + 2;
+        d->bucket = calloc(d->bucket_number, sizeof(IntList));
+        d->label[d->target] = 0;      /* 0.0 のビット列は0 */
+        d->round = 0;
+        d->round_mark[d->target] = 0;
+        d->current = 0;
+        d->heavy = 0;
+        d->finished = (d->bucket == NULL);
+        d->failed = (d->bucket == NULL) | int_list_push(&d->frontier, d->target);
+    }
+
+    for(;;){
+        pthread_barrier_wait(&d->barrier);
+        if(d->finished){
+            break;
+        }
+        for(i = w->id; i < d->frontier.size; i += d->threads){
+            u = d->frontier.item[i];
+            lu = delta_label(d->label, u);
+            PROF_COUNT(settled, 1);
+            for(j = 0; j < cross[u].points; ++j){
+                c = delta_weight(d, u, j);
+                if((c >= d->delta) != d->heavy){
+                    continue;
+                }
+                n = cross[u].next[j];
+                if(delta_lower(d->label, n, c + lu)){
+                    PROF_COUNT(relaxed, 1);
+                    if(int_list_push(out, n) < 0){
+                        d->failed = 1;
+                    }
+                }
+            }
+        }
+        pthread_barrier_wait(&d->barrier);
+        if(w->id == 0){
+            delta_next(d);
+        }
+    }
+
+    //評価値が確定したら、評価値が一致する道路から直前の交差点を選ぶ
+    for(u = w->id; u < d->crossing_number && !d->failed; u += d->threads){
+        lu = delta_label(d->label, u);
+        if(lu >= 1e100){
+            continue;
+        }
+        for(j = 0; j < cross[u].points; ++j){
+            n = cross[u].next[j];
+            if(n != u && delta_weight(d, u, j) + lu == delta_label(d->label, n)
+               && (lu < delta_label(d->label, n) || u < n)){
+                delta_previous(d, n, u, lu);
+            }
+        }
+    }
+    pthread_barrier_wait(&d->barrier);
+    for(u = w->id; u < d->crossing_number && !d->failed; u += d->threads){
+        lu = delta_label(d->label, u);
+        if(lu < 1e100){     /* 届かなかった交差点は印を付けない(search_labelが 1e100 を返す) */
+            d->result->label[u] = lu;
+            d->result->previous[u] = (u == d->target) ? -1 : d->previous[u];
+            d->result->stamp[u] = d->result->epoch;
+        }
+    }
+    return NULL;
+}
+
+//Δステッピング法で目的地targetからの最短経路を求める関数(threadsが0なら使えるコア数)
+//結果はdijkstra_distance(metric 0)・dijkstra_time(metric 1)と同じ作業領域route_context[metric]に書き込む
+static int dijkstra_parallel(int crossing_number, int target, int metric, double speed, int threads){
+    DeltaStep *d = calloc(1, sizeof(DeltaStep));
+    DeltaWorker worker[MaxThreads];
+    pthread_t thread[MaxThreads];
+    int t, result = -1;
+    PROF_BEGIN(scope);
+
+    if(threads <= 0){
+        threads = worker_count(crossing_number);
+    }
+    if(threads > MaxThreads){
+        threads = MaxThreads;
+    }
+    if(d == NULL){
+        return -1;
+    }
+    if(search_begin(&route_context[metric], crossing_number) < 0){
+        free(d);
+        return -1;
+    }
+    d->result = &route_context[metric];
+    d->crossing_number = crossing_number;
+    d->metric = metric;
+    d->speed = speed;
+    d->target = target;
+    d->threads = threads;
+    d->label = malloc(sizeof(uint64_t) * crossing_number);
+    d->previous = malloc(sizeof(int) * crossing_number);
+    d->round_mark = malloc(sizeof(int) * crossing_number);
+    d->bucket_mark = malloc(sizeof(int) * crossing_number);
+    if(d->label != NULL && d->previous != NULL && d->round_mark != NULL && d->bucket_mark != NULL){
+        //作れたスレッドの数で分担とバリアを決めてから始める(1つも作れなければこのスレッドだけで行う)
+        for(t = 0; t < threads; ++t){
+            worker[t].d = d;
+            worker[t].id = t;
+            if(t > 0 && map_thread_create(&thread[t], delta_worker, &worker[t]) != 0){
+                break;
+            }
+        }
+        d->threads = t;
+        pthread_barrier_init(&d->barrier, NULL, d->threads);
+        __atomic_store_n(&d->go, 1, __ATOMIC_RELEASE);
+        delta_worker(&worker[0]);
+        for(t = 1; t < d->threads; ++t){
+            pthread_join(thread[t], NULL);
+        }
+        pthread_barrier_destroy(&d->barrier);
+        result = d->failed ? -1 : 0;
+    }
+
+    for(t = 0; t < threads; ++t){
+        free(d->out[t].item);
+    }
+    if(d->bucket != NULL){
+        for(t = 0; t < d->bucket_number; ++t){
+            free(d->bucket[t].item);
+        }
+    }
+    free(d->bucket);
+    free(d->frontier.item);
+    free(d->settled.item);
+    free(d->label);
+    free(d->previous);
+    free(d->round_mark);
+    free(d->bucket_mark);
+    free(d);
+    PROF_END(scope, metric == 0 ? "dijkstra_parallel(distance)" : "dijkstra_parallel(time)");
+    return result;
+}
+
+//経路の記録
+//経路探索の要求と結果、移動体の位置を、描画を止めずにファイルへ書き出す
+//記録する側(メインスレッド)と書き出すスレッドの間は1対1のロックのないリングバッファでつなぐ
+//リングがいっぱいのときは待たずにその記録を捨てる(捨てた数は終了時に表示する)
+#define RouteLogRing  (1 << 20)    /* リングバッファの大きさ(2の累乗) */
+#define ROUTELOG_MAGIC "CNRL"
+#define ROUTELOG_VERSION 1
+#define ROUTELOG_ROUTE   1         /* 経路探索の要求と結果 */
+#define ROUTELOG_VEHICLE 2         /* 移動体の位置 */
+
+//リングに入れる記録(この後ろに経路の交差点番号がcount個続く)
+typedef struct {
+    int type;
+    int metric, turn_mode;
+    int start, goal;               /* 移動体なら今の交差点と次の交差点 */
+    int count;                     /* 経路の交差点数(移動体なら道路上のステップ) */
+    uint64_t time_us;              /* 記録を始めてからの時間 */
+    double speed, cost;
+} RouteLogEvent;
+
+static struct {
+    size_t head __attribute__((aligned(64)));   /* 書き込んだ位置(記録する側だけが進める) */
+    size_t tail __attribute__((aligned(64)));   /* 読み出した位置(書き出すスレッドだけが進める) */
+    unsigned char *ring;
+    int active;
+    int stop;
+    long dropped;                  /* いっぱいで捨てた記録の数 */
+    long written;
+    int last_node, last_next, last_step;        /* 同じ位置を続けて記録しない */
+    FILE *fp;
+    pthread_t thread;
+    struct timespec origin;
+} routelog;
+
+//符号なし整数を7ビットずつ書く(最上位ビットが1なら続きがある)
+static void varint_put(FILE *fp, uint64_t v){
+    while(v >= 0x80){
+        putc((int)(v & 0x7f) | 0x80, fp);
+        v >>= 7;
+    }
+    putc((int)v, fp);
+}
+
+//符号付き整数は絶対値の小さいものが短くなるようにジグザグに並べ替えて書く
+static void varint_put_signed(FILE *fp, int64_t v){
+    varint_put(fp, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static int varint_get(FILE *fp, uint64_t *v){
+    int c, shift = 0;
+    *v = 0;
+    do{
+        c = getc(fp);
+        if(c == EOF || shift > 63){
+            return -1;
+        }
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    }while(c & 0x80);
+    return 0;
+}
+
+static int varint_get_signed(FILE *fp, int64_t *v){
+    uint64_t u;
+    if(varint_get(fp, &u) < 0){
+        return -1;
+    }
+    *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    return 0;
+}
+
+static void routelog_copy_out(size_t at, void *p, size_t bytes){
+    size_t first = RouteLogRing - (at & (RouteLogRing - 1));
+    if(first > bytes){
+        first = bytes;
+    }
+    memcpy(p, routelog.ring + (at & (RouteLogRing - 1)), first);
+    memcpy((char *)p + first, routelog.ring, bytes - first);
+}
+
+static void routelog_copy_in(size_t at, void const *p, size_t bytes){
+    size_t first = RouteLogRing - (at & (RouteLogRing - 1));
+    if(first > bytes){
+        first = bytes;
+    }
+    memcpy(routelog.ring + (at & (RouteLogRing - 1)), p, first);
+    memcpy(routelog.ring, (char const *)p + first, bytes - first);
+}
+
+//リングから取り出して、時間と交差点番号を差分の可変長整数にして書き出すスレッド
+static void *routelog_writer(void *arg){
+    RouteLogEvent e;
+    uint64_t last_time = 0;
+    int last_vehicle = 0, node, prev, k, stop;
+    size_t head, tail = routelog.tail;
+    struct timespec nap = {0, 2000000};
+
+    while(1){
+        stop = __atomic_load_n(&routelog.stop, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&routelog.head, __ATOMIC_ACQUIRE);
+        if(tail == head){
+            if(stop){
+                break;
+            }
+            nanosleep(&nap, NULL);      /* 記録する側は待たせないので、こちらが見に行く */
+            continue;
+        }
+        map_enter();
+        while(tail != head){
+            routelog_copy_out(tail, &e, sizeof(e));
+            tail += sizeof(e);
+            //ファイルには交差点番号(ID)で書く(並べ替えた地図でも再実行できる)
+            e.start = cross[e.start].id;
+            e.goal = (e.goal < 0) ? e.goal : cross[e.goal].id;
+            putc(e.type, routelog.fp);
+            varint_put(routelog.fp, e.time_us - last_time);
+            last_time = e.time_us;
+            if(e.type == ROUTELOG_ROUTE){
+                putc(e.metric | (e.turn_mode << 1), routelog.fp);
+                fwrite(&e.speed, sizeof(double), 1, routelog.fp);
+                fwrite(&e.cost, sizeof(double), 1, routelog.fp);
+                varint_put(routelog.fp, e.start);
+                varint_put_signed(routelog.fp, (int64_t)e.goal - e.start);
+                varint_put(routelog.fp, e.count);
+                for(k = 0, prev = e.start; k < e.count; ++k, prev = node){
+                    routelog_copy_out(tail, &node, sizeof(int));
+                    tail += sizeof(int);
+                    node = cross[node].id;
+                    varint_put_signed(routelog.fp, (int64_t)node - prev);
+                }
+            }
+            else{
+                varint_put_signed(routelog.fp, (int64_t)e.start - last_vehicle);
+                varint_put_signed(routelog.fp, (int64_t)e.goal - e.start);
+                varint_put(routelog.fp, e.count);
+                last_vehicle = e.start;
+            }
+            routelog.written++;
+        }
+        map_leave();
+        __atomic_store_n(&routelog.tail, tail, __ATOMIC_RELEASE);
+    }
+    map_detach();
+    return NULL;
+}
+
+//記録を始める関数
+static int routelog_open(char const *filename, int crossing_number){
+    routelog.fp = fopen(filename, "wb");
+    if(routelog.fp == NULL){
+        perror(filename);
+        return -1;
+    }
+    routelog.ring = malloc(RouteLogRing);
+    if(routelog.ring == NULL){
+        fclose(routelog.fp);
+        return -1;
+    }
+    fwrite(ROUTELOG_MAGIC, 1, 4, routelog.fp);
+    putc(ROUTELOG_VERSION, routelog.fp);
+    varint_put(routelog.fp, crossing_number);
+    routelog.head = routelog.tail = 0;
+    routelog.stop = 0;
+    routelog.last_node = -2;
+    clock_gettime(CLOCK_MONOTONIC, &routelog.origin);
+    if(map_thread_create(&routelog.thread, routelog_writer, NULL) != 0){
+        fprintf(stderr, "%s: couldn't start writer thread\n", filename);
+        fclose(routelog.fp);
+        free(routelog.ring);
+        return -1;
+    }
+    routelog.active = 1;
+    return 0;
+}
+
+//残りを書き出して記録を終える関数(記録していなければ何もしない)
+static void routelog_close(void){
+    if(!routelog.active){
+        return;
+    }
+    routelog.active = 0;
+    __atomic_store_n(&routelog.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(routelog.thread, NULL);
+    fclose(routelog.fp);
+    free(routelog.ring);
+    printf("記録した件数: %ld  (書き出しが追いつかず捨てた件数: %ld)\n", routelog.written, routelog.dropped);
+}
+
+//記録をリングに入れる関数(いっぱいなら捨てる)
+static void routelog_push(RouteLogEvent *e, int const path[]){
+    size_t need = sizeof(*e) + sizeof(int) * (e->type == ROUTELOG_ROUTE ? e->count : 0);
+    size_t head = routelog.head;
+    size_t tail = __atomic_load_n(&routelog.tail, __ATOMIC_ACQUIRE);
+
+    if(need > RouteLogRing - (head - tail)){
+        routelog.dropped++;
+        return;
+    }
+    e->time_us = (uint64_t)(elapsed_ms(&routelog.origin) * 1000);
+    routelog_copy_in(head, e, sizeof(*e));
+    if(e->type == ROUTELOG_ROUTE){
+        routelog_copy_in(head + sizeof(*e), path, sizeof(int) * e->count);
+    }
+    __atomic_store_n(&routelog.head, head + need, __ATOMIC_RELEASE);
+}
+
+//経路探索の要求と結果を記録する(pathがNULLなら見つからなかった)
+static void routelog_route(int start, int goal, int metric, double speed, int const path[]){
+    RouteLogEvent e;
+    int n = 0;
+
+    if(!routelog.active){
+        return;
+    }
+    if(path != NULL){
+        while(path[n] != -1){
+            n++;
+        }
+    }
+    memset(&e, 0, sizeof(e));
+    e.type = ROUTELOG_ROUTE;
+    e.metric = metric;
+    e.turn_mode = turn_mode;
+    e.start = start;
+    e.goal = goal;
+    e.count = n;
+    e.speed = speed;
+    e.cost = (path == NULL) ? -1 : (metric == 0) ? calculate_distance((int *)path) : calculate_time((int *)path, speed);
+    routelog_push(&e, path);
+}
+
+//移動体の位置(経路上のit番目の道路のstepステップ目)を記録する(前と同じなら記録しない)
+static void routelog_vehicle(int const path[], int it, int step){
+    RouteLogEvent e;
+    int next = (path[it] == -1) ? -1 : path[it + 1];
+
+    if(!routelog.active || path[it] == -1
+       || (path[it] == routelog.last_node && next == routelog.last_next && step == routelog.last_step)){
+        return;
+    }
+    routelog.last_node = path[it];
+    routelog.last_next = next;
+    routelog.last_step = step;
+    memset(&e, 0, sizeof(e));
+    e.type = ROUTELOG_VEHICLE;
+    e.start = path[it];
+    e.goal = next;
+    e.count = step;
+    routelog_push(&e, NULL);
+}
+
+//出発地から目的地までの経路を決める関数(metric 0:最短距離 1:最短時間)
+//右左折を考慮するときは道路を状態とする探索、しないときは交差点ごとの探索を使う
+static int route_path(int crossing_number, int start, int goal, int metric, double speed,
+                      int path[], int maxpath){
+    static SearchContext context;   /* 経路探索スレッドから呼ぶ(同時には1つだけ)ので1つを使い回す */
+    int result;
+    if(turn_mode == 1){
+        return (dijkstra_turn(&context, crossing_number, start, goal, metric, speed, path, maxpath) < 0) ? -1 : 0;
+    }
+    //出発地で打ち切るA*で求める(評価値は逐次版と同じ)
+    //全交差点を求めるΔステッピング法は大きな地図でも打ち切れる分だけ遅いので、全交差点の評価値が要る処理だけで使う
+    if(metric == 0){
+        result = route_search_distance_heap(&context, crossing_number, goal, start, speed);
+    }
+    else{
+        result = route_search_time_heap(&context, crossing_number, goal, start, speed);
+    }
+    if(result < 0){     /* ヒープが確保できなければヒープのいらない選び方で求める */
+        if(metric == 0){
+            result = route_search_distance_scan(&context, crossing_number, goal, -1, speed);
+        }
+        else{
+            result = route_search_time_scan(&context, crossing_number, goal, -1, speed);
+        }
+    }
+    if(result < 0){
+        return -1;
+    }
+    return route_pickup(&context, start, goal, path, maxpath);
+}
+
+//経路探索スレッド
+//画面のスレッドは要求を置くだけで、探索の間も今の経路でアニメーションを続ける
+//新しい要求が来たら古い要求は取り消す(探索中なら、終わった結果を捨てる)
+//route_pathを呼ぶのはこのスレッドだけにする(探索の作業領域を使い回すため)
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    int crossing_number;
+    int path_size;                 /* 結果の経路の大きさ */
+    //要求(lockで守る)
+    unsigned request;              /* 最新の要求の番号 */
+    int start, goal, metric;
+    double speed;
+    int quit;
+    //結果
+    int *path, *path_sub;          /* 探索中の経路 */
+    int *ready_path, *ready_sub;   /* 公開した経路(lockで守る) */
+    int ready_found;               /* 公開した経路が見つかったか */
+    int ready_start, ready_goal, ready_metric;
+    double ready_speed;
+    unsigned ready;                /* 公開した結果の要求番号(原子的に読み書きする) */
+    unsigned taken;                /* 画面のスレッドが受け取った結果の要求番号 */
+} RouteWorker;
+
+static void *route_worker_main(void *arg){
+    RouteWorker *w = arg;
+    unsigned request, done = 0;
+    int start, goal, metric, found, *swap;
+    double speed;
+
+    pthread_mutex_lock(&w->lock);
+    while(1){
+        while(!w->quit && w->request == done){
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        if(w->quit){
+            break;
+        }
+        request = done = w->request;
+        start = w->start;
+        goal = w->goal;
+        metric = w->metric;
+        speed = w->speed;
+        pthread_mutex_unlock(&w->lock);
+        map_enter();        /* 2つの経路は同じ版の地図で求める */
+
+        //pathは指定した評価値、path_subはもう一方の評価値で求める(間に新しい要求が来たら取り消す)
+        found = route_path(w->crossing_number, start, goal, metric, speed, w->path, w->path_size) == 0;
+        PROF_PRINT_QUERY();
+        if(found && __atomic_load_n(&w->request, __ATOMIC_ACQUIRE) == request){
+            found = route_path(w->crossing_number, start, goal, 1 - metric, speed, w->path_sub, w->path_size) == 0;
+            PROF_PRINT_QUERY();
+        }
+        PROF_PUBLISH_QUERY();
+        map_leave();
+
+        pthread_mutex_lock(&w->lock);
+        if(w->request != request){
+            continue;       /* 取り消された */
+        }
+        swap = w->ready_path;
+        w->ready_path = w->path;
+        w->path = swap;
+        swap = w->ready_sub;
+        w->ready_sub = w->path_sub;
+        w->path_sub = swap;
+        w->ready_found = found;
+        w->ready_start = start;
+        w->ready_goal = goal;
+        w->ready_metric = metric;
+        w->ready_speed = speed;
+        __atomic_store_n(&w->ready, request, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    map_detach();
+    return NULL;
+}
+
+static int route_worker_start(RouteWorker *w, int crossing_number){
+    int k;
+    memset(w, 0, sizeof(*w));
+    w->crossing_number = crossing_number;
+    w->path_size = 5 * crossing_number + 1;  /* 右左折を考えると同じ交差点を道路の数だけ通りうる */
+    w->path = malloc(sizeof(int) * w->path_size);
+    w->path_sub = malloc(sizeof(int) * w->path_size);
+    w->ready_path = malloc(sizeof(int) * w->path_size);
+    w->ready_sub = malloc(sizeof(int) * w->path_size);
+    if(w->path == NULL || w->path_sub == NULL || w->ready_path == NULL || w->ready_sub == NULL){
+        return -1;
+    }
+    for(k = 0; k < w->path_size; ++k){
+        w->path[k] = w->path_sub[k] = w->ready_path[k] = w->ready_sub[k] = -1;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_cond_init(&w->done, NULL);
+    return map_thread_create(&w->thread, route_worker_main, w) == 0 ? 0 : -1;
+}
+
+static void route_worker_stop(RouteWorker *w){
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->wake);
+    pthread_cond_destroy(&w->done);
+    free(w->path);
+    free(w->path_sub);
+    free(w->ready_path);
+    free(w->ready_sub);
+}
+
+//経路探索を頼む関数(前の要求はまだ終わっていなくても取り消す)
+static unsigned route_worker_post(RouteWorker *w, int start, int goal, int metric, double speed){
+    unsigned request;
+    pthread_mutex_lock(&w->lock);
+    w->start = start;
+    w->goal = goal;
+    w->metric = metric;
+    w->speed = speed;
+    request = w->request + 1;
+    __atomic_store_n(&w->request, request, __ATOMIC_RELEASE);
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    return request;
+}
+
+//まだ受け取っていない最新の結果があるか(画面のスレッドから毎フレーム呼ぶので、ロックは取らない)
+static int route_worker_ready(RouteWorker *w){
+    unsigned ready = __atomic_load_n(&w->ready, __ATOMIC_ACQUIRE);
+    return ready != w->taken && ready == __atomic_load_n(&w->request, __ATOMIC_ACQUIRE);
+}
+
+//最新の結果をpath(とpath_sub)の先頭から-1終端で写す関数(見つからなかったか入りきらなければ-1)
+//受け取った経路は記録中なら記録する(記録するのは画面のスレッドだけ)
+static int route_worker_take(RouteWorker *w, int path[], int path_sub[], int maxpath){
+    int n, m, result = -1;
+
+    pthread_mutex_lock(&w->lock);
+    w->taken = w->ready;
+    for(n = 0; w->ready_found && w->ready_path[n] != -1; ++n){
+    }
+    for(m = 0; w->ready_found && w->ready_sub[m] != -1; ++m){
+    }
+    if(w->ready_found && n < maxpath && m < maxpath){
+        memcpy(path, w->ready_path, sizeof(int) * (n + 1));
+        if(path_sub != NULL){
+            memcpy(path_sub, w->ready_sub, sizeof(int) * (m + 1));
+        }
+        result = 0;
+    }
+    routelog_route(w->ready_start, w->ready_goal, w->ready_metric, w->ready_speed, w->ready_found ? w->ready_path : NULL);
+    routelog_route(w->ready_start, w->ready_goal, 1 - w->ready_metric, w->ready_speed, w->ready_found ? w->ready_sub : NULL);
+    pthread_mutex_unlock(&w->lock);
+    return result;
+}
+
+//経路探索を頼んで、結果が届くまで待つ関数(メニューから使う)
+static int route_worker_run(RouteWorker *w, int start, int goal, int metric, double speed,
+                            int path[], int path_sub[], int maxpath){
+    unsigned request = route_worker_post(w, start, goal, metric, speed);
+    pthread_mutex_lock(&w->lock);
+    while(w->ready != request){
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return route_worker_take(w, path, path_sub, maxpath);
+}
+
+//巡回経路問題(経由地間の所要時間の表)
+typedef struct {
+    int crossing_number;
+    double speed;
+    int stop_number;               /* 経由地の数(0番目は現在地) */
+    int stops[MaxStops];           /* 経由地の交差点番号 */
+    int round_trip;                /* 1なら最後に現在地へ戻る */
+    double cost[MaxStops][MaxStops]; /* cost[a][b] : 経由地aからbまでの所要時間[分] */
+} TourProblem;
+
+//各スレッドに渡す作業内容
+typedef struct {
+    TourProblem *problem;
+    int first, step;               /* 担当する番号 first, first+step, ... */
+    int order[MaxStops + 1];       /* 見つけた巡回順序 */
+    double best;                   /* その所要時間 */
+} TourWorker;
+
+//所要時間表の1列(経由地bへ向かう時間)を計算するスレッド
+static void *tour_matrix_worker(void *arg){
+    TourWorker *w = arg;
+    TourProblem *p = w->problem;
+    SearchContext context = {0};
+    int a, b;
+
+    for(b = w->first; b < p->stop_number; b += w->step){
+        dijkstra_time_heap(&context, p->crossing_number, p->stops[b], p->speed, p->stops, p->stop_number);
+        for(a = 0; a < p->stop_number; ++a){
+            //現在地の交差点の待ち時間は考慮しないものとする(calculate_timeと同じ)
+            p->cost[a][b] = (a == b) ? 0 : search_label(&context, p->stops[a]) - cross[p->stops[a]].wait;
+        }
+    }
+    search_free(&context);
+    return NULL;
+}
+
+//経由地aからbへの所要時間(bが-1なら巡回の終わり)
+static double tour_leg(TourProblem const *p, int a, int b){
+    if(b == -1){
+        return p->round_trip ? p->cost[a][0] : 0.0;
+    }
+    return p->cost[a][b];
+}
+
+//巡回順序全体の所要時間
+static double tour_cost(TourProblem const *p, int const order[]){
+    int i;
+    double all_time = 0.0;
+    for(i = 0; i < p->stop_number; ++i){
+        all_time += tour_leg(p, order[i], order[i + 1]);
+    }
+    return all_time;
+}
+
+//2-opt : 区間order[i..j]を反転して短くなるなら反転する
+//反転区間内の向きが変わるので、前向きと後ろ向きの累積時間を使って差分を求める
+static int tour_two_opt(TourProblem const *p, int order[]){
+    int i, j, k, tmp;
+    int n = p->stop_number;
+    double fwd[MaxStops + 1], bwd[MaxStops + 1];
+    double delta;
+
+    fwd[0] = bwd[0] = 0.0;
+    for(k = 0; k + 1 < n; ++k){
+        fwd[k + 1] = fwd[k] + p->cost[order[k]][order[k + 1]];
+        bwd[k + 1] = bwd[k] + p->cost[order[k + 1]][order[k]];
+    }
+    for(i = 1; i < n - 1; ++i){
+        for(j = i + 1; j < n; ++j){
+            delta = p->cost[order[i - 1]][order[j]] + tour_leg(p, order[i], order[j + 1])
+                  + (bwd[j] - bwd[i])
+                  - p->cost[order[i - 1]][order[i]] - tour_leg(p, order[j], order[j + 1])
+                  - (fwd[j] - fwd[i]);
+            if(delta < -1e-9){
+                for(k = 0; k < (j - i + 1) / 2; ++k){
+                    tmp = order[i + k];
+                    order[i + k] = order[j - k];
+                    order[j - k] = tmp;
+                }
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//Or-opt : 長さ1～3の区間を向きを変えずに別の位置へ移して短くなるなら移す
+static int tour_or_opt(TourProblem const *p, int order[]){
+    int i, len, q, k;
+    int n = p->stop_number;
+    int seg[3];
+    double removed, inserted;
+
+    for(len = 1; len <= 3; ++len){
+        for(i = 1; i + len <= n; ++i){
+            //区間order[i..i+len-1]を抜いたときに減る時間
+            removed = p->cost[order[i - 1]][order[i]] + tour_leg(p, order[i + len - 1], order[i + len])
+                    - tour_leg(p, order[i - 1], order[i + len]);
+            for(q = 0; q < n; ++q){
+                if(q >= i - 1 && q < i + len){
+                    continue;   /* 区間の中や元の位置には入れない */
+                }
+                //order[q]とorder[q+1]の間に入れたときに増える時間
+                inserted = p->cost[order[q]][order[i]] + tour_leg(p, order[i + len - 1], order[q + 1])
+                         - tour_leg(p, order[q], order[q + 1]);
+                if(inserted - removed < -1e-9){
+                    for(k = 0; k < len; ++k){
+                        seg[k] = order[i + k];
+                    }
+                    if(q < i){
+                        memmove(&order[q + 1 + len], &order[q + 1], sizeof(int) * (i - q - 1));
+                        memcpy(&order[q + 1], seg, sizeof(int) * len);
+                    }
+                    else{
+                        memmove(&order[i], &order[i + len], sizeof(int) * (q + 1 - i - len));
+                        memcpy(&order[q + 1 - len], seg, sizeof(int) * len);
+                    }
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+//最近傍法で初期解を作り、2-optとOr-optで改善するスレッド
+//スレッドごとに2番目に訪れる経由地を変えて、複数の初期解から探す
+static void *tour_search_worker(void *arg){
+    TourWorker *w = arg;
+    TourProblem const *p = w->problem;
+    int n = p->stop_number;
+    int order[MaxStops + 1];
+    char used[MaxStops];
+    int second, i, k, best_k;
+    double c;
+
+    w->best = 1e100;
+    for(second = w->first; second < n; second += w->step){
+        memset(used, 0, sizeof(used));
+        order[0] = 0;
+        order[1] = second;
+        used[0] = used[second] = 1;
+        for(i = 2; i < n; ++i){
+            best_k = 0;     /* 0番目(現在地)は使用済みなので未選択の印になる */
+            for(k = 1; k < n; ++k){
+                if(!used[k] && (best_k == 0 || p->cost[order[i - 1]][k] < p->cost[order[i - 1]][best_k])){
+                    best_k = k;
+                }
+            }
+            order[i] = best_k;
+            used[best_k] = 1;
+        }
+        order[n] = -1;      /* 番兵 */
+
+        while(tour_two_opt(p, order) || tour_or_opt(p, order)){
+        }
+
+        c = tour_cost(p, order);
+        if(c < w->best){
+            w->best = c;
+            memcpy(w->order, order, sizeof(order));
+        }
+    }
+    return NULL;
+}
+
+//巡回経路の各区間(経由地から次の経由地まで)の経路を求めるスレッド
+typedef struct {
+    TourProblem const *problem;
+    int const *order;
+    int first, step;
+    int **leg;                     /* 区間ごとの経路(-1終端、戻らない場合の最後の区間はNULL) */
+    int failed;                    /* たどり着けないかメモリが足りない区間があった */
+} LegWorker;
+
+static void *tour_leg_worker(void *arg){
+    LegWorker *w = arg;
+    TourProblem const *p = w->problem;
+    SearchContext context = {0};
+    int k, a, b, c, i;
+
+    w->failed = 0;
+    for(k = w->first; k < p->stop_number; k += w->step){
+        w->leg[k] = NULL;
+        if(k == p->stop_number - 1 && !p->round_trip){
+            continue;
+        }
+        a = p->stops[w->order[k]];
+        b = p->stops[(k == p->stop_number - 1) ? 0 : w->order[k + 1]];
+        dijkstra_time_heap(&context, p->crossing_number, b, p->speed, &a, 1);
+        i = 2;
+        for(c = a; c != -1 && c != b; c = search_previous(&context, c)){
+            i++;
+        }
+        if(c != b || (w->leg[k] = malloc(sizeof(int) * i)) == NULL){
+            w->failed = 1;      /* 道路のないところをつながない */
+            continue;
+        }
+        i = 0;
+        for(c = a; c != -1 && c != b; c = search_previous(&context, c)){
+            w->leg[k][i++] = c;
+        }
+        w->leg[k][i++] = b;
+        w->leg[k][i] = -1;
+    }
+    search_free(&context);
+    return NULL;
+}
+
+//複数の経由地を巡回する最短時間の経路を求める関数
+//stops[0]は現在地で固定し、残りの訪問順序を決めてroute[]に-1終端でつなぐ
+//戻り値は経路の合計時間[分]、失敗したら負の値
+static double multi_stop_route(int crossing_number, int const stops[], int stop_number,
+                               int round_trip, double speed, int route[], int routemax, int order_out[]){
+    static TourProblem problem;
+    int *leg[MaxStops];
+    TourWorker worker[MaxThreads];
+    LegWorker leg_worker[MaxThreads];
+    int threads, t, k, i, r = 0, best_t = 0;
+
+    if(stop_number < 2 || stop_number > MaxStops){
+        return -1;
+    }
+    problem.crossing_number = crossing_number;
+    problem.speed = speed;
+    problem.stop_number = stop_number;
+    problem.round_trip = round_trip;
+    memcpy(problem.stops, stops, sizeof(int) * stop_number);
+
+    //経由地間の所要時間表(経由地ごとに並列)
+    threads = worker_count(stop_number);
+    for(t = 0; t < threads; ++t){
+        worker[t].problem = &problem;
+        worker[t].first = t;
+        worker[t].step = threads;
+    }
+    map_thread_run(threads, tour_matrix_worker, worker, sizeof(worker[0]));
+    for(k = 1; k < stop_number; ++k){
+        if(problem.cost[0][k] > 1e99){
+            return -1;      /* たどり着けない経由地がある */
+        }
+    }
+
+    //訪問順序の決定(2番目の経由地ごとに並列)
+    threads = worker_count(stop_number - 1);
+    for(t = 0; t < threads; ++t){
+        worker[t].problem = &problem;
+        worker[t].first = t + 1;
+        worker[t].step = threads;
+    }
+    map_thread_run(threads, tour_search_worker, worker, sizeof(worker[0]));
+    for(t = 0; t < threads; ++t){
+        if(worker[t].best < worker[best_t].best){
+            best_t = t;
+        }
+    }
+    if(worker[best_t].best >= 1e99){
+        return -1;          /* 経由地の間にたどり着けない区間がある */
+    }
+
+    //区間ごとの経路を求めてつなげる(区間ごとに並列)
+    threads = worker_count(stop_number);
+    for(t = 0; t < threads; ++t){
+        leg_worker[t].problem = &problem;
+        leg_worker[t].order = worker[best_t].order;
+        leg_worker[t].first = t;
+        leg_worker[t].step = threads;
+        leg_worker[t].leg = leg;
+    }
+    map_thread_run(threads, tour_leg_worker, leg_worker, sizeof(leg_worker[0]));
+    for(t = 0; t < threads; ++t){
+        if(leg_worker[t].failed){
+            r = -1;
+        }
+    }
+    if(r < 0){
+        for(k = 0; k < stop_number; ++k){
+            free(leg[k]);
+        }
+        return -1;
+    }
+    for(k = 0; k < stop_number; ++k){
+        if(leg[k] == NULL){
+            continue;       /* 現在地に戻らない場合の最後の区間 */
+        }
+        //つなぎ目の交差点は二重に入れない
+        for(i = (k == 0) ? 0 : 1; leg[k][i] != -1 && r < routemax - 1; ++i){
+            route[r++] = leg[k][i];
+        }
+        if(leg[k][i] != -1){
+            r = -1;         /* routeに入りきらない */
+        }
+        free(leg[k]);
+        if(r < 0){
+            for(k++; k < stop_number; ++k){
+                free(leg[k]);
+            }
+            return -1;
+        }
+    }
+    route[r] = -1;
+
+    for(k = 0; k < stop_number; ++k){
+        order_out[k] = stops[worker[best_t].order[k]];
+    }
+    return worker[best_t].best;
+}
+
+//巡回する経由地を入力する関数
+//戻り値は経由地の数、入力をやめたら-1
+static int input_stops(int crossing_number, int stops[], int *round_trip){
+    int stop_number, method, k, c;
+
+    printf("経由地の数を入力してください(現在地を含めて2～%d)\n", MaxStops);
+    printf("input>");
+    menu_scanf("%d", &stop_number);
+    if(stop_number < 2 || stop_number > MaxStops || stop_number > crossing_number){
+        printf("その数は入力できません。\n");
+        return -1;
+    }
+    printf("経由地をどのように設定しますか\n");
+    printf("1.日本語 2. ローマ字 3. 交差点ID 4. ランダム\n");
+    printf("input>");
+    menu_scanf("%d", &method);
+    if(method < 1 || method > 4){
+        printf("無効な入力です\n");
+        return -1;
+    }
+    if(method == 4){
+        srand(time(NULL));
+    }
+    for(k = 0; k < stop_number; ++k){
+        if(method == 4){
+            //重ならないように選ぶ
+            do{
+                stops[k] = rand() % crossing_number;
+                for(c = 0; c < k && stops[c] != stops[k]; ++c){
+                }
+            }while(c < k);
+        }
+        else{
+            if(k == 0){
+                printf("現在地を入力します\n");
+            }
+            else{
+                printf("%d番目の経由地を入力します\n", k);
+            }
+            if(method == 1){
+                stops[k] = search_cross_ja(crossing_number);
+            }
+            else if(method == 2){
+                stops[k] = search_cross_en(crossing_number);
+            }
+            else{
+                stops[k] = search_cross_id(crossing_number);
+            }
+            if(stops[k] == -1){
+                return -1;
+            }
+        }
+        printf("%sを'%s  %s'と設定します\n", (k == 0) ? "現在地" : "経由地",
+               cross[stops[k]].jname, cross[stops[k]].ename);
+    }
+    printf("最後に現在地へ戻りますか\n");
+    printf("1.戻る Another number.戻らない\n");
+    printf("input>");
+    menu_scanf("%d", &c);
+    *round_trip = (c == 1);
+    return stop_number;
+}
+
+//到達圏の道路(交差点fromからtoへ向かう道路のratioの割合まで到達できる)
+typedef struct {
+    int from, to;
+    double ratio;                  /* 1.0なら道路全体 */
+} IsoEdge;
+
+//到達圏の探索結果
+typedef struct {
+    int origin;                    /* 出発地 */
+    int metric;                    /* 0:距離[km] 1:時間[分] */
+    double budget;                 /* 上限の距離または時間 */
+    int reach_number;              /* 到達できる交差点数 */
+    int *reach;                    /* 到達できる交差点番号(確定した順) */
+    double *cost;                  /* 出発地からの距離または時間(stampが一致するときだけ有効) */
+    int *previous;                 /* 出発地からの経路(直前の交差点番号) */
+    unsigned *stamp;               /* cost, previousが何回目の探索のものか */
+    unsigned epoch;                /* 探索の回数 */
+    int edge_number;               /* 到達圏の道路数 */
+    IsoEdge *edge;
+    HeapNode *heap;                /* 探索に使うヒープ */
+    int size;                      /* 配列を確保した交差点数 */
+} Isochrone;
+
+//到達圏の配列を交差点数に合わせて確保する関数(確保済みなら何もしない)
+static int isochrone_alloc(Isochrone *iso, int crossing_number){
+    if(iso->size == crossing_number){
+        return 0;
+    }
+    free(iso->reach); free(iso->cost); free(iso->previous);
+    free(iso->stamp); free(iso->edge); free(iso->heap);
+    iso->reach = malloc(sizeof(int) * crossing_number);
+    iso->cost = malloc(sizeof(double) * crossing_number);
+    iso->previous = malloc(sizeof(int) * crossing_number);
+    iso->stamp = calloc(crossing_number, sizeof(unsigned));
+    iso->edge = malloc(sizeof(IsoEdge) * crossing_number * 5);
+    iso->heap = malloc(sizeof(HeapNode) * (crossing_number * 5 + 1));
+    iso->epoch = 0;
+    iso->size = crossing_number;
+    if(!iso->reach || !iso->cost || !iso->previous || !iso->stamp || !iso->edge || !iso->heap){
+        iso->size = 0;
+        return -1;
+    }
+    return 0;
+}
+
+//交差点uからj番目の道路で隣へ進むときの評価値
+//出発地と到着地の待ち時間は含めない(calculate_timeと同じ)
+static double isochrone_step(Isochrone const *iso, int u, int j, double speed){
+    if(iso->metric == 0){
+        return cross[u].length[j];
+    }
+    return ((u == iso->origin) ? 0.0 : cross[u].wait) + cross[u].length[j] / (speed / 60);
+}
+
+//出発地から上限(budget)までに到達できる交差点と道路を求める関数
+//上限を超えた交差点は展開しないので、計算量は到達圏の広さに比例する
+//isoは使い回してよい(配列は初期化せず、epochで古い値を無効にする)
+static int isochrone_search(int crossing_number, int origin, int metric, double budget, double speed, Isochrone *iso){
+    HeapNode *heap;
+    int heap_size = 0;
+    HeapNode top;
+    int j, n, k;
+    double c, rest, step;
+    PROF_BEGIN(scope);
+
+    if(isochrone_alloc(iso, crossing_number) < 0){
+        return -1;
+    }
+    heap = iso->heap;
+    if(++iso->epoch == 0){
+        memset(iso->stamp, 0, sizeof(unsigned) * crossing_number);  /* 一周したら全部無効にする */
+        iso->epoch = 1;
+    }
+    iso->origin = origin;
+    iso->metric = metric;
+    iso->budget = budget;
+    iso->reach_number = 0;
+    iso->edge_number = 0;
+
+    iso->cost[origin] = 0;
+    iso->previous[origin] = -1;
+    iso->stamp[origin] = iso->epoch;
+    heap_push(heap, &heap_size, 0, origin);
+    while(heap_size > 0){
+        top = heap_pop(heap, &heap_size);
+        if(top.key > iso->cost[top.id]){
+            continue;       /* 古い要素は読み飛ばす */
+        }
+        iso->reach[iso->reach_number++] = top.id;
+        PROF_COUNT(settled, 1);
+        for(j = 0; j < cross[top.id].points; ++j){
+            n = cross[top.id].next[j];
+            c = top.key + isochrone_step(iso, top.id, j, speed);
+            if(c <= budget){
+                if(iso->stamp[n] != iso->epoch || iso->cost[n] > c){
+                    iso->cost[n] = c;
+                    iso->previous[n] = top.id;
+                    iso->stamp[n] = iso->epoch;
+                    heap_push(heap, &heap_size, c, n);
+                    PROF_COUNT(relaxed, 1);
+                }
+            }
+        }
+    }
+
+    //到達圏の道路(両端に届く道路は全体、片方だけなら届くところまで)
+    for(k = 0; k < iso->reach_number; ++k){
+        for(j = 0; j < cross[iso->reach[k]].points; ++j){
+            n = cross[iso->reach[k]].next[j];
+            if(iso->stamp[n] == iso->epoch && n < iso->reach[k]){
+                continue;   /* 両端に届く道路は番号の小さい方から一度だけ */
+            }
+            if(iso->stamp[n] == iso->epoch){
+                iso->edge[iso->edge_number].ratio = 1.0;
+            }
+            else{
+                rest = budget - iso->cost[iso->reach[k]];
+                step = isochrone_step(iso, iso->reach[k], j, speed);
+                if(metric == 1 && iso->reach[k] != origin){
+                    rest -= cross[iso->reach[k]].wait;  /* 信号待ちの間は進めない */
+                    step -= cross[iso->reach[k]].wait;
+                }
+                if(rest <= 0 || step <= 0){
+                    continue;
+                }
+                iso->edge[iso->edge_number].ratio = rest / step;
+            }
+            iso->edge[iso->edge_number].from = iso->reach[k];
+            iso->edge[iso->edge_number].to = n;
+            iso->edge_number++;
+        }
+    }
+    PROF_END(scope, "isochrone_search");
+    return 0;
+}
+
+//複数の出発地の到達圏を並列に求めるスレッド
+typedef struct {
+    int crossing_number;
+    int const *origins;
+    int origin_number;
+    int metric;
+    double budget, speed;
+    Isochrone *iso;
+    int first, step;
+} IsochroneWorker;
+
+static void *isochrone_worker(void *arg){
+    IsochroneWorker *w = arg;
+    int k;
+    for(k = w->first; k < w->origin_number; k += w->step){
+        isochrone_search(w->crossing_number, w->origins[k], w->metric, w->budget, w->speed, &w->iso[k]);
+    }
+    return NULL;
+}
+
+//複数の出発地の到達圏をまとめて求める関数(iso[]は出発地ごとに用意する)
+static void isochrone_batch(int crossing_number, int const origins[], int origin_number, int metric,
+                            double budget, double speed, Isochrone iso[]){
+    IsochroneWorker worker[MaxThreads];
+    int threads = worker_count(origin_number);
+    int t;
+
+    for(t = 0; t < threads; ++t){
+        worker[t].crossing_number = crossing_number;
+        worker[t].origins = origins;
+        worker[t].origin_number = origin_number;
+        worker[t].metric = metric;
+        worker[t].budget = budget;
+        worker[t].speed = speed;
+        worker[t].iso = iso;
+        worker[t].first = t;
+        worker[t].step = threads;
+    }
+    map_thread_run(threads, isochrone_worker, worker, sizeof(worker[0]));
+}
+
+//到達圏を表示する関数
+static void draw_isochrone(Isochrone const *iso){
+    int k;
+
+    glLineWidth(4.0);
+    glColor3d(1.0, 0.6, 0.0);
+    glBegin(GL_LINES);
+    for(k = 0; k < iso->edge_number; ++k){
+        road_vertices(iso->edge[k].from, iso->edge[k].to, iso->edge[k].ratio, 0.0);
+    }
+    glEnd();
+    glLineWidth(1.0);
+    for(k = 0; k < iso->reach_number; ++k){
+        draw_corn(cross[iso->reach[k]].pos.x, cross[iso->reach[k]].pos.y, 0.15, 0.05);
+    }
+}
+
+//到達圏の出発地と上限を入力する関数
+//戻り値は出発地の数、入力をやめたら-1
+static int input_isochrone(int crossing_number, int origins[], int *metric, double *budget){
+    int origin_number, method, k;
+
+    printf("出発地の数を入力してください(1～%d)\n", MaxStops);
+    printf("input>");
+    menu_scanf("%d", &origin_number);
+    if(origin_number < 1 || origin_number > MaxStops){
+        printf("その数は入力できません。\n");
+        return -1;
+    }
+    printf("出発地をどのように設定しますか\n");
+    printf("1.日本語 2. ローマ字 3. 交差点ID 4. ランダム\n");
+    printf("input>");
+    menu_scanf("%d", &method);
+    if(method < 1 || method > 4){
+        printf("無効な入力です\n");
+        return -1;
+    }
+    if(method == 4){
+        srand(time(NULL));
+    }
+    for(k = 0; k < origin_number; ++k){
+        if(method == 1){
+            origins[k] = search_cross_ja(crossing_number);
+        }
+        else if(method == 2){
+            origins[k] = search_cross_en(crossing_number);
+        }
+        else if(method == 3){
+            origins[k] = search_cross_id(crossing_number);
+        }
+        else{
+            origins[k] = rand() % crossing_number;
+        }
+        if(origins[k] == -1){
+            return -1;
+        }
+        printf("出発地を'%s  %s'と設定します\n", cross[origins[k]].jname, cross[origins[k]].ename);
+    }
+    printf("上限の種類を選んでください\n");
+    printf("1.時間[分] 2.距離[km]\n");
+    printf("input>");
+    menu_scanf("%d", &k);
+    if(k != 1 && k != 2){
+        printf("無効な入力です\n");
+        return -1;
+    }
+    *metric = (k == 1) ? 1 : 0;
+    printf("上限の値を入力してください\n");
+    printf("input>");
+    menu_scanf("%lf", budget);
+    if(*budget <= 0){
+        printf("その値は入力できません。\n");
+        return -1;
+    }
+    return origin_number;
+}
+
+//現在地から近い施設を探して、向かう施設を選ぶ関数
+//現在地をstartに入れ、選んだ施設の交差点を返す(やめたら-1)
+static int input_facility(int crossing_number, double speed, int *start){
+    static SearchContext context;
+    FacilityHit hit[MaxFacility];
+    int path_size = 5 * crossing_number + 1;
+    int *path;
+    int method, kind, k, found, i;
+    struct timespec begin;
+
+    printf("現在地をどのように設定しますか\n");
+    printf("1.日本語 2. ローマ字 3. 交差点ID 4. ランダム\n");
+    printf("input>");
+    menu_scanf("%d", &method);
+    if(method == 1){
+        *start = search_cross_ja(crossing_number);
+    }
+    else if(method == 2){
+        *start = search_cross_en(crossing_number);
+    }
+    else if(method == 3){
+        *start = search_cross_id(crossing_number);
+    }
+    else if(method == 4){
+        srand(time(NULL));
+        *start = rand() % crossing_number;
+    }
+    else{
+        printf("無効な入力です\n");
+        return -1;
+    }
+    if(*start == -1){
+        return -1;
+    }
+    printf("現在地を'%s  %s'と設定します\n", cross[*start].jname, cross[*start].ename);
+    printf("施設の種類を選んでください\n");
+    for(i = 0; i < FacilityKinds; ++i){
+        printf("%d.%s ", i + 1, facility_kind[i].jname);
+    }
+    printf("\ninput>");
+    menu_scanf("%d", &kind);
+    if(kind < 1 || kind > FacilityKinds){
+        printf("無効な入力です\n");
+        return -1;
+    }
+    printf("いくつ探しますか(1～%d)\n", MaxFacility);
+    printf("input>");
+    menu_scanf("%d", &k);
+    if(k < 1 || k > MaxFacility){
+        printf("その数は入力できません。\n");
+        return -1;
+    }
+    path = malloc(sizeof(int) * path_size);
+    if(path == NULL){
+        return -1;
+    }
+    //所要時間の近い順に探す
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    found = facility_nearest(&context, crossing_number, *start, 1u << (kind - 1), k, 1, speed, hit);
+    printf("施設の探索時間: %.2lfms (確定した状態 %d)\n", elapsed_ms(&begin), context.settled);
+    if(found <= 0){
+        printf("'%s'が見つかりませんでした\n", facility_kind[kind - 1].jname);
+        free(path);
+        return -1;
+    }
+    for(i = 0; i < found; ++i){
+        turn_path(&context, hit[i].state, path, path_size);
+        printf("%d. %s  %s  %.2lf分  %.2lfkm\n", i + 1, cross[hit[i].crossing].jname, cross[hit[i].crossing].ename,
+               hit[i].cost, calculate_distance(path));
+    }
+    free(path);
+    printf("どこへ向かいますか(番号、0で戻る)\n");
+    printf("input>");
+    menu_scanf("%d", &i);
+    if(i < 1 || i > found){
+        return -1;
+    }
+    return hit[i - 1].crossing;
+}
+
+//車両群の状態
+//位置の更新をまとめてベクトル化できるように、車両ごとの構造体ではなく項目ごとの配列で持つ
+typedef struct {
+    int number;                    /* 車両数 */
+    float *x, *y;                  /* 現在位置 */
+    float *dx, *dy;                /* 1ステップあたりの移動量 */
+    int *steps_left;               /* 今の道路の残りステップ数 */
+    int *leg;                      /* 経路上の何番目の道路か */
+    int *goal;                     /* 目的地 */
+    int stride;                    /* 1台あたりの経路の長さ(交差点数 + 1) */
+    int *route;                    /* 経路(車両ごとに stride 個ずつ、-1終端) */
+    float *vertex;                 /* 描画用の頂点配列(x, yの順) */
+    int *pending;                  /* 経路の計算待ちの車両 */
+    int pending_number;
+    long routed;                   /* 計算した経路の数 */
+    double route_ms;               /* 経路の計算にかかった時間の合計 */
+    SearchContext context[MaxThreads]; /* 経路を求めるスレッドごとの作業領域(フレームをまたいで使い回す) */
+} Fleet;
+
+//車両群を確保する関数
+static int fleet_alloc(Fleet *f, int number, int crossing_number){
+    memset(f, 0, sizeof(*f));
+    f->number = number;
+    f->stride = crossing_number + 1;
+    f->x = malloc(sizeof(float) * number);
+    f->y = malloc(sizeof(float) * number);
+    f->dx = malloc(sizeof(float) * number);
+    f->dy = malloc(sizeof(float) * number);
+    f->steps_left = malloc(sizeof(int) * number);
+    f->leg = malloc(sizeof(int) * number);
+    f->goal = malloc(sizeof(int) * number);
+    f->route = malloc(sizeof(int) * number * f->stride);
+    f->vertex = malloc(sizeof(float) * number * 2);
+    f->pending = malloc(sizeof(int) * number);
+    if(!f->x || !f->y || !f->dx || !f->dy || !f->steps_left || !f->leg
+       || !f->goal || !f->route || !f->vertex || !f->pending){
+        return -1;
+    }
+    return 0;
+}
+
+//車両群を解放する関数
+static void fleet_free(Fleet *f){
+    int t;
+    free(f->x); free(f->y); free(f->dx); free(f->dy);
+    free(f->steps_left); free(f->leg); free(f->goal);
+    free(f->route); free(f->vertex); free(f->pending);
+    for(t = 0; t < MaxThreads; ++t){
+        search_free(&f->context[t]);
+    }
+}
+
+//車両vを経路上のleg番目の道路に乗せる関数
+static int fleet_enter_leg(Fleet *f, int v){
+    int const *route = &f->route[(size_t)v * f->stride];
+    int a = route[f->leg[v]], b = route[f->leg[v] + 1];
+    double d = road_length(a, b);
+    int steps;
+
+    if(d == INFINITY){
+        return -1;      /* 道路がない */
+    }
+    //移動体と同じく、距離の大きさによってstepsの数を変える
+    if(d >= 0.05){
+        steps = (int)(d / 0.1);
+    }
+    else{
+        steps = (int)(d / 0.01);
+    }
+    if(steps < 1){
+        steps = 1;
+    }
+    f->x[v] = cross[a].pos.x;
+    f->y[v] = cross[a].pos.y;
+    f->dx[v] = (cross[b].pos.x - cross[a].pos.x) / steps;
+    f->dy[v] = (cross[b].pos.y - cross[a].pos.y) / steps;
+    f->steps_left[v] = steps;
+    return 0;
+}
+
+//経路の計算待ちの車両の経路を求めるスレッド
+typedef struct {
+    Fleet *fleet;
+    int crossing_number;
+    double speed;
+    int first, step;
+} FleetWorker;
+
+static void *fleet_route_worker(void *arg){
+    FleetWorker *w = arg;
+    Fleet *f = w->fleet;
+    SearchContext *context = &f->context[w->first];
+    int k, v, c, i, start;
+    int *route;
+
+    for(k = w->first; k < f->pending_number; k += w->step){
+        v = f->pending[k];
+        route = &f->route[(size_t)v * f->stride];
+        start = route[0];
+        dijkstra_time_heap(context, w->crossing_number, f->goal[v], w->speed, &start, 1);
+        i = 0;
+        for(c = start; c != -1 && c != f->goal[v]; c = search_previous(context, c)){
+            route[i++] = c;
+        }
+        if(c != f->goal[v]){
+            route[1] = -1;      /* たどり着けない(道路のないところは走らせない) */
+            continue;
+        }
+        route[i++] = f->goal[v];
+        route[i] = -1;
+    }
+    return NULL;
+}
+
+//車両vに現在地fromからの新しい目的地を決めて、計算待ちに入れる関数(交差点は2つ以上)
+static void fleet_new_goal(Fleet *f, int crossing_number, int v, int from){
+    int goal;
+    do{
+        goal = rand() % crossing_number;
+    }while(goal == from);
+    f->route[(size_t)v * f->stride] = from;
+    f->goal[v] = goal;
+    f->pending[f->pending_number++] = v;
+}
+
+//計算待ちの車両の経路をスレッドで分担して求め、走り出させる関数
+static void fleet_route_pending(Fleet *f, int crossing_number, double speed){
+    FleetWorker worker[MaxThreads];
+    struct timespec begin;
+    int threads, t, k, v, number;
+    int const *route;
+
+    if(f->pending_number == 0){
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    threads = worker_count(f->pending_number);
+    for(t = 0; t < threads; ++t){
+        worker[t].fleet = f;
+        worker[t].crossing_number = crossing_number;
+        worker[t].speed = speed;
+        worker[t].first = t;
+        worker[t].step = threads;
+    }
+    map_thread_run(threads, fleet_route_worker, worker, sizeof(worker[0]));
+    f->route_ms += elapsed_ms(&begin);
+    f->routed += f->pending_number;
+
+    //目的地にたどり着けなかった車両は、その場で止めて目的地を選び直す(次に呼ばれたときに求める)
+    number = f->pending_number;
+    f->pending_number = 0;
+    for(k = 0; k < number; ++k){
+        v = f->pending[k];
+        route = &f->route[(size_t)v * f->stride];
+        f->leg[v] = 0;
+        if(route[1] == -1 || fleet_enter_leg(f, v) < 0){
+            f->x[v] = cross[route[0]].pos.x;
+            f->y[v] = cross[route[0]].pos.y;
+            f->dx[v] = f->dy[v] = 0;
+            f->steps_left[v] = 1 << 30;
+            fleet_new_goal(f, crossing_number, v, route[0]);
+        }
+    }
+}
+
+//車両群を1ステップ進める関数
+static void fleet_step(Fleet *f, int crossing_number){
+    int n = f->number;
+    int v;
+    float *restrict x = f->x, *restrict y = f->y;
+    float const *restrict dx = f->dx, *restrict dy = f->dy;
+    int *restrict steps_left = f->steps_left;
+    int const *route;
+
+    //全車両の位置をまとめて更新する(分岐のないループなのでベクトル化される)
+    for(v = 0; v < n; ++v){
+        x[v] += dx[v];
+        y[v] += dy[v];
+        steps_left[v]--;
+    }
+
+    //交差点に着いた車両だけ次の道路へ、目的地に着いた車両は新しい目的地へ
+    for(v = 0; v < n; ++v){
+        if(steps_left[v] > 0){
+            continue;
+        }
+        route = &f->route[(size_t)v * f->stride];
+        f->leg[v]++;
+        if(route[f->leg[v] + 1] == -1 || fleet_enter_leg(f, v) < 0){
+            fleet_new_goal(f, crossing_number, v, route[f->leg[v]]);
+            f->steps_left[v] = 1 << 30;  /* 経路が決まるまで止めておく */
+            f->dx[v] = f->dy[v] = 0;
+        }
+    }
+}
+
+//車両群をまとめて描く関数(頂点配列で一度に描画する)
+static void fleet_show(Fleet *f){
+    int v;
+    for(v = 0; v < f->number; ++v){
+        f->vertex[2 * v + 0] = f->x[v];
+        f->vertex[2 * v + 1] = f->y[v];
+    }
+    glColor3d(0.3, 1.0, 1.0);
+    glPointSize(4.0);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(2, GL_FLOAT, 0, f->vertex);
+    glDrawArrays(GL_POINTS, 0, f->number);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glPointSize(1.0);
+}
+
+//車両群のシミュレーションを行う関数
+static int fleet_simulation(int crossing_number, int vehicle_number, double speed){
+    static Fleet fleet;
+    struct timespec begin;
+    double center_x = 0.0, center_y = 0.0;
+    double range_x = 0.0, range_y = 0.0, range_z = 10.0;
+    int width, height;
+    int v, frame = 0;
+    double step_ms = 0.0;
+
+    if(crossing_number < 2){
+        fprintf(stderr, "fleet: need at least 2 crossings\n");
+        return -1;
+    }
+    if(fleet_alloc(&fleet, vehicle_number, crossing_number) < 0){
+        fleet_free(&fleet);
+        fprintf(stderr, "couldn't allocate fleet\n");
+        return -1;
+    }
+
+    //全車両に出発地と目的地を決めて、経路を並列に求める
+    srand(time(NULL));
+    for(v = 0; v < vehicle_number; ++v){
+        fleet_new_goal(&fleet, crossing_number, v, rand() % crossing_number);
+    }
+    fleet_route_pending(&fleet, crossing_number, speed);
+    printf("%d台の経路の計算時間: %.2lfms\n", vehicle_number, fleet.route_ms);
+
+    //地図の中心から見下ろす
+    for(v = 0; v < crossing_number; ++v){
+        center_x += cross[v].pos.x / crossing_number;
+        center_y += cross[v].pos.y / crossing_number;
+    }
+
+    glfwInit();
+    glfwOpenWindow(1000, 800, 0, 0, 0, 0, 0, 0, GLFW_WINDOW);
+    while(1){
+        /* Esc が押されるかウィンドウが閉じられたらおしまい */
+        if (glfwGetKey(GLFW_KEY_ESC) || !glfwGetWindowParam(GLFW_OPENED)){
+            break;
+        }
+        //WASDで視点を移動、Eで視点が上昇、Qで視点が降下、Rでリセット
+        if(glfwGetKey(87)){
+            range_y = range_y + 0.5;
+        }
+        if(glfwGetKey(83)){
+            range_y = range_y - 0.5;
+        }
+        if(glfwGetKey(68)){
+            range_x = range_x + 0.5;
+        }
+        if(glfwGetKey(65)){
+            range_x = range_x - 0.5;
+        }
+        if(glfwGetKey(69)){
+            range_z = range_z + 0.5;
+        }
+        if(glfwGetKey(81)){
+            if(range_z >= 1.0){
+                range_z = range_z - 0.5;
+            }
+        }
+        if(glfwGetKey(82)){
+            range_x = 0; range_y = 0; range_z = 10.0;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        fleet_step(&fleet, crossing_number);
+        fleet_route_pending(&fleet, crossing_number, speed);
+        step_ms += elapsed_ms(&begin);
+        frame++;
+
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        gluPerspective(120.0,1.0,0,50);
+
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+        glTranslated(-range_x,-range_y,-range_z);
+        glTranslated(-center_x,-center_y,0);
+
+        glfwGetWindowSize(&width, &height); /* 現在のウィンドウサイズを取得する */
+        glViewport(0, 0, width, height); /* ウィンドウ全面をビューポートにする */
+
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT); /* バックバッファを黒で塗り潰す */
+
+        map_show(crossing_number, range_z * 0.005); /* 道路網の表示 */
+        fleet_show(&fleet);                       /* 車両群の表示 */
+
+        glfwSwapBuffers();  /* フロントバッファとバックバッファを入れ替える */
+        usleep(window_speed*1000);  //少しの時間
+    }
+    glfwTerminate();
+
+    printf("シミュレーションしたフレーム数: %d  1フレームの更新時間: %.3lfms\n",
+           frame, (frame > 0) ? step_ms / frame : 0.0);
+    printf("計算した経路の数: %ld  1経路あたり: %.3lfms\n",
+           fleet.routed, (fleet.routed > 0) ? fleet.route_ms / fleet.routed : 0.0);
+    fleet_free(&fleet);
+    return 0;
+}
+
+//-----------------------------ハブラベル------------------------------
+//経路はいらず費用(所要時間や距離)だけが欲しい問い合わせのために，交差点ごとのラベルを前もって作っておく
+//  出ラベル L_out(v) : vから重要な交差点(ハブ)hへの費用の表   入りラベル L_in(v) : ハブhからvへの費用の表
+//  sからgへの費用は，L_out(s)とL_in(g)に共通するハブのうち費用の合計が最小のもの
+//ラベルは重要度の高い交差点から順に，枝刈りしたダイクストラ法で作る(既にラベルで正しい費用が出る交差点から先は探さない)
+//費用の向きと待ち時間の扱いはdijkstra_time_heapと同じ(通った交差点の待ち時間を足し，出発地の待ち時間は含めない)
+//時間のラベルは作ったときの車の速度でしか使えない
+//メモリでは，ハブを重要度の順位(uint32)の昇順に並べた配列と，費用(float)の配列を別に持つ
+//各ラベルは番兵(HubNone，費用は無限大)を1つ以上付けてHubBlock個ずつにそろえるので，
+//問い合わせはHubBlock個どうしをまとめて比べながら進む併合になる(SSE2があれば4×4個を数命令で比べる)
+//ファイルには番兵を書かず，ハブの順位を前との差の可変長整数で書いて小さくする
+#define HUB_MAGIC   0x4c484e43  /* ラベルファイルの先頭の識別子 */
+#define HubBlock    4           /* ラベルをそろえる個数(SSE2の1命令で比べる数) */
+#define HubNone     UINT32_MAX  /* ラベルの終わりの番兵 */
+
+//作っている途中のラベル(交差点ごとに伸ばす)
+typedef struct {
+    uint32_t *hub;
+    double *cost;
+    int number, cap;
+} HubBuild;
+
+static struct {
+    int crossing_number;
+    unsigned version;              /* 作ったときの地図の版(費用が変わった版では使わない) */
+    double speed;                  /* 時間のラベルを作った車の速度 */
+    uint32_t *offset[2][2];        /* [評価値][0:出 1:入]  交差点vのラベルは offset[v]～offset[v+1]-1 (番兵を含み，HubBlockの倍数) */
+    uint32_t *hub[2][2];           /* ハブの順位(昇順) */
+    float *cost[2][2];             /* ハブとの間の費用 */
+    size_t entries[2][2];          /* 番兵を除いたハブの数の合計 */
+} hub;
+
+static void hub_free(void){
+    int m, d;
+    for(m = 0; m < 2; ++m){
+        for(d = 0; d < 2; ++d){
+            free(hub.offset[m][d]);
+            free(hub.hub[m][d]);
+            free(hub.cost[m][d]);
+        }
+    }
+    memset(&hub, 0, sizeof(hub));
+}
+
+//n個のハブのラベルに番兵を付けてHubBlock個ずつにそろえた長さ
+static size_t hub_padded(size_t n){
+    return (n + HubBlock) / HubBlock * HubBlock;
+}
+
+//ハブラベルが使うメモリ[バイト]
+static size_t hub_bytes(void){
+    size_t bytes = 0;
+    int m, d;
+    for(m = 0; m < 2; ++m){
+        for(d = 0; d < 2; ++d){
+            bytes += sizeof(uint32_t) * (hub.crossing_number + 1)
+                     + (sizeof(uint32_t) + sizeof(float)) * hub.offset[m][d][hub.crossing_number];
+        }
+    }
+    return bytes;
+}
+
+static int hub_append(HubBuild *b, uint32_t h, double cost){
+    uint32_t *p;
+    double *c;
+    if(b->number >= b->cap){
+        p = realloc(b->hub, sizeof(uint32_t) * (b->cap * 2 + 4));
+        if(p != NULL){
+            b->hub = p;
+        }
+        c = realloc(b->cost, sizeof(double) * (b->cap * 2 + 4));
+        if(c != NULL){
+            b->cost = c;
+        }
+        if(p == NULL || c == NULL){
+            return -1;
+        }
+        b->cap = b->cap * 2 + 4;
+    }
+    b->hub[b->number] = h;
+    b->cost[b->number] = cost;
+    b->number++;
+    return 0;
+}
+
+//交差点から出る道路の逆向き(vへ入ってくる道路)をCSR形式で作る関数
+static int hub_reverse(int crossing_number, int **roffset, int **rsource, double **rlength){
+    int v, j, n, edges = 0;
+    int *offset = calloc(crossing_number + 1, sizeof(int));
+
+    for(v = 0; v < crossing_number; ++v){
+        edges += cross[v].points;
+    }
+    *roffset = offset;
+    *rsource = malloc(sizeof(int) * (edges + 1));
+    *rlength = malloc(sizeof(double) * (edges + 1));
+    if(offset == NULL || *rsource == NULL || *rlength == NULL){
+        return -1;
+    }
+    for(v = 0; v < crossing_number; ++v){
+        for(j = 0; j < cross[v].points; ++j){
+            offset[cross[v].next[j] + 1]++;
+        }
+    }
+    for(v = 0; v < crossing_number; ++v){
+        offset[v + 1] += offset[v];
+    }
+    for(v = 0; v < crossing_number; ++v){
+        for(j = 0; j < cross[v].points; ++j){
+            n = offset[cross[v].next[j]]++;
+            (*rsource)[n] = v;
+            (*rlength)[n] = cross[v].length[j];
+        }
+    }
+    memmove(offset + 1, offset, sizeof(int) * crossing_number);
+    offset[0] = 0;
+    return 0;
+}
+
+//順を決めるための縮約中のグラフ(道路は両向きに通れるものとして，交差点ごとの隣と費用)
+typedef struct {
+    int *to;
+    double *cost;
+    int number, cap;
+} HubAdjacent;
+
+//隣を加える関数(既にあれば安い方の費用にする)
+static int hub_adjacent_add(HubAdjacent *a, int to, double cost){
+    int k;
+    int *t;
+    double *c;
+
+    for(k = 0; k < a->number; ++k){
+        if(a->to[k] == to){
+            a->cost[k] = fmin(a->cost[k], cost);
+            return 0;
+        }
+    }
+    if(a->number >= a->cap){
+        t = realloc(a->to, sizeof(int) * (a->cap * 2 + 4));
+        if(t != NULL){
+            a->to = t;
+        }
+        c = realloc(a->cost, sizeof(double) * (a->cap * 2 + 4));
+        if(c != NULL){
+            a->cost = c;
+        }
+        if(t == NULL || c == NULL){
+            return -1;
+        }
+        a->cap = a->cap * 2 + 4;
+    }
+    a->to[a->number] = to;
+    a->cost[a->number] = cost;
+    a->number++;
+    return 0;
+}
+
+//交差点vを取り除くときに要る近道の数を数える関数(addが1なら近道を加えて，vを隣から外す)
+//隣uから，vを通らずにHubWitness個まで確定させる探索で，vを通るより安い道(目撃)がなければ近道が要る
+#define HubWitness 64   /* 目撃を探すときに確定させる交差点数の上限 */
+static int hub_contract(SearchContext *ctx, HubAdjacent adjacent[], char const removed[], int crossing_number,
+                        int v, int add){
+    HubAdjacent *a = &adjacent[v];
+    int i, j, k, n, heap_size, settled, shortcuts = 0;
+    double via_max, via;
+    HeapNode top;
+
+    for(i = 0; i < a->number; ++i){
+        via_max = 0;
+        for(j = 0; j < a->number; ++j){
+            via_max = fmax(via_max, a->cost[i] + a->cost[j]);
+        }
+        if(search_begin(ctx, crossing_number) < 0){
+            return -1;
+        }
+        heap_size = 0;
+        settled = 0;
+        search_relax(ctx, &heap_size, a->to[i], 0, -1);
+        while(heap_size > 0 && settled < HubWitness){
+            top = heap_pop(ctx->heap, &heap_size);
+            if(top.key > ctx->label[top.id]){
+                continue;
+            }
+            if(top.key > via_max){
+                break;
+            }
+            settled++;
+            for(k = 0; k < adjacent[top.id].number; ++k){
+                n = adjacent[top.id].to[k];
+                if(n != v && !removed[n]){
+                    search_relax(ctx, &heap_size, n, top.key + adjacent[top.id].cost[k], top.id);
+                }
+            }
+        }
+        for(j = i + 1; j < a->number; ++j){
+            via = a->cost[i] + a->cost[j];
+            if(search_label(ctx, a->to[j]) > via){
+                shortcuts++;
+                if(add && (hub_adjacent_add(&adjacent[a->to[i]], a->to[j], via) < 0
+                           || hub_adjacent_add(&adjacent[a->to[j]], a->to[i], via) < 0)){
+                    return -1;
+                }
+            }
+        }
+    }
+    if(add){
+        //隣の表からvを外す
+        for(i = 0; i < a->number; ++i){
+            n = a->to[i];
+            for(k = 0; k < adjacent[n].number; ++k){
+                if(adjacent[n].to[k] == v){
+                    adjacent[n].number--;
+                    adjacent[n].to[k] = adjacent[n].to[adjacent[n].number];
+                    adjacent[n].cost[k] = adjacent[n].cost[adjacent[n].number];
+                    break;
+                }
+            }
+        }
+    }
+    return shortcuts;
+}
+
+//重要度の順を決める関数
+//縮約階層法と同じく，取り除いても近道の増えにくい交差点から順に取り除き，最後まで残ったものほど重要とする
+//(近道の数 - 隣の数 + 取り除かれた隣の数)の小さい順に取り除き，取り出したときに計算し直して遅延して更新する
+//順を決めるだけなので，近道そのものはラベルを作るときには使わない
+static int hub_order(SearchContext *ctx, int crossing_number, int metric, double speed, int order[]){
+    HubAdjacent *adjacent = calloc(crossing_number, sizeof(HubAdjacent));
+    char *removed = calloc(crossing_number, 1);
+    int *deleted = calloc(crossing_number, sizeof(int));
+    double *priority = malloc(sizeof(double) * crossing_number);
+    HeapNode *heap = NULL;
+    int heap_size = 0, heap_cap = 0, v, j, n, k, shortcuts, error = 0, left = crossing_number;
+    double per_km = (metric == 0) ? 1.0 : 1.0 / (speed / 60), c;
+    HeapNode top;
+
+    if(adjacent == NULL || removed == NULL || deleted == NULL || priority == NULL){
+        error = -1;
+    }
+    for(v = 0; v < crossing_number && error == 0; ++v){
+        for(j = 0; j < cross[v].points && error == 0; ++j){
+            n = cross[v].next[j];
+            c = cross[v].length[j] * per_km + ((metric == 1) ? cross[n].wait : 0);
+            if(n != v){
+                error = (hub_adjacent_add(&adjacent[v], n, c) < 0 || hub_adjacent_add(&adjacent[n], v, c) < 0) ? -1 : 0;
+            }
+        }
+    }
+    for(v = 0; v < crossing_number && error == 0; ++v){
+        shortcuts = hub_contract(ctx, adjacent, removed, crossing_number, v, 0);
+        priority[v] = shortcuts - adjacent[v].number;
+        error = (shortcuts < 0) ? -1 : heap_push_grow(&heap, &heap_size, &heap_cap, priority[v], v);
+    }
+    while(heap_size > 0 && error == 0){
+        top = heap_pop(heap, &heap_size);
+        if(removed[top.id] || top.key != priority[top.id]){
+            continue;
+        }
+        //計算し直して，まだ一番小さければ取り除く
+        shortcuts = hub_contract(ctx, adjacent, removed, crossing_number, top.id, 0);
+        priority[top.id] = shortcuts - adjacent[top.id].number + deleted[top.id];
+        if(shortcuts < 0){
+            error = -1;
+        }
+        else if(heap_size > 0 && priority[top.id] > heap[0].key){
+            error = heap_push_grow(&heap, &heap_size, &heap_cap, priority[top.id], top.id);
+        }
+        else{
+            if(hub_contract(ctx, adjacent, removed, crossing_number, top.id, 1) < 0){
+                error = -1;
+                break;
+            }
+            removed[top.id] = 1;
+            order[--left] = top.id;
+            for(k = 0; k < adjacent[top.id].number; ++k){
+                deleted[adjacent[top.id].to[k]]++;
+            }
+        }
+    }
+    for(v = 0; adjacent != NULL && v < crossing_number; ++v){
+        free(adjacent[v].to);
+        free(adjacent[v].cost);
+    }
+    free(adjacent);
+    free(removed);
+    free(deleted);
+    free(priority);
+    free(heap);
+    return (error == 0 && left == 0) ? 0 : -1;
+}
+
+//ハブv(順位r)から枝刈りしたダイクストラ法を行い，ラベルにvを加える関数
+//backwardが1なら各交差点からvへの費用を出ラベルに，0ならvから各交差点への費用を入りラベルに加える
+//tableにはvの反対側のラベルをハブの順位で引けるように広げておく(使ったら戻す)
+static int hub_prune_search(SearchContext *ctx, int crossing_number, HubBuild label[], HubBuild const *other,
+                            double table[], int v, uint32_t r, int backward, int metric, double speed,
+                            int const roffset[], int const rsource[], double const rlength[]){
+    int heap_size = 0, k, j, n, end, error = 0;
+    double per_km = (metric == 0) ? 1.0 : 1.0 / (speed / 60), c, q;
+    HeapNode top;
+    HubBuild *l;
+
+    if(search_begin(ctx, crossing_number) < 0){
+        return -1;
+    }
+    for(k = 0; k < other->number; ++k){
+        table[other->hub[k]] = other->cost[k];
+    }
+    search_relax(ctx, &heap_size, v, 0, -1);
+    while(heap_size > 0 && error == 0){
+        top = heap_pop(ctx->heap, &heap_size);
+        if(top.key > ctx->label[top.id]){
+            continue;
+        }
+        //今までのハブで同じかより安い費用が出るなら，ここから先は探さない
+        l = &label[top.id];
+        q = 1e300;
+        for(k = 0; k < l->number; ++k){
+            q = fmin(q, l->cost[k] + table[l->hub[k]]);
+        }
+        if(q <= top.key){
+            continue;
+        }
+        error = hub_append(l, r, top.key);
+        if(backward){
+            //dijkstra_time_heapと同じ向き(top.idから出る道路を逆にたどる)
+            for(j = 0; j < cross[top.id].points; ++j){
+                n = cross[top.id].next[j];
+                c = cross[top.id].length[j] * per_km + ((metric == 1) ? cross[n].wait : 0);
+                search_relax(ctx, &heap_size, n, top.key + c, top.id);
+            }
+        }
+        else{
+            end = roffset[top.id + 1];
+            for(j = roffset[top.id]; j < end; ++j){
+                c = rlength[j] * per_km + ((metric == 1) ? cross[top.id].wait : 0);
+                search_relax(ctx, &heap_size, rsource[j], top.key + c, top.id);
+            }
+        }
+    }
+    for(k = 0; k < other->number; ++k){
+        table[other->hub[k]] = 1e300;
+    }
+    return error;
+}
+
+//評価値metricのラベルを作る関数
+static int hub_build_metric(SearchContext *ctx, int crossing_number, int metric, double speed,
+                            int const roffset[], int const rsource[], double const rlength[]){
+    HubBuild *label[2];
+    int *order = malloc(sizeof(int) * crossing_number);
+    double *table = malloc(sizeof(double) * crossing_number);
+    int v, d, k, error = 0;
+    size_t at;
+
+    label[0] = calloc(crossing_number, sizeof(HubBuild));
+    label[1] = calloc(crossing_number, sizeof(HubBuild));
+    if(order == NULL || table == NULL || label[0] == NULL || label[1] == NULL
+       || hub_order(ctx, crossing_number, metric, speed, order) < 0){
+        error = -1;
+    }
+    for(v = 0; v < crossing_number && error == 0; ++v){
+        table[v] = 1e300;
+    }
+    //順位rのハブは order[r]
+    for(k = 0; k < crossing_number && error == 0; ++k){
+        error = hub_prune_search(ctx, crossing_number, label[0], &label[1][order[k]], table, order[k], (uint32_t)k,
+                                 1, metric, speed, roffset, rsource, rlength);
+        if(error == 0){
+            error = hub_prune_search(ctx, crossing_number, label[1], &label[0][order[k]], table, order[k], (uint32_t)k,
+                                     0, metric, speed, roffset, rsource, rlength);
+        }
+    }
+    //番兵を付けてHubBlock個ずつにそろえ，配列に詰める
+    for(d = 0; d < 2 && error == 0; ++d){
+        size_t total = 0;
+
+        hub.entries[metric][d] = 0;
+        for(v = 0; v < crossing_number; ++v){
+            hub.entries[metric][d] += label[d][v].number;
+            total += hub_padded(label[d][v].number);
+        }
+        hub.offset[metric][d] = malloc(sizeof(uint32_t) * (crossing_number + 1));
+        hub.hub[metric][d] = malloc(sizeof(uint32_t) * total);
+        hub.cost[metric][d] = malloc(sizeof(float) * total);
+        if(hub.offset[metric][d] == NULL || hub.hub[metric][d] == NULL || hub.cost[metric][d] == NULL
+           || total > UINT32_MAX){
+            error = -1;
+            break;
+        }
+        for(v = 0, at = 0; v < crossing_number; ++v){
+            size_t end = at + hub_padded(label[d][v].number);
+
+            hub.offset[metric][d][v] = (uint32_t)at;
+            for(k = 0; k < label[d][v].number; ++k, ++at){
+                hub.hub[metric][d][at] = label[d][v].hub[k];
+                hub.cost[metric][d][at] = (float)label[d][v].cost[k];
+            }
+            for(; at < end; ++at){
+                hub.hub[metric][d][at] = HubNone;
+                hub.cost[metric][d][at] = INFINITY;
+            }
+        }
+        hub.offset[metric][d][crossing_number] = (uint32_t)at;
+    }
+    for(d = 0; d < 2; ++d){
+        for(v = 0; label[d] != NULL && v < crossing_number; ++v){
+            free(label[d][v].hub);
+            free(label[d][v].cost);
+        }
+        free(label[d]);
+    }
+    free(order);
+    free(table);
+    return error;
+}
+
+//今の地図(cross[])から距離と時間(車の速度speed)のハブラベルを作る関数
+static int hub_build(int crossing_number, double speed){
+    SearchContext context = {0};
+    int *roffset = NULL, *rsource = NULL;
+    double *rlength = NULL;
+    int metric, error;
+
+    hub_free();
+    hub.crossing_number = crossing_number;
+    hub.version = map_version();
+    hub.speed = speed;
+    error = hub_reverse(crossing_number, &roffset, &rsource, &rlength);
+    for(metric = 0; metric < 2 && error == 0; ++metric){
+        error = hub_build_metric(&context, crossing_number, metric, speed, roffset, rsource, rlength);
+    }
+    free(roffset);
+    free(rsource);
+    free(rlength);
+    search_free(&context);
+    if(error < 0){
+        hub_free();
+    }
+    return error;
+}
+
+//ハブラベルでsからgへの費用を求める関数(metric 0:距離 1:時間，たどり着けなければ負)
+//2つのラベルはハブの順位の昇順なので，HubBlock個ずつの塊を比べ，最後のハブが小さい方(等しければ両方)を進める
+//どちらかの塊が番兵で始まるか，両方の塊に番兵が入ったら，もう共通のハブはない
+//SSE2では塊の一方を回しながら4×4組を一度に比べるので，1要素ずつの比較と前進の依存の鎖が4分の1になる
+static inline double hub_cost(int start, int goal, int metric){
+    uint32_t const *a = &hub.hub[metric][0][hub.offset[metric][0][start]];
+    uint32_t const *b = &hub.hub[metric][1][hub.offset[metric][1][goal]];
+    float const *ca = &hub.cost[metric][0][hub.offset[metric][0][start]];
+    float const *cb = &hub.cost[metric][1][hub.offset[metric][1][goal]];
+    float best = INFINITY;
+#ifdef __SSE2__
+    __m128 const inf = _mm_set1_ps(INFINITY);
+    __m128 best4 = inf, sum4, eq;
+    __m128i x4, y4;
+    uint32_t xmax, ymax;
+    int r;
+
+    if(start == goal){
+        return 0;
+    }
+    while(a[0] != HubNone && b[0] != HubNone){
+        x4 = _mm_loadu_si128((__m128i const *)a);
+        y4 = _mm_loadu_si128((__m128i const *)b);
+        sum4 = _mm_loadu_ps(cb);
+        for(r = 0; r < HubBlock; ++r){
+            eq = _mm_castsi128_ps(_mm_cmpeq_epi32(x4, y4));
+            sum4 = (r == 0) ? sum4 : _mm_shuffle_ps(sum4, sum4, _MM_SHUFFLE(0, 3, 2, 1));
+            best4 = _mm_min_ps(best4, _mm_or_ps(_mm_and_ps(eq, _mm_add_ps(_mm_loadu_ps(ca), sum4)),
+                                                _mm_andnot_ps(eq, inf)));
+            y4 = _mm_shuffle_epi32(y4, _MM_SHUFFLE(0, 3, 2, 1));
+        }
+        xmax = a[HubBlock - 1];
+        ymax = b[HubBlock - 1];
+        if(xmax == HubNone && ymax == HubNone){
+            break;
+        }
+        a += HubBlock * (xmax <= ymax);
+        ca += HubBlock * (xmax <= ymax);
+        b += HubBlock * (ymax <= xmax);
+        cb += HubBlock * (ymax <= xmax);
+    }
+    best4 = _mm_min_ps(best4, _mm_shuffle_ps(best4, best4, _MM_SHUFFLE(1, 0, 3, 2)));
+    best4 = _mm_min_ps(best4, _mm_shuffle_ps(best4, best4, _MM_SHUFFLE(2, 3, 0, 1)));
+    best = _mm_cvtss_f32(best4);
+#else
+    float sum;
+    uint32_t x, y;
+
+    if(start == goal){
+        return 0;
+    }
+    //SSE2がなければ1要素ずつ併合する(番兵の並びはそのまま使える)
+    while(1){
+        x = *a;
+        y = *b;
+        if(x == HubNone || y == HubNone){
+            break;
+        }
+        sum = *ca + *cb;
+        best = (x == y && sum < best) ? sum : best;
+        a += (x <= y);
+        ca += (x <= y);
+        b += (y <= x);
+        cb += (y <= x);
+    }
+#endif
+    if(best == INFINITY){
+        return -1;
+    }
+    //dijkstra_time_heapと同じく出発地の待ち時間は含めない
+    return (metric == 1) ? best - cross[start].wait : best;
+}
+
+//ハブラベルをファイルに書き出す関数
+//  先頭: 識別子，交差点数，車の速度
+//  [評価値][出・入]ごと，交差点ごとに: ハブの数(可変長)，ハブの順位の前との差(可変長)，費用(float)
+static int hub_write(char const *filename){
+    FILE *fp = fopen(filename, "wb");
+    uint32_t magic = HUB_MAGIC, h;
+    int m, d, v, n;
+    uint32_t k, end;
+
+    if(fp == NULL){
+        perror(filename);
+        return -1;
+    }
+    fwrite(&magic, sizeof(magic), 1, fp);
+    fwrite(&hub.crossing_number, sizeof(int), 1, fp);
+    fwrite(&hub.speed, sizeof(double), 1, fp);
+    for(m = 0; m < 2; ++m){
+        for(d = 0; d < 2; ++d){
+            for(v = 0; v < hub.crossing_number; ++v){
+                for(end = hub.offset[m][d][v]; hub.hub[m][d][end] != HubNone; ++end);   /* 番兵は書かない */
+                n = (int)(end - hub.offset[m][d][v]);
+                varint_put(fp, (uint64_t)n);
+                for(k = hub.offset[m][d][v], h = 0; k < end; ++k){
+                    varint_put(fp, hub.hub[m][d][k] - h);
+                    h = hub.hub[m][d][k];
+                }
+                fwrite(&hub.cost[m][d][hub.offset[m][d][v]], sizeof(float), n, fp);
+            }
+        }
+    }
+    if(fclose(fp) != 0){
+        perror(filename);
+        return -1;
+    }
+    return 0;
+}
+
+//ハブラベルのファイルを読み込む関数(交差点数が地図と違えば読まない)
+static int hub_read(char const *filename, int crossing_number){
+    FILE *fp = fopen(filename, "rb");
+    uint32_t magic = 0, h, *hubs;
+    float *costs;
+    int m, d, v, n, k, ok;
+    size_t at, cap;
+    uint64_t x;
+
+    if(fp == NULL){
+        return -1;
+    }
+    hub_free();
+    hub.version = map_version();
+    ok = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == HUB_MAGIC
+         && fread(&hub.crossing_number, sizeof(int), 1, fp) == 1 && hub.crossing_number == crossing_number
+         && fread(&hub.speed, sizeof(double), 1, fp) == 1;
+    for(m = 0; m < 2 && ok; ++m){
+        for(d = 0; d < 2 && ok; ++d){
+            cap = (size_t)crossing_number * 16;
+            hub.offset[m][d] = malloc(sizeof(uint32_t) * (crossing_number + 1));
+            hub.hub[m][d] = malloc(sizeof(uint32_t) * cap);
+            hub.cost[m][d] = malloc(sizeof(float) * cap);
+            ok = hub.offset[m][d] != NULL && hub.hub[m][d] != NULL && hub.cost[m][d] != NULL;
+            for(v = 0, at = 0; v < crossing_number && ok; ++v){
+                ok = varint_get(fp, &x) == 0 && x < (uint64_t)crossing_number;
+                n = (int)x;
+                if(ok && at + hub_padded(n) > cap){
+                    cap = (at + hub_padded(n)) * 2;
+                    hubs = realloc(hub.hub[m][d], sizeof(uint32_t) * cap);
+                    if(hubs != NULL){
+                        hub.hub[m][d] = hubs;
+                    }
+                    costs = realloc(hub.cost[m][d], sizeof(float) * cap);
+                    if(costs != NULL){
+                        hub.cost[m][d] = costs;
+                    }
+                    ok = hubs != NULL && costs != NULL;
+                }
+                hub.offset[m][d][v] = (uint32_t)at;
+                for(k = 0, h = 0; k < n && ok; ++k){
+                    ok = varint_get(fp, &x) == 0;
+                    h += (uint32_t)x;
+                    hub.hub[m][d][at + k] = h;
+                }
+                ok = ok && fread(&hub.cost[m][d][at], sizeof(float), n, fp) == (size_t)n;
+                for(k = n; k < (int)hub_padded(n) && ok; ++k){
+                    hub.hub[m][d][at + k] = HubNone;
+                    hub.cost[m][d][at + k] = INFINITY;
+                }
+                at += hub_padded(n);
+                hub.entries[m][d] += n;
+            }
+            if(ok){
+                hub.offset[m][d][crossing_number] = (uint32_t)at;
+            }
+        }
+    }
+    fclose(fp);
+    if(!ok){
+        fprintf(stderr, "%s: broken hub label file or different map\n", filename);
+        hub_free();
+        return -1;
+    }
+    return 0;
+}
+
+//ハブラベルを作って書き出し，読み直した費用をダイクストラ法と比べて，大きさと問い合わせの速さを表示する
+//  CarNavi hublabel [問い合わせ数] [地図ファイル] [ラベルファイル]
+static int hub_demo(int crossing_number, int queries, double speed, char const *filename){
+    SearchContext context = {0};
+    struct timespec begin;
+    struct stat st;
+    int k, s, g, metric, differ[2] = {0, 0};
+    int *pair = malloc(sizeof(int) * 2 * queries);
+    double a, b, error[2] = {0, 0}, ms[2] = {0, 0}, dijkstra_ms[2] = {0, 0}, sink = 0;
+    long checked[2] = {0, 0};
+
+    if(pair == NULL){
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if(hub_build(crossing_number, speed) < 0){
+        fprintf(stderr, "hublabel: couldn't allocate\n");
+        free(pair);
+        return 1;
+    }
+    printf("ハブラベルの作成: %.1lfms (交差点数 %d, 車の速度 %.1lfkm/h)\n", elapsed_ms(&begin), crossing_number, speed);
+    if(hub_write(filename) < 0 || hub_read(filename, crossing_number) < 0){
+        free(pair);
+        return 1;
+    }
+    stat(filename, &st);
+    printf("ラベルの大きさ(交差点あたりのハブの数): 距離 出 %.1lf 入 %.1lf  時間 出 %.1lf 入 %.1lf\n",
+           (double)hub.entries[0][0] / crossing_number, (double)hub.entries[0][1] / crossing_number,
+           (double)hub.entries[1][0] / crossing_number, (double)hub.entries[1][1] / crossing_number);
+    printf("メモリ %.2lfMB  ファイル %s %.2lfMB\n", hub_bytes() / 1e6, filename, st.st_size / 1e6);
+
+    //問い合わせの速さ(同じ組をまとめて引く)
+    srand(2);
+    for(k = 0; k < 2 * queries; ++k){
+        pair[k] = rand() % crossing_number;
+    }
+    for(metric = 0; metric < 2; ++metric){
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for(k = 0; k < queries; ++k){
+            sink += hub_cost(pair[2 * k], pair[2 * k + 1], metric);
+        }
+        ms[metric] = elapsed_ms(&begin);
+    }
+
+    //最初の1000組をダイクストラ法と比べる(距離は全交差点まで求めるので，交差点数が多ければ回数を減らす)
+    for(k = 0; k < queries && k < 1000; ++k){
+        s = pair[2 * k];
+        g = pair[2 * k + 1];
+        for(metric = 0; metric < 2; ++metric){
+            if(metric == 0 && (long)k * crossing_number > 20000000L){
+                continue;
+            }
+            a = hub_cost(s, g, metric);
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            if(metric == 0){
+                dijkstra_parallel(crossing_number, g, 0, speed, 1);
+                b = (search_label(&route_context[0], s) >= 1e100) ? -1 : search_label(&route_context[0], s);
+            }
+            else{
+                dijkstra_time_heap(&context, crossing_number, g, speed, &s, 1);
+                b = (search_label(&context, s) >= 1e100) ? -1 : (s == g) ? 0 : search_label(&context, s) - cross[s].wait;
+            }
+            dijkstra_ms[metric] += elapsed_ms(&begin);
+            checked[metric]++;
+            if((a < 0) != (b < 0)){
+                differ[metric]++;
+            }
+            else if(b > 0){
+                error[metric] = fmax(error[metric], fabs(a - b) / b);
+            }
+        }
+    }
+    printf("問い合わせ(距離) %d 回: %.1lfns/回  評価値の差 最大 %.5lf%%  到達の不一致 %d (%ld 回を比較)\n",
+           queries, ms[0] * 1e6 / queries, error[0] * 100, differ[0], checked[0]);
+    printf("問い合わせ(時間) %d 回: %.1lfns/回  dijkstra_time_heap %.3lfms/回  評価値の差 最大 %.5lf%%  到達の不一致 %d\n",
+           queries, ms[1] * 1e6 / queries, dijkstra_ms[1] / checked[1], error[1] * 100, differ[1]);
+    if(sink == 12345.678){
+        printf("\n");   /* 問い合わせを最適化で消させない */
+    }
+    search_free(&context);
+    free(pair);
+    hub_free();
+    return differ[0] + differ[1] > 0 || error[0] > 1e-5 || error[1] > 1e-5;
+}
+
+//-----------------------------ランドマーク(ALT)------------------------------
+//いくつかの交差点(ランドマーク)を選び、そこから全交差点への費用と全交差点からそこへの費用を距離と時間で前計算しておく
+//dijkstra_turnは、これと三角不等式から求めた下界を使って目的地へ向かう探索(A*)をする
+//直線距離と違って通る交差点の待ち時間も下界に入るので、時間の探索でも確定する交差点が大きく減る
+//費用はfloatで、交差点ごとにランドマークの数だけ並べる(ランドマーク1つあたり交差点ごとに16バイト)
+//ランドマークは、今までのランドマークから最も遠い交差点を選ぶ(farthest)か、
+//適当な根からの最短経路木で今の下界が悪い交差点の多い枝の先を選ぶ(avoid)
+#define ALT_MAGIC   0x544c4143  /* ランドマークファイルの先頭の識別子 */
+#define AltCount    16          /* 既定のランドマークの数 */
+
+static void alt_free(void){
+    int m;
+    for(m = 0; m < 2; ++m){
+        free(alt.from[m]);
+        free(alt.to[m]);
+    }
+    memset(&alt, 0, sizeof(alt));
+}
+
+//ランドマークが使うメモリ[バイト]
+static size_t alt_bytes(void){
+    return sizeof(float) * 4 * (size_t)alt.crossing_number * alt.number;
+}
+
+//rootから各交差点へ(backward 0)、または各交差点からrootへ(backward 1)の費用をcost[v * stride]に入れる関数
+//費用の向きと待ち時間の扱いはdijkstra_turnと同じ(道路の長さに、出ていく交差点の待ち時間を足す)
+//orderが非NULLなら確定した順に交差点を入れる(rootからの最短経路木はsearch_previousで引ける)
+//確定した交差点の数を返す
+static int alt_search(SearchContext *ctx, int crossing_number, int root, int backward, int metric, double speed,
+                      int const roffset[], int const rsource[], double const rlength[],
+                      float cost[], int stride, int order[]){
+    int heap_size = 0, settled = 0, v, j, n, end;
+    double per_km = (metric == 0) ? 1.0 : 1.0 / (speed / 60), c;
+    HeapNode top;
+
+    if(search_begin(ctx, crossing_number) < 0){
+        return -1;
+    }
+    for(v = 0; v < crossing_number; ++v){
+        cost[(size_t)v * stride] = AltNone;
+    }
+    search_relax(ctx, &heap_size, root, 0, -1);
+    while(heap_size > 0){
+        top = heap_pop(ctx->heap, &heap_size);
+        if(top.key > ctx->label[top.id]){
+            continue;
+        }
+        cost[(size_t)top.id * stride] = (float)top.key;
+        if(order != NULL){
+            order[settled] = top.id;
+        }
+        settled++;
+        if(backward == 0){
+            for(j = 0; j < cross[top.id].points; ++j){
+                c = cross[top.id].length[j] * per_km + ((metric == 1) ? cross[top.id].wait : 0);
+                search_relax(ctx, &heap_size, cross[top.id].next[j], top.key + c, top.id);
+            }
+        }
+        else{
+            end = roffset[top.id + 1];
+            for(j = roffset[top.id]; j < end; ++j){
+                n = rsource[j];
+                c = rlength[j] * per_km + ((metric == 1) ? cross[n].wait : 0);
+                search_relax(ctx, &heap_size, n, top.key + c, top.id);
+            }
+        }
+    }
+    return settled;
+}
+
+//k個目のランドマークを今までのk個から最も遠い(行きと帰りの和の最小が最大の)交差点から選ぶ関数
+//最初の1つは、適当な交差点から最も遠い交差点にする
+static int alt_farthest(SearchContext *ctx, int crossing_number, int k, char const chosen[], double speed,
+                        int const roffset[], int const rsource[], double const rlength[], float tree[]){
+    float const *f = alt.from[1], *t = alt.to[1];
+    int v, l, best = -1;
+    double far, d, best_far = -1;
+
+    if(k == 0){
+        if(alt_search(ctx, crossing_number, rand() % crossing_number, 0, 1, speed,
+                      roffset, rsource, rlength, tree, 1, NULL) < 0){
+            return -1;
+        }
+        for(v = 0; v < crossing_number; ++v){
+            if(tree[v] != AltNone && tree[v] > best_far){
+                best_far = tree[v];
+                best = v;
+            }
+        }
+        return best;
+    }
+    for(v = 0; v < crossing_number; ++v){
+        if(chosen[v]){
+            continue;
+        }
+        far = 1e300;
+        for(l = 0; l < k; ++l){
+            if(f[(size_t)v * alt.number + l] != AltNone && t[(size_t)v * alt.number + l] != AltNone){
+                d = (double)f[(size_t)v * alt.number + l] + t[(size_t)v * alt.number + l];
+                far = fmin(far, d);
+            }
+        }
+        if(far < 1e300 && far > best_far){
+            best_far = far;
+            best = v;
+        }
+    }
+    return best;
+}
+
+//k個目のランドマークをavoidの方法で選ぶ関数
+//適当な根rからの最短経路木で、各交差点の重みを「rからの費用 - 今のランドマークでの下界」とし、
+//ランドマークを含まない部分木の重みの和が最大の交差点から、和が最大の子をたどって葉まで下りる
+static int alt_avoid(SearchContext *ctx, int crossing_number, int k, char const chosen[], double speed,
+                     int const roffset[], int const rsource[], double const rlength[],
+                     float tree[], int order[], double size[], int child[]){
+    float const *f = alt.from[1], *t = alt.to[1];
+    int r = rand() % crossing_number;
+    int settled, i, l, v, p, best = -1;
+    double lb, best_size = 0;
+
+    settled = alt_search(ctx, crossing_number, r, 0, 1, speed, roffset, rsource, rlength, tree, 1, order);
+    if(settled < 0){
+        return -1;
+    }
+    for(i = 0; i < settled; ++i){
+        size[order[i]] = 0;
+        child[order[i]] = -1;
+    }
+    //葉から根へ部分木の重みを集める(ランドマークを含む部分木は負にする)
+    for(i = settled - 1; i >= 0; --i){
+        v = order[i];
+        if(chosen[v]){
+            size[v] = -1;
+        }
+        else if(size[v] >= 0){
+            lb = 0;
+            for(l = 0; l < k; ++l){
+                if(f[(size_t)v * alt.number + l] != AltNone && f[(size_t)r * alt.number + l] != AltNone){
+                    lb = fmax(lb, (double)f[(size_t)v * alt.number + l] - f[(size_t)r * alt.number + l]);
+                }
+                if(t[(size_t)v * alt.number + l] != AltNone && t[(size_t)r * alt.number + l] != AltNone){
+                    lb = fmax(lb, (double)t[(size_t)r * alt.number + l] - t[(size_t)v * alt.number + l]);
+                }
+            }
+            size[v] += fmax(tree[v] - lb, 0);
+        }
+        p = search_previous(ctx, v);
+        if(p < 0){
+            continue;
+        }
+        if(size[v] < 0){
+            size[p] = -1;
+        }
+        else if(size[p] >= 0){
+            size[p] += size[v];
+        }
+        if(size[v] >= 0 && (child[p] < 0 || size[v] > size[child[p]])){
+            child[p] = v;
+        }
+    }
+    for(i = 0; i < settled; ++i){
+        if(size[order[i]] > best_size){
+            best_size = size[order[i]];
+            best = order[i];
+        }
+    }
+    if(best < 0){
+        return alt_farthest(ctx, crossing_number, k, chosen, speed, roffset, rsource, rlength, tree);
+    }
+    while(child[best] >= 0 && size[child[best]] >= 0){
+        best = child[best];
+    }
+    return best;
+}
+
+//今の地図(cross[])からnumber個のランドマークを選び、距離と時間(車の速度speed)の費用を求める関数
+static int alt_build(int crossing_number, int number, double speed, int avoid){
+    SearchContext context = {0};
+    int *roffset = NULL, *rsource = NULL;
+    double *rlength = NULL;
+    size_t cells;
+    float *tree = malloc(sizeof(float) * crossing_number);
+    int *order = malloc(sizeof(int) * crossing_number);
+    int *child = malloc(sizeof(int) * crossing_number);
+    double *size = malloc(sizeof(double) * crossing_number);
+    char *chosen = calloc(crossing_number, 1);
+    int k, m, v, error;
+    float most;
+
+    alt_free();
+    number = (number < 1) ? 1 : (number > AltMax) ? AltMax : (number > crossing_number) ? crossing_number : number;
+    cells = (size_t)crossing_number * number;
+    alt.crossing_number = crossing_number;
+    alt.version = map_version();
+    alt.number = number;
+    alt.speed = speed;
+    error = hub_reverse(crossing_number, &roffset, &rsource, &rlength);
+    for(m = 0; m < 2; ++m){
+        alt.from[m] = malloc(sizeof(float) * cells);
+        alt.to[m] = malloc(sizeof(float) * cells);
+        if(alt.from[m] == NULL || alt.to[m] == NULL){
+            error = -1;
+        }
+    }
+    if(tree == NULL || order == NULL || child == NULL || size == NULL || chosen == NULL){
+        error = -1;
+    }
+    srand(1);
+    for(k = 0; k < number && error == 0; ++k){
+        v = avoid ? alt_avoid(&context, crossing_number, k, chosen, speed, roffset, rsource, rlength,
+                              tree, order, size, child)
+                  : alt_farthest(&context, crossing_number, k, chosen, speed, roffset, rsource, rlength, tree);
+        if(v < 0){
+            error = -1;
+            break;
+        }
+        alt.landmark[k] = v;
+        chosen[v] = 1;
+        for(m = 0; m < 2 && error == 0; ++m){
+            if(alt_search(&context, crossing_number, v, 0, m, speed, roffset, rsource, rlength,
+                          alt.from[m] + k, number, NULL) < 0
+               || alt_search(&context, crossing_number, v, 1, m, speed, roffset, rsource, rlength,
+                             alt.to[m] + k, number, NULL) < 0){
+                error = -1;
+            }
+        }
+    }
+    //下界は2つの費用の差なので、丸めの誤差は大きい方の費用の2^-23倍まで
+    for(m = 0; m < 2 && error == 0; ++m){
+        most = 0;
+        for(k = 0; (size_t)k < cells; ++k){
+            most = fmaxf(most, (alt.from[m][k] != AltNone) ? alt.from[m][k] : 0);
+            most = fmaxf(most, (alt.to[m][k] != AltNone) ? alt.to[m][k] : 0);
+        }
+        alt.slack[m] = 2 * most * FLT_EPSILON;
+    }
+    free(roffset);
+    free(rsource);
+    free(rlength);
+    free(tree);
+    free(order);
+    free(child);
+    free(size);
+    free(chosen);
+    search_free(&context);
+    if(error < 0){
+        alt_free();
+    }
+    return error;
+}
+
+//ランドマークをファイルに書き出す関数
+//  先頭: 識別子、交差点数、ランドマークの数、車の速度、丸めの誤差、ランドマークの交差点
+//  続けて 距離の from, to、時間の from, to (交差点ごとにランドマークの数だけ)
+static int alt_write(char const *filename){
+    FILE *fp = fopen(filename, "wb");
+    uint32_t magic = ALT_MAGIC;
+    size_t cells = (size_t)alt.crossing_number * alt.number;
+    int m;
+
+    if(fp == NULL){
+        perror(filename);
+        return -1;
+    }
+    fwrite(&magic, sizeof(magic), 1, fp);
+    fwrite(&alt.crossing_number, sizeof(int), 1, fp);
+    fwrite(&alt.number, sizeof(int), 1, fp);
+    fwrite(&alt.speed, sizeof(double), 1, fp);
+    fwrite(alt.slack, sizeof(float), 2, fp);
+    fwrite(alt.landmark, sizeof(int), alt.number, fp);
+    for(m = 0; m < 2; ++m){
+        fwrite(alt.from[m], sizeof(float), cells, fp);
+        fwrite(alt.to[m], sizeof(float), cells, fp);
+    }
+    if(fclose(fp) != 0){
+        perror(filename);
+        return -1;
+    }
+    return 0;
+}
+
+//ランドマークのファイルを読み込む関数(交差点数が地図と違えば読まない)
+static int alt_read(char const *filename, int crossing_number){
+    FILE *fp = fopen(filename, "rb");
+    uint32_t magic = 0;
+    size_t cells = 0;
+    int m, ok;
+
+    if(fp == NULL){
+        return -1;
+    }
+    alt_free();
+    alt.version = map_version();
+    ok = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == ALT_MAGIC
+         && fread(&alt.crossing_number, sizeof(int), 1, fp) == 1 && alt.crossing_number == crossing_number
+         && fread(&alt.number, sizeof(int), 1, fp) == 1 && alt.number >= 1 && alt.number <= AltMax
+         && fread(&alt.speed, sizeof(double), 1, fp) == 1
+         && fread(alt.slack, sizeof(float), 2, fp) == 2
+         && fread(alt.landmark, sizeof(int), alt.number, fp) == (size_t)alt.number;
+    if(ok){
+        cells = (size_t)crossing_number * alt.number;
+    }
+    for(m = 0; m < 2 && ok; ++m){
+        alt.from[m] = malloc(sizeof(float) * cells);
+        alt.to[m] = malloc(sizeof(float) * cells);
+        ok = alt.from[m] != NULL && alt.to[m] != NULL
+             && fread(alt.from[m], sizeof(float), cells, fp) == cells
+             && fread(alt.to[m], sizeof(float), cells, fp) == cells;
+    }
+    fclose(fp);
+    if(!ok){
+        fprintf(stderr, "%s: broken landmark file or different map\n", filename);
+        alt_free();
+        return -1;
+    }
+    return 0;
+}
+
+//ランドマークを選んで書き出し、読み直した下界を使った探索(dijkstra_turn)を、使わない探索と比べる
+//  CarNavi landmark [ランドマークの数] [問い合わせ数] [地図ファイル] [ランドマークのファイル]
+//farthestとavoidの両方で選んで、右左折のコストを考慮するときとしないときで比べ、avoidで選んだものを書き出す
+//右左折のコストは下界に入らないので、考慮するときは確定する状態の減り方が小さくなる
+static int alt_demo(int crossing_number, int number, int queries, double speed, char const *filename){
+    static char const *metric_name[2] = {"距離", "時間"};
+    static char const *strategy_name[2] = {"farthest", "avoid"};
+    static char const *turn_name[2] = {"右左折なし", "右左折あり"};
+    SearchContext context = {0};
+    struct timespec begin;
+    int path_size = 5 * crossing_number + 1;
+    int *path = malloc(sizeof(int) * path_size);
+    int *pair = malloc(sizeof(int) * 2 * queries);
+    double *plain = malloc(sizeof(double) * 4 * queries);   /* [右左折][評価値][問い合わせ] */
+    double build_ms, cost, ms, plain_ms[2][2], error;
+    long settled, plain_settled[2][2];
+    int k, metric, avoid, turn, differ = 0, saved_turn_mode = turn_mode;
+
+    if(path == NULL || pair == NULL || plain == NULL){
+        fprintf(stderr, "landmark: couldn't allocate\n");
+        free(path);
+        free(pair);
+        free(plain);
+        return 1;
+    }
+    srand(3);
+    for(k = 0; k < 2 * queries; ++k){
+        pair[k] = rand() % crossing_number;
+    }
+    //ランドマークを使わない探索
+    alt_free();
+    for(turn = 0; turn < 2; ++turn){
+        turn_mode = turn;
+        for(metric = 0; metric < 2; ++metric){
+            plain_settled[turn][metric] = 0;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            for(k = 0; k < queries; ++k){
+                plain[(turn * 2 + metric) * queries + k] = dijkstra_turn(&context, crossing_number, pair[2 * k], pair[2 * k + 1],
+                                                                         metric, speed, path, path_size);
+                plain_settled[turn][metric] += context.settled;
+            }
+            plain_ms[turn][metric] = elapsed_ms(&begin);
+            printf("ランドマークなし %s %s: 確定した状態 %.0lf  %.3lfms/回\n", turn_name[turn], metric_name[metric],
+                   (double)plain_settled[turn][metric] / queries, plain_ms[turn][metric] / queries);
+        }
+    }
+    for(avoid = 0; avoid < 2 && differ == 0; ++avoid){
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if(alt_build(crossing_number, number, speed, avoid) < 0){
+            fprintf(stderr, "landmark: couldn't allocate\n");
+            differ = 1;
+            break;
+        }
+        build_ms = elapsed_ms(&begin);
+        if(avoid && (alt_write(filename) < 0 || alt_read(filename, crossing_number) < 0)){
+            differ = 1;
+            break;
+        }
+        printf("%s %d個: 作成 %.1lfms  メモリ %.2lfMB\n", strategy_name[avoid], alt.number, build_ms, alt_bytes() / 1e6);
+        for(turn = 0; turn < 2; ++turn){
+            turn_mode = turn;
+            for(metric = 0; metric < 2; ++metric){
+                settled = 0;
+                error = 0;
+                clock_gettime(CLOCK_MONOTONIC, &begin);
+                for(k = 0; k < queries; ++k){
+                    cost = dijkstra_turn(&context, crossing_number, pair[2 * k], pair[2 * k + 1], metric, speed,
+                                         path, path_size);
+                    settled += context.settled;
+                    if((cost < 0) != (plain[(turn * 2 + metric) * queries + k] < 0)){
+                        differ++;
+                    }
+                    else if(plain[(turn * 2 + metric) * queries + k] > 0){
+                        error = fmax(error, fabs(cost - plain[(turn * 2 + metric) * queries + k])
+                                            / plain[(turn * 2 + metric) * queries + k]);
+                    }
+                }
+                ms = elapsed_ms(&begin);
+                if(error > 1e-9){
+                    differ++;
+                }
+                printf("  %s %s: 確定した状態 %.0lf (1/%.1lf)  %.3lfms/回 (%.1lf倍速)  評価値の差 最大 %.1e\n",
+                       turn_name[turn], metric_name[metric], (double)settled / queries,
+                       (double)plain_settled[turn][metric] / (settled > 0 ? settled : 1),
+                       ms / queries, plain_ms[turn][metric] / (ms > 0 ? ms : 1e-9), error);
+            }
+        }
+    }
+    turn_mode = saved_turn_mode;
+    if(differ == 0){
+        printf("ランドマーク %s を書き出しました\n", filename);
+    }
+    else{
+        printf("ランドマークなしと結果が %d 回違いました\n", differ);
+    }
+    search_free(&context);
+    free(path);
+    free(pair);
+    free(plain);
+    alt_free();
+    return differ > 0;
+}
+
+//-----------------------------GPSの地図照合------------------------------
+//GPSの点列(x, yは地図と同じ座標[km]、tは秒)を、道路の上の位置に合わせる(隠れマルコフモデルとビタビ算法)
+//  候補: 点からMatchRadius以内で、道路ごとに最も近い位置(両向きの道路なら向きごとに1つ)。道路の線分は格子の索引で引く
+//  出現の確からしさ: 点と候補の距離の正規分布(標準偏差MatchSigma)
+//  遷移の確からしさ: 道路に沿った距離と点の間の直線距離の差の指数分布(尺度MatchBeta)
+//                  道路に沿った距離は、次の点の候補の交差点を目標に、上限を付けたダイクストラ法で求める
+//点は1つずつ入れ、今の点のすべての候補から戻った経路が1つに合流したところまでを確定して出す
+//合流しないままMatchLag点たまったら、その時点で最もよい経路で最も古い点を確定するので、遅れはMatchLag点まで
+//走行ごとの状態は別々に持つので、多数の走行をスレッドで分担して同時に照合できる
+#define MatchRadius     0.05    /* 候補を探す半径[km] */
+#define MatchSigma      0.01    /* GPSの誤差の標準偏差[km] */
+#define MatchBeta       0.02    /* 遷移の、道路に沿った距離と直線距離の差の尺度[km] */
+#define MatchSlack      0.2     /* 道路に沿った距離の上限 = 直線距離の2倍 + これ[km] */
+#define MatchUturn      0.1     /* 同じ道路を引き返す遷移の道路に沿った距離に足す長さ[km] */
+#define MatchPrune      20.0    /* 最もよい候補より対数尤度がこれ以上低い候補は捨てる */
+#define MatchGap        60.0    /* これより時間が空いたら、つながらない別の走行とみなす[秒] */
+#define MatchCell       0.1     /* 索引の格子の一辺[km] */
+#define MatchMaxCells   (1 << 24) /* 格子の数の上限(超える地図では格子を粗くする) */
+#define MatchCandidates 8       /* 1点あたりの候補の最大数 */
+#define MatchLag        64      /* 確定を待つ点の最大数 */
+
+//索引に入れる道路の線分(形状点のある道路は折れ線の1区間ずつ)
+typedef struct {
+    float x0, y0, x1, y1;          /* 線分の両端 */
+    float s0;                      /* 道路の始点から線分の始点までの長さ[km] */
+    int a;                         /* 道路の始点の交差点 */
+    int j;                         /* 交差点aから何番目の道路か */
+} MatchSegment;
+
+static struct {
+    int crossing_number;           /* 索引を作った地図の交差点数(0なら未作成) */
+    double x0, y0, cell;           /* 格子の原点と一辺 */
+    int cols, rows;
+    int *cell_offset;              /* 格子cの線分は cell_segment[cell_offset[c]]～[cell_offset[c + 1] - 1] */
+    int *cell_segment;
+    MatchSegment *segment;
+    int segment_number;
+} match_index;
+
+//道路の上の候補
+typedef struct {
+    int a, j;                      /* 交差点aからj番目の道路の上 */
+    float offset;                  /* 道路の始点からの長さ[km] */
+    float distance;                /* 点からの距離[km] */
+    double score;                  /* この候補で終わる経路の対数尤度 */
+    int back;                      /* 1つ前の点の候補(経路の始まりなら-1) */
+} MatchCandidate;
+
+//確定を待つ点
+typedef struct {
+    int sample;                    /* 走行の中での点の番号 */
+    double x, y, t;
+    int number;                    /* 候補の数 */
+    MatchCandidate c[MatchCandidates];
+} MatchColumn;
+
+//確定した点(道路に合わなかった点は a == -1)
+typedef struct {
+    int sample;
+    int a, b;                      /* 交差点aからbへの道路の上 */
+    float offset;                  /* aからの長さ[km] */
+} MatchPoint;
+
+//1つの走行の照合の状態
+typedef struct {
+    SearchContext ctx;
+    MatchColumn column[MatchLag];  /* 確定を待つ点(リングバッファ) */
+    int first, number;             /* 最も古い点の位置と点の数 */
+    int sample;                    /* 次に入る点の番号 */
+    MatchPoint *out;               /* 確定した点(呼び出し側が読んだらout_numberを0に戻す) */
+    int out_number, out_cap;
+    long lag_sum;                  /* 確定するまでに後から入った点の数の合計 */
+    int lag_max;
+} Matcher;
+
+static void match_index_free(void){
+    free(match_index.cell_offset);
+    free(match_index.cell_segment);
+    free(match_index.segment);
+    memset(&match_index, 0, sizeof(match_index));
+}
+
+//道路の線分の格子の索引を作る関数
+//両向きの道路は片方だけ入れ、候補を作るときに逆向きも加える
+static int match_index_build(int crossing_number){
+    double xs[MaxRoadShape + 2], ys[MaxRoadShape + 2];
+    double x1 = -1e300, y1 = -1e300, s;
+    int a, j, b, k, n, c, cx0, cy0, cx1, cy1, cx, cy, pass;
+    MatchSegment *g;
+
+    match_index_free();
+    //線分を集める(1回目は数えるだけ)
+    for(pass = 0; pass < 2; ++pass){
+        match_index.segment_number = 0;
+        for(a = 0; a < crossing_number; ++a){
+            for(j = 0; j < cross[a].points; ++j){
+                b = cross[a].next[j];
+                if(b < a && road_slot(b, a) != -1){
+                    continue;
+                }
+                n = road_shape(a, j, 0.0, xs, ys);
+                for(k = 0, s = 0; k + 1 < n; ++k){
+                    if(pass == 1){
+                        g = &match_index.segment[match_index.segment_number];
+                        g->x0 = (float)xs[k];
+                        g->y0 = (float)ys[k];
+                        g->x1 = (float)xs[k + 1];
+                        g->y1 = (float)ys[k + 1];
+                        g->s0 = (float)s;
+                        g->a = a;
+                        g->j = j;
+                    }
+                    s += hypot(xs[k + 1] - xs[k], ys[k + 1] - ys[k]);
+                    match_index.segment_number++;
+                }
+            }
+        }
+        if(pass == 0){
+            match_index.segment = malloc(sizeof(MatchSegment) * (match_index.segment_number + 1));
+            if(match_index.segment == NULL){
+                return -1;
+            }
+        }
+    }
+    //格子の範囲
+    match_index.x0 = match_index.y0 = 1e300;
+    for(k = 0; k < match_index.segment_number; ++k){
+        g = &match_index.segment[k];
+        match_index.x0 = fmin(match_index.x0, fmin(g->x0, g->x1));
+        match_index.y0 = fmin(match_index.y0, fmin(g->y0, g->y1));
+        x1 = fmax(x1, fmax(g->x0, g->x1));
+        y1 = fmax(y1, fmax(g->y0, g->y1));
+    }
+    if(match_index.segment_number == 0){
+        match_index.x0 = match_index.y0 = x1 = y1 = 0;
+    }
+    match_index.cell = MatchCell;
+    do{
+        match_index.cols = (int)((x1 - match_index.x0) / match_index.cell) + 1;
+        match_index.rows = (int)((y1 - match_index.y0) / match_index.cell) + 1;
+        match_index.cell *= 2;
+    }while((double)match_index.cols * match_index.rows > MatchMaxCells);
+    match_index.cell /= 2;
+    match_index.cell_offset = calloc((size_t)match_index.cols * match_index.rows + 1, sizeof(int));
+    if(match_index.cell_offset == NULL){
+        match_index_free();
+        return -1;
+    }
+    //線分の外接矩形が掛かる格子に入れる(1回目は数えるだけ)
+    for(pass = 0; pass < 2; ++pass){
+        for(k = 0; k < match_index.segment_number; ++k){
+            g = &match_index.segment[k];
+            cx0 = (int)((fmin(g->x0, g->x1) - match_index.x0) / match_index.cell);
+            cy0 = (int)((fmin(g->y0, g->y1) - match_index.y0) / match_index.cell);
+            cx1 = (int)((fmax(g->x0, g->x1) - match_index.x0) / match_index.cell);
+            cy1 = (int)((fmax(g->y0, g->y1) - match_index.y0) / match_index.cell);
+            for(cy = cy0; cy <= cy1 && cy < match_index.rows; ++cy){
+                for(cx = cx0; cx <= cx1 && cx < match_index.cols; ++cx){
+                    c = cy * match_index.cols + cx;
+                    if(pass == 0){
+                        match_index.cell_offset[c + 1]++;
+                    }
+                    else{
+                        match_index.cell_segment[match_index.cell_offset[c]++] = k;
+                    }
+                }
+            }
+        }
+        n = match_index.cols * match_index.rows;
+        if(pass == 0){
+            for(c = 0; c < n; ++c){
+                match_index.cell_offset[c + 1] += match_index.cell_offset[c];
+            }
+            match_index.cell_segment = malloc(sizeof(int) * (match_index.cell_offset[n] + 1));
+            if(match_index.cell_segment == NULL){
+                match_index_free();
+                return -1;
+            }
+        }
+        else{
+            memmove(match_index.cell_offset + 1, match_index.cell_offset, sizeof(int) * n);
+            match_index.cell_offset[0] = 0;
+        }
+    }
+    match_index.crossing_number = crossing_number;
+    return 0;
+}
+
+//点(x, y)の候補をcandに入れて数を返す関数
+//道路ごとに最も近い位置を、近い順にMatchCandidates / 2本まで選び、両向きの道路なら逆向きの候補も加える
+static int match_candidates(double x, double y, MatchCandidate cand[]){
+    MatchCandidate road[MatchCandidates / 2 + 1];
+    MatchSegment const *g;
+    int roads = 0, cx0, cy0, cx1, cy1, cx, cy, k, end, i, n, b, r;
+    double dx, dy, u, px, py, d;
+
+    cx0 = (int)floor((x - MatchRadius - match_index.x0) / match_index.cell);
+    cy0 = (int)floor((y - MatchRadius - match_index.y0) / match_index.cell);
+    cx1 = (int)floor((x + MatchRadius - match_index.x0) / match_index.cell);
+    cy1 = (int)floor((y + MatchRadius - match_index.y0) / match_index.cell);
+    cx0 = (cx0 < 0) ? 0 : cx0;
+    cy0 = (cy0 < 0) ? 0 : cy0;
+    cx1 = (cx1 >= match_index.cols) ? match_index.cols - 1 : cx1;
+    cy1 = (cy1 >= match_index.rows) ? match_index.rows - 1 : cy1;
+    for(cy = cy0; cy <= cy1; ++cy){
+        for(cx = cx0; cx <= cx1; ++cx){
+            end = match_index.cell_offset[cy * match_index.cols + cx + 1];
+            for(k = match_index.cell_offset[cy * match_index.cols + cx]; k < end; ++k){
+                g = &match_index.segment[match_index.cell_segment[k]];
+                //線分への最も近い点
+                dx = g->x1 - g->x0;
+                dy = g->y1 - g->y0;
+                u = (dx * dx + dy * dy > 0) ? ((x - g->x0) * dx + (y - g->y0) * dy) / (dx * dx + dy * dy) : 0;
+                u = (u < 0) ? 0 : (u > 1) ? 1 : u;
+                px = g->x0 + u * dx;
+                py = g->y0 + u * dy;
+                d = hypot(x - px, y - py);
+                if(d > MatchRadius){
+                    continue;
+                }
+                //同じ道路なら近い方だけ残し、近い順に並べる(格子をまたぐ線分は何度も出てくる)
+                for(i = 0; i < roads && (road[i].a != g->a || road[i].j != g->j); ++i){
+                }
+                if(i < roads && road[i].distance <= d){
+                    continue;
+                }
+                if(i == roads){
+                    if(roads == MatchCandidates / 2 && road[roads - 1].distance <= d){
+                        continue;
+                    }
+                    roads = (roads < MatchCandidates / 2) ? roads + 1 : roads;
+                    i = roads - 1;
+                }
+                for(; i > 0 && road[i - 1].distance > d; --i){
+                    road[i] = road[i - 1];
+                }
+                road[i].a = g->a;
+                road[i].j = g->j;
+                road[i].distance = (float)d;
+                road[i].offset = (float)(g->s0 + u * sqrt(dx * dx + dy * dy));
+            }
+        }
+    }
+    for(r = 0, n = 0; r < roads; ++r){
+        cand[n++] = road[r];
+        b = cross[road[r].a].next[road[r].j];
+        if((k = road_slot(b, road[r].a)) != -1){
+            cand[n] = road[r];
+            cand[n].a = b;
+            cand[n].j = k;
+            cand[n].offset = (float)fmax(cross[b].length[k] - road[r].offset, 0);
+            n++;
+        }
+    }
+    return n;
+}
+
+//交差点fromから道路に沿って長さlimitまで広げ、targetsの交差点がすべて確定したら打ち切る関数(結果はsearch_labelで読む)
+static int match_search(SearchContext *ctx, int crossing_number, int from, double limit,
+                        int const targets[], int target_number){
+    int heap_size = 0, remain = 0, i, j;
+    HeapNode top;
+
+    if(search_begin(ctx, crossing_number) < 0){
+        return -1;
+    }
+    for(i = 0; i < target_number; ++i){
+        if(ctx->mark[targets[i]] != ctx->epoch){
+            remain++;
+        }
+        ctx->mark[targets[i]] = ctx->epoch;
+    }
+    search_relax(ctx, &heap_size, from, 0, -1);
+    while(heap_size > 0 && remain > 0){
+        top = heap_pop(ctx->heap, &heap_size);
+        if(top.key > ctx->label[top.id]){
+            continue;
+        }
+        if(top.key > limit){
+            break;
+        }
+        if(ctx->mark[top.id] == ctx->epoch){
+            remain--;
+        }
+        for(j = 0; j < cross[top.id].points; ++j){
+            search_relax(ctx, &heap_size, cross[top.id].next[j], top.key + cross[top.id].length[j], top.id);
+        }
+    }
+    return 0;
+}
+
+//確定した点を出力に加える関数
+static void match_output(Matcher *m, int sample, int a, int b, double offset){
+    MatchPoint *p;
+
+    if(m->out_number == m->out_cap){
+        p = realloc(m->out, sizeof(MatchPoint) * (m->out_cap * 2 + 64));
+        if(p == NULL){
+            return;
+        }
+        m->out = p;
+        m->out_cap = m->out_cap * 2 + 64;
+    }
+    p = &m->out[m->out_number++];
+    p->sample = sample;
+    p->a = a;
+    p->b = b;
+    p->offset = (float)offset;
+    m->lag_sum += m->sample - 1 - sample;
+    if(m->sample - 1 - sample > m->lag_max){
+        m->lag_max = m->sample - 1 - sample;
+    }
+}
+
+//古い方からcount点を確定する関数(count点目はcand番目の候補とし、それより前は経路を戻って決める)
+static void match_emit(Matcher *m, int count, int cand){
+    int chosen[MatchLag];
+    int k;
+    MatchColumn *col;
+    MatchCandidate *c;
+
+    for(k = count - 1; k >= 0; --k){
+        chosen[k] = cand;
+        cand = m->column[(m->first + k) % MatchLag].c[cand].back;
+        if(cand < 0 && k > 0){
+            cand = 0;   /* 確定を急いだ後で経路が切れていたら、その前は最初の候補にする(起きないはず) */
+        }
+    }
+    for(k = 0; k < count; ++k){
+        col = &m->column[(m->first + k) % MatchLag];
+        c = &col->c[chosen[k]];
+        match_output(m, col->sample, c->a, cross[c->a].next[c->j], c->offset);
+    }
+    m->first = (m->first + count) % MatchLag;
+    m->number -= count;
+}
+
+//最も新しい点で最もよい候補
+static int match_best(MatchColumn const *col){
+    int i, best = 0;
+    for(i = 1; i < col->number; ++i){
+        if(col->c[i].score > col->c[best].score){
+            best = i;
+        }
+    }
+    return best;
+}
+
+//確定を待つ点をすべて、最もよい経路で確定する関数(走行の終わりや、経路がつながらないとき)
+static void match_flush(Matcher *m){
+    if(m->number > 0){
+        match_emit(m, m->number, match_best(&m->column[(m->first + m->number - 1) % MatchLag]));
+    }
+}
+
+//1つ前の点の候補から今の点の候補への遷移を評価する関数(どの候補にもつながらなければ0を返す)
+static int match_transition(Matcher *m, int crossing_number, MatchColumn const *prev, MatchColumn *col){
+    int targets[MatchCandidates];
+    int i, k, b, reached = 0;
+    double straight = hypot(col->x - prev->x, col->y - prev->y);
+    double limit = 2 * straight + MatchSlack;
+    double rest, route, d, s;
+    MatchCandidate const *p;
+    MatchCandidate *c;
+
+    for(k = 0; k < col->number; ++k){
+        targets[k] = col->c[k].a;
+        col->c[k].score = -INFINITY;
+        col->c[k].back = -1;
+    }
+    for(i = 0; i < prev->number; ++i){
+        p = &prev->c[i];
+        if(p->score == -INFINITY){
+            continue;
+        }
+        b = cross[p->a].next[p->j];
+        rest = cross[p->a].length[p->j] - p->offset;   /* 道路の終わりまでの長さ */
+        if(rest <= limit && match_search(&m->ctx, crossing_number, b, limit - rest, targets, col->number) < 0){
+            return 0;
+        }
+        for(k = 0; k < col->number; ++k){
+            c = &col->c[k];
+            //同じ道路を進む(誤差で少し戻ったように見えるときは、戻った分を負の長さとして直線距離と比べる)
+            if(c->a == p->a && c->j == p->j && c->offset >= p->offset - 4 * MatchSigma){
+                route = c->offset - p->offset;
+            }
+            else{
+                d = (rest <= limit) ? search_label(&m->ctx, c->a) : 1e100;
+                route = rest + d + c->offset;
+                //交差点の近くの誤差を引き返しと取り違えないよう、同じ道路の逆向きへの遷移は長く見る
+                if(c->a == b && cross[c->a].next[c->j] == p->a){
+                    route += MatchUturn;
+                }
+            }
+            if(route > limit){
+                continue;
+            }
+            s = p->score - fabs(route - straight) / MatchBeta;
+            if(s > c->score){
+                c->score = s;
+                c->back = i;
+            }
+        }
+    }
+    for(k = 0; k < col->number; ++k){
+        if(col->c[k].score > -INFINITY){
+            col->c[k].score += -0.5 * (col->c[k].distance / MatchSigma) * (col->c[k].distance / MatchSigma);
+            reached = 1;
+        }
+    }
+    return reached;
+}
+
+//GPSの点を1つ入れる関数(確定した点はm->outに加わる)
+static void match_push(Matcher *m, int crossing_number, double x, double y, double t){
+    MatchColumn *col, *prev;
+    int k, i, newest, converged;
+    unsigned mask, next;
+    double top;
+
+    col = &m->column[(m->first + m->number) % MatchLag];
+    col->sample = m->sample++;
+    col->x = x;
+    col->y = y;
+    col->t = t;
+    col->number = match_candidates(x, y, col->c);
+    if(col->number == 0){
+        //道路から離れた点は、それまでを確定してから合わなかったとして出す
+        match_flush(m);
+        match_output(m, col->sample, -1, -1, 0);
+        return;
+    }
+    prev = (m->number > 0) ? &m->column[(m->first + m->number - 1) % MatchLag] : NULL;
+    if(prev != NULL && (t - prev->t > MatchGap || !match_transition(m, crossing_number, prev, col))){
+        //つながらなければ、それまでを確定して新しい走行として始める(確定するとfirstがcolの位置に来る)
+        match_flush(m);
+        prev = NULL;
+    }
+    if(prev == NULL){
+        for(k = 0; k < col->number; ++k){
+            col->c[k].score = -0.5 * (col->c[k].distance / MatchSigma) * (col->c[k].distance / MatchSigma);
+            col->c[k].back = -1;
+        }
+    }
+    //値が小さくなりすぎないよう最もよい候補を0にそろえ、見込みのない候補は捨てる(経路が早く合流する)
+    top = col->c[match_best(col)].score;
+    for(k = 0; k < col->number; ++k){
+        col->c[k].score -= top;
+        if(col->c[k].score < -MatchPrune){
+            col->c[k].score = -INFINITY;
+        }
+    }
+    m->number++;
+
+    //今の点の候補から戻った経路が1つに合流した点までを確定する
+    newest = m->number - 1;
+    mask = 0;
+    for(k = 0; k < col->number; ++k){
+        if(col->c[k].score > -INFINITY){
+            mask |= 1u << k;
+        }
+    }
+    converged = -1;
+    for(i = newest; i > 0 && converged < 0; --i){
+        col = &m->column[(m->first + i) % MatchLag];
+        next = 0;
+        for(k = 0; k < col->number; ++k){
+            if((mask >> k) & 1){
+                next |= 1u << col->c[k].back;
+            }
+        }
+        mask = next;
+        if((mask & (mask - 1)) == 0){
+            converged = i - 1;
+        }
+    }
+    if(converged >= 0){
+        for(k = 0; ((mask >> k) & 1) == 0; ++k){
+        }
+        match_emit(m, converged + 1, k);
+    }
+    //遅れの上限に達したら、今最もよい経路で最も古い点を確定する
+    if(m->number == MatchLag){
+        col = &m->column[(m->first + m->number - 1) % MatchLag];
+        k = match_best(col);
+        for(i = m->number - 1; i > 0; --i){
+            k = m->column[(m->first + i) % MatchLag].c[k].back;
+        }
+        match_emit(m, 1, k);
+    }
+}
+
+static void match_free(Matcher *m){
+    search_free(&m->ctx);
+    free(m->out);
+    memset(m, 0, sizeof(*m));
+}
+
+//照合を試すための走行(経路に沿って一定の速さで走り、GPSの誤差を加えた点列と、本当の道路)
+typedef struct {
+    int number;
+    double *x, *y, *t;
+    int *a, *b;                    /* 本当の道路 */
+    MatchPoint *result;            /* 照合した結果(点の番号の順) */
+} MatchTrace;
+
+//平均0、標準偏差1の正規乱数(Box-Muller法)
+static double normal_random(void){
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+//ランダムな目的地への最短距離の経路を次々に走る走行を作る関数(1秒ごとの点)
+static int match_trace_make(SearchContext *ctx, int crossing_number, MatchTrace *tr, int points, double speed,
+                            int path[], int path_size){
+    int k = 0, it = 0, v = rand() % crossing_number, goal;
+    double along = 0, step = speed / 3600, len;
+
+    tr->number = points;
+    tr->x = malloc(sizeof(double) * points);
+    tr->y = malloc(sizeof(double) * points);
+    tr->t = malloc(sizeof(double) * points);
+    tr->a = malloc(sizeof(int) * points);
+    tr->b = malloc(sizeof(int) * points);
+    tr->result = malloc(sizeof(MatchPoint) * points);
+    if(tr->x == NULL || tr->y == NULL || tr->t == NULL || tr->a == NULL || tr->b == NULL || tr->result == NULL){
+        return -1;
+    }
+    path[0] = v;
+    path[1] = -1;
+    while(k < points){
+        if(path[it + 1] == -1){
+            //目的地に着いたら次の目的地へ(行けなければ選び直す)
+            goal = rand() % crossing_number;
+            if(goal == path[it] || dijkstra_turn(ctx, crossing_number, path[it], goal, 0, speed, path, path_size) < 0){
+                continue;
+            }
+            it = 0;
+            along = 0;
+            continue;
+        }
+        len = road_length(path[it], path[it + 1]);
+        if(len == INFINITY){
+            path[it + 1] = -1;      /* 道路がなければ目的地を選び直す */
+            continue;
+        }
+        if(along > len){
+            along -= len;
+            it++;
+            continue;
+        }
+        road_point(path[it], path[it + 1], (len > 0) ? along / len : 0, &tr->x[k], &tr->y[k]);
+        tr->x[k] += normal_random() * MatchSigma;
+        tr->y[k] += normal_random() * MatchSigma;
+        tr->t[k] = k;
+        tr->a[k] = path[it];
+        tr->b[k] = path[it + 1];
+        k++;
+        along += step;
+    }
+    return 0;
+}
+
+static void match_trace_free(MatchTrace *tr){
+    free(tr->x);
+    free(tr->y);
+    free(tr->t);
+    free(tr->a);
+    free(tr->b);
+    free(tr->result);
+}
+
+typedef struct {
+    MatchTrace *trace;
+    int trace_number;
+    int crossing_number;
+    int first, step;
+    long points, lag_sum;
+    int lag_max;
+} MatchWorker;
+
+//走行をスレッドで分担して照合する
+static void *match_worker(void *arg){
+    MatchWorker *w = arg;
+    Matcher *m = calloc(1, sizeof(Matcher));
+    MatchTrace *tr;
+    int i, k, n;
+
+    if(m == NULL){
+        return NULL;
+    }
+    for(i = w->first; i < w->trace_number; i += w->step){
+        tr = &w->trace[i];
+        m->sample = 0;
+        n = 0;
+        for(k = 0; k < tr->number; ++k){
+            match_push(m, w->crossing_number, tr->x[k], tr->y[k], tr->t[k]);
+            //確定した点はすぐに受け取る(流れてくる点を順に処理するのと同じ)
+            memcpy(&tr->result[n], m->out, sizeof(MatchPoint) * m->out_number);
+            n += m->out_number;
+            m->out_number = 0;
+        }
+        match_flush(m);
+        memcpy(&tr->result[n], m->out, sizeof(MatchPoint) * m->out_number);
+        m->out_number = 0;
+        w->points += tr->number;
+    }
+    w->lag_sum = m->lag_sum;
+    w->lag_max = m->lag_max;
+    match_free(m);
+    free(m);
+    return NULL;
+}
+
+//走行をthreads個のスレッドで照合して、かかった時間[ms]を返す関数
+static double match_run(MatchTrace trace[], int trace_number, int crossing_number, int threads,
+                        long *lag_sum, int *lag_max){
+    MatchWorker worker[MaxThreads];
+    struct timespec begin;
+    int t;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for(t = 0; t < threads; ++t){
+        memset(&worker[t], 0, sizeof(worker[t]));
+        worker[t].trace = trace;
+        worker[t].trace_number = trace_number;
+        worker[t].crossing_number = crossing_number;
+        worker[t].first = t;
+        worker[t].step = threads;
+    }
+    map_thread_run(threads, match_worker, worker, sizeof(worker[0]));
+    *lag_sum = 0;
+    *lag_max = 0;
+    for(t = 0; t < threads; ++t){
+        *lag_sum += worker[t].lag_sum;
+        *lag_max = (worker[t].lag_max > *lag_max) ? worker[t].lag_max : *lag_max;
+    }
+    return elapsed_ms(&begin);
+}
+
+//作った走行を照合して、正しい道路に合った割合と速さを表示する
+//  CarNavi mapmatch [走行数] [1走行の点数] [地図ファイル]
+static int match_demo(int crossing_number, int trace_number, int points, double speed){
+    SearchContext context = {0};
+    MatchTrace *trace = calloc(trace_number, sizeof(MatchTrace));
+    int path_size = 5 * crossing_number + 1;
+    int *path = malloc(sizeof(int) * path_size);
+    struct timespec begin;
+    long lag_sum, total = (long)trace_number * points, correct = 0, unmatched = 0;
+    int i, k, threads, lag_max, error = 0;
+    double ms, one_ms;
+    MatchPoint *r;
+
+    if(trace == NULL || path == NULL){
+        free(trace);
+        free(path);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if(match_index_build(crossing_number) < 0){
+        fprintf(stderr, "mapmatch: couldn't allocate\n");
+        error = 1;
+    }
+    printf("索引の作成: %.1lfms (線分 %d, 格子 %d×%d, 一辺 %.2lfkm)\n", elapsed_ms(&begin), match_index.segment_number,
+           match_index.cols, match_index.rows, match_index.cell);
+    srand(4);
+    for(i = 0; i < trace_number && error == 0; ++i){
+        error = match_trace_make(&context, crossing_number, &trace[i], points, speed, path, path_size) < 0;
+    }
+    if(error == 0){
+        one_ms = match_run(trace, trace_number, crossing_number, 1, &lag_sum, &lag_max);
+        printf("1スレッド: %ld 点を %.1lfms (%.0lf 点/秒)\n", total, one_ms, total / one_ms * 1000);
+        threads = worker_count(trace_number);
+        ms = match_run(trace, trace_number, crossing_number, threads, &lag_sum, &lag_max);
+        printf("%dスレッド: %ld 点を %.1lfms (%.0lf 点/秒)\n", threads, total, ms, total / ms * 1000);
+        printf("確定までの遅れ: 平均 %.2lf 点  最大 %d 点\n", (double)lag_sum / total, lag_max);
+        for(i = 0; i < trace_number; ++i){
+            for(k = 0; k < trace[i].number; ++k){
+                r = &trace[i].result[k];
+                if(r->sample != k){
+                    error = 1;      /* 点の順に確定していない */
+                }
+                if(r->a == -1){
+                    unmatched++;
+                }
+                else if((r->a == trace[i].a[k] && r->b == trace[i].b[k]) || (r->a == trace[i].b[k] && r->b == trace[i].a[k])){
+                    correct++;
+                }
+            }
+        }
+        printf("正しい道路に合った点 %.2lf%%  合わなかった点 %.2lf%% (GPSの誤差 %.0lfm, 車の速度 %.1lfkm/h)\n",
+               100.0 * correct / total, 100.0 * unmatched / total, MatchSigma * 1000, speed);
+    }
+    for(i = 0; i < trace_number; ++i){
+        match_trace_free(&trace[i]);
+    }
+    free(trace);
+    free(path);
+    search_free(&context);
+    match_index_free();
+    return error;
+}
+
+//GPSの点のファイルを照合して、確定した順に標準出力に書く関数
+//  入力: 1行に 走行ID,x,y,t (同じ走行の点は時刻の順に続ける)
+//  出力: 走行ID,点の番号,交差点ID,交差点ID,道路上の位置[km] (道路に合わなかった点は 走行ID,点の番号,-1)
+static int match_file(char const *filename, int crossing_number){
+    FILE *fp = fopen(filename, "r");
+    Matcher *m = calloc(1, sizeof(Matcher));
+    char id[64], current[64] = "";
+    double x, y, t;
+    int k, more = 1;
+
+    if(fp == NULL || m == NULL){
+        if(fp == NULL){
+            perror(filename);
+        }
+        free(m);
+        return 1;
+    }
+    if(match_index_build(crossing_number) < 0){
+        fprintf(stderr, "mapmatch: couldn't allocate\n");
+        fclose(fp);
+        free(m);
+        return 1;
+    }
+    while(more){
+        more = fscanf(fp, " %63[^,],%lf,%lf,%lf", id, &x, &y, &t) == 4;
+        if(!more || strcmp(id, current) != 0){
+            match_flush(m);
+        }
+        for(k = 0; k < m->out_number; ++k){
+            if(m->out[k].a == -1){
+                printf("%s,%d,-1\n", current, m->out[k].sample);
+            }
+            else{
+                printf("%s,%d,%d,%d,%.4f\n", current, m->out[k].sample, cross[m->out[k].a].id, cross[m->out[k].b].id,
+                       m->out[k].offset);
+            }
+        }
+        m->out_number = 0;
+        if(more){
+            if(strcmp(id, current) != 0){
+                strcpy(current, id);
+                m->sample = 0;
+            }
+            match_push(m, crossing_number, x, y, t);
+        }
+    }
+    fclose(fp);
+    match_free(m);
+    free(m);
+    match_index_free();
+    return 0;
+}
+
+//応答を組み立てるための伸長可能な文字列
+typedef struct {
+    char *data;
+    size_t len, cap;
+    int failed;                    /* 領域が確保できず応答が欠けた(以後の追記はしない) */
+} Buffer;
+
+//Bufferに書式付きで追記する関数
+//広げられなければfailedを立てて、それまでの内容はそのまま残す
+static void buffer_printf(Buffer *b, char const *format, ...){
+    va_list ap;
+    int n;
+    size_t cap;
+    char *data;
+
+    while(!b->failed){
+        if(b->cap - b->len < 64){
+            cap = (b->cap == 0) ? 256 : b->cap * 2;
+        }
+        else{
+            va_start(ap, format);
+            n = vsnprintf(b->data + b->len, b->cap - b->len, format, ap);
+            va_end(ap);
+            if(n < 0){
+                b->failed = 1;
+                return;
+            }
+            if((size_t)n < b->cap - b->len){
+                b->len += n;
+                return;
+            }
+            cap = b->len + n + 64;
+        }
+        data = realloc(b->data, cap);
+        if(data == NULL){
+            b->failed = 1;
+            return;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+}
+
+//BufferにJSONの文字列として追記する関数("と\と制御文字をエスケープする)
+static void buffer_json(Buffer *b, char const *s){
+    buffer_printf(b, "\"");
+    for(; *s != '\0'; ++s){
+        if(*s == '"' || *s == '\\'){
+            buffer_printf(b, "\\%c", *s);
+        }
+        else if((unsigned char)*s < 0x20){
+            buffer_printf(b, "\\u%04x", (unsigned char)*s);
+        }
+        else{
+            buffer_printf(b, "%c", *s);
+        }
+    }
+    buffer_printf(b, "\"");
+}
+
+//要求の数の引数を読む関数(全体が整数でなければ0を返す)
+static int server_int(char const *word, int *value){
+    char *end;
+    long v;
+
+    if(word == NULL){
+        return 0;
+    }
+    errno = 0;
+    v = strtol(word, &end, 10);
+    if(end == word || *end != '\0' || errno == ERANGE || v < INT_MIN || v > INT_MAX){
+        return 0;
+    }
+    *value = (int)v;
+    return 1;
+}
+
+//要求の評価値の引数を読む関数(省略すると時間、知らない名前なら-1)
+static int server_metric(char const *word){
+    if(word == NULL || strcmp(word, "time") == 0){
+        return 1;
+    }
+    if(strcmp(word, "distance") == 0){
+        return 0;
+    }
+    return -1;
+}
+
+//経路探索サーバへの要求1行を処理して、JSONの応答1行をoutに書く関数
+//  route 出発地ID 目的地ID [time|distance]
+//  matrix ID ID ...            (経由地間の所要時間表)
+//  cost 出発地ID 目的地ID [time|distance]  (経路を求めず費用だけ、ハブラベルがあれば使う)
+//  nearest 出発地ID 施設の種類 [件数] [time|distance]  (近い順の施設とその経路)
+//  search 名前                 (日本語・ローマ字の部分一致)
+//routeとnearestは右左折のコストを含めた費用、matrixとcostはハブラベルと同じく含めない費用を返すので、
+//応答の"turns"にどちらかを書く(同じ2点でもrouteの時間はcostより長くなりうる)
+//作業領域ctxはワーカーごとに使い回すので、要求を処理する間に確保は起きない
+static void server_handle(SearchContext *ctx, int crossing_number, double speed, char *line, Buffer *out){
+    static char const *delim = " \t\r";
+    char *save, *word = strtok_r(line, delim, &save);
+    int path_size = 5 * crossing_number + 1;  /* 右左折を考えると同じ交差点を道路の数だけ通りうる */
+    int *path;
+    int ids[MaxStops];
+    FacilityHit hit[MaxFacility];
+    int i, j, n, start, goal, metric, kind;
+    double cost;
+
+    arena_reset(&ctx->arena);   /* 前の要求の一時領域をまとめて捨てる */
+
+    if(word == NULL){
+        buffer_printf(out, "{\"error\":\"empty request\"}\n");
+    }
+    else if(strcmp(word, "route") == 0){
+        if(!server_int(strtok_r(NULL, delim, &save), &start) || !server_int(strtok_r(NULL, delim, &save), &goal)
+           || start < 0 || start >= crossing_number || goal < 0 || goal >= crossing_number){
+            buffer_printf(out, "{\"error\":\"invalid crossing\"}\n");
+            return;
+        }
+        metric = server_metric(strtok_r(NULL, delim, &save));
+        if(metric < 0){
+            buffer_printf(out, "{\"error\":\"invalid metric\"}\n");
+            return;
+        }
+        start = cross_index[start];     /* 要求と応答は交差点番号(ID)で表す */
+        goal = cross_index[goal];
+        path = arena_alloc(&ctx->arena, sizeof(int) * path_size);
+        cost = (path != NULL) ? dijkstra_turn(ctx, crossing_number, start, goal, metric, speed, path, path_size) : -1;
+        if(cost < 0){
+            buffer_printf(out, "{\"error\":\"no route\"}\n");
+            return;
+        }
+        buffer_printf(out, "{\"type\":\"route\",\"metric\":\"%s\",\"turns\":true,\"cost\":%.3f,\"path\":[",
+                      (metric == 0) ? "distance" : "time", cost);
+        for(i = 0; path[i] != -1; ++i){
+            buffer_printf(out, (i == 0) ? "%d" : ",%d", cross[path[i]].id);
+        }
+        buffer_printf(out, "]}\n");
+    }
+    else if(strcmp(word, "matrix") == 0){
+        for(n = 0; n < MaxStops && (word = strtok_r(NULL, delim, &save)) != NULL; ++n){
+            if(!server_int(word, &ids[n]) || ids[n] < 0 || ids[n] >= crossing_number){
+                buffer_printf(out, "{\"error\":\"invalid crossing\"}\n");
+                return;
+            }
+            ids[n] = cross_index[ids[n]];
+        }
+        buffer_printf(out, "{\"type\":\"matrix\",\"metric\":\"time\",\"turns\":false,\"cost\":[");
+        for(i = 0; i < n; ++i){
+            //ids[i]へ向かう時間を求める(現在地の待ち時間は含めない)
+            dijkstra_time_heap(ctx, crossing_number, ids[i], speed, ids, n);
+            buffer_printf(out, (i == 0) ? "[" : ",[");
+            for(j = 0; j < n; ++j){
+                buffer_printf(out, (j == 0) ? "%.3f" : ",%.3f",
+                              (i == j) ? 0.0 : search_label(ctx, ids[j]) - cross[ids[j]].wait);
+            }
+            buffer_printf(out, "]");
+        }
+        buffer_printf(out, "]}\n");     /* cost[i][j]は j から i への所要時間 */
+    }
+    else if(strcmp(word, "cost") == 0){
+        if(!server_int(strtok_r(NULL, delim, &save), &start) || !server_int(strtok_r(NULL, delim, &save), &goal)
+           || start < 0 || start >= crossing_number || goal < 0 || goal >= crossing_number){
+            buffer_printf(out, "{\"error\":\"invalid crossing\"}\n");
+            return;
+        }
+        metric = server_metric(strtok_r(NULL, delim, &save));
+        if(metric < 0){
+            buffer_printf(out, "{\"error\":\"invalid metric\"}\n");
+            return;
+        }
+        start = cross_index[start];
+        goal = cross_index[goal];
+        //時間のラベルは同じ車の速度で作ったときだけ使い、なければ時間はダイクストラ法で求める
+        if(hub.crossing_number == crossing_number && map_costs_unchanged(hub.version) && (metric == 0 || hub.speed == speed)){
+            cost = hub_cost(start, goal, metric);
+        }
+        else if(metric == 1){
+            dijkstra_time_heap(ctx, crossing_number, goal, speed, &start, 1);
+            cost = (search_label(ctx, start) >= 1e100) ? -1 : (start == goal) ? 0 : search_label(ctx, start) - cross[start].wait;
+        }
+        else{
+            buffer_printf(out, "{\"error\":\"no hub labels\"}\n");
+            return;
+        }
+        if(cost < 0){
+            buffer_printf(out, "{\"error\":\"no route\"}\n");
+            return;
+        }
+        buffer_printf(out, "{\"type\":\"cost\",\"metric\":\"%s\",\"turns\":false,\"cost\":%.3f}\n",
+                      (metric == 0) ? "distance" : "time", cost);
+    }
+    else if(strcmp(word, "nearest") == 0){
+        if(!server_int(strtok_r(NULL, delim, &save), &start) || start < 0 || start >= crossing_number){
+            buffer_printf(out, "{\"error\":\"invalid crossing\"}\n");
+            return;
+        }
+        word = strtok_r(NULL, delim, &save);
+        kind = word ? facility_find(word) : -1;
+        word = strtok_r(NULL, delim, &save);
+        n = 1;
+        if(kind < 0 || (word != NULL && !server_int(word, &n)) || n < 1 || n > MaxFacility){
+            buffer_printf(out, "{\"error\":\"invalid facility\"}\n");
+            return;
+        }
+        metric = server_metric(strtok_r(NULL, delim, &save));
+        if(metric < 0){
+            buffer_printf(out, "{\"error\":\"invalid metric\"}\n");
+            return;
+        }
+        path = arena_alloc(&ctx->arena, sizeof(int) * path_size);
+        n = (path != NULL) ? facility_nearest(ctx, crossing_number, cross_index[start], 1u << kind, n, metric, speed, hit) : -1;
+        if(n < 0){
+            buffer_printf(out, "{\"error\":\"no route\"}\n");
+            return;
+        }
+        buffer_printf(out, "{\"type\":\"nearest\",\"kind\":\"%s\",\"metric\":\"%s\",\"turns\":true,\"result\":[",
+                      facility_kind[kind].name, (metric == 0) ? "distance" : "time");
+        for(i = 0; i < n; ++i){
+            turn_path(ctx, hit[i].state, path, path_size);
+            buffer_printf(out, "%s{\"id\":%d,\"jname\":", (i == 0) ? "" : ",", cross[hit[i].crossing].id);
+            buffer_json(out, cross[hit[i].crossing].jname);
+            buffer_printf(out, ",\"cost\":%.3f,\"path\":[", hit[i].cost);
+            for(j = 0; path[j] != -1; ++j){
+                buffer_printf(out, (j == 0) ? "%d" : ",%d", cross[path[j]].id);
+            }
+            buffer_printf(out, "]}");
+        }
+        buffer_printf(out, "]}\n");
+    }
+    else if(strcmp(word, "search") == 0){
+        word = strtok_r(NULL, "\r", &save);
+        buffer_printf(out, "{\"type\":\"search\",\"result\":[");
+        for(i = 0, n = 0; word != NULL && i < crossing_number; ++i){
+            if(strstr(cross[i].jname, word) != NULL || strstr(cross[i].ename, word) != NULL){
+                buffer_printf(out, "%s{\"id\":%d,\"jname\":", (n++ == 0) ? "" : ",", cross[i].id);
+                buffer_json(out, cross[i].jname);
+                buffer_printf(out, ",\"ename\":");
+                buffer_json(out, cross[i].ename);
+                buffer_printf(out, "}");
+            }
+        }
+        buffer_printf(out, "]}\n");
+    }
+    else{
+        buffer_printf(out, "{\"error\":\"unknown request\"}\n");
+    }
+}
+
+//1つの接続から一度に読めた要求をまとめたもの(ワーカーへ渡す単位)
+typedef struct ServerBatch {
+    struct ServerConn *conn;
+    int number;                    /* 要求数 */
+    char *line[MaxBatch];          /* 要求(textの中を指す) */
+    char text[ServerBufSize];      /* 要求をまとめて複製したもの */
+    Buffer response[MaxBatch];     /* 応答(使い回すときも領域は残す) */
+    struct ServerBatch *next;
+} ServerBatch;
+
+//接続ごとの状態
+typedef struct ServerConn {
+    int fd;
+    char in[ServerBufSize];        /* 受信した未処理の要求 */
+    int in_len;
+    ServerBatch *busy;             /* 処理中または送信中のまとめ(1接続に1つまで) */
+    struct iovec iov[MaxBatch];    /* 送信する応答(ワーカーのバッファを直接指す) */
+    int iov_first, iov_number;     /* iov_numberが0ならbusyはワーカーで処理中 */
+    int closed;                    /* 処理中に切断された */
+} ServerConn;
+
+//ワーカーとのやりとりに使うキュー
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    ServerBatch *head, *tail;      /* 処理待ち */
+    ServerBatch *done;             /* 処理済み */
+    ServerBatch *spare;            /* 使い終わったまとめ(イベントループのスレッドだけが触る) */
+    int wake_fd;                   /* 処理済みを知らせるeventfd */
+    int crossing_number;
+    double speed;
+    int stop;
+} server_queue;
+
+static volatile sig_atomic_t server_stop = 0;
+
+//応答の領域が確保できなかったときに返す応答
+static char const server_nomem[] = "{\"error\":\"out of memory\"}\n";
+
+static void server_signal(int sig){
+    server_stop = 1;
+}
+
+//まとめられた要求を処理するワーカースレッド
+static void *server_worker(void *arg){
+    ServerBatch *b;
+    SearchContext context = {0};   /* 経路探索の作業領域(このワーカーの間ずっと使い回す) */
+    uint64_t one = 1;
+    int k;
+
+    while(1){
+        pthread_mutex_lock(&server_queue.lock);
+        while(server_queue.head == NULL && !server_queue.stop){
+            pthread_cond_wait(&server_queue.ready, &server_queue.lock);
+        }
+        if(server_queue.head == NULL){
+            pthread_mutex_unlock(&server_queue.lock);
+            search_free(&context);
+            map_detach();
+            return NULL;
+        }
+        b = server_queue.head;
+        server_queue.head = b->next;
+        if(server_queue.head == NULL){
+            server_queue.tail = NULL;
+        }
+        pthread_mutex_unlock(&server_queue.lock);
+
+        //まとめた要求は同じ版の地図で処理し、処理中に公開された版は次のまとめから使う
+        map_enter();
+        for(k = 0; k < b->number; ++k){
+            server_handle(&context, server_queue.crossing_number, server_queue.speed, b->line[k], &b->response[k]);
+        }
+        map_leave();
+
+        pthread_mutex_lock(&server_queue.lock);
+        b->next = server_queue.done;
+        server_queue.done = b;
+        pthread_mutex_unlock(&server_queue.lock);
+        if(write(server_queue.wake_fd, &one, sizeof(one)) < 0){
+            perror("eventfd");
+        }
+    }
+}
+
+//使い終わったまとめを次に使うために取っておく関数(応答の領域もそのまま残す)
+static void server_batch_free(ServerBatch *b){
+    int k;
+    for(k = 0; k < b->number; ++k){
+        b->response[k].len = 0;
+        b->response[k].failed = 0;
+    }
+    b->number = 0;
+    b->next = server_queue.spare;
+    server_queue.spare = b;
+}
+
+//取っておいたまとめを本当に解放する関数(サーバの終了時)
+static void server_batch_destroy(void){
+    ServerBatch *b;
+    int k;
+    while((b = server_queue.spare) != NULL){
+        server_queue.spare = b->next;
+        for(k = 0; k < MaxBatch; ++k){
+            free(b->response[k].data);
+        }
+        free(b);
+    }
+}
+
+//接続の受信バッファから完全な行を取り出して、まとめてワーカーへ渡す関数
+//まとめの領域が確保できなければ-1を返す(呼び出し側でその接続を閉じる)
+static int server_dispatch(ServerConn *c){
+    ServerBatch *b;
+    int used = 0, k, start;
+
+    if(c->busy != NULL || c->closed){
+        return 0;           /* 応答の順番を守るため、1接続につき1つずつ処理する */
+    }
+    for(k = 0; k < c->in_len; ++k){
+        if(c->in[k] == '\n'){
+            used = k + 1;
+        }
+    }
+    if(used == 0){
+        return 0;
+    }
+    b = server_queue.spare;
+    if(b != NULL){
+        server_queue.spare = b->next;
+        b->next = NULL;
+    }
+    else{
+        b = calloc(1, sizeof(ServerBatch));
+        if(b == NULL){
+            return -1;
+        }
+    }
+    b->conn = c;
+    memcpy(b->text, c->in, used);
+    start = 0;
+    for(k = 0; k < used; ++k){
+        if(b->text[k] == '\n'){
+            b->text[k] = '\0';
+            if(b->number == MaxBatch){
+                used = start;   /* 入りきらない分は次のまとめへ */
+                break;
+            }
+            b->line[b->number++] = &b->text[start];
+            start = k + 1;
+        }
+    }
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    c->busy = b;
+    c->iov_number = 0;
+
+    pthread_mutex_lock(&server_queue.lock);
+    if(server_queue.tail != NULL){
+        server_queue.tail->next = b;
+    }
+    else{
+        server_queue.head = b;
+    }
+    server_queue.tail = b;
+    pthread_cond_signal(&server_queue.ready);
+    pthread_mutex_unlock(&server_queue.lock);
+    return 0;
+}
+
+//接続を閉じる関数(ワーカーで処理中なら処理済みになってから解放する)
+static void server_close(int epfd, ServerConn *c){
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if(c->busy != NULL && c->iov_number == 0){
+        c->closed = 1;
+        return;
+    }
+    if(c->busy != NULL){
+        server_batch_free(c->busy);     /* 送信中だった応答 */
+    }
+    free(c);
+}
+
+//応答を送る関数(writevでワーカーのバッファから直接送る)
+//送り終わったら1、途中なら0、切断なら-1を返す
+static int server_flush(ServerConn *c){
+    ssize_t n;
+    while(c->iov_first < c->iov_number){
+        n = writev(c->fd, &c->iov[c->iov_first], c->iov_number - c->iov_first);
+        if(n < 0){
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        while(n > 0 && c->iov_first < c->iov_number){
+            if((size_t)n >= c->iov[c->iov_first].iov_len){
+                n -= c->iov[c->iov_first].iov_len;
+                c->iov_first++;
+            }
+            else{
+                c->iov[c->iov_first].iov_base = (char *)c->iov[c->iov_first].iov_base + n;
+                c->iov[c->iov_first].iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+    return 1;
+}
+
+//送信が終わった接続を次の要求へ進める関数
+static void server_sent(int epfd, ServerConn *c){
+    struct epoll_event ev;
+    server_batch_free(c->busy);
+    c->busy = NULL;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    if(server_dispatch(c) < 0){
+        server_close(epfd, c);
+    }
+}
+
+//経路探索サーバ
+//地図を一度だけ読み込み、epollで接続を受け付けて、要求をワーカースレッドで処理する
+static int routing_server(int crossing_number, int port, double speed){
+    int listen_fd, epfd, fd, n, k, r, threads;
+    int one = 1;
+    uint64_t count;
+    long handled = 0;
+    struct sockaddr_in addr;
+    struct epoll_event ev, events[64];
+    struct sigaction sa;
+    pthread_t thread[MaxThreads];
+    ServerConn *c;
+    ServerBatch *done, *b;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(listen_fd < 0){
+        perror("socket");
+        return 1;
+    }
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);   /* ローカルからのみ受け付ける */
+    addr.sin_port = htons(port);
+    if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0){
+        perror("bind");
+        close(listen_fd);
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&server_queue.lock, NULL);
+    pthread_cond_init(&server_queue.ready, NULL);
+    server_queue.crossing_number = crossing_number;
+    server_queue.speed = speed;
+    server_queue.wake_fd = eventfd(0, EFD_NONBLOCK);
+    threads = worker_count(MaxThreads);
+    for(k = 0; k < threads; ++k){
+        if(map_thread_create(&thread[k], server_worker, NULL) != 0){
+            break;      /* 作れた分のワーカーで動かす */
+        }
+    }
+    threads = k;
+    if(threads == 0){
+        fprintf(stderr, "server: couldn't start worker threads\n");
+        close(server_queue.wake_fd);
+        close(listen_fd);
+        return 1;
+    }
+
+    epfd = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;                 /* NULLは待ち受け用 */
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = &server_queue;         /* 処理済みの通知 */
+    epoll_ctl(epfd, EPOLL_CTL_ADD, server_queue.wake_fd, &ev);
+
+    printf("経路探索サーバを 127.0.0.1:%d で起動しました(ワーカー %d スレッド)\n", port, threads);
+    fflush(stdout);
+
+    while(!server_stop){
+        n = epoll_wait(epfd, events, 64, -1);
+        for(k = 0; k < n; ++k){
+            if(events[k].data.ptr == NULL){
+                //新しい接続
+                while((fd = accept(listen_fd, NULL, NULL)) >= 0){
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    c = calloc(1, sizeof(ServerConn));
+                    if(c == NULL){
+                        close(fd);      /* この接続だけを断る */
+                        continue;
+                    }
+                    c->fd = fd;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+            }
+            else if(events[k].data.ptr == &server_queue){
+                //処理済みの応答を送る
+                if(read(server_queue.wake_fd, &count, sizeof(count)) < 0){
+                    count = 0;
+                }
+                pthread_mutex_lock(&server_queue.lock);
+                done = server_queue.done;
+                server_queue.done = NULL;
+                pthread_mutex_unlock(&server_queue.lock);
+                while(done != NULL){
+                    b = done;
+                    done = b->next;
+                    c = b->conn;
+                    handled += b->number;
+                    if(c->closed){
+                        server_batch_free(b);
+                        free(c);
+                        continue;
+                    }
+                    for(r = 0; r < b->number; ++r){
+                        if(b->response[r].failed){
+                            //応答の領域が確保できなかった要求には、欠けた応答の代わりにエラーを返す
+                            c->iov[r].iov_base = (void *)server_nomem;
+                            c->iov[r].iov_len = sizeof(server_nomem) - 1;
+                        }
+                        else{
+                            c->iov[r].iov_base = b->response[r].data;
+                            c->iov[r].iov_len = b->response[r].len;
+                        }
+                    }
+                    c->iov_first = 0;
+                    c->iov_number = b->number;
+                    r = server_flush(c);
+                    if(r < 0){
+                        server_close(epfd, c);
+                    }
+                    else if(r == 0){
+                        ev.events = EPOLLOUT;   /* 送りきれなかったら書けるようになるのを待つ */
+                        ev.data.ptr = c;
+                        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                    }
+                    else{
+                        server_sent(epfd, c);
+                    }
+                }
+            }
+            else{
+                c = events[k].data.ptr;
+                if(events[k].events & EPOLLOUT){
+                    r = server_flush(c);
+                    if(r < 0){
+                        server_close(epfd, c);
+                    }
+                    else if(r == 1){
+                        server_sent(epfd, c);
+                    }
+                    continue;
+                }
+                //受信できるだけ受信する
+                r = 1;
+                while(c->in_len < ServerBufSize){
+                    r = read(c->fd, c->in + c->in_len, ServerBufSize - c->in_len);
+                    if(r <= 0){
+                        break;
+                    }
+                    c->in_len += r;
+                }
+                if(r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                   || (c->in_len == ServerBufSize && memchr(c->in, '\n', c->in_len) == NULL)){
+                    server_close(epfd, c);      /* 切断、または長すぎる行 */
+                    continue;
+                }
+                if(server_dispatch(c) < 0){
+                    server_close(epfd, c);
+                    continue;
+                }
+                if(c->in_len == ServerBufSize){
+                    ev.events = 0;              /* 受信バッファが空くまで受信を止める */
+                    ev.data.ptr = c;
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                }
+            }
+        }
+    }
+
+    pthread_mutex_lock(&server_queue.lock);
+    server_queue.stop = 1;
+    pthread_cond_broadcast(&server_queue.ready);
+    pthread_mutex_unlock(&server_queue.lock);
+    for(k = 0; k < threads; ++k){
+        pthread_join(thread[k], NULL);
+    }
+    close(epfd);
+    close(listen_fd);
+    close(server_queue.wake_fd);
+    server_batch_destroy();
+    printf("\n経路探索サーバを終了しました(処理した要求 %ld 件)\n", handled);
+    return 0;
+}
+
+//負荷試験用クライアントの1接続分
+typedef struct {
+    int port;
+    int crossing_number;
+    int requests;                  /* この接続で送る要求数 */
+    int depth;                     /* 応答を待たずに送る要求数(パイプライン) */
+    unsigned seed;
+    double *latency;               /* 各要求の応答時間[us] */
+    int failed;
+} LoadWorker;
+
+//負荷試験の要求を1つ作る関数(経路8割、所要時間表1割、名前検索1割)
+static int loadgen_request(LoadWorker *w, char *line, int size){
+    int kind = rand_r(&w->seed) % 10;
+    int n = w->crossing_number;
+    if(kind == 0){
+        return snprintf(line, size, "matrix %d %d %d %d %d\n", rand_r(&w->seed) % n, rand_r(&w->seed) % n,
+                        rand_r(&w->seed) % n, rand_r(&w->seed) % n, rand_r(&w->seed) % n);
+    }
+    if(kind == 1){
+        return snprintf(line, size, "search %.3s\n", cross[rand_r(&w->seed) % n].ename);
+    }
+    return snprintf(line, size, "route %d %d %s\n", rand_r(&w->seed) % n, rand_r(&w->seed) % n,
+                    (kind % 2) ? "time" : "distance");
+}
+
+static void *loadgen_worker(void *arg){
+    LoadWorker *w = arg;
+    struct sockaddr_in addr;
+    struct timespec sent[MaxBatch];
+    char out[MaxBatch * 64], in[65536];
+    int fd, k, len, done = 0, batch, got, r, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(w->port);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        perror("connect");
+        w->failed = w->requests;
+        close(fd);
+        return NULL;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    while(done < w->requests){
+        batch = w->requests - done;
+        if(batch > w->depth){
+            batch = w->depth;
+        }
+        len = 0;
+        for(k = 0; k < batch; ++k){
+            len += loadgen_request(w, out + len, sizeof(out) - len);
+            clock_gettime(CLOCK_MONOTONIC, &sent[k]);
+        }
+        if(write(fd, out, len) != len){
+            w->failed += w->requests - done;
+            break;
+        }
+        //応答は1行ずつ順番に返ってくる
+        got = 0;
+        while(got < batch){
+            r = read(fd, in, sizeof(in));
+            if(r <= 0){
+                break;
+            }
+            for(k = 0; k < r; ++k){
+                if(in[k] == '\n'){
+                    w->latency[done + got] = elapsed_ms(&sent[got]) * 1000;
+                    got++;
+                }
+            }
+        }
+        if(got < batch){
+            w->failed += w->requests - done - got;
+            break;
+        }
+        done += batch;
+    }
+    close(fd);
+    return NULL;
+}
+
+static int compare_double(void const *a, void const *b){
+    double x = *(double const *)a, y = *(double const *)b;
+    return (x > y) - (x < y);
+}
+
+//経路探索サーバの負荷試験(スループットと応答時間の分布を表示する)
+static int routing_loadgen(int crossing_number, int port, int connections, int requests, int depth){
+    LoadWorker worker[MaxThreads];
+    struct timespec begin;
+    double *latency, seconds;
+    int k, total = 0, failed = 0;
+
+    if(connections < 1 || connections > MaxThreads || requests < connections || depth < 1 || depth > MaxBatch){
+        fprintf(stderr, "loadgen: invalid arguments\n");
+        return 1;
+    }
+    latency = malloc(sizeof(double) * requests);
+    if(latency == NULL){
+        fprintf(stderr, "loadgen: out of memory\n");
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for(k = 0; k < connections; ++k){
+        worker[k].port = port;
+        worker[k].crossing_number = crossing_number;
+        worker[k].requests = requests / connections + (k < requests % connections);
+        worker[k].depth = depth;
+        worker[k].seed = k + 1;
+        worker[k].latency = latency + total;
+        worker[k].failed = 0;
+        total += worker[k].requests;
+    }
+    map_thread_run(connections, loadgen_worker, worker, sizeof(worker[0]));
+    seconds = elapsed_ms(&begin) / 1000;
+
+    //失敗しなかった要求の応答時間を集める
+    total = 0;
+    for(k = 0; k < connections; ++k){
+        memmove(latency + total, worker[k].latency, sizeof(double) * (worker[k].requests - worker[k].failed));
+        total += worker[k].requests - worker[k].failed;
+        failed += worker[k].failed;
+    }
+    qsort(latency, total, sizeof(double), compare_double);
+    printf("接続数 %d  パイプライン %d  要求 %d 件(失敗 %d 件)  %.3lf秒\n",
+           connections, depth, total, failed, seconds);
+    if(total > 0){
+        printf("スループット: %.0lf 要求/秒\n", total / seconds);
+        printf("応答時間: p50 %.1lfus  p99 %.1lfus  最大 %.1lfus\n",
+               latency[total / 2], latency[(int)(total * 0.99)], latency[total - 1]);
+    }
+    free(latency);
+    return failed > 0;
+}
+
+//地図の版の入れ替えを測る
+//読む側のスレッドが経路探索を続ける間に差分を当てた版を次々に公開し、入れ替えのない間と応答時間を比べる
+//差分では SwapProbe か所の待ち時間を版ごとの同じ値にするので、探索の前後でそれがそろっていれば
+//探索は1つの版だけを見ていて、作りかけの版は見えていない
+#define SwapProbe    64     /* 版ごとに待ち時間をそろえる交差点の数 */
+#define SwapInterval 50     /* 版を公開する間隔[ms] */
+
+typedef struct {
+    int crossing_number;
+    double speed;
+    unsigned seed;
+    int phase;                     /* 0:入れ替えなし 1:入れ替えあり 2:終わり(原子的に読み書きする) */
+    long torn;                     /* 版の値がそろっていなかった探索の数 */
+    double *latency[2];            /* 段階ごとの応答時間[ms] */
+    int number[2], cap[2];
+} SwapReader;
+
+//見ている版で、目印の交差点の待ち時間がその版の値にそろっているか
+static int swap_consistent(MapSnapshot const *view){
+    int k, n = view->crossing_number;
+    for(k = 0; k < SwapProbe && view->version >= 2; ++k){
+        if(fabs(cross[(long)k * n / SwapProbe].wait - (0.5 + 0.001 * view->version)) > 1e-9){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void *swap_reader(void *arg){
+    SwapReader *r = arg;
+    SearchContext ctx = {0};
+    MapSnapshot *view;
+    struct timespec begin;
+    int path_size = 5 * r->crossing_number + 1;
+    int *path = malloc(sizeof(int) * path_size);
+    int phase, start, goal, ok;
+
+    while(path != NULL && (phase = __atomic_load_n(&r->phase, __ATOMIC_ACQUIRE)) < 2){
+        start = rand_r(&r->seed) % r->crossing_number;
+        goal = rand_r(&r->seed) % r->crossing_number;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        view = map_enter();
+        ok = swap_consistent(view);
+        dijkstra_turn(&ctx, r->crossing_number, start, goal, 1, r->speed, path, path_size);
+        ok = ok && swap_consistent(view);
+        map_leave();
+        r->torn += !ok;
+        if(r->number[phase] == r->cap[phase]){
+            r->cap[phase] = (r->cap[phase] == 0) ? 1024 : r->cap[phase] * 2;
+            r->latency[phase] = realloc(r->latency[phase], sizeof(double) * r->cap[phase]);
+        }
+        r->latency[phase][r->number[phase]++] = elapsed_ms(&begin);
+    }
+    free(path);
+    search_free(&ctx);
+    map_detach();
+    return NULL;
+}
+
+static int swap_demo(int crossing_number, int versions, double speed){
+    SwapReader reader[MaxThreads];
+    pthread_t thread[MaxThreads];
+    struct timespec begin, at;
+    double *latency, patch_ms = 0, seconds[2];
+    char const *phase_name[2] = {"入れ替えなし", "入れ替えあり"};
+    int threads = worker_count(MaxThreads), t, v, k, phase, total, retained = 0;
+    int probe[SwapProbe];
+    unsigned seed = 1;
+    long torn = 0;
+    FILE *fp;
+
+    if(map_share(crossing_number) < 0){
+        return 1;
+    }
+    //このスレッドは版に留まらず、差分を作って公開するだけにする
+    for(k = 0; k < SwapProbe; ++k){
+        probe[k] = cross[(long)k * crossing_number / SwapProbe].id;
+    }
+    map_leave();
+    for(t = 0; t < threads; ++t){
+        memset(&reader[t], 0, sizeof(SwapReader));
+        reader[t].crossing_number = crossing_number;
+        reader[t].speed = speed;
+        reader[t].seed = t + 1;
+        if(map_thread_create(&thread[t], swap_reader, &reader[t]) != 0){
+            break;      /* 作れた分の読む側で測る */
+        }
+    }
+    threads = t;
+    if(threads == 0){
+        fprintf(stderr, "mapswap: couldn't start reader threads\n");
+        return 1;
+    }
+    printf("交差点 %d か所  読む側 %d スレッド  公開する版 %d 個(%dmsごと)\n", crossing_number, threads, versions, SwapInterval);
+
+    //入れ替えのない間の応答時間を測ってから、版を公開し続ける
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    usleep((long)versions * SwapInterval * 1000);
+    seconds[0] = elapsed_ms(&begin) / 1000;
+    for(t = 0; t < threads; ++t){
+        __atomic_store_n(&reader[t].phase, 1, __ATOMIC_RELEASE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for(v = 2; v < versions + 2; ++v){
+        //1%の交差点の待ち時間を変え、最後に目印の待ち時間をそろえる
+        fp = tmpfile();
+        if(fp == NULL){
+            perror("tmpfile");
+            break;
+        }
+        for(k = 0; k < crossing_number / 100; ++k){
+            fprintf(fp, "wait,%d,%.3f\n", rand_r(&seed) % crossing_number, (rand_r(&seed) % 1000) / 1000.0);
+        }
+        for(k = 0; k < SwapProbe; ++k){
+            fprintf(fp, "wait,%d,%.3f\n", probe[k], 0.5 + 0.001 * v);
+        }
+        rewind(fp);
+        clock_gettime(CLOCK_MONOTONIC, &at);
+        if(map_patch(fp, "tmpfile") < 0){
+            fclose(fp);
+            break;
+        }
+        patch_ms += elapsed_ms(&at);
+        fclose(fp);
+        retained = (map_rcu.retired_number > retained) ? map_rcu.retired_number : retained;
+        usleep(SwapInterval * 1000);
+    }
+    seconds[1] = elapsed_ms(&begin) / 1000;
+    for(t = 0; t < threads; ++t){
+        __atomic_store_n(&reader[t].phase, 2, __ATOMIC_RELEASE);
+        pthread_join(thread[t], NULL);
+        torn += reader[t].torn;
+    }
+    map_enter();        /* このスレッドも最後の版に移り、古い版を全て回収する */
+    map_reclaim();
+
+    for(phase = 0; phase < 2; ++phase){
+        for(t = 0, total = 0; t < threads; ++t){
+            total += reader[t].number[phase];
+        }
+        latency = malloc(sizeof(double) * (total + 1));
+        for(t = 0, total = 0; t < threads; ++t){
+            memcpy(latency + total, reader[t].latency[phase], sizeof(double) * reader[t].number[phase]);
+            total += reader[t].number[phase];
+            free(reader[t].latency[phase]);
+        }
+        qsort(latency, total, sizeof(double), compare_double);
+        if(total > 0){
+            printf("%s: 探索 %d 回(%.0lf回/秒)  応答時間 p50 %.2lfms  p99 %.2lfms  最大 %.2lfms\n", phase_name[phase],
+                   total, total / seconds[phase], latency[total / 2], latency[(int)(total * 0.99)], latency[total - 1]);
+        }
+        free(latency);
+    }
+    printf("版の作成と公開: 平均 %.2lfms(交差点の配列 %.1lfMBを写す)\n", patch_ms / (v - 2 > 0 ? v - 2 : 1),
+           sizeof(Crossing) * (double)crossing_number / (1 << 20));
+    printf("版がそろっていなかった探索 %ld 回  回収を待った版 最大 %d 個  解放した版 %ld 個(残り %d 個)\n",
+           torn, retained, map_rcu.freed, map_rcu.retired_number);
+    return torn > 0 || v < versions + 2;
+}
+
+//車載機向けの圧縮したグラフ
+//交差点を幅優先の順に番号を付け直し、近くの交差点が近い番号になるようにしてから
+//  位置 : 区画(連続するCompactTile個の交差点)の原点からの差分を COMPACT_UNIT 単位のint32で持つ
+//  道路 : 隣の交差点番号を自分との差分の可変長整数で、長さを COMPACT_UNIT 単位の16ビット(入らなければ32ビット)で持つ
+//  待ち時間 : COMPACT_WAIT 分単位の16ビットで持つ
+//経路探索はこの形のまま行う(長さを丸めるので、評価値は元の地図と1道路あたり COMPACT_UNIT/2 まで違う)
+//形状点と右左折禁止は持たない
+#define CompactTile   256      /* 位置の原点を共有する交差点数 */
+#define COMPACT_UNIT  0.001    /* 位置と長さの単位[km] */
+#define COMPACT_WAIT  0.01     /* 待ち時間の単位[分] */
+
+static struct {
+    int crossing_number;
+    int length_bytes;          /* 道路の長さのバイト数(2か4) */
+    uint32_t *offset;          /* 交差点vの道路は edge[offset[v]]～(先頭は道路数) */
+    unsigned char *edge;
+    size_t edge_bytes;
+    uint16_t *wait;
+    int32_t (*pos)[2];         /* 区画の原点からの位置 */
+    double (*origin)[2];       /* 区画の原点 */
+    int *old_id;               /* 新しい番号から元の交差点番号へ */
+    int *new_id;               /* 元の交差点番号から新しい番号へ */
+} compact;
+
+static void compact_free(void){
+    free(compact.offset);
+    free(compact.edge);
+    free(compact.wait);
+    free(compact.pos);
+    free(compact.origin);
+    free(compact.old_id);
+    free(compact.new_id);
+    memset(&compact, 0, sizeof(compact));
+}
+
+//可変長整数をバッファに書く(書いたバイト数を返す)
+static int varint_store(unsigned char *p, uint64_t v){
+    int n = 0;
+    while(v >= 0x80){
+        p[n++] = (unsigned char)((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static inline uint64_t varint_load(unsigned char const **p){
+    uint64_t v = 0;
+    int shift = 0;
+    while(**p & 0x80){
+        v |= (uint64_t)(*(*p)++ & 0x7f) << shift;
+        shift += 7;
+    }
+    return v | (uint64_t)(*(*p)++) << shift;
+}
+
+//今の地図(cross[])から圧縮したグラフを作る関数
+static int compact_build(int crossing_number){
+    int v, t, j, o, first;
+    long q, max_length = 0;
+    size_t at = 0;
+    uint16_t l16;
+    uint32_t l32;
+
+    compact_free();
+    compact.crossing_number = crossing_number;
+    compact.offset = malloc(sizeof(uint32_t) * (crossing_number + 1));
+    compact.edge = malloc((size_t)crossing_number * (1 + 5 * (10 + 4)));  /* 1交差点あたりの最大 */
+    compact.wait = malloc(sizeof(uint16_t) * crossing_number);
+    compact.pos = malloc(sizeof(compact.pos[0]) * crossing_number);
+    compact.origin = malloc(sizeof(compact.origin[0]) * ((crossing_number + CompactTile - 1) / CompactTile));
+    compact.old_id = malloc(sizeof(int) * crossing_number);
+    compact.new_id = malloc(sizeof(int) * crossing_number);
+    if(compact.offset == NULL || compact.edge == NULL || compact.wait == NULL || compact.pos == NULL
+       || compact.origin == NULL || compact.old_id == NULL || compact.new_id == NULL){
+        compact_free();
+        return -1;
+    }
+    cross_bfs_order(crossing_number, compact.old_id, compact.new_id);
+
+    //長さが16ビットに収まるか
+    for(v = 0; v < crossing_number; ++v){
+        for(j = 0; j < cross[v].points; ++j){
+            q = lround(cross[v].length[j] / COMPACT_UNIT);
+            max_length = (q > max_length) ? q : max_length;
+        }
+    }
+    compact.length_bytes = (max_length <= UINT16_MAX) ? 2 : 4;
+
+    for(v = 0; v < crossing_number; ++v){
+        o = compact.old_id[v];
+        //区画の原点はその区画の最初の交差点の位置
+        t = v / CompactTile;
+        first = compact.old_id[t * CompactTile];
+        if(v % CompactTile == 0){
+            compact.origin[t][0] = cross[first].pos.x;
+            compact.origin[t][1] = cross[first].pos.y;
+        }
+        compact.pos[v][0] = (int32_t)lround((cross[o].pos.x - compact.origin[t][0]) / COMPACT_UNIT);
+        compact.pos[v][1] = (int32_t)lround((cross[o].pos.y - compact.origin[t][1]) / COMPACT_UNIT);
+        q = lround(cross[o].wait / COMPACT_WAIT);
+        compact.wait[v] = (uint16_t)((q > UINT16_MAX) ? UINT16_MAX : q);
+
+        compact.offset[v] = (uint32_t)at;
+        compact.edge[at++] = (unsigned char)cross[o].points;
+        for(j = 0; j < cross[o].points; ++j){
+            at += varint_store(&compact.edge[at], ((uint64_t)(compact.new_id[cross[o].next[j]] - v) << 1)
+                                                  ^ (uint64_t)((int64_t)(compact.new_id[cross[o].next[j]] - v) >> 63));
+            q = lround(cross[o].length[j] / COMPACT_UNIT);
+            if(compact.length_bytes == 2){
+                l16 = (uint16_t)q;
+                memcpy(&compact.edge[at], &l16, 2);
+            }
+            else{
+                l32 = (uint32_t)q;
+                memcpy(&compact.edge[at], &l32, 4);
+            }
+            at += compact.length_bytes;
+        }
+    }
+    compact.offset[crossing_number] = (uint32_t)at;
+    compact.edge_bytes = at;
+    compact.edge = realloc(compact.edge, at);   /* 縮めるだけなので失敗しない */
+    return 0;
+}
+
+//圧縮したグラフが使うメモリ[バイト]
+static size_t compact_bytes(void){
+    int n = compact.crossing_number;
+    return sizeof(uint32_t) * (n + 1) + compact.edge_bytes + sizeof(uint16_t) * n + sizeof(compact.pos[0]) * n
+           + sizeof(compact.origin[0]) * ((n + CompactTile - 1) / CompactTile) + 2 * sizeof(int) * n;
+}
+
+//圧縮したグラフでの交差点の位置(元の交差点番号で指定する)
+static void compact_position(int id, double *x, double *y){
+    int v = compact.new_id[id];
+    *x = compact.origin[v / CompactTile][0] + compact.pos[v][0] * COMPACT_UNIT;
+    *y = compact.origin[v / CompactTile][1] + compact.pos[v][1] * COMPACT_UNIT;
+}
+
+//圧縮したグラフのままの経路探索(metric 0:距離 1:時間)
+//dijkstra_time_heapと同じく目的地から探索し、出発地が確定したら打ち切る
+//経路は元の交差点番号でpathに-1終端で入れて、評価値を返す(たどり着けなければ負)
+static double compact_route(SearchContext *ctx, int start, int goal, int metric, double speed,
+                            int path[], int maxpath){
+    unsigned char const *p;
+    int heap_size = 0, v, n, j, points;
+    uint16_t l16;
+    uint32_t l32;
+    double c, per_km = (metric == 0) ? COMPACT_UNIT : COMPACT_UNIT / (speed / 60);
+    int64_t d;
+    HeapNode top;
+    PROF_BEGIN(scope);
+
+    if(search_begin(ctx, compact.crossing_number) < 0){
+        return -1;
+    }
+    start = compact.new_id[start];
+    goal = compact.new_id[goal];
+    search_relax(ctx, &heap_size, goal, 0, -1);
+    while(heap_size > 0){
+        top = heap_pop(ctx->heap, &heap_size);
+        if(top.key > ctx->label[top.id]){
+            continue;
+        }
+        PROF_COUNT(settled, 1);
+        if(top.id == start){
+            break;
+        }
+        p = &compact.edge[compact.offset[top.id]];
+        points = *p++;
+        for(j = 0; j < points; ++j){
+            d = (int64_t)varint_load(&p);
+            n = top.id + (int)((d >> 1) ^ -(d & 1));
+            if(compact.length_bytes == 2){
+                memcpy(&l16, p, 2);
+                l32 = l16;
+            }
+            else{
+                memcpy(&l32, p, 4);
+            }
+            p += compact.length_bytes;
+            c = l32 * per_km;
+            if(metric == 1){
+                c = compact.wait[n] * COMPACT_WAIT + c;
+            }
+            search_relax(ctx, &heap_size, n, c + top.key, top.id);
+        }
+    }
+    PROF_END(scope, "compact_route");
+    if(search_label(ctx, start) >= 1e100){
+        return -1;
+    }
+
+    //出発地から目的地へ、直前の交差点をたどる
+    for(v = start, n = 0; v != -1; v = ctx->previous[v], ++n){
+        if(n + 1 >= maxpath){
+            return -1;
+        }
+        path[n] = compact.old_id[v];
+    }
+    path[n] = -1;
+    //dijkstra_time_heapと同じく出発地の待ち時間は含めない
+    return (metric == 1 && start != goal) ? ctx->label[start] - compact.wait[start] * COMPACT_WAIT : ctx->label[start];
+}
+
+//圧縮したグラフの大きさと経路探索の速さを元の地図と比べる  CarNavi compact [問い合わせ数] [地図ファイル]
+static int compact_demo(int crossing_number, int queries, double speed){
+    SearchContext context = {0};
+    struct timespec begin;
+    int *path = malloc(sizeof(int) * (crossing_number + 1));
+    int k, s, g, metric, differ[2] = {0, 0};
+    double a, b, error[2] = {0, 0}, ms[2][2] = {{0, 0}, {0, 0}}, x, y, position_error = 0;
+    size_t full = sizeof(Crossing) * (size_t)crossing_number;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if(path == NULL || compact_build(crossing_number) < 0){
+        fprintf(stderr, "compact: couldn't allocate\n");
+        free(path);
+        return 1;
+    }
+    printf("圧縮したグラフの作成: %.1lfms\n", elapsed_ms(&begin));
+    printf("元の地図 %.2lfMB (交差点あたり %zu バイト)  圧縮 %.2lfMB (交差点あたり %.1lf バイト、道路 %.2lfMB)  %.1lf%%\n",
+           full / 1e6, sizeof(Crossing), compact_bytes() / 1e6, (double)compact_bytes() / crossing_number,
+           compact.edge_bytes / 1e6, 100.0 * compact_bytes() / full);
+    for(k = 0; k < crossing_number; ++k){
+        compact_position(k, &x, &y);
+        position_error = fmax(position_error, hypot(x - cross[k].pos.x, y - cross[k].pos.y));
+    }
+    printf("位置の誤差: 最大 %.2lfm\n", position_error * 1000);
+
+    //元の地図のダイクストラ法と比べる(同じ向きに探索して、評価値の差を調べる)
+    srand(1);
+    for(k = 0; k < queries; ++k){
+        s = rand() % crossing_number;
+        g = rand() % crossing_number;
+        for(metric = 0; metric < 2; ++metric){
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            a = compact_route(&context, s, g, metric, speed, path, crossing_number + 1);
+            ms[metric][0] += elapsed_ms(&begin);
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            if(metric == 0){
+                //距離はヒープ版がないので、全交差点まで求めるΔステッピング法(1スレッド)で答えだけ比べる
+                dijkstra_parallel(crossing_number, g, 0, speed, 1);
+                b = (search_label(&route_context[0], s) >= 1e100) ? -1 : search_label(&route_context[0], s);
+            }
+            else{
+                dijkstra_time_heap(&context, crossing_number, g, speed, &s, 1);
+                b = (search_label(&context, s) >= 1e100) ? -1 : (s == g) ? 0 : search_label(&context, s) - cross[s].wait;
+            }
+            ms[metric][1] += elapsed_ms(&begin);
+            if((a < 0) != (b < 0)){
+                differ[metric]++;
+            }
+            else if(b > 0){
+                error[metric] = fmax(error[metric], fabs(a - b) / b);
+            }
+        }
+    }
+    printf("経路探索(距離) %d 回: 圧縮 %.3lfms/回  評価値の差 最大 %.4lf%%  到達の不一致 %d\n",
+           queries, ms[0][0] / queries, error[0] * 100, differ[0]);
+    printf("経路探索(時間) %d 回: 圧縮 %.3lfms/回  元の地図(dijkstra_time_heap) %.3lfms/回  評価値の差 最大 %.4lf%%  到達の不一致 %d\n",
+           queries, ms[1][0] / queries, ms[1][1] / queries, error[1] * 100, differ[1]);
+    search_free(&context);
+    compact_free();
+    free(path);
+    return differ[0] + differ[1] > 0;
+}
+
+//ベンチマーク用の街路網を作る関数
+//格子状の道路に、一定間隔の幹線道路と斜めの近道を加える
+//縦の道路と一番下の横の道路は必ず残すので、どの交差点からでも全体に行ける
+static char const *bench_jname[] = {"青葉", "泉", "宮城野", "若林", "太白", "長町", "八幡", "上杉",
+                                    "北山", "荒町", "連坊", "五橋", "錦町", "中江", "小鶴", "鶴ケ谷"};
+static char const *bench_ename[] = {"Aoba", "Izumi", "Miyagino", "Wakabayashi", "Taihaku", "Nagamachi", "Hachiman", "Kamisugi",
+                                    "Kitayama", "Aramachi", "Renbo", "Itsutsubashi", "Nishikicho", "Nakae", "Kozuru", "Tsurugaya"};
+#define BENCH_NAMES (int)(sizeof(bench_jname) / sizeof(bench_jname[0]))
+#define BENCH_SPACING 0.4           /* 格子の間隔[km] */
+#define BENCH_ARTERIAL 8            /* 幹線道路の間隔(格子何本ごとか) */
+
+//隣接する交差点を追加する関数(5本を超える場合と重複は追加しない)
+static int bench_link(int *next, unsigned char *degree, int a, int b){
+    int j;
+    if(a == b || degree[a] >= 5 || degree[b] >= 5){
+        return -1;
+    }
+    for(j = 0; j < degree[a]; ++j){
+        if(next[a * 5 + j] == b){
+            return -1;
+        }
+    }
+    next[a * 5 + degree[a]++] = b;
+    next[b * 5 + degree[b]++] = a;
+    return 0;
+}
+
+static int map_generate(char const *filename, int crossing_number, unsigned seed){
+    int side = (int)ceil(sqrt((double)crossing_number));
+    int *next = malloc(sizeof(int) * crossing_number * 5);
+    unsigned char *degree = calloc(crossing_number, 1);
+    FILE *fp;
+    int i, j, r, c;
+
+    if(next == NULL || degree == NULL){
+        free(next);
+        free(degree);
+        return -1;
+    }
+    srand(seed);
+    for(i = 0; i < crossing_number; ++i){
+        r = i / side;
+        c = i % side;
+        //縦の道路は必ず、横の道路は幹線と一番下の行以外は3割を間引く
+        if(i + side < crossing_number){
+            bench_link(next, degree, i, i + side);
+        }
+        if(c + 1 < side && i + 1 < crossing_number
+           && (r == 0 || r % BENCH_ARTERIAL == 0 || rand() % 10 >= 3)){
+            bench_link(next, degree, i, i + 1);
+        }
+    }
+    //斜めの近道を加える
+    for(i = 0; i < crossing_number; ++i){
+        c = i % side;
+        if(rand() % 10 == 0 && c + 1 < side && i + side + 1 < crossing_number){
+            bench_link(next, degree, i, i + side + 1);
+        }
+    }
+
+    fp = fopen(filename, "w");
+    if(fp == NULL){
+        perror(filename);
+        free(next);
+        free(degree);
+        return -1;
+    }
+    fprintf(fp, "%d\n", crossing_number);
+    for(i = 0; i < crossing_number; ++i){
+        r = i / side;
+        c = i % side;
+        //幹線道路どうしの交差点は信号待ちが長い
+        fprintf(fp, "%d,%.3f,%.3f,%.1f,%s%d,%s-%d,%d", i,
+                c * BENCH_SPACING + (rand() % 201 - 100) * 0.001,
+                r * BENCH_SPACING + (rand() % 201 - 100) * 0.001,
+                (r % BENCH_ARTERIAL == 0 && c % BENCH_ARTERIAL == 0) ? 1.0 : 0.2 + (rand() % 7) * 0.1,
+                bench_jname[i % BENCH_NAMES], i / BENCH_NAMES,
+                bench_ename[i % BENCH_NAMES], i / BENCH_NAMES, degree[i]);
+        for(j = 0; j < degree[i]; ++j){
+            fprintf(fp, ",%d", next[i * 5 + j]);
+        }
+        fprintf(fp, "\n");
+    }
+    //施設は、幹線道路どうしの交差点の一部を駅に、500か所に1つほどを病院にする
+    for(i = 0; i < crossing_number; ++i){
+        r = i / side;
+        c = i % side;
+        if(r % (2 * BENCH_ARTERIAL) == 0 && c % (2 * BENCH_ARTERIAL) == 0){
+            fprintf(fp, "facility,%d,station\n", i);
+        }
+        if(rand() % 500 == 0){
+            fprintf(fp, "facility,%d,hospital\n", i);
+        }
+    }
+    free(next);
+    free(degree);
+    if(fclose(fp) != 0){
+        perror(filename);
+        return -1;
+    }
+    return 0;
+}
+
+//応答時間の分布(昇順に並べ替えて平均と分位点を求める)
+static void bench_latency(FILE *json, char const *name, double sample[], int n){
+    double sum = 0.0;
+    int k;
+    qsort(sample, n, sizeof(double), compare_double);
+    for(k = 0; k < n; ++k){
+        sum += sample[k];
+    }
+    fprintf(json, "      \"%s\": {\"queries\": %d, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f},\n",
+            name, n, sum / n, sample[n / 2], sample[(int)(n * 0.99)], sample[n - 1]);
+    printf("  %-22s 平均 %.4lfms  p50 %.4lfms  p99 %.4lfms\n", name, sum / n, sample[n / 2], sample[(int)(n * 0.99)]);
+}
+
+//スループット計測用のスレッド
+typedef struct {
+    int crossing_number;
+    int const *pair;               /* 出発地と目的地の組(2個ずつ) */
+    int pair_number;
+    double speed;
+    int first, step;
+} BenchWorker;
+
+static void *bench_worker(void *arg){
+    BenchWorker *w = arg;
+    SearchContext context = {0};
+    int k;
+    for(k = w->first; k < w->pair_number; k += w->step){
+        dijkstra_time_heap(&context, w->crossing_number, w->pair[2 * k + 1], w->speed, &w->pair[2 * k], 1);
+    }
+    search_free(&context);
+    return NULL;
+}
+
+//交差点数crossing_numberの地図を作って各処理の時間を測り、結果をjsonに書く関数
+//renderが0なら描画は測らない(ウィンドウを開けなかった)
+#define BENCH_DIJKSTRA_MAX 20000    /* O(n^2)のダイクストラ法を測る最大の交差点数 */
+//地図全体を描く時間(glFinishで描き終わるまで、3回の中央値)
+static double bench_map_show(int crossing_number, double sample[]){
+    int k;
+    struct timespec begin;
+    for(k = 0; k < 3; ++k){
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        map_show(crossing_number, 0.0);
+        glFinish();
+        sample[k] = elapsed_ms(&begin);
+    }
+    qsort(sample, 3, sizeof(double), compare_double);
+    return sample[1];
+}
+
+//道路網の画像を貼る描画を測る関数(地図の中心を真上から見て，画像を作り終えた後の1フレーム)
+static double bench_raster_show(int crossing_number, double sample[]){
+    int k, width, height;
+    struct timespec begin;
+    double x = 0.0, y = 0.0;
+
+    for(k = 0; k < crossing_number; ++k){
+        x += cross[k].pos.x / crossing_number;
+        y += cross[k].pos.y / crossing_number;
+    }
+    raster_open();
+    glfwGetWindowSize(&width, &height);
+    glViewport(0, 0, width, height);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(120.0, 1.0, 0, 50);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glTranslated(-x, -y, -1.5);
+    for(k = 0; k < RasterVisible / RasterBudget + 1; ++k){
+        raster_show(crossing_number, 1.5 * 0.005, width, height);
+    }
+    for(k = 0; k < 3; ++k){
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        raster_show(crossing_number, 1.5 * 0.005, width, height);
+        glFinish();
+        sample[k] = elapsed_ms(&begin);
+    }
+    raster_close();
+    raster_free();
+    qsort(sample, 3, sizeof(double), compare_double);
+    return sample[1];
+}
+
+static int bench_size(FILE *json, int crossing_number, unsigned seed, int render, double speed){
+    char filename[] = "/tmp/carnavi_bench_XXXXXX";
+    BenchWorker worker[MaxThreads];
+    struct timespec begin;
+    SearchContext context = {0};
+    double generate_ms, load_ms, seconds, shown, reshown, rastered, best, *sample;
+    int *pair, *path;
+    int queries, k, fd, threads, t, exact, found[10];
+    char input[MaxName];
+
+    //規模が大きいほど1回あたりが重いので、計測回数を減らす
+    queries = 2000000 / crossing_number;
+    queries = (queries < 5) ? 5 : (queries > 200) ? 200 : queries;
+
+    fd = mkstemp(filename);
+    if(fd < 0){
+        perror("mkstemp");
+        return -1;
+    }
+    close(fd);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if(map_generate(filename, crossing_number, seed) < 0){
+        unlink(filename);
+        return -1;
+    }
+    generate_ms = elapsed_ms(&begin);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    k = map_read(filename);
+    load_ms = elapsed_ms(&begin);
+    unlink(filename);
+    if(k != crossing_number){
+        return -1;
+    }
+    printf("交差点数 %d  (生成 %.1lfms  読み込み %.1lfms)\n", crossing_number, generate_ms, load_ms);
+    fprintf(json, "    {\n      \"crossings\": %d,\n      \"generate_ms\": %.3f,\n      \"load_ms\": %.3f,\n",
+            crossing_number, generate_ms, load_ms);
+
+    sample = malloc(sizeof(double) * queries * 4);
+    pair = malloc(sizeof(int) * queries * 4 * 2);
+    path = malloc(sizeof(int) * (5 * crossing_number + 1));
+    srand(seed + 1);
+    for(k = 0; k < queries * 4 * 2; ++k){
+        pair[k] = rand() % crossing_number;
+    }
+
+    //1回の経路探索の応答時間
+    if(crossing_number <= BENCH_DIJKSTRA_MAX){
+        for(k = 0; k < 5; ++k){
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            dijkstra_distance(crossing_number, pair[2 * k + 1]);
+            sample[k] = elapsed_ms(&begin);
+        }
+        bench_latency(json, "dijkstra_distance", sample, 5);
+    }
+    else{
+        fprintf(json, "      \"dijkstra_distance\": null,\n");
+        printf("  %-22s 交差点数が多いので省略\n", "dijkstra_distance");
+    }
+    for(k = 0; k < queries; ++k){
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        dijkstra_time_heap(&context, crossing_number, pair[2 * k + 1], speed, &pair[2 * k], 1);
+        sample[k] = elapsed_ms(&begin);
+    }
+    bench_latency(json, "dijkstra_time_heap", sample, queries);
+    for(k = 0; k < queries; ++k){
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        dijkstra_turn(&context, crossing_number, pair[2 * k], pair[2 * k + 1], 1, speed, path, 5 * crossing_number + 1);
+        sample[k] = elapsed_ms(&begin);
+    }
+    bench_latency(json, "dijkstra_turn", sample, queries);
+
+    //圧縮したグラフの大きさと、そのままでの経路探索(時間)の応答時間
+    if(compact_build(crossing_number) == 0){
+        fprintf(json, "      \"compact\": {\"full_bytes\": %zu, \"compact_bytes\": %zu, \"ratio\": %.3f},\n",
+                sizeof(Crossing) * (size_t)crossing_number, compact_bytes(),
+                (double)compact_bytes() / (sizeof(Crossing) * (size_t)crossing_number));
+        printf("  %-22s %.2lfMB -> %.2lfMB\n", "compact", sizeof(Crossing) * (double)crossing_number / 1e6,
+               compact_bytes() / 1e6);
+        for(k = 0; k < queries; ++k){
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            compact_route(&context, pair[2 * k], pair[2 * k + 1], 1, speed, path, 5 * crossing_number + 1);
+            sample[k] = elapsed_ms(&begin);
+        }
+        bench_latency(json, "compact_route", sample, queries);
+        compact_free();
+    }
+
+    //1つの交差点から全交差点への最短経路(逐次のヒープ版と、スレッド数を変えたΔステッピング法)
+    //スレッド数は使えるCPUの数までとし(超えた分は交代で動くだけで速くならない)、逐次版より遅ければそう表示する
+    for(k = 0; k < crossing_number; ++k){
+        path[k] = k;        /* 全交差点が確定するまで探索させる */
+    }
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    dijkstra_time_heap(&context, crossing_number, pair[1], speed, path, crossing_number);
+    seconds = elapsed_ms(&begin);
+    threads = worker_count(MaxThreads);
+    fprintf(json, "      \"one_to_all\": {\"cores\": %ld, \"max_threads\": %d, \"dijkstra_time_heap_ms\": %.3f, "
+            "\"delta_stepping\": [", sysconf(_SC_NPROCESSORS_ONLN), threads, seconds);
+    printf("  %-22s %.3lfms\n", "one_to_all(heap)", seconds);
+    best = 0;
+    for(t = 1; t <= threads; t = (t < threads && t * 2 > threads) ? threads : t * 2){
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        dijkstra_parallel(crossing_number, pair[1], 1, speed, t);
+        sample[0] = elapsed_ms(&begin);
+        for(k = 0, exact = 0; k < crossing_number; ++k){
+            if(search_label(&route_context[1], k) != search_label(&context, k)){
+                exact++;    /* 逐次版と評価値が一致しない交差点 */
+            }
+        }
+        fprintf(json, "%s{\"threads\": %d, \"ms\": %.3f, \"speedup\": %.2f, \"slower\": %s, \"mismatch\": %d}",
+                (t > 1) ? ", " : "", t, sample[0], seconds / sample[0], (seconds < sample[0]) ? "true" : "false", exact);
+        printf("  %-22s %2d スレッド  %.3lfms  (%.2lf倍)%s%s\n", "one_to_all(delta)", t, sample[0], seconds / sample[0],
+               (seconds < sample[0]) ? "  逐次版より遅い" : "", exact ? "  不一致あり" : "");
+        if(seconds / sample[0] > best){
+            best = seconds / sample[0];
+        }
+    }
+    fprintf(json, "], \"best_speedup\": %.2f},\n", best);
+    if(best < 1){
+        printf("  %-22s 並列化で速くならなかった(最大 %.2lf倍、使えるCPU %d 個)\n", "one_to_all(delta)", best, threads);
+    }
+
+    //たくさんの経路探索をスレッドで分担したときのスループット
+    threads = worker_count(queries * 4);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for(t = 0; t < threads; ++t){
+        worker[t].crossing_number = crossing_number;
+        worker[t].pair = pair;
+        worker[t].pair_number = queries * 4;
+        worker[t].speed = speed;
+        worker[t].first = t;
+        worker[t].step = threads;
+    }
+    map_thread_run(threads, bench_worker, worker, sizeof(worker[0]));
+    seconds = elapsed_ms(&begin) / 1000;
+    fprintf(json, "      \"throughput\": {\"threads\": %d, \"queries\": %d, \"queries_per_s\": %.1f},\n",
+            threads, queries * 4, queries * 4 / seconds);
+    printf("  %-22s %d スレッド  %.1lf 件/秒\n", "throughput", threads, queries * 4 / seconds);
+
+    //名前検索(完全一致と部分一致)の応答時間
+    for(k = 0; k < queries; ++k){
+        if(k % 2 == 0){
+            strcpy(input, cross[pair[k]].ename);
+        }
+        else{
+            snprintf(input, sizeof(input), "%s-%d", bench_ename[k % BENCH_NAMES], rand() % 100);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        search_cross_name(crossing_number, input, 1, &exact, found, 10);
+        sample[k] = elapsed_ms(&begin);
+    }
+    bench_latency(json, "search_cross_name", sample, queries);
+
+    //地図全体の描画
+    shown = render ? bench_map_show(crossing_number, sample) : -1;
+    rastered = render ? bench_raster_show(crossing_number, sample) : -1;
+
+    //交差点をヒルベルト曲線の順に並べ替えて、同じ経路探索と描画を測り直す(交差点番号はIDで引き直す)
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if(map_reorder(crossing_number, 0) == 0){
+        seconds = elapsed_ms(&begin);
+        for(k = 0; k < queries; ++k){
+            t = cross_index[pair[2 * k]];
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            dijkstra_time_heap(&context, crossing_number, cross_index[pair[2 * k + 1]], speed, &t, 1);
+            sample[k] = elapsed_ms(&begin);
+        }
+        bench_latency(json, "dijkstra_time_heap_hilbert", sample, queries);
+        reshown = render ? bench_map_show(crossing_number, sample) : -1;
+        printf("  %-22s 並べ替え %.1lfms", "hilbert_order", seconds);
+        if(render){
+            printf("  map_show %.3lfms -> %.3lfms", shown, reshown);
+        }
+        printf("\n");
+        fprintf(json, "      \"hilbert_order\": {\"reorder_ms\": %.3f, ", seconds);
+        fprintf(json, render ? "\"map_show_ms\": %.3f},\n" : "\"map_show_ms\": null},\n", reshown);
+    }
+
+    if(render){
+        fprintf(json, "      \"raster_show_ms\": %.3f,\n", rastered);
+        fprintf(json, "      \"map_show_ms\": %.3f\n    }", shown);
+        printf("  %-22s %.3lfms  raster_show %.3lfms\n", "map_show", shown, rastered);
+    }
+    else{
+        fprintf(json, "      \"raster_show_ms\": null,\n");
+        fprintf(json, "      \"map_show_ms\": null\n    }");
+    }
+    free(sample);
+    free(pair);
+    free(path);
+    search_free(&context);
+    return 0;
+}
+
+//ベンチマーク  CarNavi bench [交差点数 ...] [結果のJSONファイル]
+//交差点数を省略すると 1000 10000 100000 1000000 を測る
+static int routing_bench(int argc, char *argv[]){
+    static int const default_size[] = {1000, 10000, 100000, 1000000};
+    int size[64];
+    int size_number = 0, k, render, failed = 0;
+    char const *output = "bench.json";
+    unsigned seed = 1;
+    FILE *json;
+
+    for(k = 0; k < argc && size_number < 64; ++k){
+        if(atoi(argv[k]) > 0){
+            size[size_number++] = atoi(argv[k]);
+        }
+        else{
+            output = argv[k];
+        }
+    }
+    if(size_number == 0){
+        for(k = 0; k < 4; ++k){
+            size[size_number++] = default_size[k];
+        }
+    }
+    json = fopen(output, "w");
+    if(json == NULL){
+        perror(output);
+        return 1;
+    }
+
+    //描画の計測用に小さいウィンドウを開く(開けなければ描画は測らない)
+    render = glfwInit() && glfwOpenWindow(640, 480, 0, 0, 0, 0, 0, 0, GLFW_WINDOW);
+    if(render){
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        glOrtho(-1.0, 1.0, -1.0, 1.0, -1.0, 1.0);
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+    }
+
+    fprintf(json, "{\n  \"benchmark\": \"CarNavi\",\n  \"seed\": %u,\n  \"results\": [\n", seed);
+    for(k = 0; k < size_number; ++k){
+        if(k > 0){
+            fprintf(json, ",\n");
+        }
+        if(size[k] < 2 || bench_size(json, size[k], seed, render, 30.0) < 0){
+            fprintf(stderr, "bench: failed at %d crossings\n", size[k]);
+            failed = 1;
+            break;
+        }
+    }
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+    if(render){
+        glfwTerminate();
+    }
+    printf("結果を%sに書き込みました\n", output);
+    return failed;
+}
+
+//--------------------------区画に分けた地図---------------------------
+//広い地域の地図は，地理的な区画(タイル)ごとのファイルに分け，必要な区画だけを読み込む
+//  overlay.bin  区画の一覧，境界の交差点，境界の交差点間の区画内での最短距離・時間，区画をまたぐ道路
+//  tile_N.bin   区画Nの交差点(位置，待ち時間，名前)と，そこから出る道路(CSR形式)
+//交差点番号は区画ごとに連続するように付け直す
+//区画をまたぐ経路は，境界の交差点を結んだ上位のグラフ(区画内の最短経路と区画をまたぐ道路)で求める
+#define TILE_MAGIC      0x43544e43  /* ファイルの先頭の識別子 */
+#define TileBudgetMB    64          /* 区画を読み込んでおくメモリの既定の上限[MB] */
+#define MaxTilePrefetch 1024        /* 先読み待ちの区画の最大数 */
+#define TILE_SIZE       2.0         /* 区画の既定の大きさ[km] */
+#define TILE_AHEAD      200         /* 経路上で先読みする交差点の数 */
+
+//読み込んだ区画
+typedef struct {
+    int first, count;          /* 交差点番号の範囲 */
+    int edge_number;
+    double *x, *y, *wait;
+    int *offset, *target;      /* 交差点iから出る道路は target[offset[i]]～target[offset[i+1]-1] (全体の番号) */
+    double *length;
+    int *roffset, *rsource;    /* 区画内から入ってくる道路(逆向きの探索用，区画内の番号) */
+    double *rlength;
+    int *jname, *ename;        /* 名前(namesの中の位置) */
+    char *names;
+    size_t bytes;              /* 使っているメモリ */
+} TileData;
+
+//区画の一覧の1つ分
+typedef struct {
+    int row, col;
+    int first, count;          /* 交差点番号の範囲 */
+    int boundary_number;       /* 境界の交差点(区画をまたぐ道路の端)の数 */
+    int overlay;               /* 上位のグラフでの最初の番号 */
+    int *boundary;             /* 境界の交差点(全体の番号，昇順) */
+    float *clique_distance;    /* 境界の交差点間の区画内での最短距離(boundary_number * boundary_number) */
+    float *clique_time;        /* 同じく最短時間(出発する交差点の待ち時間を含む) */
+    TileData *data;            /* 読み込んでいなければNULL */
+    unsigned long used;        /* 最後に使った順番(古いものから追い出す) */
+    int pin;                   /* 使用中の数(0でなければ追い出さない) */
+    int loading;               /* 読み込み中 */
+} Tile;
+
+static struct {
+    char dir[PATH_MAX];
+    double size, origin_x, origin_y;  /* 区画の大きさと左下の位置 */
+    int cols, rows;
+    int crossing_number, tile_number;
+    double speed;                  /* clique_timeを求めた車の速度 */
+    Tile *tile;
+    int *grid;                     /* 区画の位置から区画番号(空の区画は-1) */
+    int overlay_number;            /* 上位のグラフの交差点数(境界の交差点の合計) */
+    int *overlay_tile;             /* 上位のグラフの交差点が属する区画 */
+    int *overlay_id;               /* 全体の番号 */
+    double *overlay_wait;
+    int *cut_offset, *cut_target;  /* 区画をまたぐ道路(上位のグラフの番号) */
+    double *cut_length;
+    size_t budget, bytes, peak;    /* メモリの上限，使用量，最大の使用量 */
+    unsigned long clock;
+    long loads, evictions, prefetched;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;        /* 先読みの要求と，読み込みの完了を知らせる */
+    int queue[MaxTilePrefetch], queue_head, queue_number;
+    pthread_t prefetch;
+    int stop;
+} tiles;
+
+//区画のファイルを読み込む関数
+static TileData *tile_read(char const *filename, int first){
+    FILE *fp = fopen(filename, "rb");
+    int header[4], c, e, i, k;
+    size_t bytes;
+    TileData *d;
+
+    if(fp == NULL){
+        perror(filename);
+        return NULL;
+    }
+    if(fread(header, sizeof(int), 4, fp) != 4 || header[0] != TILE_MAGIC || header[1] <= 0 || header[2] < 0){
+        fprintf(stderr, "%s: invalid tile\n", filename);
+        fclose(fp);
+        return NULL;
+    }
+    c = header[1];
+    e = header[2];
+    //倍精度の配列，整数の配列，名前の順にまとめて確保する
+    bytes = sizeof(TileData) + sizeof(double) * (3 * (size_t)c + 2 * (size_t)e)
+            + sizeof(int) * (4 * (size_t)c + 2 + 2 * (size_t)e) + header[3];
+    d = malloc(bytes);
+    if(d == NULL){
+        fclose(fp);
+        return NULL;
+    }
+    d->first = first;
+    d->count = c;
+    d->edge_number = e;
+    d->bytes = bytes;
+    d->x = (double *)(d + 1);
+    d->y = d->x + c;
+    d->wait = d->y + c;
+    d->length = d->wait + c;
+    d->rlength = d->length + e;
+    d->offset = (int *)(d->rlength + e);
+    d->target = d->offset + c + 1;
+    d->roffset = d->target + e;
+    d->rsource = d->roffset + c + 1;
+    d->jname = d->rsource + e;
+    d->ename = d->jname + c;
+    d->names = (char *)(d->ename + c);
+    if(fread(d->x, sizeof(double), c, fp) != (size_t)c || fread(d->y, sizeof(double), c, fp) != (size_t)c
+       || fread(d->wait, sizeof(double), c, fp) != (size_t)c
+       || fread(d->offset, sizeof(int), c + 1, fp) != (size_t)c + 1
+       || fread(d->target, sizeof(int), e, fp) != (size_t)e || fread(d->length, sizeof(double), e, fp) != (size_t)e
+       || fread(d->jname, sizeof(int), c, fp) != (size_t)c || fread(d->ename, sizeof(int), c, fp) != (size_t)c
+       || fread(d->names, 1, header[3], fp) != (size_t)header[3] || d->offset[c] != e){
+        fprintf(stderr, "%s: invalid tile\n", filename);
+        fclose(fp);
+        free(d);
+        return NULL;
+    }
+    fclose(fp);
+
+    //区画内から入ってくる道路を数えて，逆向きの隣接を作る(roffsetを書き込み位置に使ってから1つずらす)
+    memset(d->roffset, 0, sizeof(int) * (c + 1));
+    for(i = 0; i < e; ++i){
+        if(d->target[i] >= first && d->target[i] < first + c){
+            d->roffset[d->target[i] - first + 1]++;
+        }
+    }
+    for(i = 0; i < c; ++i){
+        d->roffset[i + 1] += d->roffset[i];
+    }
+    for(i = 0; i < c; ++i){
+        for(k = d->offset[i]; k < d->offset[i + 1]; ++k){
+            if(d->target[k] >= first && d->target[k] < first + c){
+                int slot = d->roffset[d->target[k] - first]++;
+                d->rsource[slot] = i;
+                d->rlength[slot] = d->length[k];
+            }
+        }
+    }
+    for(i = c; i > 0; --i){
+        d->roffset[i] = d->roffset[i - 1];
+    }
+    d->roffset[0] = 0;
+    return d;
+}
+
+//区画内だけでのダイクストラ法(backwardなら目的地から逆向きに探す)
+//labelとpreviousは区画内の番号，backwardのときpreviousは目的地へ向かう次の交差点
+//道路a→bの評価値は，距離なら長さ，時間なら長さ/速度 + aの待ち時間
+static int tile_local_search(TileData const *d, int source, int backward, int metric, double speed,
+                             double label[], int previous[], HeapNode **heap, int *cap){
+    int heap_size = 0;
+    HeapNode top;
+    int i, k, v;
+    double c;
+
+    for(i = 0; i < d->count; ++i){
+        label[i] = 1e100;
+        previous[i] = -1;
+    }
+    label[source] = 0;
+    if(heap_push_grow(heap, &heap_size, cap, 0, source) < 0){
+        return -1;
+    }
+    while(heap_size > 0){
+        top = heap_pop(*heap, &heap_size);
+        if(top.key > label[top.id]){
+            continue;       /* 古い要素は読み飛ばす */
+        }
+        PROF_COUNT(settled, 1);
+        if(backward){
+            for(k = d->roffset[top.id]; k < d->roffset[top.id + 1]; ++k){
+                v = d->rsource[k];
+                c = top.key + ((metric == 0) ? d->rlength[k] : d->rlength[k] / (speed / 60) + d->wait[v]);
+                if(label[v] > c){
+                    label[v] = c;
+                    previous[v] = top.id;
+                    PROF_COUNT(relaxed, 1);
+                    if(heap_push_grow(heap, &heap_size, cap, c, v) < 0){
+                        return -1;
+                    }
+                }
+            }
+            continue;
+        }
+        for(k = d->offset[top.id]; k < d->offset[top.id + 1]; ++k){
+            v = d->target[k] - d->first;
+            if(v < 0 || v >= d->count){
+                continue;   /* 区画の外へ出る道路 */
+            }
+            c = top.key + ((metric == 0) ? d->length[k] : d->length[k] / (speed / 60) + d->wait[top.id]);
+            if(label[v] > c){
+                label[v] = c;
+                previous[v] = top.id;
+                PROF_COUNT(relaxed, 1);
+                if(heap_push_grow(heap, &heap_size, cap, c, v) < 0){
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+//区画内の境界の交差点間の最短距離・時間を求める関数
+static int tile_clique(Tile *t, TileData const *d, int metric, double speed){
+    double *label = malloc(sizeof(double) * d->count);
+    int *previous = malloc(sizeof(int) * d->count);
+    HeapNode *heap = NULL;
+    int cap = 0, i, j, k = t->boundary_number, result = 0;
+    float *clique = (metric == 0) ? t->clique_distance : t->clique_time;
+
+    for(i = 0; i < k && label != NULL && previous != NULL; ++i){
+        if(tile_local_search(d, t->boundary[i] - t->first, 0, metric, speed, label, previous, &heap, &cap) < 0){
+            result = -1;
+            break;
+        }
+        for(j = 0; j < k; ++j){
+            clique[i * k + j] = (float)label[t->boundary[j] - t->first];
+        }
+    }
+    if(label == NULL || previous == NULL){
+        result = -1;
+    }
+    free(label);
+    free(previous);
+    free(heap);
+    return result;
+}
+
+//区画のファイル名
+static void tile_filename(char *filename, size_t size, char const *dir, int t){
+    snprintf(filename, size, "%s/tile_%d.bin", dir, t);
+}
+
+//読み込んである地図(cross[])を大きさsize[km]の区画に分けてdirに書き出す関数
+static int tile_build(int crossing_number, char const *dir, double size, double speed){
+    double min_x = 1e100, min_y = 1e100, max_x = -1e100, max_y = -1e100;
+    int *cell = malloc(sizeof(int) * crossing_number);       /* 交差点の区画の位置 */
+    int *newid = malloc(sizeof(int) * crossing_number);      /* 付け直した番号 */
+    int *oldid = malloc(sizeof(int) * crossing_number);
+    int *overlay = malloc(sizeof(int) * crossing_number);    /* 上位のグラフでの番号(新しい番号で引く，境界でなければ-1) */
+    int *grid = NULL, *fill = NULL;
+    Tile *tile = NULL;
+    int cols, rows, tile_number = 0, overlay_number = 0, cut_number = 0;
+    int i, j, k, t, a, b, header[7], result = -1;
+    size_t names;
+    double geometry[4];
+    char filename[PATH_MAX + 32];
+    FILE *fp = NULL;
+    TileData *d;
+    struct timespec begin;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if(cell == NULL || newid == NULL || oldid == NULL || overlay == NULL || size <= 0){
+        goto buildend;
+    }
+    for(i = 0; i < crossing_number; ++i){
+        min_x = fmin(min_x, cross[i].pos.x);
+        min_y = fmin(min_y, cross[i].pos.y);
+        max_x = fmax(max_x, cross[i].pos.x);
+        max_y = fmax(max_y, cross[i].pos.y);
+    }
+    cols = (int)((max_x - min_x) / size) + 1;
+    rows = (int)((max_y - min_y) / size) + 1;
+    grid = malloc(sizeof(int) * cols * rows);
+    fill = calloc(cols * rows, sizeof(int));
+    if(grid == NULL || fill == NULL){
+        goto buildend;
+    }
+
+    //区画の位置ごとに数えて，交差点のある区画にだけ番号を付ける
+    for(i = 0; i < crossing_number; ++i){
+        cell[i] = (int)((cross[i].pos.y - min_y) / size) * cols + (int)((cross[i].pos.x - min_x) / size);
+        fill[cell[i]]++;
+    }
+    for(k = 0; k < cols * rows; ++k){
+        grid[k] = (fill[k] > 0) ? tile_number++ : -1;
+    }
+    tile = calloc(tile_number, sizeof(Tile));
+    if(tile == NULL){
+        goto buildend;
+    }
+    for(k = 0, a = 0; k < cols * rows; ++k){
+        if(grid[k] != -1){
+            t = grid[k];
+            tile[t].row = k / cols;
+            tile[t].col = k % cols;
+            tile[t].first = a;
+            a += fill[k];
+        }
+    }
+    //区画の順に番号を付け直す
+    for(i = 0; i < crossing_number; ++i){
+        t = grid[cell[i]];
+        newid[i] = tile[t].first + tile[t].count++;
+        oldid[newid[i]] = i;
+    }
+
+    //区画をまたぐ道路の両端が境界の交差点
+    for(i = 0; i < crossing_number; ++i){
+        overlay[i] = -1;
+    }
+    for(i = 0; i < crossing_number; ++i){
+        for(j = 0; j < cross[i].points; ++j){
+            if(cell[i] != cell[cross[i].next[j]]){
+                overlay[newid[i]] = overlay[newid[cross[i].next[j]]] = 0;
+                cut_number++;
+            }
+        }
+    }
+    for(i = 0; i < crossing_number; ++i){
+        if(overlay[i] == 0){
+            t = grid[cell[oldid[i]]];
+            if(tile[t].boundary_number == 0){
+                tile[t].overlay = overlay_number;
+            }
+            tile[t].boundary_number++;
+            overlay[i] = overlay_number++;
+        }
+    }
+
+    if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+        perror(dir);
+        goto buildend;
+    }
+    //区画ごとのファイル
+    for(t = 0; t < tile_number; ++t){
+        tile_filename(filename, sizeof(filename), dir, t);
+        fp = fopen(filename, "wb");
+        if(fp == NULL){
+            perror(filename);
+            goto buildend;
+        }
+        header[0] = TILE_MAGIC;
+        header[1] = tile[t].count;
+        header[2] = 0;
+        names = 0;
+        for(k = 0; k < tile[t].count; ++k){
+            i = oldid[tile[t].first + k];
+            header[2] += cross[i].points;
+            names += strlen(cross[i].jname) + strlen(cross[i].ename) + 2;
+        }
+        header[3] = (int)names;
+        fwrite(header, sizeof(int), 4, fp);
+        for(k = 0; k < tile[t].count; ++k){
+            fwrite(&cross[oldid[tile[t].first + k]].pos.x, sizeof(double), 1, fp);
+        }
+        for(k = 0; k < tile[t].count; ++k){
+            fwrite(&cross[oldid[tile[t].first + k]].pos.y, sizeof(double), 1, fp);
+        }
+        for(k = 0; k < tile[t].count; ++k){
+            fwrite(&cross[oldid[tile[t].first + k]].wait, sizeof(double), 1, fp);
+        }
+        for(k = 0, a = 0; k <= tile[t].count; ++k){
+            fwrite(&a, sizeof(int), 1, fp);
+            if(k < tile[t].count){
+                a += cross[oldid[tile[t].first + k]].points;
+            }
+        }
+        for(k = 0; k < tile[t].count; ++k){
+            i = oldid[tile[t].first + k];
+            for(j = 0; j < cross[i].points; ++j){
+                fwrite(&newid[cross[i].next[j]], sizeof(int), 1, fp);
+            }
+        }
+        for(k = 0; k < tile[t].count; ++k){
+            i = oldid[tile[t].first + k];
+            fwrite(cross[i].length, sizeof(double), cross[i].points, fp);
+        }
+        for(k = 0, a = 0; k < tile[t].count; ++k){
+            fwrite(&a, sizeof(int), 1, fp);
+            a += strlen(cross[oldid[tile[t].first + k]].jname) + strlen(cross[oldid[tile[t].first + k]].ename) + 2;
+        }
+        for(k = 0, a = 0; k < tile[t].count; ++k){
+            a += strlen(cross[oldid[tile[t].first + k]].jname) + 1;
+            fwrite(&a, sizeof(int), 1, fp);
+            a += strlen(cross[oldid[tile[t].first + k]].ename) + 1;
+        }
+        for(k = 0; k < tile[t].count; ++k){
+            i = oldid[tile[t].first + k];
+            fwrite(cross[i].jname, 1, strlen(cross[i].jname) + 1, fp);
+            fwrite(cross[i].ename, 1, strlen(cross[i].ename) + 1, fp);
+        }
+        if(fclose(fp) != 0){
+            perror(filename);
+            fp = NULL;
+            goto buildend;
+        }
+        fp = NULL;
+    }
+
+    //境界の交差点間の区画内での最短距離・時間
+    for(t = 0; t < tile_number; ++t){
+        k = tile[t].boundary_number;
+        tile[t].boundary = malloc(sizeof(int) * (k + 1));
+        tile[t].clique_distance = malloc(sizeof(float) * (k * k + 1));
+        tile[t].clique_time = malloc(sizeof(float) * (k * k + 1));
+        if(tile[t].boundary == NULL || tile[t].clique_distance == NULL || tile[t].clique_time == NULL){
+            goto buildend;
+        }
+    }
+    for(i = 0; i < crossing_number; ++i){
+        if(overlay[i] != -1){
+            t = grid[cell[oldid[i]]];
+            tile[t].boundary[overlay[i] - tile[t].overlay] = i;
+        }
+    }
+    for(t = 0; t < tile_number; ++t){
+        if(tile[t].boundary_number == 0){
+            continue;
+        }
+        tile_filename(filename, sizeof(filename), dir, t);
+        d = tile_read(filename, tile[t].first);
+        if(d == NULL || tile_clique(&tile[t], d, 0, speed) < 0 || tile_clique(&tile[t], d, 1, speed) < 0){
+            free(d);
+            goto buildend;
+        }
+        free(d);
+    }
+
+    //区画の一覧と上位のグラフ
+    snprintf(filename, sizeof(filename), "%s/overlay.bin", dir);
+    fp = fopen(filename, "wb");
+    if(fp == NULL){
+        perror(filename);
+        goto buildend;
+    }
+    header[0] = TILE_MAGIC;
+    header[1] = cols;
+    header[2] = rows;
+    header[3] = tile_number;
+    header[4] = crossing_number;
+    header[5] = overlay_number;
+    header[6] = cut_number;
+    geometry[0] = size;
+    geometry[1] = min_x;
+    geometry[2] = min_y;
+    geometry[3] = speed;
+    fwrite(header, sizeof(int), 7, fp);
+    fwrite(geometry, sizeof(double), 4, fp);
+    for(t = 0; t < tile_number; ++t){
+        k = tile[t].boundary_number;
+        fwrite(&tile[t].row, sizeof(int), 1, fp);
+        fwrite(&tile[t].col, sizeof(int), 1, fp);
+        fwrite(&tile[t].first, sizeof(int), 1, fp);
+        fwrite(&tile[t].count, sizeof(int), 1, fp);
+        fwrite(&k, sizeof(int), 1, fp);
+        fwrite(tile[t].boundary, sizeof(int), k, fp);
+        for(i = 0; i < k; ++i){
+            fwrite(&cross[oldid[tile[t].boundary[i]]].wait, sizeof(double), 1, fp);
+        }
+        fwrite(tile[t].clique_distance, sizeof(float), k * k, fp);
+        fwrite(tile[t].clique_time, sizeof(float), k * k, fp);
+    }
+    //区画をまたぐ道路(上位のグラフの番号のCSR形式)
+    for(i = 0, a = 0; i <= crossing_number; ++i){
+        if(i == crossing_number || overlay[i] != -1){
+            fwrite(&a, sizeof(int), 1, fp);
+        }
+        if(i < crossing_number && overlay[i] != -1){
+            b = oldid[i];
+            for(j = 0; j < cross[b].points; ++j){
+                a += (cell[b] != cell[cross[b].next[j]]);
+            }
+        }
+    }
+    for(i = 0; i < crossing_number; ++i){
+        b = oldid[i];
+        for(j = 0; j < cross[b].points; ++j){
+            if(cell[b] != cell[cross[b].next[j]]){
+                fwrite(&overlay[newid[cross[b].next[j]]], sizeof(int), 1, fp);
+            }
+        }
+    }
+    for(i = 0; i < crossing_number; ++i){
+        b = oldid[i];
+        for(j = 0; j < cross[b].points; ++j){
+            if(cell[b] != cell[cross[b].next[j]]){
+                fwrite(&cross[b].length[j], sizeof(double), 1, fp);
+            }
+        }
+    }
+    if(fclose(fp) != 0){
+        perror(filename);
+        fp = NULL;
+        goto buildend;
+    }
+    fp = NULL;
+
+    //元の交差点番号との対応
+    snprintf(filename, sizeof(filename), "%s/ids.txt", dir);
+    fp = fopen(filename, "w");
+    if(fp != NULL){
+        for(i = 0; i < crossing_number; ++i){
+            fprintf(fp, "%d,%d\n", i, cross[oldid[i]].id);
+        }
+        fclose(fp);
+        fp = NULL;
+    }
+    printf("区画 %d 個(%d x %d, %.1lfkm)  境界の交差点 %d  区画をまたぐ道路 %d  %.1lfms\n",
+           tile_number, cols, rows, size, overlay_number, cut_number, elapsed_ms(&begin));
+    result = 0;
+
+    buildend:
+    if(fp != NULL){
+        fclose(fp);
+    }
+    if(tile != NULL){
+        for(t = 0; t < tile_number; ++t){
+            free(tile[t].boundary);
+            free(tile[t].clique_distance);
+            free(tile[t].clique_time);
+        }
+    }
+    free(tile);
+    free(grid);
+    free(fill);
+    free(cell);
+    free(newid);
+    free(oldid);
+    free(overlay);
+    return result;
+}
+
+//区画の一覧と上位のグラフを読み込んで，区画の先読みスレッドを始める関数
+static void *tile_prefetch_worker(void *arg);
+static int tile_open(char const *dir, size_t budget){
+    char filename[PATH_MAX + 32];
+    FILE *fp;
+    int header[7], t, k, ok = 1;
+    double geometry[4];
+    Tile *tl;
+
+    memset(&tiles, 0, sizeof(tiles));
+    snprintf(tiles.dir, sizeof(tiles.dir), "%s", dir);
+    snprintf(filename, sizeof(filename), "%s/overlay.bin", dir);
+    fp = fopen(filename, "rb");
+    if(fp == NULL){
+        perror(filename);
+        return -1;
+    }
+    if(fread(header, sizeof(int), 7, fp) != 7 || header[0] != TILE_MAGIC
+       || fread(geometry, sizeof(double), 4, fp) != 4){
+        fprintf(stderr, "%s: invalid overlay\n", filename);
+        fclose(fp);
+        return -1;
+    }
+    tiles.cols = header[1];
+    tiles.rows = header[2];
+    tiles.tile_number = header[3];
+    tiles.crossing_number = header[4];
+    tiles.overlay_number = header[5];
+    tiles.size = geometry[0];
+    tiles.origin_x = geometry[1];
+    tiles.origin_y = geometry[2];
+    tiles.speed = geometry[3];
+    tiles.budget = budget;
+    tiles.tile = calloc(tiles.tile_number, sizeof(Tile));
+    tiles.grid = malloc(sizeof(int) * tiles.cols * tiles.rows);
+    tiles.overlay_tile = malloc(sizeof(int) * (tiles.overlay_number + 1));
+    tiles.overlay_id = malloc(sizeof(int) * (tiles.overlay_number + 1));
+    tiles.overlay_wait = malloc(sizeof(double) * (tiles.overlay_number + 1));
+    tiles.cut_offset = malloc(sizeof(int) * (tiles.overlay_number + 1));
+    tiles.cut_target = malloc(sizeof(int) * (header[6] + 1));
+    tiles.cut_length = malloc(sizeof(double) * (header[6] + 1));
+    if(tiles.tile == NULL || tiles.grid == NULL || tiles.overlay_tile == NULL || tiles.overlay_id == NULL
+       || tiles.overlay_wait == NULL || tiles.cut_offset == NULL || tiles.cut_target == NULL || tiles.cut_length == NULL){
+        fclose(fp);
+        return -1;
+    }
+    for(k = 0; k < tiles.cols * tiles.rows; ++k){
+        tiles.grid[k] = -1;
+    }
+    for(t = 0, k = 0; t < tiles.tile_number && ok; ++t){
+        tl = &tiles.tile[t];
+        ok = fread(&tl->row, sizeof(int), 1, fp) == 1 && fread(&tl->col, sizeof(int), 1, fp) == 1
+             && fread(&tl->first, sizeof(int), 1, fp) == 1 && fread(&tl->count, sizeof(int), 1, fp) == 1
+             && fread(&tl->boundary_number, sizeof(int), 1, fp) == 1
+             && tl->row >= 0 && tl->row < tiles.rows && tl->col >= 0 && tl->col < tiles.cols
+             && tl->boundary_number >= 0 && k + tl->boundary_number <= tiles.overlay_number;
+        if(!ok){
+            break;
+        }
+        tl->overlay = k;
+        tl->boundary = &tiles.overlay_id[k];
+        tl->clique_distance = malloc(sizeof(float) * (tl->boundary_number * tl->boundary_number + 1));
+        tl->clique_time = malloc(sizeof(float) * (tl->boundary_number * tl->boundary_number + 1));
+        ok = tl->clique_distance != NULL && tl->clique_time != NULL
+             && fread(tl->boundary, sizeof(int), tl->boundary_number, fp) == (size_t)tl->boundary_number
+             && fread(&tiles.overlay_wait[k], sizeof(double), tl->boundary_number, fp) == (size_t)tl->boundary_number
+             && fread(tl->clique_distance, sizeof(float), tl->boundary_number * tl->boundary_number, fp)
+                == (size_t)(tl->boundary_number * tl->boundary_number)
+             && fread(tl->clique_time, sizeof(float), tl->boundary_number * tl->boundary_number, fp)
+                == (size_t)(tl->boundary_number * tl->boundary_number);
+        tiles.grid[tl->row * tiles.cols + tl->col] = t;
+        for(; k < tl->overlay + tl->boundary_number; ++k){
+            tiles.overlay_tile[k] = t;
+        }
+    }
+    ok = ok && fread(tiles.cut_offset, sizeof(int), tiles.overlay_number + 1, fp) == (size_t)tiles.overlay_number + 1
+         && fread(tiles.cut_target, sizeof(int), header[6], fp) == (size_t)header[6]
+         && fread(tiles.cut_length, sizeof(double), header[6], fp) == (size_t)header[6];
+    fclose(fp);
+    if(!ok){
+        fprintf(stderr, "%s: invalid overlay\n", filename);
+        return -1;
+    }
+    pthread_mutex_init(&tiles.lock, NULL);
+    pthread_cond_init(&tiles.changed, NULL);
+    if(map_thread_create(&tiles.prefetch, tile_prefetch_worker, NULL) != 0){
+        fprintf(stderr, "%s: couldn't start prefetch thread\n", dir);
+        return -1;
+    }
+    return 0;
+}
+
+//先読みスレッドを止めて，すべて解放する関数
+static void tile_close(void){
+    int t;
+    pthread_mutex_lock(&tiles.lock);
+    tiles.stop = 1;
+    pthread_cond_broadcast(&tiles.changed);
+    pthread_mutex_unlock(&tiles.lock);
+    pthread_join(tiles.prefetch, NULL);
+    for(t = 0; t < tiles.tile_number; ++t){
+        free(tiles.tile[t].data);
+        free(tiles.tile[t].clique_distance);
+        free(tiles.tile[t].clique_time);
+    }
+    free(tiles.tile);
+    free(tiles.grid);
+    free(tiles.overlay_tile);
+    free(tiles.overlay_id);
+    free(tiles.overlay_wait);
+    free(tiles.cut_offset);
+    free(tiles.cut_target);
+    free(tiles.cut_length);
+    pthread_mutex_destroy(&tiles.lock);
+    pthread_cond_destroy(&tiles.changed);
+}
+
+//交差点が属する区画を探す関数(区画は番号順に並んでいる)
+static int tile_of(int id){
+    int lo = 0, hi = tiles.tile_number - 1, mid;
+    while(lo < hi){
+        mid = (lo + hi + 1) / 2;
+        if(tiles.tile[mid].first <= id){
+            lo = mid;
+        }
+        else{
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+//メモリの上限を超えていれば，使用中でない区画を古いものから追い出す関数(lockを持って呼ぶ)
+static void tile_evict_locked(void){
+    int t, oldest;
+    while(tiles.bytes > tiles.budget){
+        oldest = -1;
+        for(t = 0; t < tiles.tile_number; ++t){
+            if(tiles.tile[t].data != NULL && tiles.tile[t].pin == 0
+               && (oldest == -1 || tiles.tile[t].used < tiles.tile[oldest].used)){
+                oldest = t;
+            }
+        }
+        if(oldest == -1){
+            break;      /* すべて使用中なら上限を超えても持っておく */
+        }
+        tiles.bytes -= tiles.tile[oldest].data->bytes;
+        free(tiles.tile[oldest].data);
+        tiles.tile[oldest].data = NULL;
+        tiles.evictions++;
+    }
+}
+
+//区画を読み込む関数(lockを持って呼び，ファイルを読む間だけ離す)
+static void tile_fetch_locked(int t){
+    Tile *tl = &tiles.tile[t];
+    char filename[PATH_MAX + 32];
+    TileData *d;
+
+    tl->loading = 1;
+    pthread_mutex_unlock(&tiles.lock);
+    tile_filename(filename, sizeof(filename), tiles.dir, t);
+    d = tile_read(filename, tl->first);
+    pthread_mutex_lock(&tiles.lock);
+    tl->loading = 0;
+    tl->data = d;
+    if(d != NULL){
+        tl->used = ++tiles.clock;
+        tiles.bytes += d->bytes;
+        tiles.loads++;
+        if(tiles.bytes > tiles.peak){
+            tiles.peak = tiles.bytes;
+        }
+        tile_evict_locked();
+    }
+    pthread_cond_broadcast(&tiles.changed);
+}
+
+//区画を使う関数(読み込んでいなければ読み込み，tile_releaseまで追い出さない)
+static TileData *tile_acquire(int t){
+    Tile *tl = &tiles.tile[t];
+    TileData *d;
+
+    pthread_mutex_lock(&tiles.lock);
+    tl->pin++;
+    while(tl->data == NULL){
+        if(tl->loading){
+            pthread_cond_wait(&tiles.changed, &tiles.lock);     /* 先読みスレッドが読み込み中 */
+            continue;
+        }
+        tile_fetch_locked(t);
+        if(tl->data == NULL){
+            tl->pin--;
+            pthread_mutex_unlock(&tiles.lock);
+            return NULL;
+        }
+    }
+    tl->used = ++tiles.clock;
+    d = tl->data;
+    pthread_mutex_unlock(&tiles.lock);
+    return d;
+}
+
+static void tile_release(int t){
+    pthread_mutex_lock(&tiles.lock);
+    tiles.tile[t].pin--;
+    tile_evict_locked();
+    pthread_mutex_unlock(&tiles.lock);
+}
+
+//区画の先読みを頼む関数(待たずに戻る)
+static void tile_request(int t){
+    pthread_mutex_lock(&tiles.lock);
+    if(tiles.tile[t].data == NULL && !tiles.tile[t].loading && tiles.queue_number < MaxTilePrefetch){
+        tiles.queue[(tiles.queue_head + tiles.queue_number++) % MaxTilePrefetch] = t;
+        pthread_cond_broadcast(&tiles.changed);
+    }
+    pthread_mutex_unlock(&tiles.lock);
+}
+
+static void *tile_prefetch_worker(void *arg){
+    int t;
+    pthread_mutex_lock(&tiles.lock);
+    while(1){
+        while(tiles.queue_number == 0 && !tiles.stop){
+            pthread_cond_wait(&tiles.changed, &tiles.lock);
+        }
+        if(tiles.stop){
+            break;
+        }
+        t = tiles.queue[tiles.queue_head];
+        tiles.queue_head = (tiles.queue_head + 1) % MaxTilePrefetch;
+        tiles.queue_number--;
+        if(tiles.tile[t].data == NULL && !tiles.tile[t].loading){
+            tile_fetch_locked(t);
+            tiles.prefetched++;
+        }
+    }
+    pthread_mutex_unlock(&tiles.lock);
+    return NULL;
 }
-//合計時間計算
-double calculate_time(int path[],double speed){
-    int i = 0;
-    double all_time = 0.0;
+
+//車の速度が変わったら，境界の交差点間の最短時間を求め直す関数(区画を1つずつ読み込む)
+static int tile_customize(double speed){
+    struct timespec begin;
+    TileData *d;
+    int t;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for(t = 0; t < tiles.tile_number; ++t){
+        if(tiles.tile[t].boundary_number == 0){
+            continue;
+        }
+        d = tile_acquire(t);
+        if(d == NULL || tile_clique(&tiles.tile[t], d, 1, speed) < 0){
+            if(d != NULL){
+                tile_release(t);
+            }
+            return -1;
+        }
+        tile_release(t);
+    }
+    tiles.speed = speed;
+    printf("速度%.1lfkm/hの区画内の最短時間を求め直しました(%.1lfms)\n", speed, elapsed_ms(&begin));
+    return 0;
+}
+
+//区画内の探索結果からたどった経路をpathのn番目以降に追加して，新しい長さを返す関数(from自身は追加しない)
+//backwardなら目的地への次の交差点をたどってfromから目的地まで，でなければtoから逆にたどってfromの次からtoまで
+static int tile_append(TileData const *d, int const previous[], int from, int to, int backward,
+                       int path[], int n, int maxpath){
+    int c, k, i;
+    if(backward){
+        for(c = previous[from]; c != -1; c = previous[c]){
+            if(n >= maxpath - 1){
+                return -1;
+            }
+            path[n++] = d->first + c;
+        }
+        return n;
+    }
+    for(k = 0, c = to; c != from && c != -1; c = previous[c]){
+        k++;
+    }
+    if(c == -1 || n + k >= maxpath){
+        return -1;
+    }
+    for(i = n + k, c = to; c != from; c = previous[c]){
+        path[--i] = d->first + c;
+    }
+    return n + k;
+}
+
+//区画に分けた地図での経路探索(metric 0:距離 1:時間)
+//出発地の区画内と目的地の区画内を探索し，その間は境界の交差点からなる上位のグラフで探す
+//経路をpathに-1終端で入れて合計の評価値を返す(たどり着けなければ負)
+static double tile_route(int start, int goal, int metric, double speed, int path[], int maxpath){
+    int ts = tile_of(start), tg = tile_of(goal);
+    TileData *ds, *dg, *d;
+    double *forward = NULL, *backward = NULL, *label = NULL, *local = NULL;
+    int *forward_prev = NULL, *backward_prev = NULL, *previous = NULL, *local_prev = NULL, *chain = NULL;
+    HeapNode *heap = NULL;
+    int cap = 0, heap_size = 0;
+    HeapNode top;
+    Tile *tl;
+    int i, j, k, u, v, t, n, via = -1, length;
+    double best = 1e100, c, cost = -1;
+    float const *clique;
+    PROF_BEGIN(scope);
+
+    if(metric == 1 && speed != tiles.speed && tile_customize(speed) < 0){
+        return -1;
+    }
+    ds = tile_acquire(ts);
+    dg = tile_acquire(tg);
+    if(ds == NULL || dg == NULL){
+        goto routeend;
+    }
+    forward = malloc(sizeof(double) * ds->count);
+    forward_prev = malloc(sizeof(int) * ds->count);
+    backward = malloc(sizeof(double) * dg->count);
+    backward_prev = malloc(sizeof(int) * dg->count);
+    label = malloc(sizeof(double) * (tiles.overlay_number + 1));
+    previous = malloc(sizeof(int) * (tiles.overlay_number + 1));
+    chain = malloc(sizeof(int) * (tiles.overlay_number + 1));
+    if(forward == NULL || forward_prev == NULL || backward == NULL || backward_prev == NULL
+       || label == NULL || previous == NULL || chain == NULL){
+        goto routeend;
+    }
+
+    //出発地から区画内へ，目的地へ向かって区画内から
+    if(tile_local_search(ds, start - ds->first, 0, metric, speed, forward, forward_prev, &heap, &cap) < 0
+       || tile_local_search(dg, goal - dg->first, 1, metric, speed, backward, backward_prev, &heap, &cap) < 0){
+        goto routeend;
+    }
+    if(ts == tg){
+        best = forward[goal - ds->first];
+    }
+
+    //上位のグラフで，出発地の区画の境界から目的地の区画の境界まで
+    for(u = 0; u < tiles.overlay_number; ++u){
+        label[u] = 1e100;
+        previous[u] = -1;
+    }
+    tl = &tiles.tile[ts];
+    for(i = 0; i < tl->boundary_number; ++i){
+        c = forward[tl->boundary[i] - ds->first];
+        if(c < 1e100){
+            label[tl->overlay + i] = c;
+            if(heap_push_grow(&heap, &heap_size, &cap, c, tl->overlay + i) < 0){
+                goto routeend;
+            }
+        }
+    }
+    while(heap_size > 0){
+        top = heap_pop(heap, &heap_size);
+        if(top.key > label[top.id]){
+            continue;
+        }
+        if(top.key >= best){
+            break;      /* これより先は目的地までの最短を超える */
+        }
+        PROF_COUNT(settled, 1);
+        u = top.id;
+        t = tiles.overlay_tile[u];
+        tl = &tiles.tile[t];
+        if(t == tg){
+            c = top.key + backward[tiles.overlay_id[u] - dg->first];
+            if(c < best){
+                best = c;
+                via = u;
+            }
+        }
+        //同じ区画の境界の交差点へ(区画内の最短)
+        k = tl->boundary_number;
+        clique = ((metric == 0) ? tl->clique_distance : tl->clique_time) + (u - tl->overlay) * k;
+        for(j = 0; j < k; ++j){
+            v = tl->overlay + j;
+            c = top.key + clique[j];
+            if(label[v] > c){
+                label[v] = c;
+                previous[v] = u;
+                PROF_COUNT(relaxed, 1);
+                if(heap_push_grow(&heap, &heap_size, &cap, c, v) < 0){
+                    goto routeend;
+                }
+            }
+        }
+        //隣の区画へ
+        for(j = tiles.cut_offset[u]; j < tiles.cut_offset[u + 1]; ++j){
+            v = tiles.cut_target[j];
+            c = top.key + ((metric == 0) ? tiles.cut_length[j]
+                                         : tiles.cut_length[j] / (speed / 60) + tiles.overlay_wait[u]);
+            if(label[v] > c){
+                label[v] = c;
+                previous[v] = u;
+                PROF_COUNT(relaxed, 1);
+                if(heap_push_grow(&heap, &heap_size, &cap, c, v) < 0){
+                    goto routeend;
+                }
+            }
+        }
+    }
+    if(best >= 1e100){
+        goto routeend;
+    }
+
+    //経路を組み立てる
+    path[0] = start;
+    n = 1;
+    if(via == -1){
+        n = tile_append(ds, forward_prev, start - ds->first, goal - ds->first, 0, path, n, maxpath);
+    }
+    else{
+        for(length = 0, u = via; u != -1; u = previous[u]){
+            chain[length++] = u;
+        }
+        //通る区画を先に読み込んでおく
+        for(i = length - 1; i >= 0; --i){
+            tile_request(tiles.overlay_tile[chain[i]]);
+        }
+        n = tile_append(ds, forward_prev, start - ds->first, tiles.overlay_id[chain[length - 1]] - ds->first, 0,
+                        path, n, maxpath);
+        for(i = length - 1; i > 0 && n >= 0; --i){
+            u = chain[i];
+            v = chain[i - 1];
+            t = tiles.overlay_tile[u];
+            if(t != tiles.overlay_tile[v]){
+                path[n++] = tiles.overlay_id[v];    /* 区画をまたぐ道路 */
+                if(n >= maxpath){
+                    n = -1;
+                }
+                continue;
+            }
+            //区画内の最短経路を探し直す
+            d = tile_acquire(t);
+            if(d == NULL){
+                n = -1;
+                break;
+            }
+            local = realloc(local, sizeof(double) * d->count);
+            local_prev = realloc(local_prev, sizeof(int) * d->count);
+            if(local == NULL || local_prev == NULL
+               || tile_local_search(d, tiles.overlay_id[u] - d->first, 0, metric, speed, local, local_prev, &heap, &cap) < 0){
+                tile_release(t);
+                n = -1;
+                break;
+            }
+            n = tile_append(d, local_prev, tiles.overlay_id[u] - d->first, tiles.overlay_id[v] - d->first, 0,
+                            path, n, maxpath);
+            tile_release(t);
+        }
+        if(n >= 0){
+            n = tile_append(dg, backward_prev, tiles.overlay_id[via] - dg->first, goal - dg->first, 1, path, n, maxpath);
+        }
+    }
+    if(n < 0){
+        goto routeend;
+    }
+    path[n] = -1;
+    cost = (metric == 1 && start != goal) ? best - ds->wait[start - ds->first] : best;   /* 出発地での待ち時間は含めない */
+
+    routeend:
+    if(ds != NULL){
+        tile_release(ts);
+    }
+    if(dg != NULL){
+        tile_release(tg);
+    }
+    free(forward);
+    free(forward_prev);
+    free(backward);
+    free(backward_prev);
+    free(label);
+    free(previous);
+    free(chain);
+    free(local);
+    free(local_prev);
+    free(heap);
+    PROF_END(scope, "tile_route");
+    return cost;
+}
+
+//交差点の位置を調べる関数(区画を読み込む)
+static int tile_position(int id, double *x, double *y){
+    int t = tile_of(id);
+    TileData *d = tile_acquire(t);
+    if(d == NULL){
+        return -1;
+    }
+    *x = d->x[id - d->first];
+    *y = d->y[id - d->first];
+    tile_release(t);
+    return 0;
+}
+
+//(x, y)から半径radiusの範囲の区画を描く関数
+//読み込んでいない区画は先読みを頼み，読み込めたものから描く
+static void tile_show(double x, double y, double radius){
+    int col0 = (int)floor((x - radius - tiles.origin_x) / tiles.size);
+    int col1 = (int)floor((x + radius - tiles.origin_x) / tiles.size);
+    int row0 = (int)floor((y - radius - tiles.origin_y) / tiles.size);
+    int row1 = (int)floor((y + radius - tiles.origin_y) / tiles.size);
+    int row, col, t, i, k, tt;
+    TileData const *d, *o;
+
+    col0 = (col0 < 0) ? 0 : col0;
+    row0 = (row0 < 0) ? 0 : row0;
+    col1 = (col1 >= tiles.cols) ? tiles.cols - 1 : col1;
+    row1 = (row1 >= tiles.rows) ? tiles.rows - 1 : row1;
+    for(row = row0; row <= row1; ++row){
+        for(col = col0; col <= col1; ++col){
+            t = tiles.grid[row * tiles.cols + col];
+            if(t == -1){
+                continue;
+            }
+            pthread_mutex_lock(&tiles.lock);
+            d = tiles.tile[t].data;
+            if(d == NULL){
+                pthread_mutex_unlock(&tiles.lock);
+                tile_request(t);
+                continue;
+            }
+            tiles.tile[t].used = ++tiles.clock;
+            glColor3d(1.0, 0.5, 0.5);
+            glBegin(GL_POINTS);
+            for(i = 0; i < d->count; ++i){
+                glVertex2d(d->x[i], d->y[i]);
+            }
+            glEnd();
+            glColor3d(1.0, 1.0, 1.0);
+            glBegin(GL_LINES);
+            for(i = 0; i < d->count; ++i){
+                for(k = d->offset[i]; k < d->offset[i + 1]; ++k){
+                    //隣の区画へ出る道路は，その区画も読み込んであれば描く
+                    tt = (d->target[k] - d->first >= 0 && d->target[k] - d->first < d->count) ? t : tile_of(d->target[k]);
+                    o = tiles.tile[tt].data;
+                    if(o == NULL){
+                        continue;
+                    }
+                    glVertex2d(d->x[i], d->y[i]);
+                    glVertex2d(o->x[d->target[k] - o->first], o->y[d->target[k] - o->first]);
+                }
+            }
+            glEnd();
+            pthread_mutex_unlock(&tiles.lock);
+        }
+    }
+}
+
+//区画に分けた地図で経路を求め，経路に沿って視点を動かしながら表示する関数
+//  CarNavi tiles ディレクトリ 出発地 目的地 [メモリの上限MB] [車の速度]
+static int tile_viewer(char const *dir, int start, int goal, int budget_mb, double speed){
+    struct timespec begin;
+    int *path;
+    double *px, *py;
+    double range_z = 3.0, x, y, cost, f;
+    int n, k, i, frame = 0;
+    char name[2][MaxName * 2 + 4];
+    TileData *d;
+
+    if(tile_open(dir, (size_t)budget_mb << 20) < 0){
+        return 1;
+    }
+    if(start < 0 || start >= tiles.crossing_number || goal < 0 || goal >= tiles.crossing_number){
+        fprintf(stderr, "tiles: invalid crossing\n");
+        tile_close();
+        return 1;
+    }
+    path = malloc(sizeof(int) * (tiles.crossing_number + 1));
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    cost = tile_route(start, goal, 1, speed, path, tiles.crossing_number + 1);
+    if(cost < 0){
+        printf("目的地までの経路が見つかりませんでした\n");
+        free(path);
+        tile_close();
+        return 1;
+    }
+    for(n = 0; path[n] != -1; ++n){
+    }
+    for(k = 0; k < 2; ++k){
+        i = (k == 0) ? start : goal;
+        d = tile_acquire(tile_of(i));
+        if(d == NULL){
+            snprintf(name[k], sizeof(name[k]), "%d", i);
+            continue;
+        }
+        snprintf(name[k], sizeof(name[k]), "%s  %s", d->names + d->jname[i - d->first], d->names + d->ename[i - d->first]);
+        tile_release(tile_of(i));
+    }
+    printf("'%s'から'%s'まで  所要時間: %.2lf分  交差点 %d か所  経路探索 %.2lfms\n",
+           name[0], name[1], cost, n, elapsed_ms(&begin));
+
+    //経路上の交差点の位置(前から順に区画を読み込む)
+    px = malloc(sizeof(double) * n);
+    py = malloc(sizeof(double) * n);
+    for(k = 0; k < n; ++k){
+        tile_position(path[k], &px[k], &py[k]);
+    }
+
+    printf("---操作方法-----------------------------------------\n");
+    printf("Escキーで終了\n");
+    printf("Eで視点が上昇、Qで視点が降下\n");
+    printf("----------------------------------------------------\n");
+    glfwInit();
+    glfwOpenWindow(1000, 800, 0, 0, 0, 0, 0, 0, GLFW_WINDOW);
     while(1){
-        if(path[i+1] == -1){
+        /* Esc が押されるかウィンドウが閉じられたらおしまい */
+        if (glfwGetKey(GLFW_KEY_ESC) || !glfwGetWindowParam(GLFW_OPENED)){
             break;
         }
-        all_time = all_time + cross[path[i]].wait + distance(path[i],path[i+1]) / (speed/60);
-        i++;
+        if(glfwGetKey(69)){
+            range_z = range_z + 0.5;
+        }
+        if(glfwGetKey(81)){
+            if(range_z >= 1.0){
+                range_z = range_z - 0.5;
+            }
+        }
+        //1フレームに交差点の1/10ずつ経路をたどり，先の区画を先読みする
+        k = (frame / 10 < n - 1) ? frame / 10 : n - 1;
+        f = (k < n - 1) ? (frame % 10) / 10.0 : 0.0;
+        x = px[k] + ((k < n - 1) ? (px[k + 1] - px[k]) * f : 0.0);
+        y = py[k] + ((k < n - 1) ? (py[k + 1] - py[k]) * f : 0.0);
+        if(frame % 10 == 0){
+            for(i = k; i < n && i < k + TILE_AHEAD; i += 10){
+                tile_request(tile_of(path[i]));
+            }
+        }
+        frame++;
+
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        gluPerspective(120.0,1.0,0,50);
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+        glTranslated(-x, -y, -range_z);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        tile_show(x, y, range_z * 2.0);
+        glLineWidth(6.0);
+        glColor3d(0.2, 0.2, 1.0);
+        glBegin(GL_LINE_STRIP);
+        for(i = 0; i < n; ++i){
+            glVertex2d(px[i], py[i]);
+        }
+        glEnd();
+        glLineWidth(1.0);
+        glColor3d(1.0, 1.0, 1.0);
+        draw_ball(x, y, MARKER_RADIUS);
+
+        glfwSwapBuffers();
+        usleep(window_speed*1000);
+    }
+    glfwTerminate();
+
+    printf("区画の読み込み %ld 回(先読み %ld 回)  追い出し %ld 回  最大メモリ %.1lfMB(上限 %dMB)\n",
+           tiles.loads, tiles.prefetched, tiles.evictions, tiles.peak / 1048576.0, budget_mb);
+    free(px);
+    free(py);
+    free(path);
+    tile_close();
+    return 0;
+}
+
+//--------------------------多階層の上位グラフ(CRP)---------------------------
+//地図を評価値によらない入れ子の領域(セル)に分け，評価値ごとに各セルの境界の交差点間の最短を求めておく(カスタマイズ)
+//評価値を変えたり道路の混雑が変わったりしても，カスタマイズをやり直すだけで速い経路探索が使える
+//  分割   : 位置の中央値で2つに分けることを繰り返す(交差点数が CRP_CELL 程度になるまで)
+//  階層 l : 2^(CRP_FANOUT_BITS) 個の階層 l-1 のセルをまとめたもの(階層1が一番細かい)
+#define MaxCrpLevel     4           /* 最大の階層数 */
+#define CRP_CELL        128         /* 階層1のセルの交差点数の目安 */
+#define CRP_FANOUT_BITS 3           /* 1つ上の階層でまとめるセルの数(2の何乗か) */
+
+//評価値の種類
+typedef struct {
+    int metric;             /* 0:距離 1:時間 */
+    double speed;           /* 車の速度[km/h] */
+    float *traffic;         /* 道路ごとの所要時間の倍率(交差点 * 5 + 道路番号，NULLなら混雑なし) */
+} CostProfile;
+
+//評価値ごとのカスタマイズの結果
+typedef struct {
+    CostProfile profile;
+    float *weight[MaxCrpLevel + 1];     /* 階層ごと，セルごとの境界の交差点間の最短(k * k) */
+} CrpMetric;
+
+//評価値によらない分割
+static struct {
+    int crossing_number;
+    int levels;
+    int *cell[MaxCrpLevel + 1];         /* 交差点の各階層でのセル番号 */
+    int cell_number[MaxCrpLevel + 1];
+    int *boundary_offset[MaxCrpLevel + 1];  /* セルcの境界の交差点は boundary[l][boundary_offset[l][c]]～ */
+    int *boundary[MaxCrpLevel + 1];
+    int *boundary_index[MaxCrpLevel + 1];   /* セルの境界の中での順番(境界でなければ-1) */
+    long *weight_offset[MaxCrpLevel + 1];   /* セルcの最短の表の位置 */
+    long weight_number[MaxCrpLevel + 1];
+} crp;
+
+//探索の作業領域(スレッドごと，番号は全体の交差点番号)
+typedef struct {
+    double *label;
+    int *previous;
+    signed char *previous_level;        /* どの階層の道でpreviousから来たか(0なら元の道路) */
+    unsigned *stamp;                    /* epochと同じなら有効 */
+    unsigned epoch;
+    HeapNode *heap;
+    int cap;
+} CrpWork;
+
+//道路(交差点a のj番目)の評価値(時間なら出発する交差点の待ち時間を含む)
+static double profile_cost(CostProfile const *p, int a, int j){
+    double t;
+    if(p->metric == 0){
+        return cross[a].length[j];
+    }
+    t = cross[a].length[j] / (p->speed / 60);
+    if(p->traffic != NULL){
+        t *= p->traffic[a * 5 + j];
+    }
+    return t + cross[a].wait;
+}
+
+static int crp_work_alloc(CrpWork *w, int crossing_number){
+    memset(w, 0, sizeof(*w));
+    w->label = malloc(sizeof(double) * crossing_number);
+    w->previous = malloc(sizeof(int) * crossing_number);
+    w->previous_level = malloc(crossing_number);
+    w->stamp = calloc(crossing_number, sizeof(unsigned));
+    return (w->label && w->previous && w->previous_level && w->stamp) ? 0 : -1;
+}
+
+static void crp_work_free(CrpWork *w){
+    free(w->label);
+    free(w->previous);
+    free(w->previous_level);
+    free(w->stamp);
+    free(w->heap);
+}
+
+//探索を始める前に作業領域を全部無効にする
+static void crp_work_reset(CrpWork *w){
+    if(++w->epoch == 0){
+        memset(w->stamp, 0, sizeof(unsigned) * crp.crossing_number);
+        w->epoch = 1;
+    }
+}
+
+//作業領域の評価値を更新する(よくなればヒープに入れて1を返す)
+static int crp_relax(CrpWork *w, int heap_size[], int v, double c, int from, int level){
+    if(c >= 1e99 || (w->stamp[v] == w->epoch && w->label[v] <= c)){    /* 境界の間がつながっていない */
+        return 0;
+    }
+    w->stamp[v] = w->epoch;
+    w->label[v] = c;
+    w->previous[v] = from;
+    w->previous_level[v] = level;
+    PROF_COUNT(relaxed, 1);
+    heap_push_grow(&w->heap, heap_size, &w->cap, c, v);
+    return 1;
+}
+
+//位置で並べ替えるときの軸(分割は1つのスレッドで行う)
+static int crp_axis;
+static int compare_axis(void const *a, void const *b){
+    double x = crp_axis ? cross[*(int const *)a].pos.y : cross[*(int const *)a].pos.x;
+    double y = crp_axis ? cross[*(int const *)b].pos.y : cross[*(int const *)b].pos.x;
+    return (x > y) - (x < y);
+}
+
+//ids[0..n-1]を中央値で2つに分けることを depth 回繰り返し，各交差点に番号codeを付ける関数
+static void crp_split(int ids[], int n, int depth, int code, int code_of[]){
+    double min_x = 1e100, min_y = 1e100, max_x = -1e100, max_y = -1e100;
+    int i;
+    if(depth == 0){
+        for(i = 0; i < n; ++i){
+            code_of[ids[i]] = code;
+        }
+        return;
+    }
+    for(i = 0; i < n; ++i){
+        min_x = fmin(min_x, cross[ids[i]].pos.x);
+        max_x = fmax(max_x, cross[ids[i]].pos.x);
+        min_y = fmin(min_y, cross[ids[i]].pos.y);
+        max_y = fmax(max_y, cross[ids[i]].pos.y);
+    }
+    crp_axis = (max_y - min_y > max_x - min_x);     /* 長い方の軸で分ける */
+    qsort(ids, n, sizeof(int), compare_axis);
+    crp_split(ids, n / 2, depth - 1, code * 2, code_of);
+    crp_split(ids + n / 2, n - n / 2, depth - 1, code * 2 + 1, code_of);
+}
+
+//分割を捨てる関数
+static void crp_free(void){
+    int l;
+    for(l = 1; l <= MaxCrpLevel; ++l){
+        free(crp.cell[l]);
+        free(crp.boundary_offset[l]);
+        free(crp.boundary[l]);
+        free(crp.boundary_index[l]);
+        free(crp.weight_offset[l]);
+    }
+    memset(&crp, 0, sizeof(crp));
+}
+
+static void crp_metric_free(CrpMetric *m){
+    int l;
+    for(l = 1; l <= MaxCrpLevel; ++l){
+        free(m->weight[l]);
+        m->weight[l] = NULL;
+    }
+}
+
+//読み込んである地図を分割する関数(評価値によらない前処理)
+static int crp_build(int crossing_number){
+    int *ids = malloc(sizeof(int) * crossing_number);
+    int *code = malloc(sizeof(int) * crossing_number);
+    int depth = 0, l, i, j, c, n, shift;
+    struct timespec begin;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    crp_free();
+    crp.crossing_number = crossing_number;
+    if(ids == NULL || code == NULL){
+        free(ids);
+        free(code);
+        return -1;
+    }
+    while((crossing_number >> depth) > CRP_CELL && depth < 30){
+        depth++;
+    }
+    if(depth == 0){
+        depth = 1;
+    }
+    for(i = 0; i < crossing_number; ++i){
+        ids[i] = i;
+    }
+    crp_split(ids, crossing_number, depth, 0, code);
+    free(ids);
+
+    //階層lのセルは code の上位 depth - CRP_FANOUT_BITS * (l - 1) ビット
+    for(l = 1; l <= MaxCrpLevel && depth - CRP_FANOUT_BITS * (l - 1) >= 1; ++l){
+        shift = CRP_FANOUT_BITS * (l - 1);
+        crp.levels = l;
+        crp.cell_number[l] = 1 << (depth - shift);
+        crp.cell[l] = malloc(sizeof(int) * crossing_number);
+        crp.boundary_index[l] = malloc(sizeof(int) * crossing_number);
+        crp.boundary_offset[l] = calloc(crp.cell_number[l] + 1, sizeof(int));
+        crp.weight_offset[l] = malloc(sizeof(long) * (crp.cell_number[l] + 1));
+        if(!crp.cell[l] || !crp.boundary_index[l] || !crp.boundary_offset[l] || !crp.weight_offset[l]){
+            free(code);
+            return -1;
+        }
+        for(i = 0; i < crossing_number; ++i){
+            crp.cell[l][i] = code[i] >> shift;
+            crp.boundary_index[l][i] = -1;
+        }
+        //ほかのセルとつながる交差点が境界
+        for(i = 0; i < crossing_number; ++i){
+            for(j = 0; j < cross[i].points; ++j){
+                n = cross[i].next[j];
+                if(crp.cell[l][i] != crp.cell[l][n]){
+                    crp.boundary_index[l][i] = crp.boundary_index[l][n] = 0;
+                }
+            }
+        }
+        for(i = 0; i < crossing_number; ++i){
+            if(crp.boundary_index[l][i] == 0){
+                crp.boundary_offset[l][crp.cell[l][i] + 1]++;
+            }
+        }
+        for(c = 0; c < crp.cell_number[l]; ++c){
+            crp.boundary_offset[l][c + 1] += crp.boundary_offset[l][c];
+        }
+        crp.boundary[l] = malloc(sizeof(int) * (crp.boundary_offset[l][crp.cell_number[l]] + 1));
+        if(crp.boundary[l] == NULL){
+            free(code);
+            return -1;
+        }
+        for(c = 0; c < crp.cell_number[l]; ++c){
+            crp.weight_offset[l][c] = 0;    /* 書き込み位置に使う */
+        }
+        for(i = 0; i < crossing_number; ++i){
+            if(crp.boundary_index[l][i] == 0){
+                c = crp.cell[l][i];
+                crp.boundary_index[l][i] = (int)crp.weight_offset[l][c]++;
+                crp.boundary[l][crp.boundary_offset[l][c] + crp.boundary_index[l][i]] = i;
+            }
+        }
+        crp.weight_number[l] = 0;
+        for(c = 0; c < crp.cell_number[l]; ++c){
+            n = crp.boundary_offset[l][c + 1] - crp.boundary_offset[l][c];
+            crp.weight_offset[l][c] = crp.weight_number[l];
+            crp.weight_number[l] += (long)n * n;
+        }
+        crp.weight_offset[l][crp.cell_number[l]] = crp.weight_number[l];
+    }
+    free(code);
+    printf("分割: %d 階層", crp.levels);
+    for(l = 1; l <= crp.levels; ++l){
+        printf("  [%d] セル %d 境界 %d", l, crp.cell_number[l], crp.boundary_offset[l][crp.cell_number[l]]);
+    }
+    printf("  %.1lfms\n", elapsed_ms(&begin));
+    return 0;
+}
+
+//階層lのセルcの中だけを探索する関数(カスタマイズと経路の展開に使う)
+//階層1なら元の道路で，それより上なら階層l-1のセルの境界の間の最短とセルをまたぐ道路で進む
+static void crp_cell_search(CrpMetric const *m, int l, int c, int source, CrpWork *w){
+    int heap_size = 0;
+    HeapNode top;
+    int v, j, n, s, k, i;
+    float const *row;
+
+    crp_work_reset(w);
+    crp_relax(w, &heap_size, source, 0, -1, 0);
+    while(heap_size > 0){
+        top = heap_pop(w->heap, &heap_size);
+        v = top.id;
+        if(top.key > w->label[v]){
+            continue;
+        }
+        PROF_COUNT(settled, 1);
+        if(l > 1 && w->previous_level[v] != l - 1 && (i = crp.boundary_index[l - 1][v]) >= 0){
+            s = crp.cell[l - 1][v];
+            k = crp.boundary_offset[l - 1][s + 1] - crp.boundary_offset[l - 1][s];
+            row = &m->weight[l - 1][crp.weight_offset[l - 1][s] + (long)i * k];
+            for(j = 0; j < k; ++j){
+                crp_relax(w, &heap_size, crp.boundary[l - 1][crp.boundary_offset[l - 1][s] + j], top.key + row[j], v, l - 1);
+            }
+        }
+        for(j = 0; j < cross[v].points; ++j){
+            n = cross[v].next[j];
+            if(crp.cell[l][n] != c || (l > 1 && crp.cell[l - 1][n] == crp.cell[l - 1][v])){
+                continue;   /* セルの外か，下の階層のセルの中(上で最短を使った) */
+            }
+            crp_relax(w, &heap_size, n, top.key + profile_cost(&m->profile, v, j), v, 0);
+        }
+    }
+}
+
+//階層lのセルcの境界の交差点間の最短を求める関数
+static void crp_customize_cell(CrpMetric *m, int l, int c, CrpWork *w){
+    int first = crp.boundary_offset[l][c];
+    int k = crp.boundary_offset[l][c + 1] - first;
+    float *table = &m->weight[l][crp.weight_offset[l][c]];
+    int i, j, b;
+
+    for(i = 0; i < k; ++i){
+        crp_cell_search(m, l, c, crp.boundary[l][first + i], w);
+        for(j = 0; j < k; ++j){
+            b = crp.boundary[l][first + j];
+            table[(long)i * k + j] = (w->stamp[b] == w->epoch) ? (float)w->label[b] : (float)1e100;
+        }
+    }
+}
+
+//カスタマイズをセルごとにスレッドで分担する
+typedef struct {
+    CrpMetric *metric;
+    int level;
+    char const *dirty;              /* NULLでなければ1のセルだけ */
+    int first, step;
+} CrpWorker;
+
+static void *crp_customize_worker(void *arg){
+    CrpWorker *cw = arg;
+    CrpWork w;
+    int c;
+    if(crp_work_alloc(&w, crp.crossing_number) == 0){
+        for(c = cw->first; c < crp.cell_number[cw->level]; c += cw->step){
+            if(cw->dirty == NULL || cw->dirty[c]){
+                crp_customize_cell(cw->metric, cw->level, c, &w);
+            }
+        }
+    }
+    crp_work_free(&w);
+    return NULL;
+}
+
+//評価値profileでカスタマイズする関数(dirtyがNULLでなければ，印の付いたセルだけやり直す)
+static int crp_customize(CrpMetric *m, CostProfile const *profile, char *const dirty[]){
+    CrpWorker worker[MaxThreads];
+    int l, t, threads;
+
+    m->profile = *profile;
+    for(l = 1; l <= crp.levels; ++l){
+        if(m->weight[l] == NULL){
+            m->weight[l] = malloc(sizeof(float) * (crp.weight_number[l] + 1));
+            if(m->weight[l] == NULL){
+                return -1;
+            }
+        }
+        //下の階層の結果を使うので，階層ごとに順に
+        threads = worker_count(crp.cell_number[l]);
+        for(t = 0; t < threads; ++t){
+            worker[t].metric = m;
+            worker[t].level = l;
+            worker[t].dirty = (dirty != NULL) ? dirty[l] : NULL;
+            worker[t].first = t;
+            worker[t].step = threads;
+        }
+        map_thread_run(threads, crp_customize_worker, worker, sizeof(worker[0]));
+    }
+    return 0;
+}
+
+//道路の混雑の倍率を変えて，その道路を含むセルだけカスタマイズし直す関数
+static int crp_update_traffic(CrpMetric *m, int const road[], float const factor[], int road_number){
+    char *dirty[MaxCrpLevel + 1] = {NULL};
+    int l, k, a, b, result = -1;
+
+    for(l = 1; l <= crp.levels; ++l){
+        dirty[l] = calloc(crp.cell_number[l], 1);
+        if(dirty[l] == NULL){
+            goto trafficend;
+        }
+    }
+    for(k = 0; k < road_number; ++k){
+        a = road[k] / 5;
+        b = cross[a].next[road[k] % 5];
+        m->profile.traffic[road[k]] = factor[k];
+        //道路の両端が同じセルにある階層だけ(違えばセルをまたぐ道路として探索時に使う)
+        for(l = 1; l <= crp.levels; ++l){
+            if(crp.cell[l][a] == crp.cell[l][b]){
+                dirty[l][crp.cell[l][a]] = 1;
+            }
+        }
+    }
+    result = crp_customize(m, &m->profile, dirty);
+
+    trafficend:
+    for(l = 1; l <= crp.levels; ++l){
+        free(dirty[l]);
+    }
+    return result;
+}
+
+//交差点vを探索するときに使う階層(出発地と目的地のどちらとも違うセルになる一番上の階層)
+static int crp_query_level(int v, int start, int goal, int max_level){
+    int l;
+    for(l = (max_level < crp.levels) ? max_level : crp.levels; l >= 1; --l){
+        if(crp.cell[l][v] != crp.cell[l][start] && crp.cell[l][v] != crp.cell[l][goal]){
+            return l;
+        }
+    }
+    return 0;
+}
+
+//階層lのセルの境界の交差点間の最短(u→v)を元の道路に展開してpathのn番目以降に入れる関数
+static int crp_unpack(CrpMetric const *m, int l, int u, int v, CrpWork *w, int path[], int n, int maxpath){
+    int *node, *level;
+    int k = 0, i, c;
+
+    crp_cell_search(m, l, crp.cell[l][u], u, w);
+    if(w->stamp[v] != w->epoch){
+        return -1;
+    }
+    for(c = v; c != u; c = w->previous[c]){
+        k++;
+    }
+    node = malloc(sizeof(int) * (k + 1));
+    level = malloc(sizeof(int) * (k + 1));
+    if(node == NULL || level == NULL){
+        free(node);
+        free(level);
+        return -1;
+    }
+    //作業領域は展開の中で使い直すので，先に写しておく
+    for(i = k, c = v; c != u; c = w->previous[c]){
+        --i;
+        node[i] = c;
+        level[i] = w->previous_level[c];
+    }
+    for(i = 0, c = u; i < k && n >= 0; c = node[i++]){
+        if(level[i] == 0){
+            if(n >= maxpath - 1){
+                n = -1;
+                break;
+            }
+            path[n++] = node[i];
+        }
+        else{
+            n = crp_unpack(m, level[i], c, node[i], w, path, n, maxpath);
+        }
+    }
+    free(node);
+    free(level);
+    return n;
+}
+
+//カスタマイズした上位グラフで経路を求める関数(max_levelが0なら元の道路だけのダイクストラ法)
+//経路をpathに-1終端で入れて合計の評価値を返す(たどり着けなければ負)
+static double crp_route(CrpMetric const *m, int start, int goal, int max_level, CrpWork *w, int path[], int maxpath){
+    int heap_size = 0;
+    HeapNode top;
+    int v, j, n, l, s, k, i;
+    int *node = NULL, *level = NULL;
+    float const *row;
+    double cost = -1;
+    PROF_BEGIN(scope);
+
+    crp_work_reset(w);
+    crp_relax(w, &heap_size, start, 0, -1, 0);
+    while(heap_size > 0){
+        top = heap_pop(w->heap, &heap_size);
+        v = top.id;
+        if(top.key > w->label[v]){
+            continue;
+        }
+        PROF_COUNT(settled, 1);
+        if(v == goal){
+            break;
+        }
+        l = crp_query_level(v, start, goal, max_level);
+        if(l > 0 && w->previous_level[v] != l){
+            //出発地と目的地を含まないセルは，境界の間の最短で通り抜ける
+            //(同じセルの最短で着いた交差点からもう一度たどっても短くならない)
+            s = crp.cell[l][v];
+            i = crp.boundary_index[l][v];
+            k = crp.boundary_offset[l][s + 1] - crp.boundary_offset[l][s];
+            row = &m->weight[l][crp.weight_offset[l][s] + (long)i * k];
+            for(j = 0; j < k; ++j){
+                crp_relax(w, &heap_size, crp.boundary[l][crp.boundary_offset[l][s] + j], top.key + row[j], v, l);
+            }
+        }
+        for(j = 0; j < cross[v].points; ++j){
+            n = cross[v].next[j];
+            if(l > 0 && crp.cell[l][n] == crp.cell[l][v]){
+                continue;
+            }
+            crp_relax(w, &heap_size, n, top.key + profile_cost(&m->profile, v, j), v, 0);
+        }
+    }
+    if(w->stamp[goal] != w->epoch){
+        goto crpend;
+    }
+    cost = w->label[goal];
+    if(m->profile.metric == 1 && start != goal){
+        cost -= cross[start].wait;      /* 出発地での待ち時間は含めない */
+    }
+
+    //目的地からたどって，上位グラフの道を元の道路に展開する
+    for(k = 0, v = goal; v != start; v = w->previous[v]){
+        k++;
+    }
+    node = malloc(sizeof(int) * (k + 1));
+    level = malloc(sizeof(int) * (k + 1));
+    if(node == NULL || level == NULL){
+        cost = -1;
+        goto crpend;
+    }
+    for(i = k, v = goal; v != start; v = w->previous[v]){
+        --i;
+        node[i] = v;
+        level[i] = w->previous_level[v];
+    }
+    path[0] = start;
+    n = 1;
+    for(i = 0, v = start; i < k && n >= 0; v = node[i++]){
+        if(level[i] == 0){
+            if(n >= maxpath - 1){
+                n = -1;
+                break;
+            }
+            path[n++] = node[i];
+        }
+        else{
+            n = crp_unpack(m, level[i], v, node[i], w, path, n, maxpath);
+        }
+    }
+    if(n < 0){
+        cost = -1;
+        goto crpend;
     }
-    //現在地の交差点の待ち時間は考慮しないものとする
-    all_time = all_time - cross[path[0]].wait;
+    path[n] = -1;
 
-    return all_time;
-}
-//経路をリセットする関数
-int path_reset(int path[], int pathmax){
-    int i;
-    for(i = 0; i < pathmax; ++i){
-        path[i] = -1;
-    }
-    return 0;
+    crpend:
+    free(node);
+    free(level);
+    PROF_END(scope, "crp_route");
+    return cost;
 }
 
-//経路から交差点の座標を導く関数
-double id_to_posx(int path[], int id){
-    
-    return cross[ path[id] ].pos.x;
-}
-double id_to_posy(int path[], int id){
-    
-    return cross[ path[id] ].pos.y;
-}
+//多階層の上位グラフの前処理・カスタマイズ・経路探索の時間を測る関数
+//  CarNavi crp [問い合わせ数] [地図ファイル]
+static int crp_demo(int crossing_number, int queries, double speed){
+    CostProfile distance = {0, speed, NULL}, timed = {1, speed, NULL};
+    CrpMetric metric[2];
+    CrpWork w;
+    struct timespec begin;
+    SearchContext context = {0};
+    int *path = malloc(sizeof(int) * (crossing_number + 1));
+    float *traffic = malloc(sizeof(float) * crossing_number * 5);
+    int road[1000];
+    float factor[1000];
+    int k, s, g, bad = 0, road_number;
+    double crp_ms = 0.0, dijkstra_ms = 0.0, a, b;
 
-//交差点を検索する関数(日本語)
-int search_cross_ja(int num){
-    int i,k;
-    int j = 1;
-    int f = -1;
-    char input[200];
-    int output[MaxCross];
-    //outputを初期化
-    for(i = 0; i < MaxCross; ++i){
-        output[i] = -1;
+    memset(metric, 0, sizeof(metric));
+    if(path == NULL || traffic == NULL
+       || crp_build(crossing_number) < 0 || crp_work_alloc(&w, crossing_number) < 0){
+        fprintf(stderr, "crp: couldn't allocate\n");
+        return 1;
     }
-    printf("交差点名を入力してください(日本語)\n");
-    scanf("%s",input);
-    puts("");
-    //まず完全一致から探す
-    for(i = 0; i < num; ++i){
-        if(strcmp(cross[i].jname,input) == 0){
-            f = i;          //見つけた番号保持
-            goto searchend;
+    for(k = 0; k < crossing_number * 5; ++k){
+        traffic[k] = 1.0f;
+    }
+    timed.traffic = traffic;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    crp_customize(&metric[0], &distance, NULL);
+    printf("カスタマイズ(距離): %.1lfms\n", elapsed_ms(&begin));
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    crp_customize(&metric[1], &timed, NULL);
+    printf("カスタマイズ(時間): %.1lfms  (%d スレッド)\n", elapsed_ms(&begin), worker_count(crp.cell_number[1]));
+
+    //ヒープを用いたダイクストラ法と比べる
+    srand(1);
+    for(k = 0; k < queries; ++k){
+        s = rand() % crossing_number;
+        g = rand() % crossing_number;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        a = crp_route(&metric[1], s, g, MaxCrpLevel, &w, path, crossing_number + 1);
+        crp_ms += elapsed_ms(&begin);
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        dijkstra_time_heap(&context, crossing_number, g, speed, &s, 1);
+        dijkstra_ms += elapsed_ms(&begin);
+        b = (s == g) ? 0.0 : search_label(&context, s) - cross[s].wait;
+        if((a < 0) != (b >= 1e99) || (a >= 0 && fabs(a - b) > 1e-3 * fmax(1.0, b))){
+            bad++;
         }
     }
-    //次に部分一致を探す
-    for(i = 0; i < num; ++i){
-        if(strstr(cross[i].jname, input)!=NULL){
-            output[j] = i;  //見つけた番号を配列に保存
-            j++;
+    printf("経路探索(時間) %d 回: 上位グラフ %.3lfms/回  ダイクストラ法 %.3lfms/回  不一致 %d\n",
+           queries, crp_ms / queries, dijkstra_ms / queries, bad);
+
+    //一部の道路が混雑したとき
+    road_number = (crossing_number / 100 < 1000) ? crossing_number / 100 + 1 : 1000;
+    for(k = 0; k < road_number; ++k){
+        do{
+            s = rand() % crossing_number;
+        }while(cross[s].points == 0);
+        road[k] = s * 5 + rand() % cross[s].points;
+        factor[k] = 2.0f + (rand() % 20) * 0.1f;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    crp_update_traffic(&metric[1], road, factor, road_number);
+    printf("混雑の反映(道路 %d 本): %.1lfms\n", road_number, elapsed_ms(&begin));
+    for(k = 0, bad = 0; k < queries; ++k){
+        s = rand() % crossing_number;
+        g = rand() % crossing_number;
+        a = crp_route(&metric[1], s, g, MaxCrpLevel, &w, path, crossing_number + 1);
+        b = crp_route(&metric[1], s, g, 0, &w, path, crossing_number + 1);
+        if((a < 0) != (b < 0) || fabs(a - b) > 1e-3 * fmax(1.0, b)){
+            bad++;
         }
     }
-    if(j == 1){
-        goto searchend;
+    printf("混雑を反映した経路探索 %d 回: 元の道路だけの探索との不一致 %d\n", queries, bad);
+
+    crp_metric_free(&metric[0]);
+    crp_metric_free(&metric[1]);
+    crp_work_free(&w);
+    crp_free();
+    search_free(&context);
+    free(path);
+    free(traffic);
+    return 0;
+}
+
+//記録した経路探索をできるだけ速く実行し直し、経路と費用を記録と比べる関数
+//地図や探索を変えたときに結果が変わっていないかを確かめるのに使う
+static int routelog_replay(char const *filename, char *mapfile){
+    FILE *fp;
+    char magic[4];
+    uint64_t u, time_us = 0, count;
+    int64_t d;
+    int crossing_number, recorded_number, type, flags, start, goal, node, k, n, same;
+    int saved_turn_mode = turn_mode, path_size, *logged = NULL, *path = NULL;
+    long routes = 0, vehicles = 0, mismatches = 0;
+    double speed, cost, replay_cost, total_ms = 0;
+    struct timespec begin;
+
+    fp = fopen(filename, "rb");
+    if(fp == NULL){
+        perror(filename);
+        return 1;
     }
-    k = j;
-    j = 1;
-    //部分一致の候補表示
-    printf("'%s'が含まれる交差点を表示します\n",input);
-    for(i = 1; i < k; ++i){
-        printf("%d. %s\n",i,cross[output[j]].jname);
-        j++;
+    if(fread(magic, 1, 4, fp) != 4 || memcmp(magic, ROUTELOG_MAGIC, 4) != 0 || getc(fp) != ROUTELOG_VERSION
+       || varint_get(fp, &u) < 0){
+        fprintf(stderr, "%s: 経路の記録ファイルではありません\n", filename);
+        fclose(fp);
+        return 1;
     }
-    printf("交差点を選択してください(数字)\n");
-    printf("input>");
-    scanf("%d",&i);
-    if (i >= 0 && i <= j){
-        f = output[i];
+    recorded_number = (int)u;
+    crossing_number = map_read(mapfile);
+    if(crossing_number < 0){
+        fclose(fp);
+        return 1;
     }
-    searchend:
-    if(f == -1){
-        printf("交差点を見つけることができませんでした\n");
+    if(crossing_number != recorded_number){
+        fprintf(stderr, "記録した地図(交差点数 %d)と読み込んだ地図(交差点数 %d)が違います\n",
+                recorded_number, crossing_number);
+        fclose(fp);
+        return 1;
     }
-    return f;
-}
-
-//交差点を検索する関数(英語)
-int search_cross_en(int num){
-    int i,k;
-    int j = 1;
-    int f = -1;
-    char input[200];
-    int output[MaxCross];
-    //outputを初期化
-    for(i = 0; i < MaxCross; ++i){
-        output[i] = -1;
+    path_size = MaxStops * crossing_number + 1;
+    logged = malloc(sizeof(int) * path_size);
+    path = malloc(sizeof(int) * path_size);
+    if(logged == NULL || path == NULL){
+        fprintf(stderr, "couldn't allocate path\n");
+        free(logged);
+        free(path);
+        fclose(fp);
+        return 1;
     }
-    printf("交差点名を入力してください(英語)\n");
-    scanf("%s",input);
-    puts("");
-    //まず完全一致から探す
-    for(i = 0; i < num; ++i){
-        if(strcmp(cross[i].ename,input) == 0){
-            f = i;          //見つけた番号保持
-            goto searchend;
+
+    while((type = getc(fp)) != EOF){
+        if(varint_get(fp, &u) < 0){
+            break;
         }
-    }
-    //次に部分一致を探す
-    for(i = 0; i < num; ++i){
-        if(strstr(cross[i].ename, input)!=NULL){
-            output[j] = i;  //見つけた番号を配列に保存
-            j++;
+        time_us += u;
+        if(type == ROUTELOG_VEHICLE){
+            //移動体の位置は数えるだけ
+            if(varint_get_signed(fp, &d) < 0 || varint_get_signed(fp, &d) < 0 || varint_get(fp, &u) < 0){
+                break;
+            }
+            vehicles++;
+            continue;
+        }
+        if(type != ROUTELOG_ROUTE || (flags = getc(fp)) == EOF || fread(&speed, sizeof(double), 1, fp) != 1
+           || fread(&cost, sizeof(double), 1, fp) != 1 || varint_get(fp, &u) < 0){
+            break;
+        }
+        start = (int)u;
+        if(varint_get_signed(fp, &d) < 0 || varint_get(fp, &count) < 0 || count >= (uint64_t)path_size){
+            break;
+        }
+        goal = (int)(start + d);
+        for(k = 0, node = start; k < (int)count; ++k){
+            if(varint_get_signed(fp, &d) < 0){
+                break;
+            }
+            node = (int)(node + d);
+            if(node < 0 || node >= crossing_number){
+                break;
+            }
+            logged[k] = cross_index[node];
+        }
+        if(k < (int)count || start < 0 || start >= crossing_number || goal < 0 || goal >= crossing_number){
+            break;
+        }
+        start = cross_index[start];
+        goal = cross_index[goal];
+
+        //記録したときと同じ設定で探索し直す
+        turn_mode = (flags >> 1) & 1;
+        path_reset(path, path_size);
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if(route_path(crossing_number, start, goal, flags & 1, speed, path, path_size) < 0){
+            path[0] = -1;
+        }
+        total_ms += elapsed_ms(&begin);
+        for(n = 0; path[n] != -1; ++n){
+        }
+        replay_cost = (n == 0) ? -1 : (flags & 1) ? calculate_time(path, speed) : calculate_distance(path);
+        same = (n == (int)count && memcmp(path, logged, sizeof(int) * n) == 0 && fabs(replay_cost - cost) <= 1e-9);
+        if(!same){
+            if(mismatches < 10){
+                printf("不一致 %.3f秒 %s %d -> %d : 記録 %d交差点 費用 %.6f / 再実行 %d交差点 費用 %.6f\n",
+                       time_us / 1e6, (flags & 1) ? "最短時間" : "最短距離", cross[start].id, cross[goal].id,
+                       (int)count, cost, n, replay_cost);
+            }
+            mismatches++;
         }
+        routes++;
     }
-    if(j == 1){
-        goto searchend;
+    turn_mode = saved_turn_mode;
+    if(!feof(fp)){
+        fprintf(stderr, "%s: 記録が途中で壊れています\n", filename);
     }
-    k = j;
-    j = 1;
-    //部分一致の候補表示
-    printf("'%s'が含まれる交差点を表示します\n",input);
-    for(i = 1; i < k; ++i){
-        printf("%d. %s\n",i,cross[output[j]].ename);
-        j++;
+    fclose(fp);
+    free(logged);
+    free(path);
+
+    printf("経路 %ld件  移動体 %ld件  不一致 %ld件  記録の長さ %.3f秒\n", routes, vehicles, mismatches, time_us / 1e6);
+    if(routes > 0){
+        printf("再実行 %.1f ms  (%.0f 件/秒)\n", total_ms, routes / (total_ms / 1e3));
     }
-    printf("交差点を選択してください(数字)\n");
-    printf("input>");
-    scanf("%d",&i);
-    if (i >= 0 && i <= j){
-        f = output[i];
+    return mismatches > 0;
+}
+
+//自己診断  CarNavi selftest
+//壊れやすい形の小さな地図を読み込んで、探索の結果が決まった値になるかを確かめる
+//一方通行 : 交差点1から0へは一方通行(0から1への道路はない)、0-2と1-2は両方向、0は病院、2で1から0へ曲がるのは禁止
+static char const selftest_oneway[] =
+    "3\n"
+    "0,0,0,0.5,A,A,1,2\n"
+    "1,1,0,0.5,B,B,2,0,2\n"
+    "2,1,1,0.5,C,C,2,0,1\n"
+    "facility,0,hospital\n"
+    "noturn,1,2,0\n";
+
+//textを地図ファイルとして読み込む関数
+static int selftest_map(char const *text){
+    char filename[] = "/tmp/carnavi_selftest_XXXXXX";
+    int fd = mkstemp(filename), n;
+    FILE *fp;
+
+    if(fd < 0){
+        perror("mkstemp");
+        return -1;
     }
-    searchend:
-    if(f == -1){
-        printf("交差点を見つけることができませんでした\n");
+    fp = fdopen(fd, "w");
+    if(fp == NULL){
+        close(fd);
+        unlink(filename);
+        return -1;
     }
-    return f;
+    fputs(text, fp);
+    fclose(fp);
+    n = map_read(filename);
+    unlink(filename);
+    return n;
 }
 
-//交差点を検索する関数(交差点ID)
-int search_cross_id(int num){
-    int input;
-    int f = -1;
-    printf("交差点名を入力してください(ID)\n");
-    printf("input>");
-    scanf("%d",&input);
-    puts("");
-    if(0 <= input && input < num){
-        f = input;
+//結果を表示して、合わなければ1を返す関数
+static int selftest_check(char const *name, int ok){
+    printf("  %-40s %s\n", name, ok ? "OK" : "NG");
+    return !ok;
+}
+
+static int selftest(void){
+    SearchContext context = {0};
+    FacilityHit hit[1];
+    int path[8], saved_turn_mode = turn_mode, failed = 0, n, metric;
+    double cost, around = 1 + sqrt(2);
+
+    printf("一方通行\n");
+    n = selftest_map(selftest_oneway);
+    if(n != 3){
+        return 1;
     }
-    if(f == -1){
-        printf("交差点を見つけることができませんでした\n");
+    turn_mode = 1;
+    //1から0へは一方通行をそのまま通り(長さ1、時速30kmで2分)、0から1へは2を回る
+    for(metric = 0; metric < 2; ++metric){
+        cost = dijkstra_turn(&context, n, 1, 0, metric, 30.0, path, 8);
+        failed += selftest_check(metric == 0 ? "dijkstra_turn 1->0 (距離)" : "dijkstra_turn 1->0 (時間)",
+                                 fabs(cost - (metric == 0 ? 1.0 : 2.0)) < 1e-9
+                                 && path[0] == 1 && path[1] == 0 && path[2] == -1);
     }
-    return f;
+    cost = dijkstra_turn(&context, n, 0, 1, 0, 30.0, path, 8);
+    failed += selftest_check("dijkstra_turn 0->1 (逆向き)",
+                             fabs(cost - around) < 1e-9 && path[0] == 0 && path[1] == 2 && path[2] == 1 && path[3] == -1);
+    failed += selftest_check("facility_nearest 1 -> 病院",
+                             facility_nearest(&context, n, 1, 1u << facility_find("hospital"), 1, 0, 30.0, hit) == 1
+                             && hit[0].crossing == 0 && fabs(hit[0].cost - 1.0) < 1e-9);
+    //一方通行で0に西向きに入って北の2へ出るのは右折
+    failed += selftest_check("turn_cost_path 1->0->2 (右折)", turn_cost_path(1, 0, 2) == TURN_COST_RIGHT);
+    path[0] = 0;
+    path[1] = 1;
+    path[2] = -1;
+    failed += selftest_check("calculate_distance 0->1 (道路なし)", calculate_distance(path) == INFINITY);
+    //2で1から0へ曲がるのは禁止
+    path[0] = 1;
+    path[1] = 2;
+    path[2] = 0;
+    path[3] = -1;
+    failed += selftest_check("calculate_time 1->2->0 (禁止)", calculate_time(path, 30.0) == INFINITY);
+    failed += selftest_check("calculate_distance 1->2->0 (禁止)", calculate_distance(path) == INFINITY);
+    path[0] = 1;
+    path[1] = 0;
+    path[2] = 2;
+    failed += selftest_check("calculate_time 1->0->2",
+                             fabs(calculate_time(path, 30.0) - (2.0 + 0.5 + TURN_COST_RIGHT + 2 * sqrt(2))) < 1e-9);
+    turn_mode = saved_turn_mode;
+    search_free(&context);
+
+    printf("%s\n", failed ? "失敗した項目があります" : "すべて合いました");
+    return failed > 0;
 }
 
 //メイン
-int main(void){
+int main(int argc, char *argv[]){
     int crossing_number;        //合計交差点数
     int goal,start;             //現在地＆目的地
-    int path[PATH_SIZE], path_sub[PATH_SIZE];         //経路の配列
+    int *path, *path_sub;         //経路の配列
+    int path_size;                //経路の配列の大きさ(経由地の数だけ全交差点を通れる分)
     int i,j=0;
-    double map_x = 0.0, map_y = 0.0; //地図をどれだけ動かすかの座標
     int steps;
     double rotation = 0,rotation_step;
     int vehicle_pathIterator;     /* 移動体の経路上の位置 (何個目の道路か) */
@@ -614,7 +10743,7 @@ int main(void){
     int vehicle_steprotation; //移動体の交差点での回転(何ステップ目か)
     int width, height;
     double x0,y0,x1,y1,x2,y2;
-    double distance,norm1,norm2,dot_product,cross_product,rad,deg;    //移動距離や回転量を計算するのに使う変数
+    double turn,deg;    //回転量を計算するのに使う変数
     int mode = 0; //0では回転、1では移動,2で移動のみを行う合図
     int cheak = 0; //mode の値を保存する変数
     int mode2 = 0;  //ゴールにたどり着くか判断
@@ -625,32 +10754,206 @@ int main(void){
     int choice_mode = 0; //最短距離0、最短時間1の変数
     int word_mode = 0; //文字の表示方法を変える変数 
     double all_distance, all_time; //経路の合計距離と合計時間
+    Route route = {0}; //走行中の経路(残りの距離と到着までの時間を求める)
+    RouteWorker router; //経路探索スレッド
+    int reroute_from = -1; //探し直している経路の出発点(経路上の位置、-1なら探していない)
     int wait_time; //目的地に着いた時の待ち時間
+    int multi_mode = 0; //1なら複数の経由地を巡回する
+    int stops[MaxStops], stop_order[MaxStops]; //経由地と巡回順
+    int stop_number = 0, round_trip = 0; //経由地の数、現在地に戻るか
+    int *multi_path; //巡回経路
+    int *reroute_path; //探し直した経路(つなぐ前)
+    struct timespec begin; //計算時間の計測用
+    int iso_number = 0, iso_origins[MaxStops], iso_metric; //到達圏の出発地の数、出発地、上限の種類
+    double iso_budget; //到達圏の上限
+    static Isochrone iso[MaxStops]; //到達圏
+    MapSnapshot *view; //見ている地図の版
+    unsigned map_seen = 1; //画面に反映した地図の版
 
+    //ベンチマークは自分で作った地図を使う
+    PROF_INIT();
+    if(argc >= 2 && strcmp(argv[1], "bench") == 0){
+        i = routing_bench(argc - 2, argv + 2);
+        PROF_WRITE_TRACE(PROF_TRACE_FILE);
+        return i;
+    }
+    //区画に分けた地図を作る，区画に分けた地図で経路を求める，大きな地図を作る
+    //  CarNavi tile [出力先] [区画の大きさkm] [車の速度] [地図ファイル]
+    //  CarNavi tiles ディレクトリ 出発地 目的地 [メモリの上限MB] [車の速度]
+    //  CarNavi generate 交差点数 ファイル
+    if(argc >= 2 && strcmp(argv[1], "tile") == 0){
+        crossing_number = map_read((argc >= 6) ? argv[5] : "map.dat");
+        if(crossing_number < 0){
+            return 1;
+        }
+        return tile_build(crossing_number, (argc >= 3) ? argv[2] : "tiles", (argc >= 4) ? atof(argv[3]) : TILE_SIZE,
+                          (argc >= 5) ? atof(argv[4]) : speed) < 0;
+    }
+    if(argc >= 5 && strcmp(argv[1], "tiles") == 0){
+        return tile_viewer(argv[2], atoi(argv[3]), atoi(argv[4]), (argc >= 6) ? atoi(argv[5]) : TileBudgetMB,
+                           (argc >= 7) ? atof(argv[6]) : speed);
+    }
+    //多階層の上位グラフ  CarNavi crp [問い合わせ数] [地図ファイル]
+    if(argc >= 2 && strcmp(argv[1], "crp") == 0){
+        crossing_number = map_read((argc >= 4) ? argv[3] : "map.dat");
+        if(crossing_number < 0){
+            return 1;
+        }
+        return crp_demo(crossing_number, (argc >= 3 && atoi(argv[2]) > 0) ? atoi(argv[2]) : 100, speed);
+    }
+    //交差点の並べ替え  CarNavi reorder 入力 出力 [hilbert|bfs]
+    if(argc >= 4 && strcmp(argv[1], "reorder") == 0){
+        crossing_number = map_read(argv[2]);
+        if(crossing_number < 0){
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if(map_reorder(crossing_number, (argc >= 5 && strcmp(argv[4], "bfs") == 0) ? 1 : 0) < 0){
+            return 1;
+        }
+        printf("交差点 %d か所を並べ替えました(%.1lfms)\n", crossing_number, elapsed_ms(&begin));
+        return map_write(argv[3], crossing_number) < 0;
+    }
+    if(argc >= 4 && strcmp(argv[1], "generate") == 0){
+        return (atoi(argv[2]) < 2 || map_generate(argv[3], atoi(argv[2]), 1) < 0);
+    }
+    //圧縮したグラフ  CarNavi compact [問い合わせ数] [地図ファイル]
+    if(argc >= 2 && strcmp(argv[1], "compact") == 0){
+        crossing_number = map_read((argc >= 4) ? argv[3] : "map.dat");
+        if(crossing_number < 0){
+            return 1;
+        }
+        return compact_demo(crossing_number, (argc >= 3 && atoi(argv[2]) > 0) ? atoi(argv[2]) : 100, speed);
+    }
+    //ハブラベル  CarNavi hublabel [問い合わせ数] [地図ファイル] [ラベルファイル]
+    if(argc >= 2 && strcmp(argv[1], "hublabel") == 0){
+        crossing_number = map_read((argc >= 4) ? argv[3] : "map.dat");
+        if(crossing_number < 0){
+            return 1;
+        }
+        return hub_demo(crossing_number, (argc >= 3 && atoi(argv[2]) > 0) ? atoi(argv[2]) : 100000, speed,
+                        (argc >= 5) ? argv[4] : "hublabel.bin");
+    }
+    //ランドマーク(ALT)  CarNavi landmark [ランドマークの数] [問い合わせ数] [地図ファイル] [ランドマークのファイル]
+    if(argc >= 2 && strcmp(argv[1], "landmark") == 0){
+        crossing_number = map_read((argc >= 5) ? argv[4] : "map.dat");
+        if(crossing_number < 0){
+            return 1;
+        }
+        return alt_demo(crossing_number, (argc >= 3 && atoi(argv[2]) > 0) ? atoi(argv[2]) : AltCount,
+                        (argc >= 4 && atoi(argv[3]) > 0) ? atoi(argv[3]) : 1000, speed,
+                        (argc >= 6) ? argv[5] : "landmark.bin");
+    }
+    //GPSの地図照合  CarNavi mapmatch [走行数] [1走行の点数] [地図ファイル]   CarNavi mapmatch GPSファイル [地図ファイル]
+    if(argc >= 2 && strcmp(argv[1], "mapmatch") == 0){
+        if(argc >= 3 && atoi(argv[2]) <= 0){
+            crossing_number = map_read((argc >= 4) ? argv[3] : "map.dat");
+            return (crossing_number < 0) ? 1 : match_file(argv[2], crossing_number);
+        }
+        crossing_number = map_read((argc >= 5) ? argv[4] : "map.dat");
+        if(crossing_number < 0){
+            return 1;
+        }
+        return match_demo(crossing_number, (argc >= 3) ? atoi(argv[2]) : 64, (argc >= 4 && atoi(argv[3]) > 0) ? atoi(argv[3]) : 3600,
+                          speed);
+    }
+    //自己診断  CarNavi selftest
+    if(argc >= 2 && strcmp(argv[1], "selftest") == 0){
+        return selftest();
+    }
+    //地図の版の入れ替え  CarNavi mapswap [版の数] [地図ファイル]
+    if(argc >= 2 && strcmp(argv[1], "mapswap") == 0){
+        crossing_number = map_read((argc >= 4) ? argv[3] : "map.dat");
+        if(crossing_number < 0){
+            return 1;
+        }
+        return swap_demo(crossing_number, (argc >= 3 && atoi(argv[2]) > 0) ? atoi(argv[2]) : 40, speed);
+    }
+    //記録した経路探索の再実行  CarNavi replay 記録ファイル [地図ファイル]
+    if(argc >= 3 && strcmp(argv[1], "replay") == 0){
+        return routelog_replay(argv[2], (argc >= 4) ? argv[3] : "map.dat");
+    }
     //マップファイルの読み込み
     crossing_number = map_read("map.dat");
     if (crossing_number < 0) {
         fprintf(stderr, "couldn't read map file\n");
         exit(1);
     }
-    //適当に初期化
-    for(i=0;i<crossing_number;i++){
-        cross[i].distance=0;    
-        cross[i].time = 0;      
-        cross[i].previous_distance=-1;    
-        cross[i].previous_time=-1;    
+    //ランドマークのファイルがあれば、経路探索(右左折を考慮するもの)を目的地へ向かうA*にする
+    alt_read("landmark.bin", crossing_number);
+    //コマンドライン引数でサーバと負荷試験に切り替える
+    //  CarNavi server [ポート] [車の速度] [ハブラベルのファイル] [差分ファイル]
+    //  CarNavi loadgen [ポート] [接続数] [要求数] [パイプライン]
+    //サーバと画面では地図を版として公開し、差分ファイル(既定はmap.diff)が変わるたびに止めずに新しい版へ入れ替える
+    if(argc >= 2 && strcmp(argv[1], "server") == 0){
+        if(argc >= 5 && strcmp(argv[4], "-") != 0 && hub_read(argv[4], crossing_number) < 0){
+            fprintf(stderr, "couldn't read hub labels %s\n", argv[4]);
+            return 1;
+        }
+        if(map_share(crossing_number) < 0 || map_watch_start((argc >= 6) ? argv[5] : "map.diff") < 0){
+            fprintf(stderr, "couldn't share map\n");
+            return 1;
+        }
+        i = routing_server(crossing_number, (argc >= 3) ? atoi(argv[2]) : SERVER_PORT,
+                           (argc >= 4) ? atof(argv[3]) : speed);
+        map_watch_stop();
+        PROF_WRITE_TRACE(PROF_TRACE_FILE);
+        return i;
+    }
+    if(argc >= 2 && strcmp(argv[1], "loadgen") == 0){
+        return routing_loadgen(crossing_number, (argc >= 3) ? atoi(argv[2]) : SERVER_PORT,
+                               (argc >= 4) ? atoi(argv[3]) : 4, (argc >= 5) ? atoi(argv[4]) : 100000,
+                               (argc >= 6) ? atoi(argv[5]) : 1);
+    }
+    if(map_share(crossing_number) < 0 || map_watch_start("map.diff") < 0){
+        fprintf(stderr, "couldn't share map\n");
+        exit(1);
+    }
+    //経路探索と移動体の位置を記録しながら動かす  CarNavi record [記録ファイル]
+    if(argc >= 2 && strcmp(argv[1], "record") == 0){
+        if(routelog_open((argc >= 3) ? argv[2] : "route.log", crossing_number) < 0){
+            return 1;
+        }
+    }
+    //道路網の画像をファイルにも残して動かす  CarNavi rastercache [ディレクトリ]
+    if(argc >= 2 && strcmp(argv[1], "rastercache") == 0){
+        raster.dir = (argc >= 3) ? argv[2] : "raster";
+        if(mkdir(raster.dir, 0755) < 0 && errno != EEXIST){
+            perror(raster.dir);
+            return 1;
+        }
+    }
+    path_size = MaxStops * crossing_number + 1;
+    path = malloc(sizeof(int) * path_size);
+    path_sub = malloc(sizeof(int) * path_size);
+    multi_path = malloc(sizeof(int) * path_size);
+    reroute_path = malloc(sizeof(int) * path_size);
+    if(path == NULL || path_sub == NULL || multi_path == NULL || reroute_path == NULL){
+        fprintf(stderr, "couldn't allocate path\n");
+        exit(1);
+    }
+    if(route_worker_start(&router, crossing_number) < 0){
+        fprintf(stderr, "couldn't start routing thread\n");
+        exit(1);
     }
-
     //--------------------------カーナビ開始---------------------------
     printf("\nカーナビ起動\n\n");
 
     while(1){                                //目的地入力、もう一度やり直すためのループ
         step1:
+        //メニューを出すたびに今の版の地図に移る
+        view = map_enter();
+        if(view != NULL && view->version != map_seen){
+            raster_update(view, map_seen);
+            map_seen = view->version;
+        }
         printf("現在地、目的地をどのように設定しますか\n");
-        printf("1.日本語 2. ローマ字 3. 交差点ID 4. ランダム 5.車の速度を変更\n");
+        printf("1.日本語 2. ローマ字 3. 交差点ID 4. ランダム 5.車の速度を変更 6.複数の経由地を巡回 7.到達圏を表示 8.車両群のシミュレーション 9.右左折のコストを切り替え 10.近くの施設へ\n");
         printf("input>");
 
-        scanf("%d",&choice);
+        menu_scanf("%d",&choice);
+        multi_mode = 0;
+        iso_number = 0;
 
         //現在地、目的地の検索、設定
         if(choice == 1){
@@ -726,7 +11029,7 @@ int main(void){
             printf("現在の車の速度は'%.1lf'km/hです。\n",speed);
             printf("車の速度を入力してください。\n");
             printf("input>");
-            scanf("%lf",&pre_speed);
+            menu_scanf("%lf",&pre_speed);
             if(pre_speed <= 0){
                 printf("その速度は入力できません。\n");
                 goto step1;
@@ -737,44 +11040,144 @@ int main(void){
                 goto step1;
             }
         }
+        else if(choice == 6){
+            stop_number = input_stops(crossing_number, stops, &round_trip);
+            if(stop_number == -1){
+                goto step1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            if(multi_stop_route(crossing_number, stops, stop_number, round_trip, speed,
+                                multi_path, path_size, stop_order) < 0){
+                printf("巡回経路を求めることができませんでした\n");
+                goto step1;
+            }
+            printf("巡回経路の計算時間: %.2lfms\n", elapsed_ms(&begin));
+            multi_mode = 1;
+            start = multi_path[0];
+            for(i = 0; multi_path[i + 1] != -1; ++i){
+            }
+            goal = multi_path[i];
+        }
+        else if(choice == 7){
+            i = input_isochrone(crossing_number, iso_origins, &iso_metric, &iso_budget);
+            if(i == -1){
+                goto step1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            if(i == 1){
+                isochrone_search(crossing_number, iso_origins[0], iso_metric, iso_budget, speed, &iso[0]);
+            }
+            else{
+                isochrone_batch(crossing_number, iso_origins, i, iso_metric, iso_budget, speed, iso);
+            }
+            printf("到達圏の計算時間: %.2lfms\n", elapsed_ms(&begin));
+            iso_number = i;
+            start = goal = iso_origins[0];
+        }
+        else if(choice == 8){
+            printf("車両の数を入力してください(1～%d)\n", MaxFleet);
+            printf("input>");
+            menu_scanf("%d",&i);
+            if(i < 1 || i > MaxFleet){
+                printf("その数は入力できません。\n");
+                goto step1;
+            }
+            printf("---操作方法-----------------------------------------\n");
+            printf("Escキーでシミュレーションを終了\n");
+            printf("WASDで上下左右に視点を移動\n");
+            printf("Eで視点が上昇、Qで視点が降下\n");
+            printf("Rで視点を初期状態にリセット\n");
+            printf("----------------------------------------------------\n");
+            fleet_simulation(crossing_number, i, speed);
+            goto step1;
+        }
+        else if(choice == 9){
+            turn_mode = 1 - turn_mode;
+            printf("右左折のコストと禁止を'%s'にしました。\n", (turn_mode == 1) ? "考慮する" : "考慮しない");
+            goto step1;
+        }
+        else if(choice == 10){
+            goal = input_facility(crossing_number, speed, &start);
+            if(goal == -1){
+                goto step1;
+            }
+            printf("目的地を'%s  %s'と設定します\n",cross[goal].jname,cross[goal].ename);
+        }
         else{
             printf("無効な入力です\n");
             goto step1;
         }
 
         //初回経路リセット
-        path_reset(path, PATH_SIZE);
-        path_reset(path_sub, PATH_SIZE);
+        path_reset(path, path_size);
+        path_reset(path_sub, path_size);
 
-        //ダイクストラ法を行う
-        dijkstra_distance(crossing_number,goal);
-        dijkstra_time(crossing_number,goal,speed);
-            
-        //経路の決定(pathが決まる)
-        if(pickup_path_distance(crossing_number,start,goal,path,20)<0){
-            return 1;    
+        if(multi_mode == 1){
+            //巡回経路の合計時間と合計距離
+            memcpy(path, multi_path, sizeof(int) * path_size);
+            all_distance = calculate_distance(path);
+            all_time = calculate_time(path,speed);
+            //区間は右左折を考慮しない探索でつなぐので、禁止された右左折を通るときは走れない
+            if(all_time == INFINITY){
+                printf("巡回経路が右左折の禁止された交差点を通るため、走ることができません\n");
+                goto step1;
+            }
+            printf("\n");
+            printf("車の速度'%.1lf'km/h\n",speed);
+            printf("\n");
+
+            printf("巡回順序\n");
+            for(i = 0; i < stop_number; ++i){
+                printf("%d. %s  %s\n", i, cross[stop_order[i]].jname, cross[stop_order[i]].ename);
+            }
+            if(round_trip){
+                printf("%d. %s  %s\n", i, cross[stop_order[0]].jname, cross[stop_order[0]].ename);
+            }
+            printf("巡回経路(青)\n");
+            printf("巡回経路の距離: %.2lfkm   巡回経路の所要時間: %.2lf分\n",all_distance,all_time);
         }
-        //経路の決定(path_subが決まる)
-        if(pickup_path_time(crossing_number,start,goal,path_sub,20)<0){
-            return 1;
+        else if(iso_number > 0){
+            //到達圏の一覧
+            path[0] = iso_origins[0];
+            printf("\n");
+            printf("車の速度'%.1lf'km/h\n",speed);
+            printf("\n");
+            for(i = 0; i < iso_number; ++i){
+                printf("'%s'から%.2lf%s以内に到達できる交差点: %d か所\n", cross[iso[i].origin].jname,
+                       iso_budget, (iso_metric == 1) ? "分" : "km", iso[i].reach_number);
+            }
+            if(iso_number == 1){
+                for(i = 0; i < iso[0].reach_number; ++i){
+                    printf("%s  %s  %.2lf%s\n", cross[iso[0].reach[i]].jname, cross[iso[0].reach[i]].ename,
+                           iso[0].cost[iso[0].reach[i]], (iso_metric == 1) ? "分" : "km");
+                }
+            }
+            printf("到達圏(橙)\n");
         }
+        else{
+            //経路の決定(pathが最短距離、path_subが最短時間)
+            if(route_worker_run(&router,start,goal,0,speed,path,path_sub,path_size)<0){
+                printf("目的地までの経路が見つかりませんでした\n");
+                goto step1;
+            }
 
-        //最短経路の合計時間と合計距離
-        all_distance = calculate_distance(path);
-        all_time = calculate_time(path,speed);
-        printf("\n");
-        printf("車の速度'%.1lf'km/h\n",speed);
-        printf("\n");
+            //最短経路の合計時間と合計距離
+            all_distance = calculate_distance(path);
+            all_time = calculate_time(path,speed);
+            printf("\n");
+            printf("車の速度'%.1lf'km/h\n",speed);
+            printf("\n");
 
-        printf("最短経路(青)\n");
-        printf("目的地までの距離: %.2lfkm   目的地までの所要時間: %.2lf分\n",all_distance,all_time);
+            printf("最短経路(青)\n");
+            printf("目的地までの距離: %.2lfkm   目的地までの所要時間: %.2lf分\n",all_distance,all_time);
 
-        //最短時間の合計時間と合計距離
-        all_distance = calculate_distance(path_sub);
-        all_time = calculate_time(path_sub,speed);
+            //最短時間の合計時間と合計距離
+            all_distance = calculate_distance(path_sub);
+            all_time = calculate_time(path_sub,speed);
 
-        printf("最短経路(黄緑)\n");
-        printf("目的地までの距離: %.2lfkm   目的地までの所要時間: %.2lf分\n",all_distance,all_time);
+            printf("最短経路(黄緑)\n");
+            printf("目的地までの距離: %.2lfkm   目的地までの所要時間: %.2lf分\n",all_distance,all_time);
+        }
             
 
         printf("\n");
@@ -788,6 +11191,10 @@ int main(void){
         printf("Mでマップの回転の有無を変更\n");
         printf("Pで最短距離経路(青)と最短時間経路を変更(黄緑)\n");
         printf("Bで交差点の表示方法を変更(3通り)\n");
+        printf("Zで車の速度を下げる、Xで車の速度を上げる(到着までの時間に反映)\n");
+#ifdef CARNAVI_PROFILE
+        printf("Iで計測値の表示を切り替え\n");
+#endif
         printf("----------------------------------------------------\n");
 
         sleep(1);
@@ -795,71 +11202,71 @@ int main(void){
         step2:
 
         /* グラフィック環境を初期化して、ウィンドウを開く */
-        glfwInit();
-        glfwOpenWindow(1000, 800, 0, 0, 0, 0, 0, 0, GLFW_WINDOW);
+        navi_window_open();
         
         while(1){
+            key_poll();
             /* Esc が押されるかウィンドウが閉じられたらおしまい */
-            if (glfwGetKey(GLFW_KEY_ESC) || !glfwGetWindowParam(GLFW_OPENED)){
+            if (key_pressed(GLFW_KEY_ESC) || !glfwGetWindowParam(GLFW_OPENED)){
                 goto loopend;
             }
             //もしRキーが押されたら、移動情報をリセット
-            if(glfwGetKey(82)){
+            if(key_pressed(82)){
                 range_x = 0; range_y = 0; range_z = 1.5;
                 rotation_x = 0; rotation_z = 0;
             }
             //もしWキーが押されたら前に移動
-            if(glfwGetKey(87)){
+            if(key_pressed(87)){
                 range_y = range_y + 0.5 * cos((rotation+rotation_x) * M_PI / 180);
                 range_x = range_x + 0.5 * sin((rotation+rotation_x) * M_PI / 180);
             }
             //もしSキーが押されたら後ろに移動
-            if(glfwGetKey(83)){
+            if(key_pressed(83)){
                 range_y = range_y + 0.5 * cos((rotation+rotation_x) * M_PI / 180 + M_PI);
                 range_x = range_x + 0.5 * sin((rotation+rotation_x) * M_PI / 180 + M_PI);
             }
             //もしDキーが押されたら右に移動
-            if(glfwGetKey(68)){
+            if(key_pressed(68)){
                 range_y = range_y + 0.5 * cos((rotation+rotation_x) * M_PI / 180 + M_PI / 2);
                 range_x = range_x + 0.5 * sin((rotation+rotation_x) * M_PI / 180 + M_PI / 2);
             }
             //もしAキーが押されたら左に移動
-            if(glfwGetKey(65)){
+            if(key_pressed(65)){
                 range_y = range_y + 0.5 * cos((rotation+rotation_x) * M_PI / 180 + 3 * M_PI / 2);
                 range_x = range_x + 0.5 * sin((rotation+rotation_x) * M_PI / 180 + 3 * M_PI / 2);
             }
             //もしEキーが押されたら透視投影の距離を遠くする
-            if(glfwGetKey(69)){
+            if(key_pressed(69)){
                 range_z = range_z + 0.5;
             }
             //もしQキーが押されたら透視投影の距離を近くする
-            if(glfwGetKey(81)){
+            if(key_pressed(81)){
                 if(range_z >= 1.0){
                         range_z = range_z - 0.5;
                 }
             }
             //もし上キーが押されたら透視投影の角度を上
-            if(glfwGetKey(GLFW_KEY_UP)){
+            if(key_pressed(GLFW_KEY_UP)){
                 if(rotation_z > 10) {
                     rotation_z = rotation_z - 10;
                 }
             }
             //もし下キーが押されたら透視投影の角度を下
-            if(glfwGetKey(GLFW_KEY_DOWN)){
+            if(key_pressed(GLFW_KEY_DOWN)){
                 if(rotation_z < 90){
                     rotation_z = rotation_z + 10;
                 }
             }  
             //もし右キーが押されたら透視投影の角度を時計回り
-            if(glfwGetKey(GLFW_KEY_RIGHT)){
+            if(key_pressed(GLFW_KEY_RIGHT)){
                 rotation_x = rotation_x + 10;
             }
             //もし左キーが押されたら透視投影の角度を反時計回り
-            if(glfwGetKey(GLFW_KEY_LEFT)){
+            if(key_pressed(GLFW_KEY_LEFT)){
                 rotation_x = rotation_x - 10;
             }                        
             //もしMキーが押されたらマップの回転の有無を変更
-            if(glfwGetKey(77)){
+            if(key_pressed(77)){
                 if(mode != 2){
                     mode = 2;
                 }
@@ -868,12 +11275,12 @@ int main(void){
                 }
                 range_x = 0; range_y = 0; range_z = 1.5;
                 rotation_x = 0; rotation_z = 0;
-                glfwTerminate();
+                navi_window_close();
                 goto step2;
                 
             }
             //もしPキーが押されたら最短距離と最短経路を変更
-            if(glfwGetKey(80)){
+            if(key_pressed(80)){
                 if(choice_mode == 0){
                     choice_mode = 1;
                 }
@@ -882,11 +11289,11 @@ int main(void){
                 }
                 range_x = 0; range_y = 0; range_z = 1.5;
                 rotation_x = 0; rotation_z = 0;
-                glfwTerminate();
+                navi_window_close();
                 goto step2;
             }
             //もしBキーが押されたら交差点の表示方法を変更する
-            if(glfwGetKey(66)){
+            if(key_pressed(66)){
             if(word_mode == 0){
                     word_mode = 1;
                     window_speed = 125;
@@ -901,7 +11308,7 @@ int main(void){
                 }
             }
             //もしSPACEキーが押されたら、一時停止
-            if(glfwGetKey(GLFW_KEY_SPACE)){
+            if(key_pressed(GLFW_KEY_SPACE)){
                 if(mode != 3){
                     cheak = mode;
                     mode = 3;
@@ -912,35 +11319,43 @@ int main(void){
             }
 
             //初回経路リセット
-            path_reset(path, PATH_SIZE);
-            path_reset(path_sub, PATH_SIZE);
+            path_reset(path, path_size);
+            path_reset(path_sub, path_size);
             rotation = 0;
 
-            //ダイクストラ法を行う
-            dijkstra_distance(crossing_number,goal);
-            dijkstra_time(crossing_number,goal,speed);
-            //経路の決定
-            if(choice_mode == 0){
-                //経路の決定(pathが決まる)
-                if(pickup_path_distance(crossing_number,start,goal,path,20)<0){
-                    return 1;
-                }
-                //経路の決定(path_subが決まる)
-                if(pickup_path_time(crossing_number,start,goal,path_sub,20)<0){
-                    return 1;
-                }
+            if(multi_mode == 1){
+                //巡回経路はメニューで計算済み
+                memcpy(path, multi_path, sizeof(int) * path_size);
             }
-            else if(choice_mode == 1){
-                //経路の決定(pathが決まる)
-                if(pickup_path_time(crossing_number,start,goal,path,20)<0){
-                    return 1;
+            else if(iso_number > 0){
+                //到達圏では出発地に止まったまま
+                path[0] = iso_origins[0];
+            }
+            else{
+                //経路の決定(choice_modeが0ならpathが最短距離、1ならpathが最短時間、path_subはもう一方)
+                //経路探索スレッドに頼み、届くまでは地図だけを描いてウィンドウを止めない
+                route_worker_post(&router,start,goal,choice_mode,speed);
+                while(!route_worker_ready(&router)){
+                    key_poll();
+                    if (key_pressed(GLFW_KEY_ESC) || !glfwGetWindowParam(GLFW_OPENED)){
+                        goto loopend;
+                    }
+                    draw_waiting_frame(crossing_number,start,range_z);
+                    usleep(10000);
                 }
-                 //経路の決定(pathが決まる)
-                if(pickup_path_distance(crossing_number,start,goal,path_sub,20)<0){
+                if(route_worker_take(&router,path,path_sub,path_size)<0){
+                    routelog_close();
                     return 1;
                 }
             }
+            reroute_from = -1;
             
+            //区間ごとの長さと所要時間の累積を求めておく
+            if(route_set(&route, path, speed) < 0){
+                routelog_close();
+                return 1;
+            }
+
             //地図の最初の中心を決める
             ORIGIN_X = cross[path[0]].pos.x;
             ORIGIN_Y = cross[path[0]].pos.y;
@@ -957,67 +11372,69 @@ int main(void){
             
             //ウィンドウ作成＆アニメーションの実行
             while(1){
+                PROF_BEGIN(frame_scope);
+                key_poll();
                 /* Esc が押されるかウィンドウが閉じられたらおしまい */
-                if (glfwGetKey(GLFW_KEY_ESC) || !glfwGetWindowParam(GLFW_OPENED)){
+                if (key_pressed(GLFW_KEY_ESC) || !glfwGetWindowParam(GLFW_OPENED)){
                     goto loopend;
                 }
                 //もしRキーが押されたら、移動情報をリセット
-                if(glfwGetKey(82)){
+                if(key_pressed(82)){
                     range_x = 0; range_y = 0; range_z = 1.5;
                     rotation_x = 0; rotation_z = 0;
                 }
                 //もしWキーが押されたら前に移動
-                if(glfwGetKey(87)){
+                if(key_pressed(87)){
                     range_y = range_y + 0.5 * cos((rotation+rotation_x) * M_PI / 180);
                     range_x = range_x + 0.5 * sin((rotation+rotation_x) * M_PI / 180);
                 }
                 //もしSキーが押されたら後ろに移動
-                if(glfwGetKey(83)){
+                if(key_pressed(83)){
                     range_y = range_y + 0.5 * cos((rotation+rotation_x) * M_PI / 180 + M_PI);
                     range_x = range_x + 0.5 * sin((rotation+rotation_x) * M_PI / 180 + M_PI);
                 }
                 //もしDキーが押されたら右に移動
-                if(glfwGetKey(68)){
+                if(key_pressed(68)){
                     range_y = range_y + 0.5 * cos((rotation+rotation_x) * M_PI / 180 + M_PI / 2);
                     range_x = range_x + 0.5 * sin((rotation+rotation_x) * M_PI / 180 + M_PI / 2);
                 }
                 //もしAキーが押されたら左に移動
-                if(glfwGetKey(65)){
+                if(key_pressed(65)){
                     range_y = range_y + 0.5 * cos((rotation+rotation_x) * M_PI / 180 + 3 * M_PI / 2);
                     range_x = range_x + 0.5 * sin((rotation+rotation_x) * M_PI / 180 + 3 * M_PI / 2);
                 }
                 //もしEキーが押されたら透視投影の距離を遠くする
-                if(glfwGetKey(69)){
+                if(key_pressed(69)){
                     range_z = range_z + 0.5;
                 }
                 //もしQキーが押されたら透視投影の距離を近くする
-                if(glfwGetKey(81)){
+                if(key_pressed(81)){
                     if(range_z >= 1.0){
                         range_z = range_z - 0.5;
                     }
                 }
                 //もし上キーが押されたら透視投影の角度を上
-                if(glfwGetKey(GLFW_KEY_UP)){
+                if(key_pressed(GLFW_KEY_UP)){
                     if(rotation_z > 10) {
                         rotation_z = rotation_z - 10;
                     }
                 }
                 //もし下キーが押されたら透視投影の角度を下
-                if(glfwGetKey(GLFW_KEY_DOWN)){
+                if(key_pressed(GLFW_KEY_DOWN)){
                     if(rotation_z < 90){
                         rotation_z = rotation_z + 10;
                     }
                 }
                 //もし右キーが押されたら透視投影の角度を時計回り
-                if(glfwGetKey(GLFW_KEY_RIGHT)){
+                if(key_pressed(GLFW_KEY_RIGHT)){
                     rotation_x = rotation_x + 10;
                 }
                 //もし左キーが押されたら透視投影の角度を反時計回り
-                if(glfwGetKey(GLFW_KEY_LEFT)){
+                if(key_pressed(GLFW_KEY_LEFT)){
                     rotation_x = rotation_x - 10;
                 }
                 //もしMキーが押されたらマップの回転の有無を変更
-                if(glfwGetKey(77)){
+                if(key_pressed(77)){
                     if(mode != 2){
                         mode = 2;
                     }
@@ -1026,24 +11443,31 @@ int main(void){
                     }
                     range_x = 0; range_y = 0; range_z = 1.5;
                     rotation_x = 0; rotation_z = 0;
-                    glfwTerminate();
+                    navi_window_close();
                     goto step2;
                 }
                 //もしPキーが押されたら最短距離と最短経路を変更
-                if(glfwGetKey(80)){
+                if(key_pressed(80)){
                     if(choice_mode == 0){
                         choice_mode = 1;
                     }
                     else{
                         choice_mode = 0;
                     }
-                    range_x = 0; range_y = 0; range_z = 1.5;
-                    rotation_x = 0; rotation_z = 0;
-                    glfwTerminate();
-                    goto step2;
+                    if(multi_mode == 1 || iso_number > 0){
+                        range_x = 0; range_y = 0; range_z = 1.5;
+                        rotation_x = 0; rotation_z = 0;
+                        navi_window_close();
+                        goto step2;
+                    }
+                    //走りながら、次の交差点から先を探し直す
+                    if(path[vehicle_pathIterator + 1] != -1){
+                        reroute_from = vehicle_pathIterator + 1;
+                        route_worker_post(&router,path[reroute_from],goal,choice_mode,speed);
+                    }
                 }
                 //もしBキーが押されたら交差点の表示方法を変更する
-                if(glfwGetKey(66)){
+                if(key_pressed(66)){
                     if(word_mode == 0){
                         word_mode = 1;
                         window_speed = 125;
@@ -1057,8 +11481,67 @@ int main(void){
                         window_speed = 100;
                     }
                 }
+                //もしIキーが押されたら計測値の表示を切り替える(計測を有効にしたときのみ)
+                if(key_pressed(73)){
+                    PROF_TOGGLE_OVERLAY();
+                }
+                //もしZ・Xキーが押されたら車の速度を変え、今の区間から先の所要時間だけ計算し直す
+                //最短時間の経路を走っていれば、次の交差点から先を探し直す(続けて押したら前の要求は取り消す)
+                if(key_pressed(90) || key_pressed(88)){
+                    if(key_pressed(88)){
+                        speed = speed + 5.0;
+                    }
+                    else if(speed > 5.0){
+                        speed = speed - 5.0;
+                    }
+                    route_set_speed(&route, speed, vehicle_pathIterator);
+                    if(choice_mode == 1 && multi_mode == 0 && iso_number == 0 && path[vehicle_pathIterator + 1] != -1){
+                        reroute_from = vehicle_pathIterator + 1;
+                        route_worker_post(&router,path[reroute_from],goal,choice_mode,speed);
+                    }
+                }
+                //地図の新しい版が公開されていれば、このフレームからその版を見る
+                //道路が変わった区画の画像を捨て、費用が変わっていれば次の交差点から先を探し直す
+                view = map_enter();
+                if(view != NULL && view->version != map_seen){
+                    raster_update(view, map_seen);
+                    if(view->cost_version > map_seen && multi_mode == 0 && iso_number == 0
+                       && path[vehicle_pathIterator + 1] != -1){
+                        reroute_from = vehicle_pathIterator + 1;
+                        route_worker_post(&router,path[reroute_from],goal,choice_mode,speed);
+                    }
+                    map_seen = view->version;
+                    navi_input.dirty = 1;
+                }
+                //探し直した経路が届いたら、その交差点から先を入れ替える
+                //届いたときにもうその交差点を過ぎていたら、今の次の交差点から探し直す
+                if(reroute_from >= 0 && route_worker_ready(&router)){
+                    if(vehicle_pathIterator < reroute_from){
+                        //見つからなければ今の経路のまま走る
+                        //つなぎ目で禁止された右左折になるときも今の経路のまま走る
+                        if(route_worker_take(&router,reroute_path,path_sub,path_size - reroute_from) == 0
+                           && (reroute_from == 0 || reroute_path[1] == -1
+                               || turn_cost_path(path[reroute_from - 1], reroute_path[0], reroute_path[1]) != INFINITY)){
+                            for(i = 0; reroute_path[i] != -1; ++i){
+                                path[reroute_from + i] = reroute_path[i];
+                            }
+                            path[reroute_from + i] = -1;
+                            route_set(&route, path, speed);
+                            navi_input.dirty = 1;
+                        }
+                        reroute_from = -1;
+                    }
+                    else{
+                        route_worker_take(&router,NULL,NULL,0);   /* 古くなった結果は捨てる */
+                        reroute_from = -1;
+                        if(path[vehicle_pathIterator + 1] != -1){
+                            reroute_from = vehicle_pathIterator + 1;
+                            route_worker_post(&router,path[reroute_from],goal,choice_mode,speed);
+                        }
+                    }
+                }
                 //もしSPACEキーが押されたら、一時停止
-                if(glfwGetKey(GLFW_KEY_SPACE)){
+                if(key_pressed(GLFW_KEY_SPACE)){
                     if(mode != 3){
                         cheak = mode;
                         mode = 3;
@@ -1068,6 +11551,28 @@ int main(void){
                     }
                 }
 
+                //車が止まっていて(一時停止中か到着後)、キー入力も経路の入れ替えもなければ描き直さない
+                if(!navi_input.dirty && (mode == 3 || mode2 == 1)){
+                    if(mode2 == 1){
+                        //到着後は少し待ってからループを抜ける
+                        wait_time = (int) 1000 / window_speed;
+                        if(j >= wait_time){
+                            j = 0;
+                            mode2 = 0;
+                            break;
+                        }
+                        j++;
+                        usleep(window_speed*1000);
+                    }
+                    else{
+                        //一時停止中はキーが押されるかウィンドウが変わるまで眠る
+                        //(GLFW2には他のスレッドから起こす手段がないので、探し直した経路はその後で入れ替える)
+                        glfwWaitEvents();
+                    }
+                    continue;
+                }
+                navi_input.dirty = 0;   /* この後の入力はglfwSwapBuffersの中で届き、次のフレームで描き直す */
+
                 /* (ORIGIN_X, ORIGIN_Y) を中心に、REAL_SIZE_X * REAL_SIZE_Y の範囲の空間をビューポートに投影する */
                 glMatrixMode(GL_PROJECTION);
                 glLoadIdentity();
@@ -1080,30 +11585,28 @@ int main(void){
                 glTranslated(-range_x,-range_y,-range_z);
                 glTranslated(-ORIGIN_X,-ORIGIN_Y,0);
 
-                /* 文字列描画のためのフォントの読み込みと設定 */
-                font = ftglCreateExtrudeFont(FONT_FILENAME);
-                if (font == NULL) {
-                    perror(FONT_FILENAME);
-                    fprintf(stderr, "could not load font\n");
-                    exit(1);
-                }
-                ftglSetFontFaceSize(font, 24, 24);
-                ftglSetFontDepth(font, 0.01);
-                ftglSetFontOutset(font, 0, 0.1);
-                ftglSetFontCharMap(font, ft_encoding_unicode);
-                   
                 glfwGetWindowSize(&width, &height); /* 現在のウィンドウサイズを取得する */
                 glViewport(0, 0, width, height); /* ウィンドウ全面をビューポートにする */
 
                 glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
                 glClear(GL_COLOR_BUFFER_BIT); /* バックバッファを黒で塗り潰す */
 
-                map_show(crossing_number);                /* 道路網の表示 */
-                draw_main_path(path,choice_mode);
-                draw_sub_path(path_sub,choice_mode);
+                PROF_BEGIN(map_scope);
+                raster_show(crossing_number, range_z * 0.005, width, height); /* 道路網の表示(区画ごとの画像を貼る) */
+                PROF_PART(map_scope, PROF_MAP);
+                for(i = 0; i < iso_number; ++i){          //到達圏の表示
+                    draw_isochrone(&iso[i]);
+                }
+                draw_path(path, route_color[choice_mode], 6.0);           //メイン経路の表示
+                draw_path(path_sub, route_color[1 - choice_mode], 1.5); //サブ経路の表示
                 glColor3d(0.6,1.0,1.0);                   //現在地と目的地の表示
                 draw_corn(cross[start].pos.x,cross[start].pos.y,0.4,0.05);
                 draw_corn(cross[goal].pos.x,cross[goal].pos.y,0.4,0.05);
+                if(multi_mode == 1){                      //経由地の表示
+                    for(i = 0; i < stop_number; ++i){
+                        draw_corn(cross[stops[i]].pos.x,cross[stops[i]].pos.y,0.4,0.05);
+                    }
+                }
 
                 switch(mode){
                     case 0:                             //回転を行う
@@ -1123,14 +11626,8 @@ int main(void){
                                 y0 = id_to_posy(path,vehicle_pathIterator - 1);//前の交差点                            
                             }
 
-                            dot_product = (x1 - x0)*(x1 - x2) + (y1 - y0)*(y1 - y2); //内積の計算
-                            cross_product = (x0 - x1)*(y2 - y1) - (y0 - y1)*(x2 - x1); //外積のZ軸計算
-                            norm1 = hypot(x1 - x0,y1 - y0);//ノルム1
-                            norm2 = hypot(x1 - x2,y1 - y2);//ノルム2
-
-                            rad = acos(dot_product/(norm1*norm2)); //3点の角度計算
-                            deg = rad * 180 / M_PI;
-                            deg = 180 - deg;
+                            turn = turn_angle(x0, y0, x1, y1, x2, y2); //3点の角度計算(右折が負)
+                            deg = fabs(turn);
                             if(deg > 100){
                                 steps = (int)(deg/5);
                             }
@@ -1150,10 +11647,10 @@ int main(void){
                             rotation_step = deg / steps;
 
                             //時計回りと反時計回り
-                            if(cross_product >= 0.0){
+                            if(turn <= 0.0){
                                 rotation = rotation + rotation_step;
                             }
-                            else if(cross_product < 0.0){
+                            else{
                                 rotation = rotation - rotation_step;
                             }
                         
@@ -1183,23 +11680,10 @@ int main(void){
                     case 1:
                         //移動体を進めて座標を計算する
                         if(path[vehicle_pathIterator + 0] != -1 &&path[vehicle_pathIterator + 1] != -1){
-                            x0 = cross[path[vehicle_pathIterator + 0]].pos.x;
-                            y0 = cross[path[vehicle_pathIterator + 0]].pos.y;
-                            x1 = cross[path[vehicle_pathIterator + 1]].pos.x;
-                            y1 = cross[path[vehicle_pathIterator + 1]].pos.y;
-                            distance = hypot(x1 - x0, y1 - y0);
-
-                            //distanceの大きさによってstepsの数を変える
-                            if (distance >= 0.05){
-                                steps = (int)(distance / 0.1);
-                            }
-                            else{
-                                steps = (int)(distance / 0.01);
-                            }
+                            //道路を進むステップ数(経路を決めたときに道路の長さから求めてある)
+                            steps = route.leg_steps[vehicle_pathIterator];
                             //ステップを増やして地図の動きを決める
                             vehicle_stepOnEdge++;
-                            map_x = (x1 - x0) / steps;
-                            map_y = (y1 - y0) / steps;
 
                             //交差点を表示
                             if(word_mode == 0){
@@ -1216,8 +11700,9 @@ int main(void){
                             glColor3d(1.0, 1.0, 1.0);
                             draw_ball(ORIGIN_X, ORIGIN_Y, MARKER_RADIUS);
 
-                            ORIGIN_X = ORIGIN_X + map_x;
-                            ORIGIN_Y = ORIGIN_Y + map_y;
+                            //道路の形に沿って地図の中心を進める
+                            road_point(path[vehicle_pathIterator + 0], path[vehicle_pathIterator + 1],
+                                       (double)vehicle_stepOnEdge / steps, &ORIGIN_X, &ORIGIN_Y);
 
             
                             if(vehicle_stepOnEdge >= steps){
@@ -1233,23 +11718,10 @@ int main(void){
                     case 2:
                         //移動体を進めて座標を計算する
                         if(path[vehicle_pathIterator + 0] != -1 &&path[vehicle_pathIterator + 1] != -1){
-                            x0 = cross[path[vehicle_pathIterator + 0]].pos.x;
-                            y0 = cross[path[vehicle_pathIterator + 0]].pos.y;
-                            x1 = cross[path[vehicle_pathIterator + 1]].pos.x;
-                            y1 = cross[path[vehicle_pathIterator + 1]].pos.y;
-                            distance = hypot(x1 - x0, y1 - y0);
-
-                            //distanceの大きさによってstepsの数を変える
-                            if (distance >= 0.05){
-                                steps = (int)(distance / 0.1);
-                            }
-                            else{
-                                steps = (int)(distance / 0.01);
-                            }
+                            //道路を進むステップ数(経路を決めたときに道路の長さから求めてある)
+                            steps = route.leg_steps[vehicle_pathIterator];
                             //ステップを増やして地図の動きを決める
                             vehicle_stepOnEdge++;
-                            map_x = (x1 - x0) / steps;
-                            map_y = (y1 - y0) / steps;
 
                             //交差点を表示
                             if(word_mode == 0){
@@ -1266,8 +11738,9 @@ int main(void){
                             glColor3d(1.0, 1.0, 1.0);
                             draw_ball(ORIGIN_X, ORIGIN_Y, MARKER_RADIUS);
 
-                            ORIGIN_X = ORIGIN_X + map_x;
-                            ORIGIN_Y = ORIGIN_Y + map_y;
+                            //道路の形に沿って地図の中心を進める
+                            road_point(path[vehicle_pathIterator + 0], path[vehicle_pathIterator + 1],
+                                       (double)vehicle_stepOnEdge / steps, &ORIGIN_X, &ORIGIN_Y);
 
                             if(vehicle_stepOnEdge >= steps){
                                 //交差点についたので回転後、次の道路へ
@@ -1313,7 +11786,13 @@ int main(void){
                         break;
                 }
 
+                routelog_vehicle(path, vehicle_pathIterator, vehicle_stepOnEdge);  /* 記録中なら移動体の位置を残す */
+                draw_route_status(&route, vehicle_pathIterator, vehicle_stepOnEdge, width, height);
+                PROF_OVERLAY(width, height);    /* 計測値の表示 */
+                PROF_BEGIN(swap_scope);
                 glfwSwapBuffers();  /* フロントバッファとバックバッファを入れ替える */
+                PROF_PART(swap_scope, PROF_SWAP);
+                PROF_FRAME_END(frame_scope);
                 
                 //もしループ抜ける準備ができたら少し待ってループを抜ける
                 if(mode2 == 1){
@@ -1339,17 +11818,30 @@ int main(void){
         
         loopend:
 
-        glfwTerminate();
+        navi_window_close();
         printf("もう一度行いますか？\n");
         printf("1.もう一度行う Another number.カーナビを終了\n");
         printf("input>");
-        scanf("%d",&choice);
+        menu_scanf("%d",&choice);
         if(choice != 1){
             break;
         }
     }
     
     printf("\nカーナビ終了\n\n");
+    if(raster.made + raster.loaded > 0){
+        printf("道路網の画像: 作成 %ld枚  ファイルから %ld枚  再利用 %ld回  直接描いた区画 %ld\n",
+               raster.made, raster.loaded, raster.reused, raster.fallback);
+    }
+    raster_free();
+    routelog_close();
+    PROF_WRITE_TRACE(PROF_TRACE_FILE);
+    free(path);
+    free(path_sub);
+    free(multi_path);
+    free(reroute_path);
+    route_free(&route);
+    route_worker_stop(&router);
 
     return 0;
 }